@@ -0,0 +1,183 @@
+#pragma once
+
+#include<algorithm>
+#include<cmath>
+#include<cstdint>
+#include<fstream>
+#include<sstream>
+#include<string>
+#include<vector>
+
+#include"geometry.h"
+
+// Camera paths for batch rendering. A path is a list of cameraToWorld keyframes and optional per frame object motions.
+//
+// Text format, one entry per line, '#' starts a comment:
+//   frames <count>
+//   camera <frame> <16 matrix values, row by row>
+//   translate <object> <first frame> <last frame> <x> <y> <z>
+//   rotate <object> <first frame> <last frame> <angle> <axis x> <axis y> <axis z>
+// Object motions are applied once per frame in [first, last], objects are numbered in scene order.
+namespace animation
+{
+	struct camera_key
+	{
+		float frame;
+		Matrix44f camera_to_world;
+	};
+
+	struct object_motion
+	{
+		enum class kind { translate, rotate };
+		kind type;
+		uint32_t object;
+		uint32_t first_frame, last_frame;
+		Vec3f vector;		// translation, or rotation axis
+		float angle;		// degrees
+	};
+
+	namespace detail
+	{
+		struct quaternion
+		{
+			float w, x, y, z;
+		};
+
+		// The upper 3x3 of m is expected to be a pure rotation
+		inline quaternion to_quaternion(const Matrix44f &m)
+		{
+			const auto &a = m.x;
+			quaternion q;
+			float trace = a[0][0] + a[1][1] + a[2][2];
+			if (trace > 0.0f)
+			{
+				float s = std::sqrt(trace + 1.0f) * 2.0f;
+				q = { 0.25f * s, (a[2][1] - a[1][2]) / s, (a[0][2] - a[2][0]) / s, (a[1][0] - a[0][1]) / s };
+			}
+			else if (a[0][0] > a[1][1] && a[0][0] > a[2][2])
+			{
+				float s = std::sqrt(1.0f + a[0][0] - a[1][1] - a[2][2]) * 2.0f;
+				q = { (a[2][1] - a[1][2]) / s, 0.25f * s, (a[0][1] + a[1][0]) / s, (a[0][2] + a[2][0]) / s };
+			}
+			else if (a[1][1] > a[2][2])
+			{
+				float s = std::sqrt(1.0f + a[1][1] - a[0][0] - a[2][2]) * 2.0f;
+				q = { (a[0][2] - a[2][0]) / s, (a[0][1] + a[1][0]) / s, 0.25f * s, (a[1][2] + a[2][1]) / s };
+			}
+			else
+			{
+				float s = std::sqrt(1.0f + a[2][2] - a[0][0] - a[1][1]) * 2.0f;
+				q = { (a[1][0] - a[0][1]) / s, (a[0][2] + a[2][0]) / s, (a[1][2] + a[2][1]) / s, 0.25f * s };
+			}
+			return q;
+		}
+
+		inline Matrix44f to_matrix(const quaternion &q, const Vec3f &translation)
+		{
+			float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+			float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+			float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+			return Matrix44f(
+				1 - 2 * (yy + zz), 2 * (xy - wz), 2 * (xz + wy), 0,
+				2 * (xy + wz), 1 - 2 * (xx + zz), 2 * (yz - wx), 0,
+				2 * (xz - wy), 2 * (yz + wx), 1 - 2 * (xx + yy), 0,
+				translation.x, translation.y, translation.z, 1);
+		}
+
+		inline quaternion slerp(quaternion a, const quaternion &b, float t)
+		{
+			float cosine = a.w * b.w + a.x * b.x + a.y * b.y + a.z * b.z;
+			// Take the short way around
+			if (cosine < 0.0f)
+			{
+				a = { -a.w, -a.x, -a.y, -a.z };
+				cosine = -cosine;
+			}
+
+			float wa = 1.0f - t, wb = t;
+			// Nearly parallel, a normalized lerp is accurate and avoids dividing by sin(0)
+			if (cosine < 0.9995f)
+			{
+				float theta = std::acos(cosine), sine = std::sin(theta);
+				wa = std::sin(wa * theta) / sine;
+				wb = std::sin(wb * theta) / sine;
+			}
+
+			quaternion q = { wa * a.w + wb * b.w, wa * a.x + wb * b.x, wa * a.y + wb * b.y, wa * a.z + wb * b.z };
+			float length = std::sqrt(q.w * q.w + q.x * q.x + q.y * q.y + q.z * q.z);
+			return { q.w / length, q.x / length, q.y / length, q.z / length };
+		}
+	}
+
+	struct camera_path
+	{
+		uint32_t num_frames = 0;
+		std::vector<camera_key> keys;		// sorted by frame
+		std::vector<object_motion> motions;
+
+		// Translation is interpolated linearly and rotation spherically, frames outside the keys hold the nearest key
+		Matrix44f camera_at(float frame) const
+		{
+			if (keys.empty())
+				return Matrix44f();
+			if (frame <= keys.front().frame)
+				return keys.front().camera_to_world;
+			if (frame >= keys.back().frame)
+				return keys.back().camera_to_world;
+
+			auto next = std::upper_bound(keys.begin(), keys.end(), frame, [](float f, const camera_key &key) { return f < key.frame; });
+			const camera_key &a = *(next - 1), &b = *next;
+			float t = (frame - a.frame) / (b.frame - a.frame);
+			const auto &ma = a.camera_to_world.x, &mb = b.camera_to_world.x;
+			Vec3f translation(ma[3][0] + (mb[3][0] - ma[3][0]) * t, ma[3][1] + (mb[3][1] - ma[3][1]) * t, ma[3][2] + (mb[3][2] - ma[3][2]) * t);
+			return detail::to_matrix(detail::slerp(detail::to_quaternion(a.camera_to_world), detail::to_quaternion(b.camera_to_world), t), translation);
+		}
+	};
+
+	// Returns false if the file could not be read or has no frames. Without camera keys every frame uses default_camera.
+	inline bool load(const std::string &path, camera_path &camera, const Matrix44f &default_camera = Matrix44f())
+	{
+		std::ifstream ifs(path);
+		if (!ifs.is_open())
+			return false;
+
+		camera = camera_path();
+		std::string line;
+		while (std::getline(ifs, line))
+		{
+			std::istringstream iss(line.substr(0, line.find('#')));
+			std::string keyword;
+			if (!(iss >> keyword))
+				continue;
+
+			if (keyword == "frames")
+				iss >> camera.num_frames;
+			else if (keyword == "camera")
+			{
+				camera_key key;
+				iss >> key.frame;
+				for (uint32_t i = 0; i < 16; ++i)
+					iss >> key.camera_to_world.x[i / 4][i % 4];
+				if (iss)
+					camera.keys.push_back(key);
+			}
+			else if (keyword == "translate" || keyword == "rotate")
+			{
+				object_motion motion;
+				motion.type = keyword == "translate" ? object_motion::kind::translate : object_motion::kind::rotate;
+				motion.angle = 0.0f;
+				iss >> motion.object >> motion.first_frame >> motion.last_frame;
+				if (motion.type == object_motion::kind::rotate)
+					iss >> motion.angle;
+				iss >> motion.vector.x >> motion.vector.y >> motion.vector.z;
+				if (iss)
+					camera.motions.push_back(motion);
+			}
+		}
+
+		if (camera.keys.empty())
+			camera.keys.push_back({ 0.0f, default_camera });
+		std::stable_sort(camera.keys.begin(), camera.keys.end(), [](const camera_key &a, const camera_key &b) { return a.frame < b.frame; });
+		return camera.num_frames > 0;
+	}
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include<cstdint>
+#include<cstring>
+#include<string>
+#include<vector>
+
+#include"material.h"
+#include"texture.h"
+
+// Textures and materials of the objects in a scene file(scene_cache.h, paged_mesh.h). Records refer to them by their
+// index in tables the file carries, loading maps those to the ids of this process: textures are added to the shared
+// texture cache by their source file, materials to the shared library. Textures made in memory have no file to go
+// back to, so scenes using them cannot be written.
+//
+// Table layout: uint32_t num_textures | uint32_t num_materials | material::description * num_materials |
+//               for every texture uint32_t length and the length characters of its path
+namespace appearance
+{
+	const uint32_t kNone = ~0u;
+
+	// Collects the textures and materials of the objects going into a file
+	class table_writer
+	{
+		std::vector<std::string> texture_paths;
+		std::vector<uint32_t> textures, materials;		// ids of this process, by file index
+
+		static uint32_t index_of(std::vector<uint32_t> &ids, uint32_t id)
+		{
+			for (uint32_t i = 0; i < ids.size(); ++i)
+				if (ids[i] == id)
+					return i;
+			ids.push_back(id);
+			return static_cast<uint32_t>(ids.size() - 1);
+		}
+	public:
+		// File index of a texture id, kNone stays kNone. False for textures that were not read from a file.
+		bool texture(uint32_t id, uint32_t &index)
+		{
+			index = kNone;
+			if (id == texture::kNone)
+				return true;
+			std::string path;
+			if (!texture::cache::shared().source_file(id, path))
+				return false;
+			index = index_of(textures, id);
+			if (index == texture_paths.size())
+				texture_paths.push_back(path);
+			return true;
+		}
+
+		// File index of a material id, kNone stays kNone
+		uint32_t material(uint32_t id) { return id == material::kNone ? kNone : index_of(materials, id); }
+
+		// Per triangle material ids as file indices, triangles using the object's material keep kObjectMaterial
+		std::vector<uint16_t> triangle_materials(const std::vector<uint16_t> &ids)
+		{
+			std::vector<uint16_t> indices(ids.size());
+			for (size_t t = 0; t < ids.size(); ++t)
+				indices[t] = ids[t] == material::kObjectMaterial ? material::kObjectMaterial : static_cast<uint16_t>(material(ids[t]));
+			return indices;
+		}
+
+		std::vector<char> serialize() const
+		{
+			std::vector<char> data;
+			auto append = [&data](const void *bytes, size_t size) { data.insert(data.end(), static_cast<const char*>(bytes), static_cast<const char*>(bytes) + size); };
+			uint32_t counts[2] = { static_cast<uint32_t>(textures.size()), static_cast<uint32_t>(materials.size()) };
+			append(counts, sizeof(counts));
+			for (uint32_t id : materials)
+				append(&material::library::shared().get(id), sizeof(material::description));
+			for (const std::string &path : texture_paths)
+			{
+				uint32_t length = static_cast<uint32_t>(path.size());
+				append(&length, sizeof(length));
+				append(path.data(), path.size());
+			}
+			return data;
+		}
+	};
+
+	// Ids of this process for the indices of a file's tables
+	class table
+	{
+		std::vector<uint32_t> textures, materials;
+	public:
+		// Reads size bytes of tables at data and adds what they hold. False if they are corrupt or a texture cannot be read.
+		bool read(const char *data, uint64_t size)
+		{
+			uint32_t counts[2];
+			if (size < sizeof(counts))
+				return false;
+			std::memcpy(counts, data, sizeof(counts));
+			uint64_t offset = sizeof(counts);
+			if (counts[1] > (size - offset) / sizeof(material::description))
+				return false;
+
+			materials.clear();
+			for (uint32_t m = 0; m < counts[1]; ++m, offset += sizeof(material::description))
+			{
+				material::description d;
+				std::memcpy(&d, data + offset, sizeof(d));
+				if (static_cast<uint8_t>(d.type) > static_cast<uint8_t>(material::model::emissive))
+					return false;
+				materials.push_back(material::library::shared().add(d));
+				if (materials.back() == material::kNone)
+					return false;
+			}
+
+			textures.clear();
+			for (uint32_t t = 0; t < counts[0]; ++t)
+			{
+				uint32_t length;
+				if (size - offset < sizeof(length))
+					return false;
+				std::memcpy(&length, data + offset, sizeof(length));
+				offset += sizeof(length);
+				if (length > size - offset)
+					return false;
+				textures.push_back(texture::cache::shared().add(std::string(data + offset, length)));
+				offset += length;
+				if (textures.back() == texture::kNone)
+					return false;
+			}
+			return true;
+		}
+
+		// Id of a file index, false when the index is out of range. kNone maps to kNone.
+		bool texture(uint32_t index, uint32_t &id) const
+		{
+			id = index == kNone ? texture::kNone : index < textures.size() ? textures[index] : kNone;
+			return index == kNone || index < textures.size();
+		}
+
+		bool material(uint32_t index, uint32_t &id) const
+		{
+			id = index == kNone ? material::kNone : index < materials.size() ? materials[index] : kNone;
+			return index == kNone || index < materials.size();
+		}
+
+		// Per triangle file indices as material ids, false if one is out of range
+		bool triangle_materials(const uint16_t *indices, size_t count, std::vector<uint16_t> &ids) const
+		{
+			ids.resize(count);
+			for (size_t t = 0; t < count; ++t)
+			{
+				if (indices[t] != material::kObjectMaterial && indices[t] >= materials.size())
+					return false;
+				ids[t] = indices[t] == material::kObjectMaterial ? material::kObjectMaterial : static_cast<uint16_t>(materials[indices[t]]);
+			}
+			return true;
+		}
+	};
+}
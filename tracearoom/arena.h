@@ -0,0 +1,128 @@
+#pragma once
+
+#include<algorithm>
+#include<cstddef>
+#include<cstdint>
+#include<memory>
+#include<new>
+#include<type_traits>
+#include<vector>
+
+// Monotonic allocator for scratch memory. Allocating bumps a pointer, nothing is freed individually,
+// reset or rewinding to a marker releases everything allocated since at once. The memory itself is kept,
+// so once an arena has grown to what a frame or a tile needs it stops touching the heap.
+class arena
+{
+	struct block
+	{
+		std::unique_ptr<unsigned char[]> data;
+		size_t size;
+	};
+
+	static constexpr size_t kMinBlockSize = 64 * 1024;
+
+	std::vector<block> blocks;
+	size_t current = 0;		// block being allocated from
+	size_t used = 0;		// bytes used in the current block
+	size_t peak = 0;		// most bytes in use between two resets
+
+	size_t in_use() const
+	{
+		size_t total = used;
+		for (size_t b = 0; b < current && b < blocks.size(); ++b)
+			total += blocks[b].size;
+		return total;
+	}
+public:
+	// Position to rewind to
+	struct marker
+	{
+		size_t block;
+		size_t used;
+	};
+
+	arena() {}
+	explicit arena(size_t initial_size) { blocks.push_back({ std::unique_ptr<unsigned char[]>(new unsigned char[initial_size]), initial_size }); }
+
+	arena(const arena &) = delete;
+	arena &operator=(const arena &) = delete;
+
+	void *allocate(size_t size, size_t alignment = alignof(std::max_align_t))
+	{
+		for (; current < blocks.size(); ++current, used = 0)
+		{
+			uintptr_t base = reinterpret_cast<uintptr_t>(blocks[current].data.get());
+			size_t offset = ((base + used + alignment - 1) & ~(alignment - 1)) - base;
+			if (offset + size <= blocks[current].size)
+			{
+				used = offset + size;
+				return blocks[current].data.get() + offset;
+			}
+		}
+
+		// Out of space, grow geometrically so a steady workload settles on a few blocks
+		size_t block_size = blocks.empty() ? kMinBlockSize : blocks.back().size * 2;
+		if (block_size < size + alignment)
+			block_size = size + alignment;
+		blocks.push_back({ std::unique_ptr<unsigned char[]>(new unsigned char[block_size]), block_size });
+		current = blocks.size() - 1;
+		used = 0;
+		return allocate(size, alignment);
+	}
+
+	// Uninitialized storage for count objects, only for types that need no destructor
+	template<typename T>
+	T *allocate_array(size_t count)
+	{
+		static_assert(std::is_trivially_destructible<T>::value, "arena memory is never destroyed");
+		return static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+	}
+
+	marker mark() const { return { current, used }; }
+	void rewind(const marker &m)
+	{
+		peak = std::max(peak, in_use());
+		current = m.block, used = m.used;
+	}
+
+	// Releases everything. When the last round needed more than one block they are merged into one big enough
+	// for it, so the next round runs out of a single block.
+	void reset()
+	{
+		peak = std::max(peak, in_use());
+		if (blocks.size() > 1)
+		{
+			blocks.clear();
+			blocks.push_back({ std::unique_ptr<unsigned char[]>(new unsigned char[peak]), peak });
+		}
+		current = 0, used = 0, peak = 0;
+	}
+
+	size_t capacity() const
+	{
+		size_t total = 0;
+		for (const block &b : blocks)
+			total += b.size;
+		return total;
+	}
+};
+
+// Rewinds an arena to where it was when the scope was entered, e.g. per tile
+class arena_scope
+{
+	arena &scratch;
+	arena::marker start;
+public:
+	explicit arena_scope(arena &a) : scratch(a), start(a.mark()) {}
+	~arena_scope() { scratch.rewind(start); }
+
+	arena_scope(const arena_scope &) = delete;
+	arena_scope &operator=(const arena_scope &) = delete;
+};
+
+// Scratch arena of the calling thread, for memory that does not outlive the current tile or task
+inline arena &thread_scratch()
+{
+	static thread_local arena scratch;
+	return scratch;
+}
@@ -29,50 +29,76 @@ namespace bitmap_utils
 
 		std::array<uchar, 14> file_header = { 'B','M', 0,0,0,0, 0,0, 0,0, 54,0,0,0 };
 		std::unique_ptr<uchar[]> pix_data = nullptr;
+		const uchar *pixels = nullptr;	// what gets written, pix_data or borrowed memory
 
 		uint32_t width;
 		uint32_t height;
+		bool is_bottom_up;
+
+		// Rows in a bmp file are padded to a multiple of 4 bytes
+		uint32_t row_stride() const { return (width * 3 + 3) & ~3u; }
 
 		// Flips the pixel data horizontally(by rows)
 		void flip_pixel_data()
 		{
-			uint32_t current_row = 0;
 			uint32_t pivot = (height % 2 == 0) ? (height / 2 - 1) : (height / 2);
 
 			for (uint32_t idx = 0; idx <= pivot; ++idx)
 			{
-				std::unique_ptr<uchar[]> temp_arrray(new uchar[height]);
-
-				uint32_t upper_row_start_idx = idx * width * 3;
-				uint32_t upper_row_end_idx = upper_row_start_idx + width * 3;
-				uint32_t lower_row_start_idx = (height - 1 - idx) * width * 3;
+				uint32_t upper_row_start_idx = idx * row_stride();
+				uint32_t upper_row_end_idx = upper_row_start_idx + row_stride();
+				uint32_t lower_row_start_idx = (height - 1 - idx) * row_stride();
 
 				std::swap_ranges(&pix_data[upper_row_start_idx], &pix_data[upper_row_end_idx], &pix_data[lower_row_start_idx]);
 			}
 		}
-	public:
-		bitmap_image(uint32_t img_width, uint32_t img_height, std::unique_ptr<uchar[] > pixel_data) : width(img_width), height(img_height), pix_data(std::move(pixel_data))
+
+		void write_headers()
 		{
 			info_header.width = width;
 			info_header.height = height;
 
-			uint32_t file_size = width * height * 3 + 54;
+			uint32_t file_size = row_stride() * height + 54;
 			uchar* pFH = reinterpret_cast<uchar*>(&file_size);
 
 			// Assign the bytes to size field of bitmpa file header
 			file_header[2] = pFH[0], file_header[3] = pFH[1], file_header[4] = pFH[2], file_header[5] = pFH[3];
 		}
+	public:
+		// pixel_data holds padded bgr rows, top-down unless bottom_up is set(the order bmp stores them in)
+		bitmap_image(uint32_t img_width, uint32_t img_height, std::unique_ptr<uchar[] > pixel_data, bool bottom_up = false) 
+			: width(img_width), height(img_height), pix_data(std::move(pixel_data)), is_bottom_up(bottom_up)
+		{
+			pixels = pix_data.get();
+			write_headers();
+		}
+
+		// Writes pixel data owned by the caller, which has to hold padded bottom-up bgr rows and stay alive until written.
+		// Lets a renderer reuse one buffer for every frame.
+		bitmap_image(uint32_t img_width, uint32_t img_height, const uchar *bottom_up_pixel_data)
+			: pixels(bottom_up_pixel_data), width(img_width), height(img_height), is_bottom_up(true)
+		{
+			write_headers();
+		}
 
-		void write_to_file(std::string file_path)
+		void write_to_file(const std::string &file_path)
 		{
 			uchar infoheader_array[40];
 			std::memcpy(infoheader_array, &info_header, 40);
-			flip_pixel_data();
+			if (!is_bottom_up)
+			{
+				flip_pixel_data();
+				is_bottom_up = true;
+			}
 
-			std::ofstream ofs(file_path);
+			// A stream buffer of our own, otherwise every file allocates one
+			char stream_buffer[256];
+			std::ofstream ofs;
+			ofs.rdbuf()->pubsetbuf(stream_buffer, sizeof(stream_buffer));
+			ofs.open(file_path, std::ios::out | std::ios::binary);
 			ofs.write((char *)file_header.data(), 14);
 			ofs.write((char *)infoheader_array, 40);
-			ofs.write((char*)pix_data.get(), width * height * 3);
+			ofs.write((const char*)pixels, row_stride() * height);
 
 			ofs.close();
 		}
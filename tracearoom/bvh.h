@@ -0,0 +1,404 @@
+#pragma once
+
+#include<algorithm>
+#include<cassert>
+#include<cstdint>
+#include<utility>
+#include<vector>
+
+#include"geometry.h"
+#include"mesh_buffer.h"
+#include"ray_cost.h"
+
+// Axis aligned bounding box
+struct bbox
+{
+	Vec3f min, max;
+
+	bbox() : min(kInfinity), max(-kInfinity) {}
+	bbox(const Vec3f &bmin, const Vec3f &bmax) : min(bmin), max(bmax) {}
+
+	void extend(const Vec3f &p)
+	{
+		min = Vec3f(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+		max = Vec3f(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+	}
+
+	void extend(const bbox &b) { extend(b.min), extend(b.max); }
+
+	bool empty() const { return min.x > max.x; }
+	Vec3f centroid() const { return (min + max) * 0.5f; }
+	Vec3f extent() const { return max - min; }
+
+	float surface_area() const
+	{
+		if (empty())
+			return 0.0f;
+		Vec3f d = extent();
+		return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+
+	uint8_t longest_axis() const
+	{
+		Vec3f d = extent();
+		return (d.x > d.y && d.x > d.z) ? 0 : (d.y > d.z ? 1 : 2);
+	}
+};
+
+// Slab test against a box, inv_dir is 1 / ray direction
+inline bool intersect_bbox(const Vec3f &bmin, const Vec3f &bmax, const Vec3f &orig, const Vec3f &inv_dir, float tmax, float &tentry)
+{
+	float tx0 = (bmin.x - orig.x) * inv_dir.x, tx1 = (bmax.x - orig.x) * inv_dir.x;
+	float ty0 = (bmin.y - orig.y) * inv_dir.y, ty1 = (bmax.y - orig.y) * inv_dir.y;
+	float tz0 = (bmin.z - orig.z) * inv_dir.z, tz1 = (bmax.z - orig.z) * inv_dir.z;
+
+	float tmin = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), 0.0f));
+	float tfar = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::min(std::max(tz0, tz1), tmax));
+	tentry = tmin;
+
+	return tmin <= tfar;
+}
+
+inline Vec3f safe_inverse(const Vec3f &dir)
+{
+	// Keep the sign of zero components so the slab test still produces +-infinity
+	auto inv = [](float d) { return std::fabs(d) > 1e-20f ? 1.0f / d : (std::signbit(d) ? -kInfinity : kInfinity); };
+	return Vec3f(inv(dir.x), inv(dir.y), inv(dir.z));
+}
+
+struct bvh_node
+{
+	Vec3f bmin;
+	uint32_t offset;	// first primitive for leaves, second child for interior nodes(the first child directly follows its parent)
+	Vec3f bmax;
+	uint32_t count;		// number of primitives, 0 for interior nodes
+};
+
+static_assert(sizeof(bvh_node) == 32, "bvh_node is expected to be 32 bytes");
+
+// Bounding volume hierarchy over the triangles of a mesh.
+// Nodes are stored depth first, leaves refer to a range of prim_indices which in turn index the triangles.
+class bvh
+{
+	mesh_buffer<bvh_node> nodes;
+	mesh_buffer<uint32_t> prim_indices;
+
+	struct build_prim
+	{
+		bbox bounds;
+		Vec3f centroid;
+	};
+
+	// Scratch state of a build
+	struct build_state
+	{
+		std::vector<build_prim> prims;
+		std::vector<bvh_node> nodes;
+		std::vector<uint32_t> prim_indices;
+	};
+
+	static constexpr uint32_t kNumBins = 16;
+	static constexpr uint32_t kMaxLeafSize = 8;
+	// From this depth on subtrees are split at their median, which halves them every level, so even where the
+	// heuristic peels off one primitive at a time no leaf ends up deeper than kMaxDepth
+	static constexpr uint32_t kMedianSplitDepth = 32;
+	// Relative cost of visiting a node vs testing a triangle
+	static constexpr float kTraversalCost = 1.0f;
+
+	static void set_bounds(bvh_node &node, const build_state &state, uint32_t begin, uint32_t end, bbox &centroid_bounds)
+	{
+		bbox bounds;
+		for (uint32_t i = begin; i < end; ++i)
+		{
+			bounds.extend(state.prims[state.prim_indices[i]].bounds);
+			centroid_bounds.extend(state.prims[state.prim_indices[i]].centroid);
+		}
+		node.bmin = bounds.min, node.bmax = bounds.max;
+	}
+
+	// Binned surface area heuristic split, returns false when a leaf is cheaper
+	static bool find_split(const build_state &state, uint32_t begin, uint32_t end, const bvh_node &node, const bbox &centroid_bounds, uint8_t &axis, float &split)
+	{
+		uint32_t count = end - begin;
+		float leaf_cost = static_cast<float>(count);
+		float best_cost = kInfinity;
+
+		for (uint8_t a = 0; a < 3; ++a)
+		{
+			float lo = centroid_bounds.min[a], hi = centroid_bounds.max[a];
+			if (hi - lo <= 0.0f)
+				continue;
+
+			bbox bin_bounds[kNumBins];
+			uint32_t bin_counts[kNumBins] = {};
+			float scale = kNumBins / (hi - lo);
+			for (uint32_t i = begin; i < end; ++i)
+			{
+				const build_prim &prim = state.prims[state.prim_indices[i]];
+				uint32_t bin = std::min(kNumBins - 1, static_cast<uint32_t>((prim.centroid[a] - lo) * scale));
+				bin_counts[bin]++;
+				bin_bounds[bin].extend(prim.bounds);
+			}
+
+			// Sweep from the right to get the cost of every right side, then from the left
+			float right_area[kNumBins];
+			uint32_t right_count[kNumBins];
+			bbox acc;
+			uint32_t acc_count = 0;
+			for (uint32_t b = kNumBins - 1; b > 0; --b)
+			{
+				acc.extend(bin_bounds[b]);
+				acc_count += bin_counts[b];
+				right_area[b] = acc.surface_area();
+				right_count[b] = acc_count;
+			}
+
+			acc = bbox();
+			acc_count = 0;
+			for (uint32_t b = 0; b < kNumBins - 1; ++b)
+			{
+				acc.extend(bin_bounds[b]);
+				acc_count += bin_counts[b];
+				float cost = acc_count * acc.surface_area() + right_count[b + 1] * right_area[b + 1];
+				if (acc_count > 0 && right_count[b + 1] > 0 && cost < best_cost)
+				{
+					best_cost = cost;
+					axis = a;
+					split = lo + (b + 1) / scale;
+				}
+			}
+		}
+
+		if (best_cost == kInfinity)
+			return false;
+
+		float node_area = bbox(node.bmin, node.bmax).surface_area();
+		best_cost = kTraversalCost + (node_area > 0.0f ? best_cost / node_area : best_cost);
+
+		return best_cost < leaf_cost || count > kMaxLeafSize;
+	}
+
+	static void build_recursive(build_state &state, uint32_t node_index, uint32_t begin, uint32_t end, uint32_t depth)
+	{
+		auto &nodes = state.nodes;
+		bbox centroid_bounds;
+		set_bounds(nodes[node_index], state, begin, end, centroid_bounds);
+
+		uint32_t count = end - begin;
+		uint8_t axis = 0;
+		float split = 0.0f;
+		uint32_t mid = begin;
+		if (depth >= kMedianSplitDepth)
+		{
+			if (count > kMaxLeafSize)
+			{
+				axis = centroid_bounds.longest_axis();
+				mid = begin + count / 2;
+				std::nth_element(state.prim_indices.begin() + begin, state.prim_indices.begin() + mid, state.prim_indices.begin() + end,
+					[&](uint32_t a, uint32_t b) { return state.prims[a].centroid[axis] < state.prims[b].centroid[axis]; });
+			}
+		}
+		else if (count > 1 && find_split(state, begin, end, nodes[node_index], centroid_bounds, axis, split))
+			mid = static_cast<uint32_t>(std::partition(state.prim_indices.begin() + begin, state.prim_indices.begin() + end,
+				[&](uint32_t p) { return state.prims[p].centroid[axis] < split; }) - state.prim_indices.begin());
+
+		// Centroids all in one spot, split in the middle if the leaf would be too large
+		if ((mid == begin || mid == end) && count > kMaxLeafSize)
+			mid = begin + count / 2;
+
+		if (mid == begin || mid == end)
+		{
+			nodes[node_index].offset = begin;
+			nodes[node_index].count = count;
+			return;
+		}
+
+		nodes[node_index].count = 0;
+		nodes.emplace_back();
+		build_recursive(state, node_index + 1, begin, mid, depth + 1);
+		nodes[node_index].offset = static_cast<uint32_t>(nodes.size());
+		nodes.emplace_back();
+		build_recursive(state, nodes[node_index].offset, mid, end, depth + 1);
+	}
+public:
+	// Interior nodes on the way from the root to any leaf, at most. traverse keeps one far child per interior node
+	// on its stack, both builders stay within it and trees read from files are checked against it.
+	static constexpr uint32_t kMaxDepth = 64;
+
+
+	bvh() {}
+	// Adopt a hierarchy that was built earlier, e.g. read back from a scene cache
+	bvh(mesh_buffer<bvh_node> bvh_nodes, mesh_buffer<uint32_t> indices) : nodes(std::move(bvh_nodes)), prim_indices(std::move(indices)) {}
+
+	// tris_index holds three vertex indices per triangle
+	void build(const Vec3f *vertices, const uint32_t *tris_index, uint32_t num_tris)
+	{
+		build_state state;
+		state.prim_indices.resize(num_tris);
+		if (num_tris > 0)
+		{
+			state.prims.resize(num_tris);
+			for (uint32_t i = 0; i < num_tris; ++i)
+			{
+				build_prim &prim = state.prims[i];
+				prim.bounds.extend(vertices[tris_index[i * 3]]);
+				prim.bounds.extend(vertices[tris_index[i * 3 + 1]]);
+				prim.bounds.extend(vertices[tris_index[i * 3 + 2]]);
+				prim.centroid = prim.bounds.centroid();
+				state.prim_indices[i] = i;
+			}
+
+			state.nodes.reserve(2 * num_tris);
+			state.nodes.emplace_back();
+			build_recursive(state, 0, 0, num_tris, 0);
+			state.nodes.shrink_to_fit();
+		}
+
+		nodes = std::move(state.nodes);
+		prim_indices = std::move(state.prim_indices);
+	}
+
+	// Recomputes the node bounds bottom up after the vertices moved, the tree itself is kept.
+	// Much cheaper than a build but the tree gets looser the further the vertices move from where it was built.
+	void refit(const Vec3f *vertices, const uint32_t *tris_index)
+	{
+		if (nodes.empty())
+			return;
+
+		// Children are always stored after their parent, so a reverse sweep visits them first
+		bvh_node *first = nodes.mutable_data();
+		for (size_t i = nodes.size(); i-- > 0;)
+		{
+			bvh_node &node = first[i];
+			bbox bounds;
+			if (node.count > 0)
+			{
+				for (uint32_t j = node.offset; j < node.offset + node.count; ++j)
+				{
+					const uint32_t *tri = tris_index + prim_indices[j] * 3;
+					bounds.extend(vertices[tri[0]]);
+					bounds.extend(vertices[tri[1]]);
+					bounds.extend(vertices[tri[2]]);
+				}
+			}
+			else
+			{
+				bounds.extend(bbox(first[i + 1].bmin, first[i + 1].bmax));
+				bounds.extend(bbox(first[node.offset].bmin, first[node.offset].bmax));
+			}
+			node.bmin = bounds.min, node.bmax = bounds.max;
+		}
+	}
+
+	// Surface area heuristic cost of the whole tree relative to its root, used to tell how much refits degraded it
+	float sah_cost() const
+	{
+		if (nodes.empty())
+			return 0.0f;
+
+		float root_area = bbox(nodes[0].bmin, nodes[0].bmax).surface_area();
+		if (root_area <= 0.0f)
+			return 0.0f;
+
+		float cost = 0.0f;
+		for (const bvh_node &node : nodes)
+			cost += bbox(node.bmin, node.bmax).surface_area() * (node.count > 0 ? static_cast<float>(node.count) : kTraversalCost);
+		return cost / root_area;
+	}
+
+	// Checks the shape of a tree read from a file: children come after their parent and lie within the tree, and
+	// no path has more than kMaxDepth interior nodes. Leaves are not looked at.
+	static bool well_formed_tree(const bvh_node *tree, uint32_t num_nodes)
+	{
+		std::vector<uint8_t> depth(num_nodes, 0);
+		for (uint32_t n = 0; n < num_nodes; ++n)
+		{
+			const bvh_node &node = tree[n];
+			if (node.count > 0)
+				continue;
+			if (n + 1 >= num_nodes || node.offset <= n + 1 || node.offset >= num_nodes || depth[n] >= kMaxDepth)
+				return false;
+			depth[n + 1] = std::max<uint8_t>(depth[n + 1], depth[n] + 1);
+			depth[node.offset] = std::max<uint8_t>(depth[node.offset], depth[n] + 1);
+		}
+		return true;
+	}
+
+	// Also checks the leaves: they lie within the num_indices prim indices, which refer to fewer than num_prims
+	// primitives
+	static bool well_formed(const bvh_node *tree, uint32_t num_nodes, const uint32_t *indices, uint32_t num_indices, uint32_t num_prims)
+	{
+		if (!well_formed_tree(tree, num_nodes))
+			return false;
+		for (uint32_t n = 0; n < num_nodes; ++n)
+			if (tree[n].count > 0 && (tree[n].offset > num_indices || tree[n].count > num_indices - tree[n].offset))
+				return false;
+		for (uint32_t i = 0; i < num_indices; ++i)
+			if (indices[i] >= num_prims)
+				return false;
+		return true;
+	}
+
+	bool empty() const { return nodes.empty(); }
+	const mesh_buffer<bvh_node> &get_nodes() const { return nodes; }
+	const mesh_buffer<uint32_t> &get_prim_indices() const { return prim_indices; }
+
+	// Visits the leaves hit by the ray front to back. leaf_fn(prim) tests a primitive and may shorten tmax.
+	template<typename Fn>
+	void traverse(const Vec3f &orig, const Vec3f &dir, float &tmax, Fn &&leaf_fn) const
+	{
+		if (nodes.empty())
+			return;
+
+		ray_cost_tally tally;
+		Vec3f inv_dir = safe_inverse(dir);
+		// Far children are pushed along with their entry distance so they can be culled once tmax shrinks
+		std::pair<uint32_t, float> stack[kMaxDepth];
+		uint32_t stack_size = 0;
+		uint32_t current = 0;
+		float tentry;
+		if (!intersect_bbox(nodes[0].bmin, nodes[0].bmax, orig, inv_dir, tmax, tentry))
+			return;
+
+		for (;;)
+		{
+			const bvh_node &node = nodes[current];
+			++tally.nodes;
+			if (node.count > 0)
+			{
+				tally.triangles += node.count;
+				for (uint32_t i = 0; i < node.count; ++i)
+					leaf_fn(prim_indices[node.offset + i]);
+			}
+			else
+			{
+				uint32_t near_child = current + 1, far_child = node.offset;
+				float tnear_child, tfar_child;
+				bool hit_near = intersect_bbox(nodes[near_child].bmin, nodes[near_child].bmax, orig, inv_dir, tmax, tnear_child);
+				bool hit_far = intersect_bbox(nodes[far_child].bmin, nodes[far_child].bmax, orig, inv_dir, tmax, tfar_child);
+				if (hit_near && hit_far)
+				{
+					if (tfar_child < tnear_child)
+						std::swap(near_child, far_child);
+					assert(stack_size < kMaxDepth);
+					stack[stack_size++] = { far_child, std::max(tnear_child, tfar_child) };
+					current = near_child;
+					continue;
+				}
+				if (hit_near || hit_far)
+				{
+					current = hit_near ? near_child : far_child;
+					continue;
+				}
+			}
+
+			do
+			{
+				if (stack_size == 0)
+					return;
+				--stack_size;
+			} while (stack[stack_size].second > tmax);
+			current = stack[stack_size].first;
+		}
+	}
+};
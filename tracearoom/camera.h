@@ -0,0 +1,63 @@
+#pragma once
+
+#include<cmath>
+#include<cstdint>
+
+#include"geometry.h"
+
+// Pinhole camera looking down -z in camera space, maps pixels to primary rays and world points back to pixels
+struct pinhole_camera
+{
+	uint32_t width, height;
+	float scale;			// tan(fov / 2)
+	float aspect_ratio;
+	Matrix44f camera_to_world, world_to_camera;
+	Vec3f origin;
+
+	pinhole_camera(uint32_t image_width, uint32_t image_height, float fov, const Matrix44f &cam_to_world) :
+		width(image_width),
+		height(image_height),
+		scale(static_cast<float>(std::tan(deg_to_rad(fov * 0.5f)))),
+		aspect_ratio(image_width / static_cast<float>(image_height)),
+		camera_to_world(cam_to_world),
+		world_to_camera(cam_to_world.inverse())
+	{
+		camera_to_world.multVecMatrix(Vec3f(0), origin);
+	}
+
+	// Ray differential of a pixel: how much wider a primary ray gets per unit of distance(see lod.h)
+	float pixel_spread() const
+	{
+		return 2 * scale / static_cast<float>(height);
+	}
+
+	// Normalized direction through the center of pixel (i, j), j = 0 is the top row
+	Vec3f ray_direction(uint32_t i, uint32_t j) const
+	{
+		return ray_direction_at(i + 0.5f, j + 0.5f);
+	}
+
+	// Normalized direction through continuous pixel coordinates, pixel centers are at +0.5
+	Vec3f ray_direction_at(float px, float py) const
+	{
+		float x = (2 * px / static_cast<float>(width) - 1) * aspect_ratio * scale;
+		float y = (1 - 2 * py / static_cast<float>(height)) * scale;
+		Vec3f dir;
+		camera_to_world.multDirMatrix(Vec3f(x, y, -1), dir);
+		return dir.normalize();
+	}
+
+	// Continuous pixel coordinates of a world point, pixel centers are at +0.5. Returns false for points behind the camera.
+	bool project(const Vec3f &point, float &px, float &py, float &depth) const
+	{
+		Vec3f p;
+		world_to_camera.multVecMatrix(point, p);
+		if (p.z >= 0.0f)
+			return false;
+
+		depth = -p.z;
+		px = (p.x / (depth * aspect_ratio * scale) + 1) * 0.5f * width;
+		py = (1 - p.y / (depth * scale)) * 0.5f * height;
+		return true;
+	}
+};
@@ -0,0 +1,318 @@
+#pragma once
+
+#include<algorithm>
+#include<cmath>
+#include<cstdint>
+#include<fstream>
+#include<memory>
+#include<sstream>
+#include<string>
+#include<vector>
+
+#include"bvh.h"
+#include"geometry.h"
+#include"polygon_primitves.h"
+
+// Cells and portals for buildings of closed rooms. A ray that starts in a room can only see other rooms through
+// its doorways, so instead of the whole scene it traces the triangles of the room it is in and moves on to the
+// next room only where it leaves through a doorway. What a ray costs then depends on the rooms it passes through,
+// not on the size of the building.
+//
+// Rooms(cells) are boxes, their walls lie on the faces of the box. Doorways(portals) are boxes that are flat
+// along one axis and lie on the face two cells share, or on the outside of one for windows. Text format, one
+// entry per line, '#' starts a comment:
+//   cell <name> <min x> <min y> <min z> <max x> <max y> <max z>
+//   portal <cell> <cell or outside> <min x> <min y> <min z> <max x> <max y> <max z>
+//
+// Every cell gets its own bvh over the triangles that touch its box. The result is always the nearest hit in
+// the whole scene: a ray that starts outside every cell, leaves through a window or through a gap in the walls
+// where there is no doorway is traced against the whole scene instead. Objects that are not a TriangleMesh
+// are tested on every ray.
+namespace cells
+{
+	const uint32_t kOutside = ~0u;
+	// Boxes are grown by this so walls on their faces and points on a doorway count as inside despite rounding
+	const float kTolerance = 1e-3f;
+	// Cells a ray may pass through before it is traced against the whole scene
+	const uint32_t kMaxSteps = 256;
+
+	struct cell
+	{
+		std::string name;
+		bbox bounds;
+	};
+
+	struct portal
+	{
+		uint32_t cells[2];		// the second is kOutside for windows
+		bbox bounds;
+	};
+
+	struct layout
+	{
+		std::vector<cell> cells;
+		std::vector<portal> portals;
+
+		bool empty() const { return cells.empty(); }
+	};
+
+	namespace detail
+	{
+		inline bbox grown(const bbox &b, float by) { return bbox(b.min - Vec3f(by), b.max + Vec3f(by)); }
+
+		inline bool contains(const bbox &b, const Vec3f &p)
+		{
+			return p.x >= b.min.x && p.y >= b.min.y && p.z >= b.min.z && p.x <= b.max.x && p.y <= b.max.y && p.z <= b.max.z;
+		}
+
+		inline bool overlaps(const bbox &a, const bbox &b)
+		{
+			return a.min.x <= b.max.x && a.min.y <= b.max.y && a.min.z <= b.max.z && b.min.x <= a.max.x && b.min.y <= a.max.y && b.min.z <= a.max.z;
+		}
+
+		// Distance along the ray at which it leaves b, the origin is expected inside
+		inline float exit_distance(const bbox &b, const Vec3f &orig, const Vec3f &inv_dir)
+		{
+			float t = kInfinity;
+			for (uint8_t a = 0; a < 3; ++a)
+				t = std::min(t, ((inv_dir[a] > 0.0f ? b.max[a] : b.min[a]) - orig[a]) * inv_dir[a]);
+			return t;
+		}
+	}
+
+	// Returns false if the file could not be read or has no cells. Entries may come in any order, portals naming
+	// unknown cells are skipped.
+	inline bool load(const std::string &path, layout &building)
+	{
+		std::ifstream ifs(path);
+		if (!ifs.is_open())
+			return false;
+
+		building = layout();
+		std::vector<std::pair<std::string, std::string>> portal_cells;
+		std::string line;
+		while (std::getline(ifs, line))
+		{
+			std::istringstream iss(line.substr(0, line.find('#')));
+			std::string keyword;
+			if (!(iss >> keyword))
+				continue;
+
+			if (keyword == "cell")
+			{
+				cell c;
+				iss >> c.name >> c.bounds.min.x >> c.bounds.min.y >> c.bounds.min.z >> c.bounds.max.x >> c.bounds.max.y >> c.bounds.max.z;
+				if (iss)
+					building.cells.push_back(c);
+			}
+			else if (keyword == "portal")
+			{
+				std::string first, second;
+				portal p;
+				iss >> first >> second >> p.bounds.min.x >> p.bounds.min.y >> p.bounds.min.z >> p.bounds.max.x >> p.bounds.max.y >> p.bounds.max.z;
+				if (iss)
+				{
+					building.portals.push_back(p);
+					portal_cells.emplace_back(first, second);
+				}
+			}
+		}
+
+		auto find = [&](const std::string &name) {
+			for (uint32_t c = 0; c < building.cells.size(); ++c)
+				if (building.cells[c].name == name)
+					return c;
+			return kOutside;
+		};
+		std::vector<portal> portals;
+		for (size_t p = 0; p < building.portals.size(); ++p)
+		{
+			portal resolved = building.portals[p];
+			resolved.cells[0] = find(portal_cells[p].first), resolved.cells[1] = find(portal_cells[p].second);
+			if (resolved.cells[0] != kOutside && (resolved.cells[1] != kOutside || portal_cells[p].second == "outside"))
+				portals.push_back(resolved);
+		}
+		building.portals = std::move(portals);
+		return !building.cells.empty();
+	}
+
+	class portal_graph
+	{
+		struct source_triangle
+		{
+			uint32_t object;
+			uint32_t tri;
+		};
+
+		struct cell_state
+		{
+			bbox bounds;							// grown by kTolerance
+			std::unique_ptr<TriangleMesh> mesh;		// copies of the triangles that touch the cell, nullptr when there are none
+			std::vector<source_triangle> sources;	// by triangle of mesh
+			std::vector<uint32_t> portals;
+		};
+
+		std::vector<cell_state> cells;
+		std::vector<portal> portals;				// bounds grown by 2 * kTolerance
+		std::vector<const Object*> objects;			// indexed by object
+		std::vector<const Object*> unbounded;
+
+		uint32_t locate(const Vec3f &p) const
+		{
+			// Rays of a frame mostly start in the same cell as the last one
+			static thread_local uint32_t hint = 0;
+			if (hint < cells.size() && detail::contains(cells[hint].bounds, p))
+				return hint;
+			for (uint32_t c = 0; c < cells.size(); ++c)
+				if (detail::contains(cells[c].bounds, p))
+					return hint = c;
+			return kOutside;
+		}
+
+		const Object *intersect_all(const Vec3f &orig, const Vec3f &dir, float &tNear, uint32_t &triIndex, Vec2f &uv) const
+		{
+			const Object *hit_object = nullptr;
+			for (const Object *object : objects)
+			{
+				float t = kInfinity;
+				uint32_t index;
+				Vec2f object_uv;
+				if (object->intersect(orig, dir, t, index, object_uv) && t < tNear)
+					tNear = t, triIndex = index, uv = object_uv, hit_object = object;
+			}
+			return hit_object;
+		}
+
+	public:
+		// Rebuilds the cells over objects, which have to stay alive and unchanged until the next build
+		void build(const std::vector<std::unique_ptr<Object>> &scene, const layout &building)
+		{
+			objects.clear();
+			unbounded.clear();
+			for (auto &object : scene)
+			{
+				objects.push_back(object.get());
+				if (!dynamic_cast<const TriangleMesh*>(object.get()))
+					unbounded.push_back(object.get());
+			}
+
+			cells.clear();
+			cells.resize(building.cells.size());
+			for (uint32_t c = 0; c < cells.size(); ++c)
+				cells[c].bounds = detail::grown(building.cells[c].bounds, kTolerance);
+			portals = building.portals;
+			for (uint32_t p = 0; p < portals.size(); ++p)
+			{
+				// Twice as much, rays leave a cell on its grown faces and these have to lie within the doorway
+				portals[p].bounds = detail::grown(portals[p].bounds, 2.0f * kTolerance);
+				for (uint32_t side = 0; side < 2; ++side)
+					if (portals[p].cells[side] < cells.size())
+						cells[portals[p].cells[side]].portals.push_back(p);
+			}
+
+			// Triangles go to every cell their bounds touch
+			std::vector<std::vector<Vec3f>> verts(cells.size());
+			for (uint32_t k = 0; k < scene.size(); ++k)
+			{
+				auto mesh = dynamic_cast<const TriangleMesh*>(scene[k].get());
+				if (!mesh)
+					continue;
+				const mesh_buffer<Vec3f> &mesh_verts = mesh->get_vertices();
+				const mesh_buffer<uint32_t> &index = mesh->get_tris_index();
+				for (uint32_t t = 0; t < mesh->get_num_tris(); ++t)
+				{
+					const Vec3f &v0 = mesh_verts[index[t * 3]], &v1 = mesh_verts[index[t * 3 + 1]], &v2 = mesh_verts[index[t * 3 + 2]];
+					bbox tri_bounds;
+					tri_bounds.extend(v0), tri_bounds.extend(v1), tri_bounds.extend(v2);
+					for (uint32_t c = 0; c < cells.size(); ++c)
+						if (detail::overlaps(tri_bounds, cells[c].bounds))
+						{
+							verts[c].push_back(v0), verts[c].push_back(v1), verts[c].push_back(v2);
+							cells[c].sources.push_back({ k, t });
+						}
+				}
+			}
+
+			for (uint32_t c = 0; c < cells.size(); ++c)
+			{
+				if (verts[c].empty())
+					continue;
+				size_t num_verts = verts[c].size();
+				std::vector<uint32_t> tris(num_verts);
+				for (uint32_t i = 0; i < num_verts; ++i)
+					tris[i] = i;
+				cells[c].mesh.reset(new TriangleMesh(std::move(verts[c]), std::move(tris), std::vector<Vec3f>(num_verts), std::vector<Vec2f>(num_verts), Vec3f(0)));
+			}
+		}
+
+		uint32_t num_cells() const { return static_cast<uint32_t>(cells.size()); }
+
+		// Triangles over all cells, those touching several cells count once per cell
+		size_t num_triangles() const
+		{
+			size_t count = 0;
+			for (const cell_state &c : cells)
+				count += c.sources.size();
+			return count;
+		}
+
+		// Nearest hit along the ray, same contract as Object::intersect. Returns the object that was hit or nullptr.
+		const Object *intersect(const Vec3f &orig, const Vec3f &dir, float &tNear, uint32_t &triIndex, Vec2f &uv) const
+		{
+			uint32_t current = locate(orig);
+			if (current == kOutside)
+				return intersect_all(orig, dir, tNear, triIndex, uv);
+
+			const Object *hit_object = nullptr;
+			for (const Object *object : unbounded)
+			{
+				float t = kInfinity;
+				uint32_t index;
+				Vec2f object_uv;
+				if (object->intersect(orig, dir, t, index, object_uv) && t < tNear)
+					tNear = t, triIndex = index, uv = object_uv, hit_object = object;
+			}
+
+			Vec3f inv_dir = safe_inverse(dir);
+			float tprevious = -kInfinity;
+			for (uint32_t step = 0; step < kMaxSteps; ++step)
+			{
+				const cell_state &c = cells[current];
+				uint32_t local;
+				Vec2f local_uv;
+				if (c.mesh && c.mesh->intersect(orig, dir, tNear, local, local_uv))
+				{
+					const source_triangle &source = c.sources[local];
+					triIndex = source.tri, uv = local_uv, hit_object = objects[source.object];
+				}
+
+				// Anything the ray meets before it leaves the cell touches the cell, so it has been tested
+				float texit = detail::exit_distance(c.bounds, orig, inv_dir);
+				if (tNear <= texit)
+					return hit_object;
+
+				// Leaving through a doorway moves on to the cell behind it, anywhere else nothing here can tell
+				Vec3f exit_point = orig + dir * texit;
+				uint32_t next = kOutside;
+				for (uint32_t p : c.portals)
+					if (detail::contains(portals[p].bounds, exit_point))
+					{
+						next = portals[p].cells[portals[p].cells[0] == current ? 1 : 0];
+						break;
+					}
+				if (next == kOutside || texit <= tprevious || !detail::contains(cells[next].bounds, exit_point))
+					break;
+				tprevious = texit;
+				current = next;
+			}
+
+			float t = tNear;
+			uint32_t index;
+			Vec2f all_uv;
+			const Object *all_hit = intersect_all(orig, dir, t, index, all_uv);
+			if (all_hit)
+				tNear = t, triIndex = index, uv = all_uv, hit_object = all_hit;
+			return hit_object;
+		}
+	};
+}
@@ -0,0 +1,530 @@
+#pragma once
+
+#include<algorithm>
+#include<cassert>
+#include<cmath>
+#include<cstdint>
+#include<cstring>
+#include<memory>
+#include<vector>
+
+#include"bvh.h"
+#include"geometry.h"
+#include"polygon_primitves.h"
+#include"ray_cost.h"
+
+// Compressed, read only version of a TriangleMesh for scenes that do not fit in memory otherwise.
+//  - the bvh is collapsed into 4-wide nodes whose child boxes are quantized to 8 bits relative to the node box
+//  - every bvh leaf becomes a cluster of at most 8 triangles with its own small vertex list; positions are
+//    16 bit offsets from the cluster origin on a grid shared by the whole mesh, so neighbouring clusters
+//    decode shared vertices to exactly the same point
+//  - triangles are three 8 bit cluster local vertex indices
+//  - per corner normals are octahedral encoded into 2x16 bits, uvs are stored as half floats, and both are
+//    dropped entirely when the source mesh leaves them all zero(flat walls)
+// Everything is decoded on the fly during traversal.
+namespace compact
+{
+	namespace detail
+	{
+		inline uint16_t float_to_half(float value)
+		{
+			uint32_t bits;
+			std::memcpy(&bits, &value, 4);
+			uint32_t sign = (bits >> 16) & 0x8000u;
+			int32_t exponent = static_cast<int32_t>((bits >> 23) & 0xff) - 127 + 15;
+			uint32_t mantissa = bits & 0x7fffffu;
+
+			if (exponent <= 0)
+			{
+				if (exponent < -10)
+					return static_cast<uint16_t>(sign);
+				// Denormal half
+				mantissa |= 0x800000u;
+				uint32_t shift = static_cast<uint32_t>(14 - exponent);
+				return static_cast<uint16_t>(sign | ((mantissa + (1u << (shift - 1))) >> shift));
+			}
+			if (exponent >= 31)
+				return static_cast<uint16_t>(sign | 0x7c00u | (((bits >> 23) & 0xff) == 0xff && mantissa ? 0x200u : 0u));
+
+			// Round to nearest, a carry into the exponent is still correct
+			return static_cast<uint16_t>(sign | ((static_cast<uint32_t>(exponent) << 10) + ((mantissa + 0x1000u) >> 13)));
+		}
+
+		inline float half_to_float(uint16_t half)
+		{
+			uint32_t sign = (half & 0x8000u) << 16;
+			uint32_t exponent = (half >> 10) & 0x1f;
+			uint32_t mantissa = half & 0x3ffu;
+			uint32_t bits;
+
+			if (exponent == 0)
+			{
+				float value = std::ldexp(static_cast<float>(mantissa), -24);
+				return sign ? -value : value;
+			}
+			if (exponent == 31)
+				bits = sign | 0x7f800000u | (mantissa << 13);
+			else
+				bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+
+			float value;
+			std::memcpy(&value, &bits, 4);
+			return value;
+		}
+
+		inline int16_t snorm16(float v) { return static_cast<int16_t>(std::round(std::min(1.0f, std::max(-1.0f, v)) * 32767.0f)); }
+
+		// Octahedral normal encoding, two signed 16 bit values packed into 32 bits
+		inline uint32_t encode_normal(const Vec3f &n)
+		{
+			float l1 = std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z);
+			if (l1 == 0.0f)
+				return 0;
+
+			float x = n.x / l1, y = n.y / l1;
+			if (n.z < 0.0f)
+			{
+				float fx = (1.0f - std::fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+				float fy = (1.0f - std::fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+				x = fx, y = fy;
+			}
+			return static_cast<uint16_t>(snorm16(x)) | (static_cast<uint32_t>(static_cast<uint16_t>(snorm16(y))) << 16);
+		}
+
+		inline Vec3f decode_normal(uint32_t packed)
+		{
+			float x = static_cast<int16_t>(packed & 0xffff) / 32767.0f;
+			float y = static_cast<int16_t>(packed >> 16) / 32767.0f;
+			Vec3f n(x, y, 1.0f - std::fabs(x) - std::fabs(y));
+			if (n.z < 0.0f)
+			{
+				float fx = (1.0f - std::fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+				float fy = (1.0f - std::fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+				n.x = fx, n.y = fy;
+			}
+			return n.normalize();
+		}
+
+		inline uint32_t encode_uv(const Vec2f &uv) { return float_to_half(uv.x) | (static_cast<uint32_t>(float_to_half(uv.y)) << 16); }
+		inline Vec2f decode_uv(uint32_t packed) { return Vec2f(half_to_float(packed & 0xffff), half_to_float(packed >> 16)); }
+	}
+
+	// 4-wide bvh node, child boxes are stored as 8 bit offsets from origin in steps of 2^exponent per axis.
+	// Interior children are stored consecutively from first_child, leaf children consecutively from first_cluster,
+	// both in the order of the child slots.
+	struct wide_node
+	{
+		Vec3f origin;
+		int8_t exponent[3];
+		uint8_t num_children;
+		uint32_t first_child;
+		uint32_t first_cluster;
+		uint8_t leaf_mask;		// bit i set when child i is a cluster
+		uint8_t pad[3];
+		uint8_t lo[3][4];		// [axis][child]
+		uint8_t hi[3][4];
+	};
+
+	static_assert(sizeof(wide_node) == 52, "wide_node is expected to be 52 bytes");
+
+	struct quantized_position
+	{
+		uint16_t x, y, z;
+	};
+
+	struct cluster
+	{
+		int32_t base[3];		// cluster origin in grid steps from the mesh origin
+		uint32_t first_vertex;
+		uint32_t first_tri;
+		uint8_t num_vertices;
+		uint8_t num_tris;
+		uint16_t pad;
+	};
+
+	class CompactTriangleMesh : public Object
+	{
+		Vec3f grid_origin;
+		float grid_step;
+		std::vector<wide_node> nodes;
+		std::vector<cluster> clusters;
+		std::vector<quantized_position> positions;
+		std::vector<uint32_t> tris;			// three 8 bit cluster local vertex indices per triangle
+		std::vector<uint32_t> normals;		// three per triangle, empty when the mesh has no normals
+		std::vector<uint32_t> tex_coords;	// three per triangle, empty when the mesh has no uvs
+		std::vector<uint16_t> materials;	// one per triangle, empty when they all use material_id
+
+		Vec3f decode_vertex(const cluster &c, uint32_t local) const
+		{
+			const quantized_position &q = positions[c.first_vertex + local];
+			return Vec3f(grid_origin.x + (c.base[0] + static_cast<int32_t>(q.x)) * grid_step,
+				grid_origin.y + (c.base[1] + static_cast<int32_t>(q.y)) * grid_step,
+				grid_origin.z + (c.base[2] + static_cast<int32_t>(q.z)) * grid_step);
+		}
+
+		void decode_triangle(uint32_t tri_index, uint32_t cluster_index, Vec3f &v0, Vec3f &v1, Vec3f &v2) const
+		{
+			const cluster &c = clusters[cluster_index];
+			uint32_t packed = tris[tri_index];
+			v0 = decode_vertex(c, packed & 0xff);
+			v1 = decode_vertex(c, (packed >> 8) & 0xff);
+			v2 = decode_vertex(c, (packed >> 16) & 0xff);
+		}
+
+		// Cluster index of each triangle, recovered from the cluster table when needed
+		uint32_t cluster_of(uint32_t tri_index) const
+		{
+			auto it = std::upper_bound(clusters.begin(), clusters.end(), tri_index, [](uint32_t t, const cluster &c) { return t < c.first_tri; });
+			return static_cast<uint32_t>(it - clusters.begin()) - 1;
+		}
+
+		struct wide_child
+		{
+			uint32_t binary_node;
+			bbox bounds;
+		};
+
+		uint32_t add_cluster(const TriangleMesh &mesh, const bvh_node &leaf)
+		{
+			const auto &verts = mesh.get_vertices();
+			const auto &tris_index = mesh.get_tris_index();
+			const auto &prims = mesh.get_bvh().get_prim_indices();
+
+			cluster c;
+			c.first_vertex = static_cast<uint32_t>(positions.size());
+			c.first_tri = static_cast<uint32_t>(tris.size());
+			c.num_tris = static_cast<uint8_t>(leaf.count);
+			c.pad = 0;
+
+			// Grid coordinates of every corner, the cluster origin is their minimum
+			std::vector<uint32_t> local_verts;
+			int64_t base[3] = { INT64_MAX, INT64_MAX, INT64_MAX };
+			for (uint32_t i = 0; i < leaf.count; ++i)
+				for (uint32_t k = 0; k < 3; ++k)
+				{
+					uint32_t vert = tris_index[prims[leaf.offset + i] * 3 + k];
+					if (std::find(local_verts.begin(), local_verts.end(), vert) == local_verts.end())
+						local_verts.push_back(vert);
+					for (uint32_t a = 0; a < 3; ++a)
+						base[a] = std::min(base[a], grid_coordinate(verts[vert], a));
+				}
+
+			for (uint32_t a = 0; a < 3; ++a)
+				c.base[a] = static_cast<int32_t>(base[a]);
+			c.num_vertices = static_cast<uint8_t>(local_verts.size());
+
+			for (uint32_t vert : local_verts)
+			{
+				quantized_position q;
+				q.x = static_cast<uint16_t>(grid_coordinate(verts[vert], 0) - base[0]);
+				q.y = static_cast<uint16_t>(grid_coordinate(verts[vert], 1) - base[1]);
+				q.z = static_cast<uint16_t>(grid_coordinate(verts[vert], 2) - base[2]);
+				positions.push_back(q);
+			}
+
+			for (uint32_t i = 0; i < leaf.count; ++i)
+			{
+				uint32_t tri = prims[leaf.offset + i];
+				uint32_t packed = 0;
+				for (uint32_t k = 0; k < 3; ++k)
+				{
+					uint32_t vert = tris_index[tri * 3 + k];
+					uint32_t local = static_cast<uint32_t>(std::find(local_verts.begin(), local_verts.end(), vert) - local_verts.begin());
+					packed |= local << (8 * k);
+					if (has_normals)
+						normals.push_back(detail::encode_normal(mesh.get_normals()[tri * 3 + k]));
+					if (has_tex_coords)
+						tex_coords.push_back(detail::encode_uv(mesh.get_tex_coordinates()[tri * 3 + k]));
+				}
+				tris.push_back(packed);
+				if (!mesh.get_triangle_materials().empty())
+					materials.push_back(mesh.get_triangle_materials()[tri]);
+			}
+
+			clusters.push_back(c);
+			return static_cast<uint32_t>(clusters.size() - 1);
+		}
+
+		int64_t grid_coordinate(const Vec3f &p, uint32_t axis) const
+		{
+			return static_cast<int64_t>(std::llround((p[axis] - grid_origin[axis]) / grid_step));
+		}
+
+		// Collapses the binary node into the wide node at wide_index
+		void build_wide(const TriangleMesh &mesh, uint32_t binary_index, uint32_t wide_index)
+		{
+			const auto &binary = mesh.get_bvh().get_nodes();
+			std::vector<wide_child> children;
+			auto add_child = [&](uint32_t index) { children.push_back({ index, bbox(binary[index].bmin, binary[index].bmax) }); };
+
+			if (binary[binary_index].count > 0)
+				add_child(binary_index);
+			else
+			{
+				add_child(binary_index + 1);
+				add_child(binary[binary_index].offset);
+			}
+
+			// Open the largest interior child until all four slots are used
+			while (children.size() < 4)
+			{
+				int best = -1;
+				float best_area = -1.0f;
+				for (size_t i = 0; i < children.size(); ++i)
+					if (binary[children[i].binary_node].count == 0 && children[i].bounds.surface_area() > best_area)
+						best = static_cast<int>(i), best_area = children[i].bounds.surface_area();
+				if (best < 0)
+					break;
+
+				uint32_t opened = children[best].binary_node;
+				children.erase(children.begin() + best);
+				add_child(opened + 1);
+				add_child(binary[opened].offset);
+			}
+
+			bbox bounds;
+			for (auto &child : children)
+				bounds.extend(child.bounds);
+
+			wide_node node = {};
+			node.origin = bounds.min;
+			node.num_children = static_cast<uint8_t>(children.size());
+			Vec3f scale;
+			for (uint32_t a = 0; a < 3; ++a)
+			{
+				// Smallest power of two step that covers the extent in 255 steps
+				float extent = bounds.max[a] - bounds.min[a];
+				int exponent = extent > 0.0f ? static_cast<int>(std::ceil(std::log2(extent / 255.0f))) : -126;
+				exponent = std::max(-126, std::min(127, exponent));
+				while (exponent < 127 && std::ldexp(255.0f, exponent) < extent)
+					++exponent;
+				node.exponent[a] = static_cast<int8_t>(exponent);
+				scale[a] = std::ldexp(1.0f, exponent);
+			}
+
+			for (size_t i = 0; i < children.size(); ++i)
+				for (uint32_t a = 0; a < 3; ++a)
+				{
+					// Round outwards so the decoded box always contains the child
+					float lo = std::floor((children[i].bounds.min[a] - node.origin[a]) / scale[a]);
+					float hi = std::ceil((children[i].bounds.max[a] - node.origin[a]) / scale[a]);
+					node.lo[a][i] = static_cast<uint8_t>(std::max(0.0f, std::min(255.0f, lo)));
+					node.hi[a][i] = static_cast<uint8_t>(std::max(0.0f, std::min(255.0f, hi)));
+				}
+
+			// Reserve consecutive slots for the interior children before descending into them
+			node.first_child = static_cast<uint32_t>(nodes.size());
+			node.first_cluster = static_cast<uint32_t>(clusters.size());
+			uint32_t num_interior = 0;
+			for (size_t i = 0; i < children.size(); ++i)
+				if (binary[children[i].binary_node].count > 0)
+				{
+					node.leaf_mask |= 1 << i;
+					add_cluster(mesh, binary[children[i].binary_node]);
+				}
+				else
+					++num_interior;
+
+			nodes.resize(nodes.size() + num_interior);
+			nodes[wide_index] = node;
+			uint32_t next = node.first_child;
+			for (size_t i = 0; i < children.size(); ++i)
+				if (!(node.leaf_mask & (1 << i)))
+					build_wide(mesh, children[i].binary_node, next++);
+		}
+
+		bool has_normals = false;
+		bool has_tex_coords = false;
+	public:
+		explicit CompactTriangleMesh(const TriangleMesh &mesh) : Object(mesh.color), grid_step(1.0f)
+		{
+			const auto &binary = mesh.get_bvh().get_nodes();
+			if (binary.empty())
+				return;
+
+			has_normals = std::any_of(mesh.get_normals().begin(), mesh.get_normals().end(), [](const Vec3f &n) { return n.norm() > 0.0f; });
+			has_tex_coords = std::any_of(mesh.get_tex_coordinates().begin(), mesh.get_tex_coordinates().end(), [](const Vec2f &st) { return st.x != 0.0f || st.y != 0.0f; });
+
+			// The grid step has to let the largest leaf fit into 16 bits, and the whole mesh into 31 bits
+			bbox mesh_bounds(binary[0].bmin, binary[0].bmax);
+			float max_leaf_extent = 0.0f;
+			for (const bvh_node &node : binary)
+				if (node.count > 0)
+				{
+					Vec3f extent = node.bmax - node.bmin;
+					max_leaf_extent = std::max(max_leaf_extent, std::max(extent.x, std::max(extent.y, extent.z)));
+				}
+			Vec3f mesh_extent = mesh_bounds.extent();
+			float max_mesh_extent = std::max(mesh_extent.x, std::max(mesh_extent.y, mesh_extent.z));
+			grid_origin = mesh_bounds.min;
+			grid_step = std::max(max_leaf_extent / 65533.0f, max_mesh_extent / static_cast<float>(1 << 30));
+			if (grid_step <= 0.0f)
+				grid_step = 1.0f;
+
+			nodes.resize(1);
+			build_wide(mesh, 0, 0);
+			nodes.shrink_to_fit();
+			clusters.shrink_to_fit();
+			positions.shrink_to_fit();
+			tris.shrink_to_fit();
+			normals.shrink_to_fit();
+			tex_coords.shrink_to_fit();
+		}
+
+		size_t memory_usage() const
+		{
+			return sizeof(*this) + nodes.size() * sizeof(wide_node) + clusters.size() * sizeof(cluster) +
+				positions.size() * sizeof(quantized_position) + (tris.size() + normals.size() + tex_coords.size()) * sizeof(uint32_t);
+		}
+
+		bool intersect(const Vec3f &orig, const Vec3f &dir, float &tNear, uint32_t &triIndex, Vec2f &uv) const
+		{
+			if (nodes.empty())
+				return false;
+
+			ray_cost_tally tally;
+			Vec3f inv_dir = safe_inverse(dir);
+			bool isect = false;
+			// A wide node opens at least one binary level and leaves at most three of its children waiting
+			std::pair<uint32_t, float> stack[3 * bvh::kMaxDepth + 1];
+			uint32_t stack_size = 0;
+			stack[stack_size++] = { 0, 0.0f };
+
+			while (stack_size > 0)
+			{
+				auto entry = stack[--stack_size];
+				if (entry.second > tNear)
+					continue;
+
+				const wide_node &node = nodes[entry.first];
+				++tally.nodes;
+				Vec3f scale(std::ldexp(1.0f, node.exponent[0]), std::ldexp(1.0f, node.exponent[1]), std::ldexp(1.0f, node.exponent[2]));
+
+				// Decode and test the child boxes, interior hits are collected and pushed far to near
+				std::pair<uint32_t, float> hits[4];
+				uint32_t num_hits = 0;
+				uint32_t interior_slot = node.first_child, cluster_slot = node.first_cluster;
+				for (uint32_t i = 0; i < node.num_children; ++i)
+				{
+					bool is_leaf = (node.leaf_mask >> i) & 1;
+					uint32_t target = is_leaf ? cluster_slot++ : interior_slot++;
+
+					Vec3f bmin(node.origin.x + node.lo[0][i] * scale.x, node.origin.y + node.lo[1][i] * scale.y, node.origin.z + node.lo[2][i] * scale.z);
+					Vec3f bmax(node.origin.x + node.hi[0][i] * scale.x, node.origin.y + node.hi[1][i] * scale.y, node.origin.z + node.hi[2][i] * scale.z);
+					float tentry;
+					if (!intersect_bbox(bmin, bmax, orig, inv_dir, tNear, tentry))
+						continue;
+
+					if (!is_leaf)
+					{
+						hits[num_hits++] = { target, tentry };
+						continue;
+					}
+
+					const cluster &c = clusters[target];
+					tally.triangles += c.num_tris;
+					for (uint32_t k = 0; k < c.num_tris; ++k)
+					{
+						Vec3f v0, v1, v2;
+						decode_triangle(c.first_tri + k, target, v0, v1, v2);
+						float t = kInfinity, u, v;
+						if (TriangleMesh::rayTriangleIntersect(orig, dir, v0, v1, v2, t, u, v) && t < tNear) {
+							tNear = t;
+							uv.x = u;
+							uv.y = v;
+							triIndex = c.first_tri + k;
+							isect = true;
+						}
+					}
+				}
+
+				// Insertion sort far to near, there are at most four
+				for (uint32_t i = 1; i < num_hits; ++i)
+					for (uint32_t j = i; j > 0 && hits[j - 1].second < hits[j].second; --j)
+						std::swap(hits[j - 1], hits[j]);
+				assert(stack_size + num_hits <= 3 * bvh::kMaxDepth + 1);
+				for (uint32_t i = 0; i < num_hits; ++i)
+					stack[stack_size++] = hits[i];
+			}
+
+			return isect;
+		}
+
+		void getSurfaceProperties(
+			const Vec3f &hitPoint,
+			const Vec3f &viewDirection,
+			const uint32_t &triIndex,
+			const Vec2f &uv,
+			Vec3f &hitNormal,
+			Vec2f &hitTextureCoordinates) const
+		{
+			// face normal
+			Vec3f v0, v1, v2;
+			decode_triangle(triIndex, cluster_of(triIndex), v0, v1, v2);
+			hitNormal = (v1 - v0).crossProduct(v2 - v0);
+			hitNormal.normalize();
+
+			// texture coordinates
+			hitTextureCoordinates = Vec2f(0);
+			if (has_tex_coords)
+			{
+				Vec2f st0 = detail::decode_uv(tex_coords[triIndex * 3]);
+				Vec2f st1 = detail::decode_uv(tex_coords[triIndex * 3 + 1]);
+				Vec2f st2 = detail::decode_uv(tex_coords[triIndex * 3 + 2]);
+				hitTextureCoordinates = (1 - uv.x - uv.y) * st0 + uv.x * st1 + uv.y * st2;
+			}
+		}
+
+		uint32_t material_of(const uint32_t &triIndex) const
+		{
+			return materials.empty() || materials[triIndex] == 0xFFFF ? material_id : materials[triIndex];
+		}
+
+		float texture_density(const uint32_t &triIndex) const
+		{
+			if (!has_tex_coords)
+				return 0.0f;
+			Vec3f v0, v1, v2;
+			decode_triangle(triIndex, cluster_of(triIndex), v0, v1, v2);
+			return TriangleMesh::density(v0, v1, v2, detail::decode_uv(tex_coords[triIndex * 3]), detail::decode_uv(tex_coords[triIndex * 3 + 1]),
+				detail::decode_uv(tex_coords[triIndex * 3 + 2]));
+		}
+
+		// Interpolated shading normal, the face normal when the mesh has none
+		Vec3f shading_normal(uint32_t triIndex, const Vec2f &uv, const Vec3f &face_normal) const
+		{
+			if (!has_normals)
+				return face_normal;
+			Vec3f n0 = detail::decode_normal(normals[triIndex * 3]);
+			Vec3f n1 = detail::decode_normal(normals[triIndex * 3 + 1]);
+			Vec3f n2 = detail::decode_normal(normals[triIndex * 3 + 2]);
+			return ((1 - uv.x - uv.y) * n0 + uv.x * n1 + uv.y * n2).normalize();
+		}
+	};
+
+	// Bytes held by a regular mesh, to report the savings
+	inline size_t memory_usage(const TriangleMesh &mesh)
+	{
+		return sizeof(mesh) + mesh.get_vertices().size() * sizeof(Vec3f) + mesh.get_tris_index().size() * sizeof(uint32_t) +
+			mesh.get_normals().size() * sizeof(Vec3f) + mesh.get_tex_coordinates().size() * sizeof(Vec2f) +
+			mesh.get_bvh().get_nodes().size() * sizeof(bvh_node) + mesh.get_bvh().get_prim_indices().size() * sizeof(uint32_t);
+	}
+
+	// Replaces every TriangleMesh in objects with its compact version, returns the bytes before and after
+	inline std::pair<size_t, size_t> compact_objects(std::vector<std::unique_ptr<Object>> &objects)
+	{
+		std::pair<size_t, size_t> bytes(0, 0);
+		for (auto &object : objects)
+			if (auto mesh = dynamic_cast<TriangleMesh*>(object.get()))
+			{
+				mesh->update();
+				std::unique_ptr<CompactTriangleMesh> compact_mesh(new CompactTriangleMesh(*mesh));
+				compact_mesh->texture_id = mesh->texture_id;
+				compact_mesh->material_id = mesh->material_id;
+				bytes.first += memory_usage(*mesh);
+				bytes.second += compact_mesh->memory_usage();
+				object = std::move(compact_mesh);
+			}
+		return bytes;
+	}
+}
@@ -0,0 +1,312 @@
+#pragma once
+
+#include<algorithm>
+#include<chrono>
+#include<cstdint>
+#include<cstring>
+#include<deque>
+#include<functional>
+#include<iostream>
+#include<vector>
+
+#ifndef _WIN32
+#include<cerrno>
+#include<csignal>
+#include<poll.h>
+#include<sys/socket.h>
+#include<sys/types.h>
+#include<sys/wait.h>
+#include<unistd.h>
+#endif
+
+#include"geometry.h"
+
+// Renders an image as tiles on several worker processes.
+//
+// The coordinator forks the workers once the scene is built, so each of them starts with the scene already in memory,
+// and talks to every worker over its own socket pair. Tiles are handed out one at a time as workers finish, which keeps
+// fast workers busy while slow ones catch up. A worker that dies, closes its socket, sends garbage or takes longer than
+// the tile timeout is killed and its tile goes back into the queue for the others. Once no worker is left the
+// coordinator renders what remains itself, so a frame always completes.
+//
+// Workers have a single thread: the thread pool of the coordinator does not survive the fork, so tiles must be
+// rendered without it. Only POSIX systems fork, elsewhere every tile is rendered by the coordinator.
+namespace distributed
+{
+	struct tile
+	{
+		uint32_t id;
+		uint32_t x0, y0, x1, y1;	// pixels [x0, x1) x [y0, y1)
+
+		uint32_t width() const { return x1 - x0; }
+		uint32_t height() const { return y1 - y0; }
+	};
+
+	struct settings
+	{
+		uint32_t workers = 4;
+		uint32_t tile_size = 32;
+		uint32_t tile_timeout_ms = 60000;
+		// Worker that crashes on its second tile, to try out recovery. -1 for none.
+		int32_t faulty_worker = -1;
+	};
+
+	struct report
+	{
+		uint32_t tiles = 0;
+		uint32_t workers_started = 0;
+		uint32_t workers_failed = 0;
+		uint32_t tiles_reissued = 0;
+		uint32_t tiles_local = 0;	// rendered by the coordinator
+	};
+
+	// Renders one tile into pixels, width() * height() of them row by row. Called from a single thread.
+	typedef std::function<void(const tile &, Vec3f *pixels)> tile_renderer;
+
+	inline std::vector<tile> split(uint32_t width, uint32_t height, uint32_t tile_size)
+	{
+		tile_size = std::max(1u, tile_size);
+		std::vector<tile> tiles;
+		for (uint32_t y = 0; y < height; y += tile_size)
+			for (uint32_t x = 0; x < width; x += tile_size)
+				tiles.push_back({ static_cast<uint32_t>(tiles.size()), x, y, std::min(width, x + tile_size), std::min(height, y + tile_size) });
+		return tiles;
+	}
+
+	namespace detail
+	{
+		inline void copy_tile(const tile &t, const Vec3f *pixels, uint32_t width, Vec3f *framebuffer)
+		{
+			for (uint32_t y = t.y0; y < t.y1; ++y)
+				std::copy(pixels + (y - t.y0) * t.width(), pixels + (y - t.y0 + 1) * t.width(), framebuffer + y * width + t.x0);
+		}
+
+#ifndef _WIN32
+		enum class message : uint32_t
+		{
+			render_tile = 1,	// followed by a tile
+			tile_done = 2,		// followed by its pixels
+			shutdown = 3
+		};
+
+		struct message_header
+		{
+			message type;
+			uint32_t tile;
+			uint32_t bytes;		// of what follows
+		};
+
+		inline bool write_all(int fd, const void *data, size_t bytes)
+		{
+			const char *p = static_cast<const char*>(data);
+			while (bytes > 0)
+			{
+				ssize_t n = write(fd, p, bytes);
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n <= 0)
+					return false;
+				p += n, bytes -= static_cast<size_t>(n);
+			}
+			return true;
+		}
+
+		inline bool read_all(int fd, void *data, size_t bytes)
+		{
+			char *p = static_cast<char*>(data);
+			while (bytes > 0)
+			{
+				ssize_t n = read(fd, p, bytes);
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n <= 0)
+					return false;
+				p += n, bytes -= static_cast<size_t>(n);
+			}
+			return true;
+		}
+
+		// Body of a worker process, never returns. Leaves with _exit so nothing the coordinator set up is torn down twice.
+		inline void worker_main(int fd, bool faulty, const tile_renderer &render_tile)
+		{
+			std::vector<Vec3f> pixels;
+			uint32_t rendered = 0;
+			for (;;)
+			{
+				message_header header;
+				tile t;
+				if (!read_all(fd, &header, sizeof(header)) || header.type != message::render_tile ||
+					header.bytes != sizeof(tile) || !read_all(fd, &t, sizeof(t)))
+					_exit(0);
+				if (faulty && rendered == 1)
+					_exit(1);
+
+				pixels.resize(static_cast<size_t>(t.width()) * t.height());
+				render_tile(t, pixels.data());
+				++rendered;
+
+				message_header reply = { message::tile_done, t.id, static_cast<uint32_t>(pixels.size() * sizeof(Vec3f)) };
+				if (!write_all(fd, &reply, sizeof(reply)) || !write_all(fd, pixels.data(), reply.bytes))
+					_exit(1);
+			}
+		}
+
+		struct worker
+		{
+			pid_t pid = -1;
+			int fd = -1;
+			int32_t tile = -1;		// in flight, -1 while idle
+			std::chrono::steady_clock::time_point started;
+		};
+#endif
+	}
+
+	// Renders a width x height image into framebuffer with settings.workers processes. Returns what happened.
+	inline report render(uint32_t width, uint32_t height, const settings &config, const tile_renderer &render_tile, Vec3f *framebuffer)
+	{
+		report result;
+		std::vector<tile> tiles = split(width, height, config.tile_size);
+		result.tiles = static_cast<uint32_t>(tiles.size());
+		std::deque<uint32_t> pending;
+		for (const tile &t : tiles)
+			pending.push_back(t.id);
+		std::vector<Vec3f> pixels;
+
+#ifndef _WIN32
+		using detail::message;
+		using detail::message_header;
+
+		// Writing to a worker that just died must fail rather than kill the coordinator
+		void(*previous_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+		std::cout.flush();
+
+		std::vector<detail::worker> workers;
+		for (uint32_t w = 0; w < config.workers; ++w)
+		{
+			int fds[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+				break;
+			pid_t pid = fork();
+			if (pid == 0)
+			{
+				// Only this worker's end stays open, so a worker notices when the coordinator goes away
+				close(fds[0]);
+				for (const detail::worker &other : workers)
+					close(other.fd);
+				detail::worker_main(fds[1], static_cast<int32_t>(w) == config.faulty_worker, render_tile);
+			}
+			close(fds[1]);
+			if (pid < 0)
+			{
+				close(fds[0]);
+				break;
+			}
+			detail::worker worker;
+			worker.pid = pid;
+			worker.fd = fds[0];
+			workers.push_back(worker);
+		}
+		result.workers_started = static_cast<uint32_t>(workers.size());
+
+		auto retire = [&](detail::worker &worker, bool failed) {
+			if (failed)
+			{
+				kill(worker.pid, SIGKILL);
+				result.workers_failed += 1;
+				if (worker.tile >= 0)
+				{
+					pending.push_front(static_cast<uint32_t>(worker.tile));
+					result.tiles_reissued += 1;
+				}
+			}
+			else
+			{
+				message_header bye = { message::shutdown, 0, 0 };
+				detail::write_all(worker.fd, &bye, sizeof(bye));
+			}
+			close(worker.fd);
+			waitpid(worker.pid, nullptr, 0);
+			worker.fd = -1;
+			worker.tile = -1;
+		};
+
+		const auto timeout = std::chrono::milliseconds(config.tile_timeout_ms);
+		std::vector<pollfd> polled;
+		std::vector<detail::worker*> polled_workers;
+		for (;;)
+		{
+			// Hand out tiles to idle workers
+			for (detail::worker &worker : workers)
+			{
+				if (worker.fd < 0 || worker.tile >= 0 || pending.empty())
+					continue;
+				const tile &t = tiles[pending.front()];
+				message_header header = { message::render_tile, t.id, sizeof(tile) };
+				worker.tile = static_cast<int32_t>(t.id);
+				worker.started = std::chrono::steady_clock::now();
+				pending.pop_front();
+				if (!detail::write_all(worker.fd, &header, sizeof(header)) || !detail::write_all(worker.fd, &t, sizeof(t)))
+					retire(worker, true);
+			}
+
+			polled.clear();
+			polled_workers.clear();
+			auto now = std::chrono::steady_clock::now();
+			auto wait = timeout;
+			for (detail::worker &worker : workers)
+				if (worker.fd >= 0 && worker.tile >= 0)
+				{
+					polled.push_back({ worker.fd, POLLIN, 0 });
+					polled_workers.push_back(&worker);
+					wait = std::min(wait, std::chrono::duration_cast<std::chrono::milliseconds>(timeout - (now - worker.started)));
+				}
+			if (polled.empty())
+				break;
+
+			int ready = poll(polled.data(), polled.size(), static_cast<int>(std::max<int64_t>(0, wait.count())));
+			if (ready < 0 && errno != EINTR)
+				break;
+
+			now = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < polled.size(); ++i)
+			{
+				detail::worker &worker = *polled_workers[i];
+				if (polled[i].revents == 0)
+				{
+					if (now - worker.started > timeout)
+						retire(worker, true);
+					continue;
+				}
+
+				const tile &t = tiles[static_cast<uint32_t>(worker.tile)];
+				message_header header;
+				pixels.resize(static_cast<size_t>(t.width()) * t.height());
+				if (!detail::read_all(worker.fd, &header, sizeof(header)) || header.type != message::tile_done || header.tile != t.id ||
+					header.bytes != pixels.size() * sizeof(Vec3f) || !detail::read_all(worker.fd, pixels.data(), header.bytes))
+				{
+					retire(worker, true);
+					continue;
+				}
+				detail::copy_tile(t, pixels.data(), width, framebuffer);
+				worker.tile = -1;
+			}
+		}
+
+		for (detail::worker &worker : workers)
+			if (worker.fd >= 0)
+				retire(worker, worker.tile >= 0);
+		signal(SIGPIPE, previous_sigpipe);
+#endif
+
+		// Whatever no worker could take
+		for (uint32_t id : pending)
+		{
+			const tile &t = tiles[id];
+			pixels.resize(static_cast<size_t>(t.width()) * t.height());
+			render_tile(t, pixels.data());
+			detail::copy_tile(t, pixels.data(), width, framebuffer);
+			result.tiles_local += 1;
+		}
+		return result;
+	}
+}
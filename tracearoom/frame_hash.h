@@ -0,0 +1,92 @@
+#pragma once
+
+#include<cstdint>
+#include<cstdio>
+#include<cstring>
+#include<fstream>
+#include<string>
+
+#include"geometry.h"
+
+// Content hash of a rendered frame, for checking that renders are reproducible and for keying caches on them.
+//
+// The hash covers the exact bits of every channel, so it only matches when two frames are bit for bit the same.
+// Four independent lanes of multiply and rotate over 64 bit words keep it at memory speed, it is not cryptographic.
+namespace frame_hash
+{
+	namespace detail
+	{
+		const uint64_t kPrime1 = 0x9E3779B185EBCA87ull;
+		const uint64_t kPrime2 = 0xC2B2AE3D27D4EB4Full;
+
+		inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+		inline uint64_t round(uint64_t acc, uint64_t input) { return rotl(acc + input * kPrime2, 31) * kPrime1; }
+
+		inline uint64_t avalanche(uint64_t h)
+		{
+			h ^= h >> 33;
+			h *= 0xff51afd7ed558ccdull;
+			h ^= h >> 33;
+			h *= 0xc4ceb9fe1a85ec53ull;
+			h ^= h >> 33;
+			return h;
+		}
+	}
+
+	inline uint64_t hash(const void *data, size_t bytes)
+	{
+		const unsigned char *p = static_cast<const unsigned char*>(data);
+		uint64_t lanes[4] = { detail::kPrime1 + detail::kPrime2, detail::kPrime2, 0, 0 - detail::kPrime1 };
+		size_t i = 0;
+		for (; i + 32 <= bytes; i += 32)
+			for (int l = 0; l < 4; ++l)
+			{
+				uint64_t word;
+				std::memcpy(&word, p + i + l * 8, sizeof(word));
+				lanes[l] = detail::round(lanes[l], word);
+			}
+
+		uint64_t h = detail::rotl(lanes[0], 1) + detail::rotl(lanes[1], 7) + detail::rotl(lanes[2], 12) + detail::rotl(lanes[3], 18);
+		h += bytes;
+		for (; i < bytes; ++i)
+			h = detail::rotl(h ^ (p[i] * detail::kPrime1), 11) * detail::kPrime2;
+		return detail::avalanche(h);
+	}
+
+	inline uint64_t hash(const Vec3f *pixels, size_t count)
+	{
+		return hash(static_cast<const void*>(pixels), count * sizeof(Vec3f));
+	}
+
+	inline std::string to_hex(uint64_t h)
+	{
+		char text[17];
+		snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(h));
+		return text;
+	}
+
+	// A reference is a text file holding the hash in hex
+	inline bool read_reference(const std::string &path, uint64_t &h)
+	{
+		std::ifstream ifs(path);
+		std::string text;
+		if (!(ifs >> text) || text.size() != 16)
+			return false;
+		h = 0;
+		for (char c : text)
+		{
+			int digit = c >= '0' && c <= '9' ? c - '0' : (c >= 'a' && c <= 'f' ? c - 'a' + 10 : (c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1));
+			if (digit < 0)
+				return false;
+			h = h << 4 | static_cast<uint64_t>(digit);
+		}
+		return true;
+	}
+
+	inline bool write_reference(const std::string &path, uint64_t h)
+	{
+		std::ofstream ofs(path);
+		ofs << to_hex(h) << "\n";
+		return static_cast<bool>(ofs);
+	}
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include<algorithm>
+#include<cstdint>
+#include<fstream>
+#include<string>
+#include<vector>
+
+#include"ray_cost.h"
+#include"tonemap.h"
+
+// Diagnostic images of where rays get expensive. Takes the per pixel ray_cost recorded while tracing a frame and
+// turns one of its measures into a false colour bitmap, along with a histogram of the cost over all pixels.
+// Colours run from dark blue(cheap) through cyan, green and yellow to red. The scale tops out at the 99th
+// percentile so a handful of pathological pixels does not wash the rest out, pixels above it are drawn white.
+namespace heatmap
+{
+	typedef unsigned char uchar;
+
+	enum class metric
+	{
+		total,		// nodes + triangles + lights
+		nodes,
+		triangles,
+		lights
+	};
+
+	inline bool parse_metric(const std::string &name, metric &m)
+	{
+		static const char *names[] = { "total", "nodes", "triangles", "lights" };
+		for (uint32_t i = 0; i < 4; ++i)
+			if (name == names[i])
+			{
+				m = static_cast<metric>(i);
+				return true;
+			}
+		return false;
+	}
+
+	inline uint32_t cost_of(const ray_cost &cost, metric m)
+	{
+		switch (m)
+		{
+		case metric::nodes: return cost.nodes;
+		case metric::triangles: return cost.triangles;
+		case metric::lights: return cost.lights;
+		default: return cost.total();
+		}
+	}
+
+	struct summary
+	{
+		uint32_t min = 0, max = 0;
+		uint32_t p50 = 0, p90 = 0, p99 = 0;
+		double mean = 0.0;
+	};
+
+	inline summary summarize(const std::vector<uint32_t> &values)
+	{
+		summary s;
+		if (values.empty())
+			return s;
+
+		std::vector<uint32_t> sorted(values);
+		std::sort(sorted.begin(), sorted.end());
+		auto percentile = [&](double p) { return sorted[static_cast<size_t>(p * (sorted.size() - 1))]; };
+		s.min = sorted.front(), s.max = sorted.back();
+		s.p50 = percentile(0.5), s.p90 = percentile(0.9), s.p99 = percentile(0.99);
+		double sum = 0.0;
+		for (uint32_t v : sorted)
+			sum += v;
+		s.mean = sum / sorted.size();
+		return s;
+	}
+
+	namespace detail
+	{
+		// t in [0, 1] to the colour ramp, as rgb in [0, 255]
+		inline void ramp(float t, uchar rgb[3])
+		{
+			static const float stops[5][3] = { { 0, 0, 96 }, { 0, 160, 255 }, { 0, 200, 0 }, { 255, 230, 0 }, { 230, 0, 0 } };
+			float x = std::min(1.0f, std::max(0.0f, t)) * 4.0f;
+			uint32_t lo = std::min(3u, static_cast<uint32_t>(x));
+			float f = x - lo;
+			for (uint32_t c = 0; c < 3; ++c)
+				rgb[c] = static_cast<uchar>(stops[lo][c] + (stops[lo + 1][c] - stops[lo][c]) * f);
+		}
+	}
+
+	// values: width * height costs, top-down. bgr receives bottom-up padded rows like tonemap::to_bgr.
+	// scale_max is the cost drawn red, 0 picks the 99th percentile.
+	inline void to_bgr(const std::vector<uint32_t> &values, uint32_t width, uint32_t height, uchar *bgr, uint32_t scale_max = 0)
+	{
+		if (scale_max == 0)
+			scale_max = std::max(1u, summarize(values).p99);
+
+		const uint32_t stride = tonemap::bgr_row_stride(width);
+		for (uint32_t row = 0; row < height; ++row)
+		{
+			uchar *dst = bgr + static_cast<size_t>(height - 1 - row) * stride;
+			for (uint32_t i = 0; i < width; ++i)
+			{
+				uint32_t v = values[static_cast<size_t>(row) * width + i];
+				uchar rgb[3] = { 255, 255, 255 };
+				if (v <= scale_max)
+					detail::ramp(v / static_cast<float>(scale_max), rgb);
+				dst[i * 3 + 0] = rgb[2], dst[i * 3 + 1] = rgb[1], dst[i * 3 + 2] = rgb[0];
+			}
+			std::fill(dst + width * 3, dst + stride, static_cast<uchar>(0));
+		}
+	}
+
+	// Csv with one line per bucket: first cost, last cost, pixels. Buckets split [0, max] evenly.
+	inline bool write_histogram(const std::string &path, const std::vector<uint32_t> &values, uint32_t num_buckets = 64)
+	{
+		std::ofstream ofs(path);
+		if (!ofs.is_open())
+			return false;
+
+		uint32_t max_value = values.empty() ? 0 : *std::max_element(values.begin(), values.end());
+		uint32_t bucket_width = std::max(1u, (max_value + num_buckets) / num_buckets);
+		std::vector<uint32_t> counts(max_value / bucket_width + 1, 0);
+		for (uint32_t v : values)
+			++counts[v / bucket_width];
+
+		ofs << "cost_from,cost_to,pixels\n";
+		for (uint32_t b = 0; b < counts.size(); ++b)
+			ofs << b * bucket_width << "," << (b + 1) * bucket_width - 1 << "," << counts[b] << "\n";
+		return static_cast<bool>(ofs);
+	}
+}
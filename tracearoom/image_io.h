@@ -0,0 +1,367 @@
+#pragma once
+
+#include<algorithm>
+#include<cctype>
+#include<cerrno>
+#include<cmath>
+#include<cstdint>
+#include<cstdlib>
+#include<cstring>
+#include<fstream>
+#include<string>
+#include<vector>
+
+#include"arena.h"
+#include"geometry.h"
+
+// Binary image readers/writers for the formats we use around the renderer:
+//   PPM (P6)  - 8 bit rgb, top-down rows
+//   PFM (PF)  - 32 bit float rgb, bottom-up rows, linear
+//   HDR       - Radiance rgbe, top-down rows, linear
+// All pixel data goes through bulk read/write calls, headers are the only thing parsed token by token.
+// Pixels are passed in top-down row order for every format, the writers/readers take care of flipping.
+namespace image_io
+{
+	typedef unsigned char uchar;
+
+	static_assert(sizeof(Vec3f) == 3 * sizeof(float), "Vec3f is expected to be tightly packed");
+
+	namespace detail
+	{
+		inline bool is_little_endian()
+		{
+			uint32_t one = 1;
+			uchar first;
+			std::memcpy(&first, &one, 1);
+			return first == 1;
+		}
+
+		inline void swap_float_bytes(float *data, size_t count)
+		{
+			for (size_t i = 0; i < count; ++i)
+			{
+				uchar *b = reinterpret_cast<uchar*>(data + i);
+				std::swap(b[0], b[3]);
+				std::swap(b[1], b[2]);
+			}
+		}
+
+		// Reads the next whitespace separated header token, skipping '#' comments
+		inline bool read_header_token(std::istream &is, std::string &token)
+		{
+			token.clear();
+			int c = is.get();
+			while (c != EOF)
+			{
+				if (c == '#')
+					while (c != EOF && c != '\n') c = is.get();
+				else if (std::isspace(c))
+					c = is.get();
+				else
+					break;
+			}
+
+			while (c != EOF && !std::isspace(c))
+			{
+				token.push_back(static_cast<char>(c));
+				c = is.get();
+			}
+			// The single whitespace after the last header token has been consumed, binary data starts here
+			return !token.empty();
+		}
+
+		inline bool read_header_uint(std::istream &is, uint32_t &value)
+		{
+			std::string token;
+			if (!read_header_token(is, token) || token.find_first_not_of("0123456789") != std::string::npos)
+				return false;
+			errno = 0;
+			unsigned long parsed = std::strtoul(token.c_str(), nullptr, 10);
+			if (errno == ERANGE || parsed > UINT32_MAX)
+				return false;
+			value = static_cast<uint32_t>(parsed);
+			return true;
+		}
+
+		inline bool read_header_float(std::istream &is, float &value)
+		{
+			std::string token;
+			if (!read_header_token(is, token))
+				return false;
+			char *end;
+			errno = 0;
+			value = std::strtof(token.c_str(), &end);
+			return *end == '\0' && errno != ERANGE && std::isfinite(value);
+		}
+
+		// Bytes between the read position and the end of the file, so corrupt headers cannot ask for more than is there
+		inline uint64_t remaining_bytes(std::istream &is)
+		{
+			std::streampos position = is.tellg();
+			is.seekg(0, std::ios::end);
+			std::streampos end = is.tellg();
+			is.seekg(position);
+			return position < 0 || end < position ? 0 : static_cast<uint64_t>(end - position);
+		}
+
+		// Fewest bytes a radiance scanline of width pixels takes, a run covers at most 127 pixels in two bytes
+		inline uint64_t min_scanline_bytes(uint32_t width)
+		{
+			if (width < 8 || width >= 32768)
+				return std::max<uint64_t>(4, static_cast<uint64_t>(width) * 4);
+			return 4 + 4 * 2 * ((width + 126) / 127);
+		}
+
+		inline void float_to_rgbe(const Vec3f &c, uchar rgbe[4])
+		{
+			float v = std::max(c.x, std::max(c.y, c.z));
+			if (v < 1e-32f)
+			{
+				rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+				return;
+			}
+
+			int e;
+			v = std::frexp(v, &e) * 256.0f / v;
+			rgbe[0] = static_cast<uchar>(std::max(0.0f, c.x) * v);
+			rgbe[1] = static_cast<uchar>(std::max(0.0f, c.y) * v);
+			rgbe[2] = static_cast<uchar>(std::max(0.0f, c.z) * v);
+			rgbe[3] = static_cast<uchar>(e + 128);
+		}
+
+		inline Vec3f rgbe_to_float(const uchar rgbe[4])
+		{
+			if (rgbe[3] == 0)
+				return Vec3f(0);
+
+			float f = std::ldexp(1.0f, rgbe[3] - (128 + 8));
+			return Vec3f((rgbe[0] + 0.5f) * f, (rgbe[1] + 0.5f) * f, (rgbe[2] + 0.5f) * f);
+		}
+
+		// Decodes one scanline of a radiance file, handles both flat and the run length encoded layout
+		inline bool read_rgbe_scanline(std::istream &is, uint32_t width, uchar *scanline)
+		{
+			uchar head[4];
+			if (!is.read(reinterpret_cast<char*>(head), 4))
+				return false;
+
+			bool rle = width >= 8 && width < 32768 && head[0] == 2 && head[1] == 2 && static_cast<uint32_t>((head[2] << 8) | head[3]) == width;
+			if (!rle)
+			{
+				std::memcpy(scanline, head, 4);
+				return width <= 1 || static_cast<bool>(is.read(reinterpret_cast<char*>(scanline + 4), (width - 1) * 4));
+			}
+
+			// Run length encoded scanlines store each component in its own run
+			std::vector<uchar> component(width);
+			for (uint32_t ch = 0; ch < 4; ++ch)
+			{
+				uint32_t x = 0;
+				while (x < width)
+				{
+					uchar run[2];
+					if (!is.read(reinterpret_cast<char*>(run), 1))
+						return false;
+
+					if (run[0] > 128)
+					{
+						uint32_t count = run[0] - 128;
+						if (count > width - x || !is.read(reinterpret_cast<char*>(run + 1), 1))
+							return false;
+						std::fill_n(&component[x], count, run[1]);
+						x += count;
+					}
+					else
+					{
+						uint32_t count = run[0];
+						if (count == 0 || count > width - x || !is.read(reinterpret_cast<char*>(&component[x]), count))
+							return false;
+						x += count;
+					}
+				}
+
+				for (uint32_t i = 0; i < width; ++i)
+					scanline[i * 4 + ch] = component[i];
+			}
+
+			return true;
+		}
+	}
+
+	// rgb is width * height * 3 bytes, top-down
+	inline bool write_ppm(const std::string &path, uint32_t width, uint32_t height, const uchar *rgb)
+	{
+		std::ofstream ofs(path, std::ios::out | std::ios::binary);
+		if (!ofs.is_open())
+			return false;
+
+		ofs << "P6\n" << width << " " << height << "\n255\n";
+		ofs.write(reinterpret_cast<const char*>(rgb), static_cast<std::streamsize>(width) * height * 3);
+		return static_cast<bool>(ofs);
+	}
+
+	// 16 bit ppm files are reduced to 8 bits per channel
+	inline bool read_ppm(const std::string &path, uint32_t &width, uint32_t &height, std::vector<uchar> &rgb)
+	{
+		std::ifstream ifs(path, std::ios::in | std::ios::binary);
+		if (!ifs.is_open())
+			return false;
+
+		std::string magic;
+		uint32_t max_value;
+		if (!detail::read_header_token(ifs, magic) || magic != "P6" ||
+			!detail::read_header_uint(ifs, width) || !detail::read_header_uint(ifs, height) ||
+			!detail::read_header_uint(ifs, max_value) || max_value == 0 || max_value > 65535)
+			return false;
+
+		size_t count = static_cast<size_t>(width) * height * 3;
+		if (static_cast<uint64_t>(count) * (max_value < 256 ? 1 : 2) > detail::remaining_bytes(ifs))
+			return false;
+		rgb.resize(count);
+		if (max_value < 256)
+		{
+			if (!ifs.read(reinterpret_cast<char*>(rgb.data()), count))
+				return false;
+			if (max_value != 255)
+				std::for_each(rgb.begin(), rgb.end(), [max_value](uchar &c) { c = static_cast<uchar>(std::min(255u, c * 255u / max_value)); });
+			return true;
+		}
+
+		// Samples are big endian when wider than a byte
+		std::vector<uchar> wide(count * 2);
+		if (!ifs.read(reinterpret_cast<char*>(wide.data()), wide.size()))
+			return false;
+		for (size_t i = 0; i < count; ++i)
+			rgb[i] = static_cast<uchar>(std::min(255u, ((wide[i * 2] << 8) | wide[i * 2 + 1]) * 255u / max_value));
+
+		return true;
+	}
+
+	// pixels is width * height linear rgb values, top-down
+	inline bool write_pfm(const std::string &path, uint32_t width, uint32_t height, const Vec3f *pixels)
+	{
+		// Rows go out in bulk writes, a small stream buffer of our own saves allocating one for every file
+		char stream_buffer[256];
+		std::ofstream ofs;
+		ofs.rdbuf()->pubsetbuf(stream_buffer, sizeof(stream_buffer));
+		ofs.open(path, std::ios::out | std::ios::binary);
+		if (!ofs.is_open())
+			return false;
+
+		// A negative scale marks little endian data
+		ofs << "PF\n" << width << " " << height << "\n" << (detail::is_little_endian() ? "-1.0" : "1.0") << "\n";
+		// PFM stores the bottom row first
+		for (uint32_t row = height; row-- > 0;)
+			ofs.write(reinterpret_cast<const char*>(pixels + static_cast<size_t>(row) * width), static_cast<std::streamsize>(width) * sizeof(Vec3f));
+
+		return static_cast<bool>(ofs);
+	}
+
+	// Reads both color (PF) and greyscale (Pf) files, greyscale is splatted to all three channels
+	inline bool read_pfm(const std::string &path, uint32_t &width, uint32_t &height, std::vector<Vec3f> &pixels)
+	{
+		std::ifstream ifs(path, std::ios::in | std::ios::binary);
+		if (!ifs.is_open())
+			return false;
+
+		std::string magic;
+		float scale;
+		if (!detail::read_header_token(ifs, magic) || (magic != "PF" && magic != "Pf") ||
+			!detail::read_header_uint(ifs, width) || !detail::read_header_uint(ifs, height) ||
+			!detail::read_header_float(ifs, scale) || scale == 0.0f)
+			return false;
+
+		uint32_t channels = magic == "PF" ? 3 : 1;
+		size_t row_floats = static_cast<size_t>(width) * channels;
+		if (static_cast<uint64_t>(row_floats) * height * sizeof(float) > detail::remaining_bytes(ifs))
+			return false;
+		std::vector<float> data(row_floats * height);
+		if (!ifs.read(reinterpret_cast<char*>(data.data()), data.size() * sizeof(float)))
+			return false;
+
+		if ((scale < 0.0f) != detail::is_little_endian())
+			detail::swap_float_bytes(data.data(), data.size());
+
+		pixels.resize(static_cast<size_t>(width) * height);
+		for (uint32_t row = 0; row < height; ++row)
+		{
+			const float *src = &data[(height - 1 - row) * row_floats];
+			Vec3f *dst = &pixels[static_cast<size_t>(row) * width];
+			if (channels == 3)
+				std::memcpy(static_cast<void*>(dst), src, row_floats * sizeof(float));
+			else
+				for (uint32_t i = 0; i < width; ++i)
+					dst[i] = Vec3f(src[i]);
+		}
+
+		return true;
+	}
+
+	// Radiance rgbe, written flat (uncompressed) since that is a single bulk write
+	inline bool write_hdr(const std::string &path, uint32_t width, uint32_t height, const Vec3f *pixels)
+	{
+		std::ofstream ofs(path, std::ios::out | std::ios::binary);
+		if (!ofs.is_open())
+			return false;
+
+		ofs << "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y " << height << " +X " << width << "\n";
+
+		size_t count = static_cast<size_t>(width) * height;
+		arena_scope scope(thread_scratch());
+		uchar *rgbe = thread_scratch().allocate_array<uchar>(count * 4);
+		for (size_t i = 0; i < count; ++i)
+			detail::float_to_rgbe(pixels[i], rgbe + i * 4);
+
+		ofs.write(reinterpret_cast<const char*>(rgbe), count * 4);
+		return static_cast<bool>(ofs);
+	}
+
+	// Only the standard -Y h +X w orientation is supported
+	inline bool read_hdr(const std::string &path, uint32_t &width, uint32_t &height, std::vector<Vec3f> &pixels)
+	{
+		std::ifstream ifs(path, std::ios::in | std::ios::binary);
+		if (!ifs.is_open())
+			return false;
+
+		std::string line;
+		if (!std::getline(ifs, line) || line.compare(0, 2, "#?") != 0)
+			return false;
+
+		// Header variables end with an empty line
+		bool rgbe_format = true;
+		while (std::getline(ifs, line) && !line.empty())
+			if (line.compare(0, 7, "FORMAT=") == 0)
+				rgbe_format = line == "FORMAT=32-bit_rle_rgbe";
+
+		std::string y_axis, x_axis;
+		if (!rgbe_format || !detail::read_header_token(ifs, y_axis) || y_axis != "-Y" || !detail::read_header_uint(ifs, height) ||
+			!detail::read_header_token(ifs, x_axis) || x_axis != "+X" || !detail::read_header_uint(ifs, width))
+			return false;
+		if (height > detail::remaining_bytes(ifs) / detail::min_scanline_bytes(width))
+			return false;
+
+		pixels.resize(static_cast<size_t>(width) * height);
+		std::vector<uchar> scanline(static_cast<size_t>(width) * 4);
+		for (uint32_t row = 0; row < height; ++row)
+		{
+			if (!detail::read_rgbe_scanline(ifs, width, scanline.data()))
+				return false;
+			for (uint32_t i = 0; i < width; ++i)
+				pixels[static_cast<size_t>(row) * width + i] = detail::rgbe_to_float(&scanline[i * 4]);
+		}
+
+		return true;
+	}
+
+	// Picks the float format from the file extension(.pfm or .hdr)
+	inline bool write_float_image(const std::string &path, uint32_t width, uint32_t height, const Vec3f *pixels)
+	{
+		auto ext_pos = path.find_last_of('.');
+		std::string ext = ext_pos == std::string::npos ? "" : path.substr(ext_pos);
+		std::transform(ext.begin(), ext.end(), ext.begin(), [](char c) { return static_cast<char>(std::tolower(c)); });
+
+		if (ext == ".hdr")
+			return write_hdr(path, width, height, pixels);
+		return write_pfm(path, width, height, pixels);
+	}
+}
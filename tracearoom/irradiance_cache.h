@@ -0,0 +1,161 @@
+#pragma once
+
+#include<algorithm>
+#include<atomic>
+#include<cmath>
+#include<cstdint>
+#include<memory>
+
+#include"geometry.h"
+
+// World space cache of the light arriving at diffuse surfaces, shared by every thread, frame and sample pass.
+//
+// Space is cut into cubic cells and normals into octahedral buckets. The irradiance at each cell corner is computed
+// the first time a lookup needs it and stored in a fixed size open addressing hash table, lookups interpolate
+// the eight corners around the point. A corner's value only depends on its position and the bucket's normal,
+// never on which thread got there first, so images stay deterministic.
+//
+// Insertion is lock free: a thread claims an empty slot with a CAS, fills it and then publishes it.
+// Threads that find a slot that is still being filled or a full table just compute the value themselves.
+// The cached values assume a static scene and lights, call clear when either changes.
+class irradiance_cache
+{
+	// Slot states live in the two low bits of the key, the rest is a hash of the corner
+	static constexpr uint64_t kEmpty = 0;
+	static constexpr uint64_t kFilling = 1;
+	static constexpr uint64_t kReady = 2;
+	static constexpr uint64_t kStateMask = 3;
+	static constexpr uint32_t kMaxProbes = 16;
+	static constexpr int32_t kNormalBuckets = 33;	// per axis of the octahedral square, odd so the axes are bucket centers
+
+	struct slot
+	{
+		std::atomic<uint64_t> key{ kEmpty };
+		Vec3f value;
+	};
+
+	float cell_size;
+	float inv_cell_size;
+	uint64_t mask;
+	std::unique_ptr<slot[]> slots;
+
+	static uint64_t mix(uint64_t h)
+	{
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ull;
+		h ^= h >> 33;
+		return h;
+	}
+
+	static uint64_t corner_key(int32_t x, int32_t y, int32_t z, uint32_t bucket)
+	{
+		uint64_t h = mix(static_cast<uint32_t>(x) * 0x9e3779b97f4a7c15ull ^ static_cast<uint32_t>(y));
+		h = mix(h ^ (static_cast<uint64_t>(static_cast<uint32_t>(z)) << 32 | bucket));
+		// 62 bits of hash, a collision between two corners in one table is not a practical concern
+		return (h & ~kStateMask) | kReady;
+	}
+
+	// Octahedral map of n onto the nearest point of a kNormalBuckets x kNormalBuckets grid
+	static uint32_t normal_bucket(const Vec3f &n)
+	{
+		float l1 = std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z);
+		float u = n.x / l1, v = n.y / l1;
+		if (n.z < 0.0f)
+		{
+			float fu = (1.0f - std::fabs(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+			float fv = (1.0f - std::fabs(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+			u = fu, v = fv;
+		}
+		auto quantize = [](float c) { return static_cast<int32_t>(std::floor((c * 0.5f + 0.5f) * (kNormalBuckets - 1) + 0.5f)); };
+		return static_cast<uint32_t>(quantize(u) * kNormalBuckets + quantize(v));
+	}
+
+	// Normal at a bucket's grid point
+	static Vec3f bucket_normal(uint32_t bucket)
+	{
+		float u = static_cast<float>(bucket / kNormalBuckets) / (kNormalBuckets - 1) * 2.0f - 1.0f;
+		float v = static_cast<float>(bucket % kNormalBuckets) / (kNormalBuckets - 1) * 2.0f - 1.0f;
+		Vec3f n(u, v, 1.0f - std::fabs(u) - std::fabs(v));
+		if (n.z < 0.0f)
+		{
+			float fu = (1.0f - std::fabs(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+			float fv = (1.0f - std::fabs(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+			n.x = fu, n.y = fv;
+		}
+		return n.normalize();
+	}
+
+	template<typename Fn>
+	Vec3f corner(int32_t x, int32_t y, int32_t z, uint32_t bucket, const Vec3f &normal, Fn &compute)
+	{
+		uint64_t key = corner_key(x, y, z, bucket);
+		uint64_t filling = (key & ~kStateMask) | kFilling;
+		Vec3f position(x * cell_size, y * cell_size, z * cell_size);
+		for (uint64_t probe = 0, index = key >> 2; probe < kMaxProbes; ++probe, ++index)
+		{
+			slot &s = slots[index & mask];
+			uint64_t current = s.key.load(std::memory_order_acquire);
+			if (current == kEmpty && s.key.compare_exchange_strong(current, filling, std::memory_order_acquire))
+			{
+				s.value = compute(position, normal);
+				s.key.store(key, std::memory_order_release);
+				return s.value;
+			}
+
+			// current holds the slot's key, also when the CAS above lost
+			if (current == key)
+				return s.value;
+			// Another thread is computing this corner right now
+			if (current == filling)
+				break;
+		}
+		return compute(position, normal);
+	}
+public:
+	// capacity is rounded up to a power of two
+	irradiance_cache(float cell_world_size, uint32_t capacity = 1u << 20) :
+		cell_size(cell_world_size),
+		inv_cell_size(1.0f / cell_world_size)
+	{
+		uint64_t size = 1;
+		while (size < capacity)
+			size <<= 1;
+		mask = size - 1;
+		slots.reset(new slot[size]);
+	}
+
+	irradiance_cache(const irradiance_cache &) = delete;
+	irradiance_cache &operator=(const irradiance_cache &) = delete;
+
+	// Not safe while lookups are running
+	void clear()
+	{
+		for (uint64_t i = 0; i <= mask; ++i)
+			slots[i].key.store(kEmpty, std::memory_order_relaxed);
+	}
+
+	// Irradiance at point on a surface facing normal. compute(position, normal) evaluates the lighting
+	// and is called for the corners that are not cached yet.
+	template<typename Fn>
+	Vec3f lookup(const Vec3f &point, const Vec3f &normal, Fn &&compute)
+	{
+		uint32_t bucket = normal_bucket(normal);
+		Vec3f bucket_n = bucket_normal(bucket);
+		float gx = point.x * inv_cell_size, gy = point.y * inv_cell_size, gz = point.z * inv_cell_size;
+		float fx = std::floor(gx), fy = std::floor(gy), fz = std::floor(gz);
+		int32_t x = static_cast<int32_t>(fx), y = static_cast<int32_t>(fy), z = static_cast<int32_t>(fz);
+		float tx = gx - fx, ty = gy - fy, tz = gz - fz;
+
+		Vec3f result(0);
+		for (uint32_t c = 0; c < 8; ++c)
+		{
+			uint32_t dx = c & 1, dy = (c >> 1) & 1, dz = c >> 2;
+			float weight = (dx ? tx : 1 - tx) * (dy ? ty : 1 - ty) * (dz ? tz : 1 - tz);
+			if (weight > 0.0f)
+				result = result + corner(x + dx, y + dy, z + dz, bucket, bucket_n, compute) * weight;
+		}
+		return result;
+	}
+};
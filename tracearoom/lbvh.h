@@ -0,0 +1,484 @@
+#pragma once
+
+#include<algorithm>
+#include<atomic>
+#include<cstdint>
+#include<memory>
+#include<utility>
+#include<vector>
+
+#ifdef _MSC_VER
+#include<intrin.h>
+#endif
+
+#include"bvh.h"
+#include"geometry.h"
+#include"thread_pool.h"
+
+// Parallel linear bvh builder for large meshes, produces the same node layout as bvh::build.
+//  1. Triangle centroids get 63 bit morton codes which are radix sorted in parallel
+//  2. Every internal node of the binary radix tree over the sorted codes is found independently (Karras 2012)
+//  3. Bounds are propagated bottom up, the second thread to reach a node handles it. Optionally each node then
+//     rearranges the treelet of up to kTreeletLeaves subtrees below it into the cheapest topology (Karras and Aila 2013)
+//  4. Subtrees that are cheaper as leaves are collapsed and the tree is written depth first, large subtrees in parallel
+namespace lbvh
+{
+	struct settings
+	{
+		bool optimize_treelets = true;
+	};
+
+	namespace detail
+	{
+		static constexpr uint32_t kMaxLeafSize = 8;
+		static constexpr float kTraversalCost = 1.0f;
+		static constexpr uint32_t kTreeletLeaves = 5;
+		// Smaller subtrees end up collapsed into leaves anyway
+		static constexpr uint32_t kMinTreeletPrims = kMaxLeafSize;
+
+		inline int32_t leading_zeros(uint64_t v)
+		{
+#ifdef _MSC_VER
+			unsigned long index;
+			return _BitScanReverse64(&index, v) ? 63 - static_cast<int32_t>(index) : 64;
+#else
+			return v ? __builtin_clzll(v) : 64;
+#endif
+		}
+
+		inline uint32_t lowest_bit_index(uint32_t v)
+		{
+			uint32_t index = 0;
+			while (!(v & 1u))
+				v >>= 1, ++index;
+			return index;
+		}
+
+		inline bool single_bit(uint32_t v) { return (v & (v - 1)) == 0; }
+
+		// Spreads the low 21 bits of v out to every third bit
+		inline uint64_t expand_bits(uint64_t v)
+		{
+			v &= 0x1fffffull;
+			v = (v | v << 32) & 0x1f00000000ffffull;
+			v = (v | v << 16) & 0x1f0000ff0000ffull;
+			v = (v | v << 8) & 0x100f00f00f00f00full;
+			v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+			v = (v | v << 2) & 0x1249249249249249ull;
+			return v;
+		}
+
+		// p in [0, 1]^3
+		inline uint64_t morton_code(const Vec3f &p)
+		{
+			auto quantize = [](float c) { return static_cast<uint64_t>(std::min(std::max(c * 2097152.0f, 0.0f), 2097151.0f)); };
+			return expand_bits(quantize(p.x)) << 2 | expand_bits(quantize(p.y)) << 1 | expand_bits(quantize(p.z));
+		}
+
+		// Stable LSD radix sort of keys with their values, 8 bits per pass. Passes over a digit every key shares are skipped.
+		inline void radix_sort(std::vector<uint64_t> &keys, std::vector<uint32_t> &values, thread_pool &pool)
+		{
+			const uint32_t n = static_cast<uint32_t>(keys.size());
+			const uint32_t num_chunks = std::max(1u, std::min(pool.size() + 1, n / 16384));
+			const uint32_t chunk_size = (n + num_chunks - 1) / num_chunks;
+			std::vector<uint64_t> sorted_keys(n);
+			std::vector<uint32_t> sorted_values(n);
+			std::vector<uint32_t> histograms(num_chunks * 256);
+
+			for (uint32_t shift = 0; shift < 64; shift += 8)
+			{
+				std::fill(histograms.begin(), histograms.end(), 0);
+				pool.parallel_for(0, num_chunks, 1, [&](uint32_t first_chunk, uint32_t last_chunk) {
+					for (uint32_t c = first_chunk; c < last_chunk; ++c)
+					{
+						uint32_t *histogram = &histograms[c * 256];
+						for (uint32_t i = c * chunk_size; i < std::min(n, (c + 1) * chunk_size); ++i)
+							histogram[(keys[i] >> shift) & 0xff]++;
+					}
+				});
+
+				// Turn the counts into where each chunk starts writing each digit
+				uint32_t total = 0, first_digit_total = 0, first_digit = static_cast<uint32_t>((keys[0] >> shift) & 0xff);
+				for (uint32_t d = 0; d < 256; ++d)
+					for (uint32_t c = 0; c < num_chunks; ++c)
+					{
+						uint32_t count = histograms[c * 256 + d];
+						if (d == first_digit)
+							first_digit_total += count;
+						histograms[c * 256 + d] = total;
+						total += count;
+					}
+				if (first_digit_total == n)
+					continue;
+
+				pool.parallel_for(0, num_chunks, 1, [&](uint32_t first_chunk, uint32_t last_chunk) {
+					for (uint32_t c = first_chunk; c < last_chunk; ++c)
+					{
+						uint32_t *offsets = &histograms[c * 256];
+						for (uint32_t i = c * chunk_size; i < std::min(n, (c + 1) * chunk_size); ++i)
+						{
+							uint32_t slot = offsets[(keys[i] >> shift) & 0xff]++;
+							sorted_keys[slot] = keys[i];
+							sorted_values[slot] = values[i];
+						}
+					}
+				});
+				std::swap(keys, sorted_keys);
+				std::swap(values, sorted_values);
+			}
+		}
+
+		// Binary radix tree over the sorted prims. Ids below num_internal() are internal nodes, the rest are leaves
+		// holding one prim each(leaf id num_internal() + i holds sorted prim i).
+		struct radix_tree
+		{
+			uint32_t num_prims;
+			std::vector<uint32_t> children;		// two per internal node
+			std::vector<uint32_t> parents;
+			std::vector<bbox> bounds;
+			std::vector<uint32_t> counts;
+			std::vector<float> costs;			// sah cost of the subtree, weighted by area
+			std::vector<uint8_t> collapsed;		// subtree is written as one leaf
+			std::vector<uint32_t> sizes;		// nodes the subtree is written as
+			std::vector<uint32_t> heights;		// interior nodes on the longest path of the subtree as written
+
+			uint32_t num_internal() const { return num_prims - 1; }
+			bool is_leaf(uint32_t id) const { return id >= num_internal(); }
+			uint32_t left(uint32_t id) const { return children[id * 2]; }
+			uint32_t right(uint32_t id) const { return children[id * 2 + 1]; }
+		};
+
+		// Length of the common prefix of the codes at i and j, ties are broken by the index. -1 when j is out of range.
+		inline int32_t common_prefix(const std::vector<uint64_t> &codes, int32_t i, int32_t j)
+		{
+			if (j < 0 || j >= static_cast<int32_t>(codes.size()))
+				return -1;
+			uint64_t x = codes[i] ^ codes[j];
+			return x ? leading_zeros(x) : 64 + leading_zeros(static_cast<uint64_t>(i ^ j));
+		}
+
+		// Karras 2012, finds the range the internal node i covers and where it splits
+		inline void find_children(const std::vector<uint64_t> &codes, radix_tree &tree, int32_t i)
+		{
+			int32_t d = common_prefix(codes, i, i + 1) - common_prefix(codes, i, i - 1) > 0 ? 1 : -1;
+			int32_t min_prefix = common_prefix(codes, i, i - d);
+			int32_t max_length = 2;
+			while (common_prefix(codes, i, i + max_length * d) > min_prefix)
+				max_length *= 2;
+
+			int32_t length = 0;
+			for (int32_t t = max_length / 2; t >= 1; t /= 2)
+				if (common_prefix(codes, i, i + (length + t) * d) > min_prefix)
+					length += t;
+			int32_t j = i + length * d;
+
+			int32_t node_prefix = common_prefix(codes, i, j);
+			int32_t split = 0;
+			for (int32_t divisor = 2, t = length; t > 1; divisor *= 2)
+			{
+				t = (length + divisor - 1) / divisor;
+				if (common_prefix(codes, i, i + (split + t) * d) > node_prefix)
+					split += t;
+			}
+			int32_t gamma = i + split * d + std::min(d, 0);
+
+			uint32_t leaf_base = tree.num_internal();
+			uint32_t left = std::min(i, j) == gamma ? leaf_base + gamma : gamma;
+			uint32_t right = std::max(i, j) == gamma + 1 ? leaf_base + gamma + 1 : gamma + 1;
+			tree.children[i * 2] = left;
+			tree.children[i * 2 + 1] = right;
+			tree.parents[left] = i;
+			tree.parents[right] = i;
+		}
+
+		// Rearranges the treelet below root into the topology with the lowest sah cost
+		inline void optimize_treelet(radix_tree &tree, uint32_t root)
+		{
+			// Grow the treelet by opening its largest internal leaf
+			uint32_t leaves[kTreeletLeaves] = { tree.left(root), tree.right(root) };
+			uint32_t internals[kTreeletLeaves - 1] = { root };
+			uint32_t num_leaves = 2;
+			while (num_leaves < kTreeletLeaves)
+			{
+				int32_t largest = -1;
+				float largest_area = -1.0f;
+				for (uint32_t k = 0; k < num_leaves; ++k)
+				{
+					float area = tree.bounds[leaves[k]].surface_area();
+					if (!tree.is_leaf(leaves[k]) && area > largest_area)
+						largest = static_cast<int32_t>(k), largest_area = area;
+				}
+				if (largest < 0)
+					break;
+				uint32_t opened = leaves[largest];
+				internals[num_leaves - 1] = opened;
+				leaves[largest] = tree.left(opened);
+				leaves[num_leaves++] = tree.right(opened);
+			}
+			if (num_leaves < 3)
+				return;
+
+			// Best cost and split of every subset of the treelet leaves
+			const uint32_t num_subsets = 1u << num_leaves;
+			bbox subset_bounds[1u << kTreeletLeaves];
+			uint32_t subset_counts[1u << kTreeletLeaves];
+			float subset_costs[1u << kTreeletLeaves];
+			subset_counts[0] = 0;
+			uint32_t subset_splits[1u << kTreeletLeaves];
+			for (uint32_t s = 1; s < num_subsets; ++s)
+			{
+				uint32_t low = lowest_bit_index(s);
+				subset_bounds[s] = subset_bounds[s & (s - 1)];
+				subset_bounds[s].extend(tree.bounds[leaves[low]]);
+				subset_counts[s] = subset_counts[s & (s - 1)] + tree.counts[leaves[low]];
+				if (single_bit(s))
+				{
+					subset_costs[s] = tree.costs[leaves[low]];
+					continue;
+				}
+
+				// Partitions that keep the lowest leaf on the left cover every split once
+				float best = kInfinity;
+				uint32_t low_bit = s & (0u - s);
+				for (uint32_t p = (s - 1) & s; p; p = (p - 1) & s)
+				{
+					if (!(p & low_bit))
+						continue;
+					float cost = subset_costs[p] + subset_costs[s ^ p];
+					if (cost < best)
+						best = cost, subset_splits[s] = p;
+				}
+				subset_costs[s] = kTraversalCost * subset_bounds[s].surface_area() + best;
+			}
+
+			const uint32_t all = num_subsets - 1;
+			if (subset_costs[all] >= tree.costs[root] * 0.999f)
+				return;
+
+			// Rebuild the treelet from the best splits, reusing its internal nodes
+			uint32_t next_internal = 1;
+			std::pair<uint32_t, uint32_t> stack[kTreeletLeaves];	// subset, node
+			uint32_t stack_size = 0;
+			stack[stack_size++] = { all, root };
+			while (stack_size > 0)
+			{
+				auto entry = stack[--stack_size];
+				uint32_t halves[2] = { subset_splits[entry.first], entry.first ^ subset_splits[entry.first] };
+				for (uint32_t h = 0; h < 2; ++h)
+				{
+					uint32_t child;
+					if (single_bit(halves[h]))
+						child = leaves[lowest_bit_index(halves[h])];
+					else
+					{
+						child = internals[next_internal++];
+						stack[stack_size++] = { halves[h], child };
+					}
+					tree.children[entry.second * 2 + h] = child;
+					tree.parents[child] = entry.second;
+				}
+				tree.bounds[entry.second] = subset_bounds[entry.first];
+				tree.counts[entry.second] = subset_counts[entry.first];
+				tree.costs[entry.second] = subset_costs[entry.first];
+			}
+		}
+
+		// Visits the internal nodes bottom up in parallel, fn(id) runs once both children of id are done
+		template<typename Fn>
+		void bottom_up(radix_tree &tree, thread_pool &pool, Fn &&fn)
+		{
+			const uint32_t num_internal = tree.num_internal();
+			if (num_internal == 0)
+				return;
+			std::unique_ptr<std::atomic<uint32_t>[]> visits(new std::atomic<uint32_t>[num_internal]);
+			for (uint32_t i = 0; i < num_internal; ++i)
+				visits[i].store(0, std::memory_order_relaxed);
+
+			pool.parallel_for(0, tree.num_prims, 4096, [&](uint32_t first, uint32_t last) {
+				for (uint32_t leaf = first; leaf < last; ++leaf)
+				{
+					uint32_t node = tree.parents[num_internal + leaf];
+					// The first thread to arrive leaves the node to the second, which then sees both children done
+					while (visits[node].fetch_add(1, std::memory_order_acq_rel) == 1)
+					{
+						fn(node);
+						if (node == 0)
+							break;
+						node = tree.parents[node];
+					}
+				}
+			});
+		}
+	}
+
+	inline bvh build(const Vec3f *vertices, const uint32_t *tris_index, uint32_t num_tris, const settings &config = settings(), thread_pool &pool = thread_pool::shared())
+	{
+		using namespace detail;
+		if (num_tris == 0)
+			return bvh();
+
+		// Morton codes of the centroids within their bounds
+		std::vector<bbox> prim_bounds(num_tris);
+		bbox centroid_bounds;
+		for (uint32_t t = 0; t < num_tris; ++t)
+		{
+			prim_bounds[t].extend(vertices[tris_index[t * 3]]);
+			prim_bounds[t].extend(vertices[tris_index[t * 3 + 1]]);
+			prim_bounds[t].extend(vertices[tris_index[t * 3 + 2]]);
+			centroid_bounds.extend(prim_bounds[t].centroid());
+		}
+
+		Vec3f extent = centroid_bounds.extent();
+		Vec3f inv_extent(extent.x > 0.0f ? 1.0f / extent.x : 0.0f, extent.y > 0.0f ? 1.0f / extent.y : 0.0f, extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+		std::vector<uint64_t> codes(num_tris);
+		std::vector<uint32_t> order(num_tris);
+		pool.parallel_for(0, num_tris, 16384, [&](uint32_t first, uint32_t last) {
+			for (uint32_t t = first; t < last; ++t)
+			{
+				codes[t] = morton_code((prim_bounds[t].centroid() - centroid_bounds.min) * inv_extent);
+				order[t] = t;
+			}
+		});
+		radix_sort(codes, order, pool);
+
+		radix_tree tree;
+		tree.num_prims = num_tris;
+		const uint32_t num_nodes = 2 * num_tris - 1, num_internal = num_tris - 1;
+		tree.children.resize(2 * static_cast<size_t>(num_internal));
+		tree.parents.assign(num_nodes, 0);
+		tree.bounds.resize(num_nodes);
+		tree.counts.resize(num_nodes);
+		tree.costs.resize(num_nodes);
+		tree.collapsed.assign(num_nodes, 1);
+		tree.sizes.assign(num_nodes, 1);
+		tree.heights.assign(num_nodes, 0);
+
+		pool.parallel_for(0, num_tris, 16384, [&](uint32_t first, uint32_t last) {
+			for (uint32_t i = first; i < last; ++i)
+			{
+				uint32_t leaf = num_internal + i;
+				tree.bounds[leaf] = prim_bounds[order[i]];
+				tree.counts[leaf] = 1;
+				tree.costs[leaf] = tree.bounds[leaf].surface_area();
+				if (i < num_internal)
+					find_children(codes, tree, static_cast<int32_t>(i));
+			}
+		});
+
+		// Bounds and costs, treelets are rearranged once their subtrees are final
+		bottom_up(tree, pool, [&](uint32_t node) {
+			uint32_t left = tree.left(node), right = tree.right(node);
+			tree.bounds[node] = tree.bounds[left];
+			tree.bounds[node].extend(tree.bounds[right]);
+			tree.counts[node] = tree.counts[left] + tree.counts[right];
+			tree.costs[node] = kTraversalCost * tree.bounds[node].surface_area() + tree.costs[left] + tree.costs[right];
+			if (config.optimize_treelets && tree.counts[node] >= kMinTreeletPrims)
+				optimize_treelet(tree, node);
+		});
+
+		// Collapse subtrees that are cheaper as one leaf, and size what is written for each subtree
+		bottom_up(tree, pool, [&](uint32_t node) {
+			uint32_t left = tree.left(node), right = tree.right(node);
+			float area = tree.bounds[node].surface_area();
+			float split_cost = kTraversalCost * area + tree.costs[left] + tree.costs[right];
+			float leaf_cost = area * tree.counts[node];
+			tree.collapsed[node] = tree.counts[node] <= kMaxLeafSize && leaf_cost <= split_cost;
+			tree.costs[node] = tree.collapsed[node] ? leaf_cost : split_cost;
+			tree.sizes[node] = tree.collapsed[node] ? 1 : 1 + tree.sizes[left] + tree.sizes[right];
+			tree.heights[node] = tree.collapsed[node] ? 0 : 1 + std::max(tree.heights[left], tree.heights[right]);
+		});
+
+		// Runs of equal codes are split by index, clustered geometry can make the tree deeper than traversal allows.
+		// The binned builder limits its depth.
+		if (tree.heights[0] > bvh::kMaxDepth)
+		{
+			bvh fallback;
+			fallback.build(vertices, tris_index, num_tris);
+			return fallback;
+		}
+
+		// Write depth first. The top of the tree is written here until there are enough subtrees to share out.
+		std::vector<bvh_node> nodes(tree.sizes[0]);
+		std::vector<uint32_t> prim_indices(num_tris);
+		struct subtree
+		{
+			uint32_t id, node_index, prim_offset;
+		};
+
+		auto write_leaf = [&](const subtree &s) {
+			bvh_node &out = nodes[s.node_index];
+			out.bmin = tree.bounds[s.id].min, out.bmax = tree.bounds[s.id].max;
+			out.offset = s.prim_offset;
+			out.count = tree.counts[s.id];
+			// Gather the prims of the collapsed subtree
+			uint32_t stack[2 * kMaxLeafSize], stack_size = 0, next = s.prim_offset;
+			stack[stack_size++] = s.id;
+			while (stack_size > 0)
+			{
+				uint32_t id = stack[--stack_size];
+				if (tree.is_leaf(id))
+					prim_indices[next++] = order[id - num_internal];
+				else
+					stack[stack_size++] = tree.right(id), stack[stack_size++] = tree.left(id);
+			}
+		};
+
+		auto write_interior = [&](const subtree &s, subtree &left, subtree &right) {
+			uint32_t l = tree.left(s.id), r = tree.right(s.id);
+			left = { l, s.node_index + 1, s.prim_offset };
+			right = { r, s.node_index + 1 + tree.sizes[l], s.prim_offset + tree.counts[l] };
+			bvh_node &out = nodes[s.node_index];
+			out.bmin = tree.bounds[s.id].min, out.bmax = tree.bounds[s.id].max;
+			out.offset = right.node_index;
+			out.count = 0;
+		};
+
+		std::vector<subtree> frontier(1, subtree{ 0, 0, 0 }), expanded;
+		if (num_tris == 1)
+			frontier[0].id = num_internal;
+		const size_t target_subtrees = 8 * (pool.size() + 1);
+		while (frontier.size() < target_subtrees)
+		{
+			expanded.clear();
+			for (const subtree &s : frontier)
+			{
+				if (tree.is_leaf(s.id) || tree.collapsed[s.id])
+				{
+					expanded.push_back(s);
+					continue;
+				}
+				subtree left, right;
+				write_interior(s, left, right);
+				expanded.push_back(left);
+				expanded.push_back(right);
+			}
+			if (expanded.size() == frontier.size())
+				break;
+			std::swap(frontier, expanded);
+		}
+
+		pool.parallel_for(0, static_cast<uint32_t>(frontier.size()), 1, [&](uint32_t first, uint32_t last) {
+			std::vector<subtree> stack;
+			for (uint32_t f = first; f < last; ++f)
+			{
+				stack.push_back(frontier[f]);
+				while (!stack.empty())
+				{
+					subtree s = stack.back();
+					stack.pop_back();
+					if (tree.is_leaf(s.id) || tree.collapsed[s.id])
+					{
+						write_leaf(s);
+						continue;
+					}
+					subtree left, right;
+					write_interior(s, left, right);
+					stack.push_back(right);
+					stack.push_back(left);
+				}
+			}
+		});
+
+		return bvh(mesh_buffer<bvh_node>(std::move(nodes)), mesh_buffer<uint32_t>(std::move(prim_indices)));
+	}
+}
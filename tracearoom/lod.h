@@ -0,0 +1,236 @@
+#pragma once
+
+#include<algorithm>
+#include<cassert>
+#include<cmath>
+#include<cstdint>
+#include<memory>
+#include<unordered_map>
+#include<unordered_set>
+#include<vector>
+
+#include"geometry.h"
+#include"polygon_primitves.h"
+
+// Levels of detail picked by how wide a ray is where it reaches an object.
+//
+// Primary rays carry a ray differential from the camera: a pinhole ray widens by pixel_spread per unit of distance
+// (see pinhole_camera::pixel_spread). While a ray_footprint_scope is alive the calling thread traces rays of that
+// spread, the same way ray_cost_scope records their cost, so every accelerator and batch path sees it without
+// changing how objects are intersected. Rays traced outside of a scope have no spread and always see full detail.
+//
+// At scene build every large enough mesh is decimated into coarser levels by vertex clustering: vertices are merged
+// per cell of a grid and triangles that collapse are dropped. How far the vertices moved measures how far a level
+// strays from the original surface. A ray picks the coarsest level that strays by less than tolerance times its width
+// at the object's nearest point, so with a tolerance of one what it sees moves by less than a pixel.
+namespace ray_footprint
+{
+	// Spread of the rays traced by the calling thread, in radians per unit of distance, 0 for exact rays
+	inline float &spread()
+	{
+		static thread_local float value = 0.0f;
+		return value;
+	}
+}
+
+// Traces the rays of the calling thread with spread for the lifetime of the scope
+class ray_footprint_scope
+{
+	float previous;
+public:
+	explicit ray_footprint_scope(float spread) : previous(ray_footprint::spread()) { ray_footprint::spread() = spread; }
+	~ray_footprint_scope() { ray_footprint::spread() = previous; }
+
+	ray_footprint_scope(const ray_footprint_scope &) = delete;
+	ray_footprint_scope &operator=(const ray_footprint_scope &) = delete;
+};
+
+namespace lod
+{
+	const uint32_t kMaxLevels = 8;
+	// Meshes below this are not worth decimating, and levels stop once they get there
+	const uint32_t kMinTris = 64;
+	// A level is only kept if it has at most this share of the triangles of the previous one
+	const float kMinReduction = 0.6f;
+	// Cells along the bounding box diagonal for the finest level, every further level halves it
+	const float kFinestCells = 256.0f;
+	// A hit's triangle index holds both the level and the triangle within it
+	const uint32_t kLevelShift = 28;
+
+	// Mesh with its vertices clustered on a grid of cell_size, nullptr if nothing is left of it.
+	// error receives how far the farthest vertex moved.
+	inline std::unique_ptr<TriangleMesh> decimate(const TriangleMesh &mesh, float cell_size, float &error)
+	{
+		const mesh_buffer<Vec3f> &vertices = mesh.get_vertices();
+		const mesh_buffer<uint32_t> &tris = mesh.get_tris_index();
+		Vec3f bmin(kInfinity);
+		for (const Vec3f &v : vertices)
+			bmin = Vec3f(std::min(bmin.x, v.x), std::min(bmin.y, v.y), std::min(bmin.z, v.z));
+
+		// Cluster of every vertex, clusters sit at the mean of their vertices
+		std::unordered_map<uint64_t, uint32_t> cells;
+		std::vector<uint32_t> cluster(vertices.size());
+		std::vector<Vec3f> positions;
+		std::vector<uint32_t> counts;
+		const float inv_cell = 1.0f / cell_size;
+		for (size_t i = 0; i < vertices.size(); ++i)
+		{
+			Vec3f p = (vertices[i] - bmin) * inv_cell;
+			uint64_t key = (static_cast<uint64_t>(p.x) & 0x1FFFFF) | (static_cast<uint64_t>(p.y) & 0x1FFFFF) << 21 | (static_cast<uint64_t>(p.z) & 0x1FFFFF) << 42;
+			auto inserted = cells.insert({ key, static_cast<uint32_t>(positions.size()) });
+			if (inserted.second)
+			{
+				positions.push_back(0);
+				counts.push_back(0);
+			}
+			cluster[i] = inserted.first->second;
+			positions[cluster[i]] = positions[cluster[i]] + vertices[i];
+			counts[cluster[i]] += 1;
+		}
+		// Triangles are told apart by their clusters packed in one key
+		if (positions.size() >= (1u << 21))
+			return nullptr;
+		for (size_t c = 0; c < positions.size(); ++c)
+			positions[c] = positions[c] * (1.0f / counts[c]);
+		error = 0.0f;
+		for (size_t i = 0; i < vertices.size(); ++i)
+			error = std::max(error, (vertices[i] - positions[cluster[i]]).length());
+
+		// Triangles with all corners in different clusters survive, once each whatever their winding
+		std::unordered_set<uint64_t> kept;
+		std::vector<uint32_t> lod_tris;
+		std::vector<Vec3f> lod_normals;
+		std::vector<Vec2f> lod_st;
+		std::vector<uint16_t> lod_materials;
+		const std::vector<uint16_t> &materials = mesh.get_triangle_materials();
+		for (uint32_t t = 0; t < mesh.get_num_tris(); ++t)
+		{
+			uint32_t c[3] = { cluster[tris[t * 3]], cluster[tris[t * 3 + 1]], cluster[tris[t * 3 + 2]] };
+			if (c[0] == c[1] || c[1] == c[2] || c[0] == c[2])
+				continue;
+			uint32_t sorted[3] = { c[0], c[1], c[2] };
+			std::sort(sorted, sorted + 3);
+			if (!kept.insert(sorted[0] | static_cast<uint64_t>(sorted[1]) << 21 | static_cast<uint64_t>(sorted[2]) << 42).second)
+				continue;
+			for (uint32_t k = 0; k < 3; ++k)
+			{
+				lod_tris.push_back(c[k]);
+				lod_normals.push_back(mesh.get_normals()[t * 3 + k]);
+				lod_st.push_back(mesh.get_tex_coordinates()[t * 3 + k]);
+			}
+			if (!materials.empty())
+				lod_materials.push_back(materials[t]);
+		}
+		if (lod_tris.empty())
+			return nullptr;
+		std::unique_ptr<TriangleMesh> level(new TriangleMesh(std::move(positions), std::move(lod_tris), std::move(lod_normals), std::move(lod_st), mesh.color));
+		level->set_triangle_materials(std::move(lod_materials));
+		level->material_id = mesh.material_id;
+		return level;
+	}
+
+	// A mesh and its decimated levels, each ray is traced against one of them
+	class lod_mesh : public Object
+	{
+		std::vector<std::unique_ptr<TriangleMesh>> levels;	// finest first
+		std::vector<float> errors;		// how far each level may stray from the original surface
+		Vec3f bmin, bmax;
+		float tolerance;
+
+		uint32_t pick(const Vec3f &orig) const
+		{
+			float spread = ray_footprint::spread();
+			if (spread <= 0.0f)
+				return 0;
+			// Nearest point of the bounds, the ray is at least this wide anywhere on the object
+			Vec3f nearest(std::min(std::max(orig.x, bmin.x), bmax.x), std::min(std::max(orig.y, bmin.y), bmax.y), std::min(std::max(orig.z, bmin.z), bmax.z));
+			float footprint = (nearest - orig).length() * spread * tolerance;
+			uint32_t level = static_cast<uint32_t>(levels.size()) - 1;
+			while (level > 0 && errors[level] > footprint)
+				--level;
+			return level;
+		}
+	public:
+		// tolerance: how many ray widths a level may stray from the original surface
+		lod_mesh(std::unique_ptr<TriangleMesh> mesh, float lod_tolerance) : Object(mesh->color), tolerance(lod_tolerance)
+		{
+			texture_id = mesh->texture_id;
+			material_id = mesh->material_id;
+			mesh->update();
+			bmin = bmax = mesh->get_vertices()[0];
+			for (const Vec3f &v : mesh->get_vertices())
+			{
+				bmin = Vec3f(std::min(bmin.x, v.x), std::min(bmin.y, v.y), std::min(bmin.z, v.z));
+				bmax = Vec3f(std::max(bmax.x, v.x), std::max(bmax.y, v.y), std::max(bmax.z, v.z));
+			}
+			errors.push_back(0.0f);
+			levels.push_back(std::move(mesh));
+
+			// Every level is clustered from the original so the error bounds do not add up
+			float cell_size = (bmax - bmin).length() / kFinestCells;
+			for (uint32_t step = 0; cell_size > 0.0f && step < 2 * kMaxLevels && levels.size() < kMaxLevels && levels.back()->get_num_tris() > kMinTris; ++step, cell_size *= 2.0f)
+			{
+				float error;
+				std::unique_ptr<TriangleMesh> level = decimate(*levels.front(), cell_size, error);
+				if (level && level->get_num_tris() <= levels.back()->get_num_tris() * kMinReduction)
+				{
+					errors.push_back(std::max(error, errors.back()));
+					levels.push_back(std::move(level));
+				}
+			}
+		}
+
+		uint32_t num_levels() const { return static_cast<uint32_t>(levels.size()); }
+		const TriangleMesh &level(uint32_t i) const { return *levels[i]; }
+
+		bool intersect(const Vec3f &orig, const Vec3f &dir, float &tNear, uint32_t &triIndex, Vec2f &uv) const
+		{
+			uint32_t level = pick(orig);
+			if (!levels[level]->intersect(orig, dir, tNear, triIndex, uv))
+				return false;
+			triIndex |= level << kLevelShift;
+			return true;
+		}
+
+		void getSurfaceProperties(
+			const Vec3f &hitPoint,
+			const Vec3f &viewDirection,
+			const uint32_t &triIndex,
+			const Vec2f &uv,
+			Vec3f &hitNormal,
+			Vec2f &hitTextureCoordinates) const
+		{
+			uint32_t tri = triIndex & ((1u << kLevelShift) - 1);
+			levels[triIndex >> kLevelShift]->getSurfaceProperties(hitPoint, viewDirection, tri, uv, hitNormal, hitTextureCoordinates);
+		}
+
+		uint32_t material_of(const uint32_t &triIndex) const
+		{
+			return levels[triIndex >> kLevelShift]->material_of(triIndex & ((1u << kLevelShift) - 1));
+		}
+
+		float texture_density(const uint32_t &triIndex) const
+		{
+			return levels[triIndex >> kLevelShift]->texture_density(triIndex & ((1u << kLevelShift) - 1));
+		}
+	};
+
+	// Replaces every TriangleMesh in objects that is worth it with a lod_mesh. Returns the triangles of all levels
+	// that were added.
+	inline size_t make_lods(std::vector<std::unique_ptr<Object>> &objects, float tolerance)
+	{
+		size_t added = 0;
+		for (auto &object : objects)
+		{
+			auto mesh = dynamic_cast<TriangleMesh*>(object.get());
+			if (!mesh || mesh->get_num_tris() <= kMinTris || mesh->get_num_tris() >= (1u << kLevelShift))
+				continue;
+			std::unique_ptr<TriangleMesh> owned(static_cast<TriangleMesh*>(object.release()));
+			std::unique_ptr<lod_mesh> levels(new lod_mesh(std::move(owned), tolerance));
+			for (uint32_t i = 1; i < levels->num_levels(); ++i)
+				added += levels->level(i).get_num_tris();
+			object = std::move(levels);
+		}
+		return added;
+	}
+}
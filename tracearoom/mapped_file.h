@@ -0,0 +1,112 @@
+#pragma once
+
+#include<cstddef>
+#include<cstdint>
+#include<string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include<windows.h>
+#else
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+#endif
+
+// Read only memory mapping of a whole file. The mapping stays valid for the lifetime of the object.
+class mapped_file
+{
+	const unsigned char *base = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	HANDLE file_handle = INVALID_HANDLE_VALUE;
+	HANDLE mapping_handle = nullptr;
+#endif
+
+	void close()
+	{
+#ifdef _WIN32
+		if (base)
+			UnmapViewOfFile(base);
+		if (mapping_handle)
+			CloseHandle(mapping_handle);
+		if (file_handle != INVALID_HANDLE_VALUE)
+			CloseHandle(file_handle);
+		file_handle = INVALID_HANDLE_VALUE;
+		mapping_handle = nullptr;
+#else
+		if (base)
+			munmap(const_cast<unsigned char*>(base), length);
+#endif
+		base = nullptr;
+		length = 0;
+	}
+public:
+	mapped_file() {}
+	explicit mapped_file(const std::string &path) { open(path); }
+	~mapped_file() { close(); }
+
+	mapped_file(const mapped_file &) = delete;
+	mapped_file &operator=(const mapped_file &) = delete;
+
+	bool open(const std::string &path)
+	{
+		close();
+#ifdef _WIN32
+		file_handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+		if (file_handle == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file_handle, &file_size) || file_size.QuadPart == 0)
+		{
+			close();
+			return false;
+		}
+
+		mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!mapping_handle)
+		{
+			close();
+			return false;
+		}
+
+		base = static_cast<const unsigned char*>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+		length = static_cast<size_t>(file_size.QuadPart);
+#else
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+
+		struct stat file_stat;
+		if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0)
+		{
+			::close(fd);
+			return false;
+		}
+
+		void *mapping = mmap(nullptr, static_cast<size_t>(file_stat.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		// The mapping keeps its own reference to the file
+		::close(fd);
+		if (mapping == MAP_FAILED)
+			return false;
+
+		base = static_cast<const unsigned char*>(mapping);
+		length = static_cast<size_t>(file_stat.st_size);
+#endif
+		if (!base)
+		{
+			close();
+			return false;
+		}
+
+		return true;
+	}
+
+	bool is_open() const { return base != nullptr; }
+	const unsigned char *data() const { return base; }
+	size_t size() const { return length; }
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include<algorithm>
+#include<cmath>
+#include<cstdint>
+#include<vector>
+
+#include"geometry.h"
+
+// Materials describe how a surface reflects light beyond its colour. Objects refer to one by its id in the shared
+// library(Object::material_id), meshes can also give every triangle its own(TriangleMesh::set_triangle_materials,
+// 16 bit ids). Surfaces without a material are plain diffuse in the object's colour, exactly as before materials existed.
+//
+// The raytracer shades hits in batches: it sorts them by material and runs the kernel of each model over all the hits
+// that use it, so the material is looked up and dispatched once per run instead of once per hit. The kernels are
+// scalar loops: they write colours through each hit's ray index and evaluate the lights through PointLight's
+// virtual illuminate, so they are not expected to vectorise.
+// The albedo of a hit is always the object's colour times its texture, a material only adds what it does with it.
+namespace material
+{
+	const uint32_t kNone = ~0u;
+	// Per triangle ids are 16 bit, this one stands for the object's material
+	const uint16_t kObjectMaterial = 0xFFFF;
+	// Bounces of mirror and dielectric rays before they stop contributing
+	const uint32_t kMaxDepth = 4;
+	// Reflected and refracted rays start this far off the surface so they do not hit it again
+	const float kBounceOffset = 1e-3f;
+
+	enum class model : uint8_t
+	{
+		diffuse,	// Lambert
+		glossy,		// Lambert plus a GGX microfacet highlight of the specular colour
+		mirror,		// perfect reflection tinted by the specular colour
+		dielectric,	// glass: Fresnel weighted reflection and refraction through a surface of index ior
+		emissive	// diffuse plus light of its own
+	};
+
+	struct description
+	{
+		model type = model::diffuse;
+		Vec3f specular = Vec3f(0.04f);	// reflectance at normal incidence for glossy, tint for mirror
+		float roughness = 0.5f;			// glossy, 0 is smooth
+		float ior = 1.5f;				// dielectric
+		Vec3f emission = Vec3f(0);		// emissive
+	};
+
+	class library
+	{
+		std::vector<description> materials;
+	public:
+		static library &shared()
+		{
+			static library instance;
+			return instance;
+		}
+
+		// Add every material before rendering, the library is read without locks while tracing.
+		// Returns kNone once all 16 bit ids are used.
+		uint32_t add(const description &m)
+		{
+			if (materials.size() >= kObjectMaterial)
+				return kNone;
+			materials.push_back(m);
+			return static_cast<uint32_t>(materials.size() - 1);
+		}
+
+		const description &get(uint32_t id) const { return materials[id]; }
+		uint32_t size() const { return static_cast<uint32_t>(materials.size()); }
+	};
+
+	// GGX normal distribution of a surface of roughness alpha
+	inline float ggx_distribution(float n_dot_h, float alpha)
+	{
+		float a2 = alpha * alpha;
+		float d = n_dot_h * n_dot_h * (a2 - 1.0f) + 1.0f;
+		return a2 / (static_cast<float>(M_PI) * d * d);
+	}
+
+	// Smith masking of one direction, Schlick's approximation matched to GGX
+	inline float smith_g1(float n_dot_x, float alpha)
+	{
+		float k = alpha * 0.5f;
+		return n_dot_x / (n_dot_x * (1.0f - k) + k);
+	}
+
+	inline Vec3f fresnel_schlick(const Vec3f &f0, float cosine)
+	{
+		float m = std::pow(1.0f - cosine, 5.0f);
+		return f0 + (Vec3f(1) - f0) * m;
+	}
+
+	// Unpolarised Fresnel reflectance of a dielectric, 1 for total internal reflection.
+	// cos_i is measured on the side the ray arrives from, eta is the index ratio incident / transmitted.
+	inline float fresnel_dielectric(float cos_i, float eta, float &cos_t)
+	{
+		float sin_t2 = eta * eta * std::max(0.0f, 1.0f - cos_i * cos_i);
+		if (sin_t2 >= 1.0f)
+		{
+			cos_t = 0.0f;
+			return 1.0f;
+		}
+		cos_t = std::sqrt(1.0f - sin_t2);
+		float rs = (eta * cos_i - cos_t) / (eta * cos_i + cos_t);
+		float rp = (cos_i - eta * cos_t) / (cos_i + eta * cos_t);
+		return 0.5f * (rs * rs + rp * rp);
+	}
+
+	inline Vec3f reflect(const Vec3f &dir, const Vec3f &normal)
+	{
+		return dir - normal * (2.0f * dir.dotProduct(normal));
+	}
+}
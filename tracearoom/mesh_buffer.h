@@ -0,0 +1,62 @@
+#pragma once
+
+#include<cstddef>
+#include<memory>
+#include<utility>
+#include<vector>
+
+// Array storage for mesh data that either owns its elements or borrows them from the caller,
+// e.g. from a memory mapped scene cache. A borrowed buffer keeps the memory it points into alive through
+// keep_alive, and turns into an owned copy the first time it is written to.
+template<typename T>
+class mesh_buffer
+{
+	std::vector<T> storage;
+	const T *first = nullptr;
+	size_t count = 0;
+	std::shared_ptr<const void> keep_alive;
+	bool owning = true;
+public:
+	mesh_buffer() {}
+	mesh_buffer(std::vector<T> data) : storage(std::move(data)), first(storage.data()), count(storage.size()) {}
+	mesh_buffer(const T *data, size_t size, std::shared_ptr<const void> owner = nullptr) : first(data), count(size), keep_alive(std::move(owner)), owning(false) {}
+
+	mesh_buffer(const mesh_buffer &other) : storage(other.storage), first(other.owning ? storage.data() : other.first), count(other.count), keep_alive(other.keep_alive), owning(other.owning) {}
+	// Moving a vector keeps its heap block, so first stays valid
+	mesh_buffer(mesh_buffer &&other) : storage(std::move(other.storage)), first(other.first), count(other.count), keep_alive(std::move(other.keep_alive)), owning(other.owning)
+	{
+		other.first = nullptr;
+		other.count = 0;
+	}
+
+	mesh_buffer &operator=(mesh_buffer other)
+	{
+		std::swap(storage, other.storage);
+		std::swap(first, other.first);
+		std::swap(count, other.count);
+		std::swap(keep_alive, other.keep_alive);
+		std::swap(owning, other.owning);
+		return *this;
+	}
+
+	const T *data() const { return first; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	bool is_borrowed() const { return !owning; }
+	const T &operator[](size_t i) const { return first[i]; }
+	const T *begin() const { return first; }
+	const T *end() const { return first + count; }
+
+	// Copies borrowed data before handing out write access
+	T *mutable_data()
+	{
+		if (!owning)
+		{
+			storage.assign(first, first + count);
+			first = storage.data();
+			keep_alive.reset();
+			owning = true;
+		}
+		return storage.data();
+	}
+};
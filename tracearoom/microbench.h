@@ -0,0 +1,174 @@
+#pragma once
+
+#include<algorithm>
+#include<chrono>
+#include<cstdint>
+#include<cstdio>
+#include<functional>
+#include<memory>
+#include<string>
+#include<vector>
+
+#include"camera.h"
+#include"compact_mesh.h"
+#include"geometry.h"
+#include"polygon_primitves.h"
+#include"sampler.h"
+#include"selftest.h"
+
+// Micro-benchmarks of the kernels a frame spends its time in, run with --bench.
+//
+// Each benchmark times a batch of calls and grows the batch until it runs for kMinBatchTime, then the best of
+// kRepetitions batches is reported, the best is the run least disturbed by the rest of the machine. Results go
+// into a volatile sink so the compiler cannot drop the work. Run it single threaded on an idle machine and compare
+// numbers from the same machine only.
+namespace microbench
+{
+	const double kMinBatchTime = 0.05;	// seconds
+	const uint32_t kRepetitions = 5;
+
+	namespace detail
+	{
+		inline volatile float &sink()
+		{
+			static volatile float value = 0.0f;
+			return value;
+		}
+	}
+
+	struct result
+	{
+		std::string name;
+		double ns_per_call;
+		uint64_t iterations;
+	};
+
+	// body runs iterations calls of the kernel and returns something made from their results
+	inline result measure(const std::string &name, const std::function<float(uint64_t)> &body)
+	{
+		typedef std::chrono::steady_clock clock;
+		auto time = [&](uint64_t iterations) {
+			clock::time_point start = clock::now();
+			detail::sink() = body(iterations);
+			return std::chrono::duration<double>(clock::now() - start).count();
+		};
+
+		uint64_t iterations = 1;
+		double seconds = time(iterations);
+		while (seconds < kMinBatchTime)
+		{
+			iterations = seconds > 0.0 ? std::max(iterations * 2, static_cast<uint64_t>(iterations * kMinBatchTime * 1.4 / seconds)) : iterations * 10;
+			seconds = time(iterations);
+		}
+		for (uint32_t r = 1; r < kRepetitions; ++r)
+			seconds = std::min(seconds, time(iterations));
+		return { name, seconds * 1e9 / iterations, iterations };
+	}
+
+	inline void print(const std::vector<result> &results)
+	{
+		printf("%-40s %14s %14s\n", "Benchmark", "Time ns", "Iterations");
+		for (const result &r : results)
+			printf("%-40s %14.2f %14llu\n", r.name.c_str(), r.ns_per_call, static_cast<unsigned long long>(r.iterations));
+	}
+
+	inline std::vector<result> run()
+	{
+		std::vector<result> results;
+		selftest::rng random(7);
+
+		// Single triangles, one ray that hits and one that runs parallel past it
+		const Vec3f v0(-1, -1, -5), v1(1, -1, -5), v2(0, 1, -5);
+		const Vec3f orig(0), hit_dir = Vec3f(0.1f, 0.1f, -1).normalize(), miss_dir = Vec3f(1, 0, 0);
+		results.push_back(measure("rayTriangleIntersect/hit", [&](uint64_t n) {
+			float sum = 0.0f;
+			for (uint64_t i = 0; i < n; ++i)
+			{
+				float t = kInfinity, u, v;
+				TriangleMesh::rayTriangleIntersect(orig, hit_dir, v0, v1, v2, t, u, v);
+				sum += t;
+			}
+			return sum;
+		}));
+		results.push_back(measure("rayTriangleIntersect/miss", [&](uint64_t n) {
+			float sum = 0.0f;
+			for (uint64_t i = 0; i < n; ++i)
+			{
+				float t = kInfinity, u = 0.0f, v;
+				sum += TriangleMesh::rayTriangleIntersect(orig, miss_dir, v0, v1, v2, t, u, v) ? t : u;
+			}
+			return sum;
+		}));
+
+		Matrix44f transform = Matrix44f::create_rotation(30.0f, Vec3f(0, 1, 0)) * Matrix44f::create_translation(Vec3f(4, 3, 4));
+		results.push_back(measure("Matrix44f::inverse", [&](uint64_t n) {
+			float sum = 0.0f;
+			for (uint64_t i = 0; i < n; ++i)
+			{
+				transform[3][0] = static_cast<float>(i & 7);
+				sum += transform.inverse()[3][2];
+			}
+			return sum;
+		}));
+
+		pinhole_camera camera(640, 480, 90.0f, Matrix44f());
+		results.push_back(measure("pinhole_camera::ray_direction", [&](uint64_t n) {
+			float sum = 0.0f;
+			for (uint64_t i = 0; i < n; ++i)
+				sum += camera.ray_direction(static_cast<uint32_t>(i % 640), static_cast<uint32_t>(i / 640 % 480)).z;
+			return sum;
+		}));
+
+		const uint32_t seed = sampler::pixel_seed(3, 5);
+		results.push_back(measure("sampler::owen_sobol", [&](uint64_t n) {
+			float sum = 0.0f;
+			for (uint64_t i = 0; i < n; ++i)
+				sum += sampler::owen_sobol(seed, static_cast<uint32_t>(i), static_cast<uint32_t>(i & 3));
+			return sum;
+		}));
+
+		// Whole meshes, rays from selftest aimed into the bounds so most of them hit
+		auto trace = [&](const std::string &name, const Object &object, const std::vector<Vec3f> &origins, const std::vector<Vec3f> &dirs) {
+			results.push_back(measure(name, [&](uint64_t n) {
+				float sum = 0.0f;
+				for (uint64_t i = 0; i < n; ++i)
+				{
+					size_t r = i % origins.size();
+					float t = kInfinity;
+					uint32_t tri;
+					Vec2f uv;
+					if (object.intersect(origins[r], dirs[r], t, tri, uv))
+						sum += t;
+				}
+				return sum;
+			}));
+		};
+
+		std::vector<Vec3f> origins, dirs;
+		std::unique_ptr<TriangleMesh> soup = selftest::make_soup(random, 3000, Vec3f(-5), Vec3f(5), 0.6f);
+		selftest::make_rays(*soup, random, 4096, origins, dirs);
+		trace("TriangleMesh::intersect/3k soup", *soup, origins, dirs);
+
+		std::unique_ptr<TriangleMesh> sphere = selftest::make_sphere(Vec3f(0), 4.0f, 160, 256);
+		selftest::make_rays(*sphere, random, 4096, origins, dirs);
+		trace("TriangleMesh::intersect/82k sphere", *sphere, origins, dirs);
+		compact::CompactTriangleMesh compact_sphere(*sphere);
+		trace("CompactTriangleMesh::intersect/82k", compact_sphere, origins, dirs);
+
+		std::vector<ray_hit> hits(origins.size());
+		results.push_back(measure("TriangleMesh::intersect_batch/82k", [&](uint64_t n) {
+			float sum = 0.0f;
+			for (uint64_t i = 0; i < n; i += origins.size())
+			{
+				uint32_t count = static_cast<uint32_t>(std::min<uint64_t>(origins.size(), n - i));
+				std::fill(hits.begin(), hits.begin() + count, ray_hit());
+				sphere->intersect_batch(origins.data(), dirs.data(), count, hits.data());
+				sum += hits[0].t;
+			}
+			return sum;
+		}));
+
+		print(results);
+		return results;
+	}
+}
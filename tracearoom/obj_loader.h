@@ -0,0 +1,403 @@
+#pragma once
+
+#include<cmath>
+#include<cstdint>
+#include<cstdlib>
+#include<fstream>
+#include<cstring>
+#include<map>
+#include<memory>
+#include<string>
+#include<vector>
+
+#include"geometry.h"
+#include"material.h"
+#include"polygon_primitves.h"
+#include"texture.h"
+
+// Wavefront obj importer. Faces are grouped by their usemtl material, each group becomes one TriangleMesh
+// colored with the material's diffuse(Kd) color and textured with its diffuse map(map_Kd, .ppm, .pfm or .hdr),
+// which goes to the shared texture::cache. Materials that do more than diffuse reflection go to the shared
+// material::library: emitters(Ke), glass(illum 4, 6, 7 or d/Tr, index Ni), mirrors(illum 3, 5, tinted by Ks) and
+// glossy surfaces(Ks with roughness from Ns). Only positions, normals, texture coordinates and polygonal
+// faces are read, everything else is skipped.
+namespace obj_loader
+{
+	namespace detail
+	{
+		inline bool read_file(const std::string &path, std::string &contents)
+		{
+			std::ifstream ifs(path, std::ios::in | std::ios::binary);
+			if (!ifs.is_open())
+				return false;
+
+			ifs.seekg(0, std::ios::end);
+			contents.resize(static_cast<size_t>(ifs.tellg()));
+			ifs.seekg(0, std::ios::beg);
+			ifs.read(&contents[0], contents.size());
+			return static_cast<bool>(ifs);
+		}
+
+		inline void skip_spaces(const char *&p) { while (*p == ' ' || *p == '\t') ++p; }
+		inline void skip_line(const char *&p) { while (*p && *p != '\n') ++p; if (*p) ++p; }
+		inline bool at_line_end(const char *p) { return *p == '\0' || *p == '\n' || *p == '\r' || *p == '#'; }
+
+		// Much faster than strtof and good enough for mesh data
+		inline float parse_float(const char *&p)
+		{
+			skip_spaces(p);
+			float sign = 1.0f;
+			if (*p == '-' || *p == '+')
+				sign = (*p++ == '-') ? -1.0f : 1.0f;
+
+			double value = 0.0;
+			while (*p >= '0' && *p <= '9')
+				value = value * 10.0 + (*p++ - '0');
+
+			if (*p == '.')
+			{
+				++p;
+				double scale = 0.1;
+				while (*p >= '0' && *p <= '9')
+				{
+					value += (*p++ - '0') * scale;
+					scale *= 0.1;
+				}
+			}
+
+			if (*p == 'e' || *p == 'E')
+			{
+				++p;
+				int exp_sign = 1, exponent = 0;
+				if (*p == '-' || *p == '+')
+					exp_sign = (*p++ == '-') ? -1 : 1;
+				while (*p >= '0' && *p <= '9')
+					exponent = exponent * 10 + (*p++ - '0');
+				value *= std::pow(10.0, exp_sign * exponent);
+			}
+
+			return sign * static_cast<float>(value);
+		}
+
+		inline int64_t parse_int(const char *&p)
+		{
+			int64_t sign = 1, value = 0;
+			if (*p == '-')
+				sign = -1, ++p;
+			while (*p >= '0' && *p <= '9')
+				value = value * 10 + (*p++ - '0');
+			return sign * value;
+		}
+
+		// obj indices are 1 based, negative ones are relative to the end of the list so far. Returns ~0u when invalid.
+		inline uint32_t resolve_index(int64_t index, size_t count)
+		{
+			if (index > 0 && static_cast<size_t>(index) <= count)
+				return static_cast<uint32_t>(index - 1);
+			if (index < 0 && static_cast<size_t>(-index) <= count)
+				return static_cast<uint32_t>(count + index);
+			return ~0u;
+		}
+
+		// Counts the lines of each kind so the arrays can be allocated once
+		struct line_counts
+		{
+			size_t positions = 0, normals = 0, tex_coords = 0, faces = 0, materials = 0;
+		};
+
+		inline line_counts count_lines(const std::string &contents)
+		{
+			line_counts counts;
+			for (const char *p = contents.c_str(); *p; skip_line(p))
+			{
+				skip_spaces(p);
+				if (p[0] == 'v')
+					(p[1] == 'n' ? counts.normals : (p[1] == 't' ? counts.tex_coords : counts.positions))++;
+				else if (p[0] == 'f')
+					counts.faces++;
+				else if (p[0] == 'u')
+					counts.materials++;
+			}
+			return counts;
+		}
+
+		inline std::string parse_name(const char *&p)
+		{
+			skip_spaces(p);
+			const char *start = p;
+			while (!at_line_end(p))
+				++p;
+			const char *end = p;
+			while (end > start && (end[-1] == ' ' || end[-1] == '\t'))
+				--end;
+			return std::string(start, end);
+		}
+
+		struct mtl_material
+		{
+			Vec3f color = Vec3f(0.8f);
+			uint32_t texture_id = texture::kNone;
+			Vec3f specular = Vec3f(0), emission = Vec3f(0);
+			float shininess = 0.0f, ior = 1.5f, opacity = 1.0f;
+			int illum = -1;
+			bool specular_given = false;
+		};
+
+		// Adds what the mtl describes beyond diffuse reflection to the material library, kNone for plain diffuse
+		inline uint32_t register_material(const mtl_material &m)
+		{
+			material::description d;
+			auto nonzero = [](const Vec3f &v) { return v.x > 0.0f || v.y > 0.0f || v.z > 0.0f; };
+			if (nonzero(m.emission))
+			{
+				d.type = material::model::emissive;
+				d.emission = m.emission;
+			}
+			else if (m.illum == 4 || m.illum == 6 || m.illum == 7 || m.opacity < 1.0f)
+			{
+				d.type = material::model::dielectric;
+				d.ior = m.ior;
+			}
+			else if (m.illum == 3 || m.illum == 5)
+			{
+				d.type = material::model::mirror;
+				d.specular = m.specular_given ? m.specular : Vec3f(1);
+			}
+			else if (nonzero(m.specular) && m.illum != 0 && m.illum != 1)
+			{
+				d.type = material::model::glossy;
+				d.specular = m.specular;
+				d.roughness = std::sqrt(2.0f / (std::max(m.shininess, 0.0f) + 2.0f));
+			}
+			else
+				return material::kNone;
+			return material::library::shared().add(d);
+		}
+
+		inline void load_mtl(const std::string &path, std::map<std::string, mtl_material> &materials)
+		{
+			std::string contents;
+			if (!read_file(path, contents))
+				return;
+
+			std::string directory = path.substr(0, path.find_last_of("/\\") + 1);
+			std::string current;
+			for (const char *p = contents.c_str(); *p; skip_line(p))
+			{
+				skip_spaces(p);
+				if (std::strncmp(p, "newmtl", 6) == 0)
+				{
+					p += 6;
+					current = parse_name(p);
+					materials[current] = mtl_material();
+				}
+				else if (p[0] == 'K' && p[1] == 'd' && !current.empty())
+				{
+					p += 2;
+					float r = parse_float(p), g = parse_float(p), b = parse_float(p);
+					materials[current].color = Vec3f(r, g, b);
+				}
+				else if (p[0] == 'K' && (p[1] == 's' || p[1] == 'e') && !current.empty())
+				{
+					bool emission = p[1] == 'e';
+					p += 2;
+					float r = parse_float(p), g = parse_float(p), b = parse_float(p);
+					if (emission)
+						materials[current].emission = Vec3f(r, g, b);
+					else
+						materials[current].specular = Vec3f(r, g, b), materials[current].specular_given = true;
+				}
+				else if (p[0] == 'N' && (p[1] == 's' || p[1] == 'i') && !current.empty())
+				{
+					bool shininess = p[1] == 's';
+					p += 2;
+					(shininess ? materials[current].shininess : materials[current].ior) = parse_float(p);
+				}
+				else if (((p[0] == 'd' && (p[1] == ' ' || p[1] == '\t')) || (p[0] == 'T' && p[1] == 'r')) && !current.empty())
+				{
+					bool transparency = p[0] == 'T';
+					p += transparency ? 2 : 1;
+					float value = parse_float(p);
+					materials[current].opacity = transparency ? 1.0f - value : value;
+				}
+				else if (std::strncmp(p, "illum", 5) == 0 && !current.empty())
+				{
+					p += 5;
+					skip_spaces(p);
+					materials[current].illum = static_cast<int>(parse_int(p));
+				}
+				else if (std::strncmp(p, "map_Kd", 6) == 0 && !current.empty())
+				{
+					// Options such as -s come before the file name, which is the last word
+					p += 6;
+					std::string line = parse_name(p);
+					std::string file = line.substr(line.find_last_of(" \t") + 1);
+					materials[current].texture_id = texture::cache::shared().add(directory + file);
+				}
+			}
+		}
+
+		// Faces that share a material, with vertices renumbered to the ones the group uses
+		struct face_group
+		{
+			Vec3f color;
+			uint32_t texture_id = texture::kNone;
+			uint32_t material_id = material::kNone;
+			std::vector<uint32_t> face_index;
+			std::vector<uint32_t> verts_index;
+			std::vector<Vec3f> normals;
+			std::vector<Vec2f> st;
+			std::vector<Vec3f> verts;
+		};
+
+		// Where a file vertex went last: the group that used it and its index there. One table is shared by every
+		// group, a group that finds another group's entry adds the vertex again, so memory stays by file vertex.
+		struct vertex_slot
+		{
+			uint32_t group = ~0u;
+			uint32_t index = ~0u;
+		};
+	}
+
+	// Appends one TriangleMesh per material to objects, returns false if the file could not be read
+	inline bool load(const std::string &path, std::vector<std::unique_ptr<Object>> &objects, const Vec3f &default_color = Vec3f(0.8f))
+	{
+		std::string contents;
+		if (!detail::read_file(path, contents))
+			return false;
+
+		std::string directory = path.substr(0, path.find_last_of("/\\") + 1);
+		std::map<std::string, detail::mtl_material> materials;
+		std::vector<Vec3f> positions, normals;
+		std::vector<Vec2f> tex_coords;
+		std::vector<detail::face_group> groups(1);
+		groups[0].color = default_color;
+		std::map<std::string, size_t> group_of_material;
+		detail::face_group *group = &groups[0];
+		uint32_t group_index = 0;
+		std::vector<detail::vertex_slot> slots;
+
+		detail::line_counts counts = detail::count_lines(contents);
+		positions.reserve(counts.positions);
+		normals.reserve(counts.normals);
+		tex_coords.reserve(counts.tex_coords);
+		// With a single material every face ends up in one group, assume triangles
+		if (counts.materials <= 1)
+		{
+			group->face_index.reserve(counts.faces);
+			group->verts_index.reserve(counts.faces * 3);
+			group->normals.reserve(counts.faces * 3);
+			group->st.reserve(counts.faces * 3);
+			group->verts.reserve(counts.positions);
+		}
+		slots.reserve(counts.positions);
+
+		for (const char *p = contents.c_str(); *p; detail::skip_line(p))
+		{
+			detail::skip_spaces(p);
+			if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+			{
+				p += 1;
+				float x = detail::parse_float(p), y = detail::parse_float(p), z = detail::parse_float(p);
+				positions.emplace_back(x, y, z);
+			}
+			else if (p[0] == 'v' && p[1] == 'n')
+			{
+				p += 2;
+				float x = detail::parse_float(p), y = detail::parse_float(p), z = detail::parse_float(p);
+				normals.emplace_back(x, y, z);
+			}
+			else if (p[0] == 'v' && p[1] == 't')
+			{
+				p += 2;
+				float s = detail::parse_float(p), t = detail::parse_float(p);
+				tex_coords.emplace_back(s, t);
+			}
+			else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+			{
+				p += 1;
+				uint32_t corners = 0;
+				for (detail::skip_spaces(p); !detail::at_line_end(p); detail::skip_spaces(p))
+				{
+					uint32_t v = detail::resolve_index(detail::parse_int(p), positions.size());
+					uint32_t vt = ~0u, vn = ~0u;
+					if (*p == '/')
+					{
+						++p;
+						if (*p != '/')
+							vt = detail::resolve_index(detail::parse_int(p), tex_coords.size());
+						if (*p == '/')
+						{
+							++p;
+							vn = detail::resolve_index(detail::parse_int(p), normals.size());
+						}
+					}
+					// Skip anything unexpected up to the next corner
+					while (!detail::at_line_end(p) && *p != ' ' && *p != '\t')
+						++p;
+					if (v == ~0u)
+						continue;
+
+					if (slots.size() < positions.size())
+						slots.resize(positions.size());
+					detail::vertex_slot &slot = slots[v];
+					if (slot.group != group_index)
+					{
+						slot.group = group_index;
+						slot.index = static_cast<uint32_t>(group->verts.size());
+						group->verts.push_back(positions[v]);
+					}
+
+					group->verts_index.push_back(slot.index);
+					group->normals.push_back(vn != ~0u ? normals[vn] : Vec3f(0));
+					group->st.push_back(vt != ~0u ? tex_coords[vt] : Vec2f(0));
+					++corners;
+				}
+
+				if (corners >= 3)
+					group->face_index.push_back(corners);
+				else
+				{
+					// Drop degenerate faces
+					group->verts_index.resize(group->verts_index.size() - corners);
+					group->normals.resize(group->normals.size() - corners);
+					group->st.resize(group->st.size() - corners);
+				}
+			}
+			else if (std::strncmp(p, "mtllib", 6) == 0)
+			{
+				p += 6;
+				detail::load_mtl(directory + detail::parse_name(p), materials);
+			}
+			else if (std::strncmp(p, "usemtl", 6) == 0)
+			{
+				p += 6;
+				std::string name = detail::parse_name(p);
+				auto found = group_of_material.find(name);
+				if (found == group_of_material.end())
+				{
+					found = group_of_material.emplace(name, groups.size()).first;
+					groups.emplace_back();
+					auto material = materials.find(name);
+					groups.back().color = material != materials.end() ? material->second.color : default_color;
+					groups.back().texture_id = material != materials.end() ? material->second.texture_id : texture::kNone;
+					groups.back().material_id = material != materials.end() ? detail::register_material(material->second) : material::kNone;
+				}
+				group_index = static_cast<uint32_t>(found->second);
+				group = &groups[group_index];
+			}
+		}
+
+		for (auto &g : groups)
+		{
+			if (g.face_index.empty())
+				continue;
+			objects.push_back(std::unique_ptr<Object>(new TriangleMesh(static_cast<uint32_t>(g.face_index.size()), g.face_index,
+				std::move(g.verts_index), std::move(g.verts), std::move(g.normals), std::move(g.st), g.color)));
+			objects.back()->texture_id = g.texture_id;
+			objects.back()->material_id = g.material_id;
+		}
+
+		return true;
+	}
+}
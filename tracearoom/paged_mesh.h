@@ -0,0 +1,862 @@
+#pragma once
+
+#include<algorithm>
+#include<cassert>
+#include<cmath>
+#include<condition_variable>
+#include<cstdint>
+#include<cstring>
+#include<fstream>
+#include<list>
+#include<memory>
+#include<mutex>
+#include<string>
+#include<vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include<windows.h>
+#else
+#include<cerrno>
+#include<fcntl.h>
+#include<unistd.h>
+#endif
+
+#include"appearance.h"
+#include"arena.h"
+#include"bvh.h"
+#include"geometry.h"
+#include"polygon_primitves.h"
+#include"ray_cost.h"
+
+// Out of core triangle meshes for scenes that do not fit in memory.
+//
+// A mesh is cut into pages of up to page_tris triangles along its bvh: every subtree small enough becomes a page
+// holding its triangles, their attributes and a bvh of its own. Only the part of the tree above the pages stays
+// in memory, the pages live in a file and are read on demand through a page_cache that keeps the most recently
+// used ones within a memory budget.
+//
+// Single rays just wait for the pages they need. intersect_batch, which the renderer uses for whole rows of pixels,
+// first takes every ray as far as the resident pages go and queues the rest by page, then reads each missing page
+// once for all the rays waiting on it.
+//
+// File layout: file_header | mesh_record * num_meshes | page_record * num_pages | top nodes... | pages... | tables
+// A page holds vertices, tris, normals, st, bvh nodes, prim indices and optionally a material per triangle at aligned
+// offsets(see page_layout). Textures and materials are stored as tables(see appearance.h), scenes with textures made
+// in memory cannot be written.
+namespace paged
+{
+	const char kMagic[8] = { 'T', 'R', 'A', 'C', 'E', 'P', 'G', 'S' };
+	const uint32_t kVersion = 2;
+	const uint64_t kAlignment = 64;
+	const uint32_t kDefaultPageTris = 4096;
+	// A hit's triangle index holds both the page and the triangle within it
+	const uint32_t kMaxPageTris = 1u << 16;
+	const uint32_t kMaxPages = 1u << 16;
+
+	struct file_header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t num_meshes;
+		uint32_t num_pages;
+		uint32_t page_tris;
+		uint32_t padding;
+		uint64_t tables_offset;
+		uint64_t tables_bytes;
+	};
+
+	struct mesh_record
+	{
+		Vec3f color;
+		uint32_t num_top_nodes;		// leaves of the top tree refer to a page, offset is the page id
+		uint64_t top_nodes_offset;
+		uint32_t texture;			// index into the file's tables, appearance::kNone for none
+		uint32_t material;
+	};
+
+	struct page_record
+	{
+		uint64_t offset;
+		uint32_t num_tris;
+		uint32_t num_vertices;
+		uint32_t num_nodes;
+		uint32_t has_materials;		// 1 when the page stores a 16 bit material index per triangle
+	};
+
+	// Offsets of a page's arrays from the start of the page
+	struct page_layout
+	{
+		uint64_t vertices, tris, normals, st, nodes, prim_indices, materials, bytes;
+
+		explicit page_layout(const page_record &record)
+		{
+			auto align = [](uint64_t offset) { return (offset + kAlignment - 1) & ~(kAlignment - 1); };
+			uint64_t corners = static_cast<uint64_t>(record.num_tris) * 3;
+			vertices = 0;
+			tris = align(vertices + record.num_vertices * sizeof(Vec3f));
+			normals = align(tris + corners * sizeof(uint32_t));
+			st = align(normals + corners * sizeof(Vec3f));
+			nodes = align(st + corners * sizeof(Vec2f));
+			prim_indices = align(nodes + record.num_nodes * sizeof(bvh_node));
+			materials = align(prim_indices + record.num_tris * sizeof(uint32_t));
+			bytes = record.has_materials ? materials + record.num_tris * sizeof(uint16_t) : prim_indices + record.num_tris * sizeof(uint32_t);
+		}
+	};
+
+	// A page read into memory. Pages that could not be read or are malformed are kept as broken pages without
+	// triangles, rays pass through them.
+	class page
+	{
+		std::unique_ptr<unsigned char[]> data;
+		size_t bytes;
+		uint32_t num_tris;
+		bool broken;
+		const Vec3f *vertices;
+		const uint32_t *tris;
+		const Vec2f *st;
+		const uint16_t *materials;	// nullptr when every triangle uses the mesh's material
+		bvh accel;
+	public:
+		// read tells whether page_data holds the page's bytes
+		page(std::unique_ptr<unsigned char[]> page_data, const page_record &record, bool read) : data(std::move(page_data))
+		{
+			page_layout layout(record);
+			bytes = static_cast<size_t>(layout.bytes);
+			num_tris = record.num_tris;
+			vertices = reinterpret_cast<const Vec3f*>(data.get() + layout.vertices);
+			tris = reinterpret_cast<const uint32_t*>(data.get() + layout.tris);
+			st = reinterpret_cast<const Vec2f*>(data.get() + layout.st);
+			materials = record.has_materials ? reinterpret_cast<const uint16_t*>(data.get() + layout.materials) : nullptr;
+			const bvh_node *nodes = reinterpret_cast<const bvh_node*>(data.get() + layout.nodes);
+			const uint32_t *prim_indices = reinterpret_cast<const uint32_t*>(data.get() + layout.prim_indices);
+			broken = !read || !well_formed(record, nodes, prim_indices);
+			if (broken)
+			{
+				num_tris = 0;
+				return;
+			}
+			accel = bvh(mesh_buffer<bvh_node>(nodes, record.num_nodes), mesh_buffer<uint32_t>(prim_indices, record.num_tris));
+		}
+
+		size_t size() const { return bytes; }
+		bool is_broken() const { return broken; }
+
+		// Everything traversal and shading index with has to stay in range: the bvh(see bvh::well_formed) and the
+		// corners of the triangles within the vertices
+		bool well_formed(const page_record &record, const bvh_node *nodes, const uint32_t *prim_indices) const
+		{
+			if (!bvh::well_formed(nodes, record.num_nodes, prim_indices, record.num_tris, record.num_tris))
+				return false;
+			for (uint64_t c = 0; c < static_cast<uint64_t>(record.num_tris) * 3; ++c)
+				if (tris[c] >= record.num_vertices)
+					return false;
+			return true;
+		}
+
+		// Same contract as TriangleMesh::intersect, tri is the triangle within the page
+		bool intersect(const Vec3f &orig, const Vec3f &dir, float &tNear, uint32_t &tri, Vec2f &uv) const
+		{
+			bool isect = false;
+			accel.traverse(orig, dir, tNear, [&](uint32_t i) {
+				float t = kInfinity, u, v;
+				if (TriangleMesh::rayTriangleIntersect(orig, dir, vertices[tris[i * 3]], vertices[tris[i * 3 + 1]], vertices[tris[i * 3 + 2]], t, u, v) && t < tNear) {
+					tNear = t;
+					uv.x = u;
+					uv.y = v;
+					tri = i;
+					isect = true;
+				}
+			});
+			return isect;
+		}
+
+		// Same as TriangleMesh::getSurfaceProperties
+		void surface(uint32_t tri, const Vec2f &uv, Vec3f &normal, Vec2f &tex_coordinates) const
+		{
+			// A hit on a page that broke when it was read again
+			if (tri >= num_tris)
+			{
+				normal = Vec3f(0), tex_coordinates = Vec2f(0);
+				return;
+			}
+			const Vec3f &v0 = vertices[tris[tri * 3]], &v1 = vertices[tris[tri * 3 + 1]], &v2 = vertices[tris[tri * 3 + 2]];
+			normal = (v1 - v0).crossProduct(v2 - v0);
+			normal.normalize();
+			tex_coordinates = (1 - uv.x - uv.y) * st[tri * 3] + uv.x * st[tri * 3 + 1] + uv.y * st[tri * 3 + 2];
+		}
+
+		// Same as TriangleMesh::texture_density
+		float texture_density(uint32_t tri) const
+		{
+			if (tri >= num_tris)
+				return 0.0f;
+			return TriangleMesh::density(vertices[tris[tri * 3]], vertices[tris[tri * 3 + 1]], vertices[tris[tri * 3 + 2]], st[tri * 3], st[tri * 3 + 1], st[tri * 3 + 2]);
+		}
+
+		// Index into the file's material table, kObjectMaterial for the mesh's material
+		uint16_t material(uint32_t tri) const { return materials && tri < num_tris ? materials[tri] : material::kObjectMaterial; }
+	};
+
+	// Read only file read at explicit offsets. Nothing is shared between reads, not even a file position, so threads
+	// and the worker processes forked by distributed.h can read at once without locking each other out.
+	class page_file
+	{
+#ifdef _WIN32
+		HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+		int fd = -1;
+#endif
+	public:
+		explicit page_file(const std::string &path)
+		{
+#ifdef _WIN32
+			handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+#else
+			fd = ::open(path.c_str(), O_RDONLY);
+#endif
+		}
+
+		~page_file()
+		{
+#ifdef _WIN32
+			if (handle != INVALID_HANDLE_VALUE)
+				CloseHandle(handle);
+#else
+			if (fd >= 0)
+				::close(fd);
+#endif
+		}
+
+		page_file(const page_file &) = delete;
+		page_file &operator=(const page_file &) = delete;
+
+		bool is_open() const
+		{
+#ifdef _WIN32
+			return handle != INVALID_HANDLE_VALUE;
+#else
+			return fd >= 0;
+#endif
+		}
+
+		// False unless all bytes were read
+		bool read(uint64_t offset, unsigned char *data, size_t bytes) const
+		{
+			while (bytes > 0)
+			{
+#ifdef _WIN32
+				OVERLAPPED position = {};
+				position.Offset = static_cast<DWORD>(offset);
+				position.OffsetHigh = static_cast<DWORD>(offset >> 32);
+				DWORD chunk = static_cast<DWORD>(std::min<size_t>(bytes, 1u << 30)), done = 0;
+				if (!ReadFile(handle, data, chunk, &done, &position) || done == 0)
+					return false;
+#else
+				ssize_t done = pread(fd, data, bytes, static_cast<off_t>(offset));
+				if (done < 0 && errno == EINTR)
+					continue;
+				if (done <= 0)
+					return false;
+#endif
+				offset += static_cast<uint64_t>(done), data += done, bytes -= static_cast<size_t>(done);
+			}
+			return true;
+		}
+	};
+
+	// Resident pages, least recently used ones are dropped once they take more than the budget.
+	// Pages handed out stay valid while they are held even if the cache drops them meanwhile.
+	class page_cache
+	{
+	public:
+		struct stats
+		{
+			uint64_t loads = 0;
+			uint64_t evictions = 0;
+			uint64_t queued_rays = 0;	// rays intersect_batch had to hold back for a page
+			uint64_t broken_loads = 0;	// pages that could not be read or were malformed, rays pass through them
+			size_t resident_bytes = 0;
+			size_t peak_bytes = 0;
+			size_t budget = 0;
+		};
+
+		page_cache(const std::string &path, std::vector<page_record> page_records, appearance::table file_tables, size_t budget_bytes) :
+			file(path),
+			records(std::move(page_records)),
+			tables(std::move(file_tables)),
+			entries(records.size()),
+			budget(budget_bytes)
+		{}
+
+		page_cache(const page_cache &) = delete;
+		page_cache &operator=(const page_cache &) = delete;
+
+		bool is_open() const { return file.is_open(); }
+
+		// Textures and materials of the file
+		const appearance::table &get_tables() const { return tables; }
+
+		// The page if it is resident, never reads. Does not count as a use.
+		std::shared_ptr<const page> find(uint32_t id)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			return entries[id].resident;
+		}
+
+		// Resident pages among [first, first + count), sorted by id
+		void resident_pages(uint32_t first, uint32_t count, std::vector<std::pair<uint32_t, std::shared_ptr<const page>>> &pages)
+		{
+			pages.clear();
+			std::lock_guard<std::mutex> lock(mutex);
+			for (uint32_t id : lru)
+				if (id >= first && id - first < count)
+					pages.push_back({ id, entries[id].resident });
+			std::sort(pages.begin(), pages.end(), [](const std::pair<uint32_t, std::shared_ptr<const page>> &a, const std::pair<uint32_t, std::shared_ptr<const page>> &b) { return a.first < b.first; });
+		}
+
+		// Marks a page as just used
+		void touch(uint32_t id)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (entries[id].resident)
+				lru.splice(lru.begin(), lru, entries[id].lru_position);
+		}
+
+		// The page, read from the file if it is not resident. Threads asking for a page another thread is reading wait for it.
+		std::shared_ptr<const page> acquire(uint32_t id)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			entry &e = entries[id];
+			loaded.wait(lock, [&e] { return !e.loading; });
+			if (e.resident)
+			{
+				lru.splice(lru.begin(), lru, e.lru_position);
+				return e.resident;
+			}
+
+			e.loading = true;
+			lock.unlock();
+			std::shared_ptr<const page> result = read(id);
+			lock.lock();
+
+			e.loading = false;
+			e.resident = result;
+			lru.push_front(id);
+			e.lru_position = lru.begin();
+			counters.loads += 1;
+			counters.broken_loads += result->is_broken() ? 1 : 0;
+			counters.resident_bytes += result->size();
+			while (counters.resident_bytes > budget && lru.size() > 1)
+			{
+				entry &victim = entries[lru.back()];
+				counters.resident_bytes -= victim.resident->size();
+				victim.resident.reset();
+				lru.pop_back();
+				counters.evictions += 1;
+			}
+			counters.peak_bytes = std::max(counters.peak_bytes, counters.resident_bytes);
+			loaded.notify_all();
+			return result;
+		}
+
+		void add_queued_rays(uint64_t count)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			counters.queued_rays += count;
+		}
+
+		stats get_stats()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stats result = counters;
+			result.budget = budget;
+			return result;
+		}
+	private:
+		struct entry
+		{
+			std::shared_ptr<const page> resident;
+			bool loading = false;
+			std::list<uint32_t>::iterator lru_position;
+		};
+
+		page_file file;
+		std::vector<page_record> records;
+		appearance::table tables;
+		std::vector<entry> entries;
+		std::list<uint32_t> lru;	// most recently used first
+		size_t budget;
+		stats counters;
+		std::mutex mutex;
+		std::condition_variable loaded;
+
+		std::shared_ptr<const page> read(uint32_t id)
+		{
+			const page_record &record = records[id];
+			size_t bytes = static_cast<size_t>(page_layout(record).bytes);
+			std::unique_ptr<unsigned char[]> data(new unsigned char[bytes]);
+			// Load only checked the header and the tables, the page itself is checked once it is read
+			bool read = file.read(record.offset, data.get(), bytes);
+			return std::make_shared<const page>(std::move(data), record, read);
+		}
+	};
+
+	class PagedTriangleMesh : public Object
+	{
+		std::shared_ptr<page_cache> cache;
+		std::vector<bvh_node> top;		// leaves hold a page id in offset
+		uint32_t first_page, num_pages;
+		bool tri_materials;				// some page stores a material per triangle
+
+		struct pending_ray
+		{
+			uint32_t page;
+			uint32_t ray;
+			float tentry;
+
+			bool operator<(const pending_ray &other) const { return page != other.page ? page < other.page : ray < other.ray; }
+		};
+
+		static uint32_t hit_index(uint32_t page, uint32_t tri) { return page * kMaxPageTris + tri; }
+
+		// Visits the pages hit by the ray front to back, page_fn(page, tentry) may shorten tmax
+		template<typename Fn>
+		void walk_pages(const Vec3f &orig, const Vec3f &dir, float &tmax, Fn &&page_fn) const
+		{
+			ray_cost_tally tally;
+			Vec3f inv_dir = safe_inverse(dir);
+			// Both children are pushed, so the stack grows by one per interior level
+			std::pair<uint32_t, float> stack[bvh::kMaxDepth + 1];
+			uint32_t stack_size = 0;
+			float tentry;
+			if (top.empty() || !intersect_bbox(top[0].bmin, top[0].bmax, orig, inv_dir, tmax, tentry))
+				return;
+
+			stack[stack_size++] = { 0, tentry };
+			while (stack_size > 0)
+			{
+				auto entry = stack[--stack_size];
+				if (entry.second > tmax)
+					continue;
+
+				const bvh_node &node = top[entry.first];
+				++tally.nodes;
+				if (node.count > 0)
+				{
+					page_fn(node.offset, entry.second);
+					continue;
+				}
+
+				uint32_t near_child = entry.first + 1, far_child = node.offset;
+				float tnear_child, tfar_child;
+				bool hit_near = intersect_bbox(top[near_child].bmin, top[near_child].bmax, orig, inv_dir, tmax, tnear_child);
+				bool hit_far = intersect_bbox(top[far_child].bmin, top[far_child].bmax, orig, inv_dir, tmax, tfar_child);
+				if (hit_near && hit_far && tfar_child < tnear_child)
+					std::swap(near_child, far_child), std::swap(tnear_child, tfar_child);
+				assert(stack_size + 2 <= bvh::kMaxDepth + 1);
+				if (hit_far)
+					stack[stack_size++] = { far_child, tfar_child };
+				if (hit_near)
+					stack[stack_size++] = { near_child, tnear_child };
+			}
+		}
+	public:
+		PagedTriangleMesh(std::shared_ptr<page_cache> pages, std::vector<bvh_node> top_nodes, uint32_t mesh_first_page, uint32_t mesh_num_pages, bool has_tri_materials, const Vec3f &mesh_color) :
+			Object(mesh_color),
+			cache(std::move(pages)),
+			top(std::move(top_nodes)),
+			first_page(mesh_first_page),
+			num_pages(mesh_num_pages),
+			tri_materials(has_tri_materials)
+		{}
+
+		// Which pages a batch visits first depends on what is resident, so a hit as near as the current one wins by its
+		// lower index. Whatever the order, every ray ends up with the same hit.
+		void intersect_page(const page &p, uint32_t id, const Vec3f &orig, const Vec3f &dir, ray_hit &hit) const
+		{
+			float t = std::nextafter(hit.t, kInfinity);
+			uint32_t tri;
+			Vec2f uv;
+			if (!p.intersect(orig, dir, t, tri, uv))
+				return;
+			uint32_t index = hit_index(id, tri);
+			if (t < hit.t || (hit.object == this && index < hit.index))
+				hit.t = t, hit.index = index, hit.uv = uv, hit.object = this;
+		}
+
+		bool intersect(const Vec3f &orig, const Vec3f &dir, float &tNear, uint32_t &triIndex, Vec2f &uv) const
+		{
+			ray_hit hit;
+			hit.t = tNear;
+			walk_pages(orig, dir, hit.t, [&](uint32_t id, float) { intersect_page(*cache->acquire(id), id, orig, dir, hit); });
+			if (hit.object != this)
+				return false;
+			tNear = hit.t, triIndex = hit.index, uv = hit.uv;
+			return true;
+		}
+
+		void intersect_batch(const Vec3f *origins, const Vec3f *dirs, uint32_t count, ray_hit *hits) const
+		{
+			// Both keep their capacity between calls
+			static thread_local std::vector<std::pair<uint32_t, std::shared_ptr<const page>>> resident;
+			static thread_local std::vector<pending_ray> pending;
+			cache->resident_pages(first_page, num_pages, resident);
+			pending.clear();
+
+			// Take every ray as far as the resident pages go, queue it on the pages that are missing
+			arena_scope scope(thread_scratch());
+			bool *used = thread_scratch().allocate_array<bool>(resident.size());
+			std::fill(used, used + resident.size(), false);
+			for (uint32_t r = 0; r < count; ++r)
+			{
+				ray_hit &hit = hits[r];
+				walk_pages(origins[r], dirs[r], hit.t, [&](uint32_t id, float tentry) {
+					auto found = std::lower_bound(resident.begin(), resident.end(), id,
+						[](const std::pair<uint32_t, std::shared_ptr<const page>> &p, uint32_t key) { return p.first < key; });
+					if (found == resident.end() || found->first != id) {
+						pending.push_back({ id, r, tentry });
+						return;
+					}
+					used[found - resident.begin()] = true;
+					intersect_page(*found->second, id, origins[r], dirs[r], hit);
+				});
+			}
+			for (size_t p = 0; p < resident.size(); ++p)
+				if (used[p])
+					cache->touch(resident[p].first);
+			resident.clear();
+			if (pending.empty())
+				return;
+
+			// Then read each missing page once for all rays waiting on it. Rays that found a nearer hit meanwhile are skipped.
+			cache->add_queued_rays(pending.size());
+			std::sort(pending.begin(), pending.end());
+			for (size_t begin = 0, end; begin < pending.size(); begin = end)
+			{
+				end = begin;
+				while (end < pending.size() && pending[end].page == pending[begin].page)
+					++end;
+
+				std::shared_ptr<const page> loaded = cache->acquire(pending[begin].page);
+				for (size_t i = begin; i < end; ++i)
+				{
+					ray_hit &hit = hits[pending[i].ray];
+					if (pending[i].tentry > hit.t)
+						continue;
+					intersect_page(*loaded, pending[i].page, origins[pending[i].ray], dirs[pending[i].ray], hit);
+				}
+			}
+		}
+
+		bool prefers_batches() const { return true; }
+
+		void getSurfaceProperties(
+			const Vec3f &hitPoint,
+			const Vec3f &viewDirection,
+			const uint32_t &triIndex,
+			const Vec2f &uv,
+			Vec3f &hitNormal,
+			Vec2f &hitTextureCoordinates) const
+		{
+			cache->acquire(triIndex / kMaxPageTris)->surface(triIndex % kMaxPageTris, uv, hitNormal, hitTextureCoordinates);
+		}
+
+		float texture_density(const uint32_t &triIndex) const
+		{
+			return cache->acquire(triIndex / kMaxPageTris)->texture_density(triIndex % kMaxPageTris);
+		}
+
+		uint32_t material_of(const uint32_t &triIndex) const
+		{
+			if (!tri_materials)
+				return material_id;
+			uint16_t index = cache->acquire(triIndex / kMaxPageTris)->material(triIndex % kMaxPageTris);
+			uint32_t id;
+			return index != material::kObjectMaterial && cache->get_tables().material(index, id) ? id : material_id;
+		}
+	};
+
+	namespace detail
+	{
+		inline void write_padding(std::ofstream &ofs, uint64_t &offset)
+		{
+			static const char zeros[kAlignment] = {};
+			uint64_t aligned = (offset + kAlignment - 1) & ~(kAlignment - 1);
+			ofs.write(zeros, static_cast<std::streamsize>(aligned - offset));
+			offset = aligned;
+		}
+
+		template<typename T>
+		void write_array(std::ofstream &ofs, uint64_t &offset, const T *data, size_t count)
+		{
+			write_padding(ofs, offset);
+			ofs.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(count * sizeof(T)));
+			offset += count * sizeof(T);
+		}
+
+		// Cuts a mesh into pages along its bvh
+		struct mesh_pager
+		{
+			const TriangleMesh &mesh;
+			uint32_t page_tris;
+			const bvh_node *nodes;
+			const uint32_t *prim_indices;
+			std::vector<uint32_t> subtree_tris;
+			std::vector<std::vector<uint32_t>> pages;	// triangles of every page
+			std::vector<bvh_node> top;
+
+			mesh_pager(const TriangleMesh &m, uint32_t max_page_tris, uint32_t first_page) :
+				mesh(m),
+				page_tris(max_page_tris),
+				nodes(m.get_bvh().get_nodes().data()),
+				prim_indices(m.get_bvh().get_prim_indices().data())
+			{
+				// Children come after their parents, a reverse sweep sees both before the parent
+				size_t num_nodes = m.get_bvh().get_nodes().size();
+				subtree_tris.resize(num_nodes);
+				for (size_t i = num_nodes; i-- > 0;)
+					subtree_tris[i] = nodes[i].count > 0 ? nodes[i].count : subtree_tris[i + 1] + subtree_tris[nodes[i].offset];
+				if (num_nodes > 0)
+					cut(0, first_page);
+			}
+
+			void collect(uint32_t node, std::vector<uint32_t> &tris) const
+			{
+				if (nodes[node].count > 0)
+				{
+					tris.insert(tris.end(), prim_indices + nodes[node].offset, prim_indices + nodes[node].offset + nodes[node].count);
+					return;
+				}
+				collect(node + 1, tris);
+				collect(nodes[node].offset, tris);
+			}
+
+			// Copies the tree above the pages into top, depth first like bvh
+			void cut(uint32_t node, uint32_t first_page)
+			{
+				uint32_t index = static_cast<uint32_t>(top.size());
+				top.push_back(nodes[node]);
+				if (subtree_tris[node] <= page_tris)
+				{
+					top[index].offset = first_page + static_cast<uint32_t>(pages.size());
+					top[index].count = 1;
+					pages.emplace_back();
+					collect(node, pages.back());
+					return;
+				}
+				cut(node + 1, first_page);
+				top[index].offset = static_cast<uint32_t>(top.size());
+				cut(nodes[node].offset, first_page);
+			}
+		};
+	}
+
+	// Writes the TriangleMeshes among objects as paged meshes, anything else is skipped. Returns false without writing
+	// when a mesh uses a texture made in memory.
+	inline bool write(const std::string &path, std::vector<std::unique_ptr<Object>> &objects, uint32_t page_tris = kDefaultPageTris)
+	{
+		page_tris = std::max(1u, std::min(page_tris, kMaxPageTris));
+		std::vector<TriangleMesh*> meshes;
+		for (auto &object : objects)
+			if (auto mesh = dynamic_cast<TriangleMesh*>(object.get()))
+			{
+				mesh->update();
+				meshes.push_back(mesh);
+			}
+
+		std::vector<std::unique_ptr<detail::mesh_pager>> pagers;
+		uint32_t num_pages = 0;
+		for (TriangleMesh *mesh : meshes)
+		{
+			pagers.emplace_back(new detail::mesh_pager(*mesh, page_tris, num_pages));
+			num_pages += static_cast<uint32_t>(pagers.back()->pages.size());
+			if (num_pages > kMaxPages)
+				return false;
+		}
+
+		std::vector<mesh_record> mesh_records(meshes.size());
+		std::vector<std::vector<uint16_t>> tri_materials(meshes.size());
+		appearance::table_writer tables;
+		for (size_t m = 0; m < meshes.size(); ++m)
+		{
+			if (!tables.texture(meshes[m]->texture_id, mesh_records[m].texture))
+				return false;
+			mesh_records[m].material = tables.material(meshes[m]->material_id);
+			tri_materials[m] = tables.triangle_materials(meshes[m]->get_triangle_materials());
+		}
+
+		std::ofstream ofs(path, std::ios::out | std::ios::binary);
+		if (!ofs.is_open())
+			return false;
+
+		file_header header;
+		std::memcpy(header.magic, kMagic, sizeof(kMagic));
+		header.version = kVersion;
+		header.num_meshes = static_cast<uint32_t>(meshes.size());
+		header.num_pages = num_pages;
+		header.page_tris = page_tris;
+		header.padding = 0;
+		header.tables_offset = header.tables_bytes = 0;
+
+		// The header and both record tables are written up front with placeholder offsets and patched at the end
+		std::vector<page_record> page_records(num_pages);
+		ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		ofs.write(reinterpret_cast<const char*>(mesh_records.data()), mesh_records.size() * sizeof(mesh_record));
+		ofs.write(reinterpret_cast<const char*>(page_records.data()), page_records.size() * sizeof(page_record));
+		uint64_t offset = sizeof(header) + mesh_records.size() * sizeof(mesh_record) + page_records.size() * sizeof(page_record);
+
+		for (size_t m = 0; m < meshes.size(); ++m)
+		{
+			mesh_records[m].color = meshes[m]->color;
+			mesh_records[m].num_top_nodes = static_cast<uint32_t>(pagers[m]->top.size());
+			detail::write_padding(ofs, offset);
+			mesh_records[m].top_nodes_offset = offset;
+			detail::write_array(ofs, offset, pagers[m]->top.data(), pagers[m]->top.size());
+		}
+
+		uint32_t page_id = 0;
+		std::vector<uint32_t> local_index;
+		for (size_t m = 0; m < meshes.size(); ++m)
+		{
+			const TriangleMesh &mesh = *meshes[m];
+			local_index.assign(mesh.get_vertices().size(), ~0u);
+			for (const std::vector<uint32_t> &page_tris_list : pagers[m]->pages)
+			{
+				// Page local copies of everything the triangles use
+				std::vector<Vec3f> vertices, normals;
+				std::vector<uint32_t> tris;
+				std::vector<Vec2f> st;
+				std::vector<uint16_t> materials;
+				for (uint32_t t : page_tris_list)
+				{
+					if (!tri_materials[m].empty())
+						materials.push_back(tri_materials[m][t]);
+					for (uint32_t c = 0; c < 3; ++c)
+					{
+						uint32_t v = mesh.get_tris_index()[t * 3 + c];
+						if (local_index[v] == ~0u)
+						{
+							local_index[v] = static_cast<uint32_t>(vertices.size());
+							vertices.push_back(mesh.get_vertices()[v]);
+						}
+						tris.push_back(local_index[v]);
+						normals.push_back(mesh.get_normals()[t * 3 + c]);
+						st.push_back(mesh.get_tex_coordinates()[t * 3 + c]);
+					}
+				}
+				for (uint32_t t : page_tris_list)
+					for (uint32_t c = 0; c < 3; ++c)
+						local_index[mesh.get_tris_index()[t * 3 + c]] = ~0u;
+
+				bvh page_bvh;
+				page_bvh.build(vertices.data(), tris.data(), static_cast<uint32_t>(page_tris_list.size()));
+
+				page_record &record = page_records[page_id++];
+				record.num_tris = static_cast<uint32_t>(page_tris_list.size());
+				record.num_vertices = static_cast<uint32_t>(vertices.size());
+				record.num_nodes = static_cast<uint32_t>(page_bvh.get_nodes().size());
+				record.has_materials = !materials.empty();
+				detail::write_padding(ofs, offset);
+				record.offset = offset;
+				detail::write_array(ofs, offset, vertices.data(), vertices.size());
+				detail::write_array(ofs, offset, tris.data(), tris.size());
+				detail::write_array(ofs, offset, normals.data(), normals.size());
+				detail::write_array(ofs, offset, st.data(), st.size());
+				detail::write_array(ofs, offset, page_bvh.get_nodes().data(), page_bvh.get_nodes().size());
+				detail::write_array(ofs, offset, page_bvh.get_prim_indices().data(), page_bvh.get_prim_indices().size());
+				detail::write_array(ofs, offset, materials.data(), materials.size());
+			}
+		}
+
+		std::vector<char> table_data = tables.serialize();
+		detail::write_padding(ofs, offset);
+		header.tables_offset = offset;
+		header.tables_bytes = table_data.size();
+		detail::write_array(ofs, offset, table_data.data(), table_data.size());
+
+		ofs.seekp(0);
+		ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		ofs.write(reinterpret_cast<const char*>(mesh_records.data()), mesh_records.size() * sizeof(mesh_record));
+		ofs.write(reinterpret_cast<const char*>(page_records.data()), page_records.size() * sizeof(page_record));
+		return static_cast<bool>(ofs);
+	}
+
+	// Appends the paged meshes of the file to objects, they share one page_cache of budget_bytes which is returned.
+	// Returns nullptr for missing, truncated or incompatible files and when a texture cannot be read, in which case
+	// objects is left untouched.
+	inline std::shared_ptr<page_cache> load(const std::string &path, size_t budget_bytes, std::vector<std::unique_ptr<Object>> &objects)
+	{
+		std::ifstream ifs(path, std::ios::in | std::ios::binary | std::ios::ate);
+		if (!ifs.is_open())
+			return nullptr;
+		uint64_t file_size = static_cast<uint64_t>(ifs.tellg());
+		ifs.seekg(0);
+
+		file_header header;
+		if (!ifs.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+			header.version != kVersion || header.num_pages > kMaxPages || header.page_tris > kMaxPageTris ||
+			header.num_meshes > file_size / sizeof(mesh_record) || header.tables_offset > file_size || header.tables_bytes > file_size - header.tables_offset)
+			return nullptr;
+
+		std::vector<mesh_record> mesh_records(header.num_meshes);
+		std::vector<page_record> page_records(header.num_pages);
+		if (!ifs.read(reinterpret_cast<char*>(mesh_records.data()), mesh_records.size() * sizeof(mesh_record)) ||
+			!ifs.read(reinterpret_cast<char*>(page_records.data()), page_records.size() * sizeof(page_record)))
+			return nullptr;
+		for (const page_record &record : page_records)
+			if (record.num_tris > header.page_tris || record.offset > file_size || page_layout(record).bytes > file_size - record.offset)
+				return nullptr;
+
+		std::vector<char> table_data(static_cast<size_t>(header.tables_bytes));
+		appearance::table tables;
+		ifs.seekg(static_cast<std::streamoff>(header.tables_offset));
+		if (!ifs.read(table_data.data(), table_data.size()) || !tables.read(table_data.data(), table_data.size()))
+			return nullptr;
+
+		auto cache = std::make_shared<page_cache>(path, page_records, tables, budget_bytes);
+		if (!cache->is_open())
+			return nullptr;
+
+		std::vector<std::unique_ptr<Object>> loaded;
+		for (const mesh_record &record : mesh_records)
+		{
+			if (record.top_nodes_offset > file_size || record.num_top_nodes > (file_size - record.top_nodes_offset) / sizeof(bvh_node))
+				return nullptr;
+			std::vector<bvh_node> top(record.num_top_nodes);
+			ifs.seekg(static_cast<std::streamoff>(record.top_nodes_offset));
+			if (!ifs.read(reinterpret_cast<char*>(top.data()), top.size() * sizeof(bvh_node)))
+				return nullptr;
+
+			// A mesh's pages are consecutive, and every node has to point inside the tree or the file
+			if (!bvh::well_formed_tree(top.data(), static_cast<uint32_t>(top.size())))
+				return nullptr;
+			uint32_t first_page = ~0u, last_page = 0;
+			for (uint32_t n = 0; n < top.size(); ++n)
+			{
+				const bvh_node &node = top[n];
+				if (node.count > 0 && node.offset >= header.num_pages)
+					return nullptr;
+				if (node.count > 0)
+					first_page = std::min(first_page, node.offset), last_page = std::max(last_page, node.offset);
+			}
+			uint32_t num_pages = top.empty() ? 0 : last_page - first_page + 1;
+			bool tri_materials = false;
+			for (uint32_t p = 0; p < num_pages; ++p)
+				tri_materials |= page_records[first_page + p].has_materials != 0;
+
+			uint32_t texture_id, material_id;
+			if (!tables.texture(record.texture, texture_id) || !tables.material(record.material, material_id))
+				return nullptr;
+			loaded.push_back(std::unique_ptr<Object>(new PagedTriangleMesh(cache, std::move(top), top.empty() ? 0 : first_page, num_pages, tri_materials, record.color)));
+			loaded.back()->texture_id = texture_id;
+			loaded.back()->material_id = material_id;
+		}
+
+		for (auto &object : loaded)
+			objects.push_back(std::move(object));
+		return cache;
+	}
+}
@@ -1,9 +1,25 @@
 #pragma once
 #include<memory>
 #include <algorithm>
+#include <atomic>
 #include <vector>
 #include <cassert>
 #include "geometry.h"
+#include "bvh.h"
+#include "lbvh.h"
+#include "mesh_buffer.h"
+#include "thread_pool.h"
+
+class Object;
+
+// Nearest hit of a ray, filled in by Object::intersect_batch
+struct ray_hit
+{
+	float t = kInfinity;
+	uint32_t index = 0;
+	Vec2f uv;
+	const Object *object = nullptr;
+};
 
 class Object
 {
@@ -12,15 +28,43 @@ public:
 	virtual ~Object() {}
 	virtual bool intersect(const Vec3f &, const Vec3f &, float &, uint32_t &, Vec2f &) const = 0;
 	virtual void getSurfaceProperties(const Vec3f &, const Vec3f &, const uint32_t &, const Vec2f &, Vec3f &, Vec2f &) const = 0;
+	// Brings acceleration data up to date after the object moved, call it between frames and never while tracing.
+	// Returns true if the object moved since the last update.
+	virtual bool update() { return false; }
+	// Intersects count rays at once, replacing the hits that are farther than what this object hits.
+	// Objects whose data is expensive to reach override it to share that cost between the rays.
+	virtual void intersect_batch(const Vec3f *origins, const Vec3f *dirs, uint32_t count, ray_hit *hits) const
+	{
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			float t = kInfinity;
+			uint32_t index;
+			Vec2f uv;
+			if (intersect(origins[i], dirs[i], t, index, uv) && t < hits[i].t)
+				hits[i].t = t, hits[i].index = index, hits[i].uv = uv, hits[i].object = this;
+		}
+	}
+	// True for objects that trace much faster through intersect_batch
+	virtual bool prefers_batches() const { return false; }
+	// Texture units per unit of world distance on a triangle, how much of the texture a ray footprint covers there.
+	// 0 for objects without texture coordinates.
+	virtual float texture_density(const uint32_t &) const { return 0.0f; }
+	// Material of a triangle in the shared material::library, ~0u for plain diffuse
+	virtual uint32_t material_of(const uint32_t &) const { return material_id; }
 	Vec3f color;
+	// Texture of the shared texture::cache that modulates color, ~0u for none
+	uint32_t texture_id = ~0u;
+	// Material of the whole object, ~0u for plain diffuse
+	uint32_t material_id = ~0u;
 };
 
 class TriangleMesh : public Object
 {
-	bool rayTriangleIntersect(
+public:
+	static bool rayTriangleIntersect(
 		const Vec3f &orig, const Vec3f &dir,
 		const Vec3f &v0, const Vec3f &v1, const Vec3f &v2,
-		float &t, float &u, float &v) const
+		float &t, float &u, float &v)
 	{
 		Vec3f v0v1 = v1 - v0;
 		Vec3f v0v2 = v2 - v0;
@@ -42,17 +86,19 @@ class TriangleMesh : public Object
 
 		t = v0v2.dotProduct(qvec) * invDet;
 
-		return true;
+		// Triangles behind the origin are no hit, a bvh leaf can hold some on either side of it
+		return t > 0;
 	}
-public:
-	// Build a triangle mesh from a face index array and a vertex index array
+
+	// Build a triangle mesh from a face index array and a vertex index array.
+	// Pass the arrays with std::move to avoid copies, when every face is a triangle they are adopted as is.
 	TriangleMesh(
 		const uint32_t nfaces,
 		const std::vector<uint32_t> &faceIndex,
-		const std::vector<uint32_t> &vertsIndex,
-		const std::vector<Vec3f> &verts,
-		std::vector<Vec3f> &normals,
-		std::vector<Vec2f> &st, 
+		std::vector<uint32_t> vertsIndex,
+		std::vector<Vec3f> verts,
+		std::vector<Vec3f> normals,
+		std::vector<Vec2f> st, 
 		const Vec3f &mesh_color):
 		numTris(0), Object(mesh_color)
 	{
@@ -74,15 +120,19 @@ public:
 		}
 		maxVertIndex += 1;
 
-		// allocate memory to store the position of the mesh vertices
-		vertices.reserve(maxVertIndex);
-		for (uint32_t i = 0; i < maxVertIndex; ++i) {
-			vertices.push_back(verts[i]);
+		// Unreferenced trailing vertices are dropped, shrinking keeps the same block
+		verts.resize(maxVertIndex);
+		vertices = std::move(verts);
+
+		// The input geometry is already triangulated, transfer ownership
+		if (k == numTris * 3) {
+			trisIndex = std::move(vertsIndex);
+			N = std::move(normals);
+			texCoordinates = std::move(st);
+			build_bvh();
+			return;
 		}
 
-		// allocate memory to store triangle indices
-		trisIndex.reserve(numTris * 3);
-		uint32_t l = 0;
 		// [comment]
 		// Generate the triangle index array
 		// Keep in mind that there is generally 1 vertex attribute for each vertex of each face.
@@ -93,48 +143,68 @@ public:
 		// multiplied by 3, and then set the value of the vertex attribute at each vertex
 		// of each triangle using the input array (normals[], st[], etc.)
 		// [/comment]
-		N.reserve(numTris * 3);
-		texCoordinates.reserve(numTris * 3);
-		for (uint32_t i = 0, k = 0; i < nfaces; ++i) { // for each  face
+		std::vector<uint32_t> tris(numTris * 3);
+		std::vector<Vec3f> tri_normals(numTris * 3);
+		std::vector<Vec2f> tri_st(numTris * 3);
+		for (uint32_t i = 0, k = 0, l = 0; i < nfaces; ++i) { // for each  face
 			for (uint32_t j = 0; j < faceIndex[i] - 2; ++j) { // for each triangle in the face
-				//trisIndex[l] = vertsIndex[k];
-				//trisIndex[l + 1] = vertsIndex[k + j + 1];
-				//trisIndex[l + 2] = vertsIndex[k + j + 2];
-				trisIndex.push_back(vertsIndex[k]);
-				trisIndex.push_back(vertsIndex[k + j + 1]);
-				trisIndex.push_back(vertsIndex[k + j + 2]);
-
-				//N[l] = normals[k];
-				//N[l + 1] = normals[k + j + 1];
-				//N[l + 2] = normals[k + j + 2];
-				N.push_back(normals[k]);
-				N.push_back(normals[k + j + 1]);
-				N.push_back(normals[k + j + 2]);
-
-				/*texCoordinates[l] = st[k];
-				texCoordinates[l + 1] = st[k + j + 1];
-				texCoordinates[l + 2] = st[k + j + 2];*/
-				
-				texCoordinates.push_back(st[k]);
-				texCoordinates.push_back(st[k + j + 1]);
-				texCoordinates.push_back(st[k + j + 2]);
+				tris[l] = vertsIndex[k];
+				tris[l + 1] = vertsIndex[k + j + 1];
+				tris[l + 2] = vertsIndex[k + j + 2];
+
+				tri_normals[l] = normals[k];
+				tri_normals[l + 1] = normals[k + j + 1];
+				tri_normals[l + 2] = normals[k + j + 2];
+
+				tri_st[l] = st[k];
+				tri_st[l + 1] = st[k + j + 1];
+				tri_st[l + 2] = st[k + j + 2];
 				l += 3;
 			}
 			k += faceIndex[i];
 		}
-		// you can use move if the input geometry is already triangulated
-		//N = std::move(normals); // transfer ownership
-		//sts = std::move(st); // transfer ownership
+		trisIndex = std::move(tris);
+		N = std::move(tri_normals);
+		texCoordinates = std::move(tri_st);
+		build_bvh();
+	}
+
+	// Build a triangle mesh from data that is already triangulated(three entries of tris/normals/st per triangle).
+	// Vectors passed with std::move are adopted, mesh_buffer views over caller owned memory(e.g. a mapped
+	// scene cache) are used in place without copying. A prebuilt bvh is adopted as is, otherwise one is built.
+	TriangleMesh(
+		mesh_buffer<Vec3f> verts,
+		mesh_buffer<uint32_t> tris,
+		mesh_buffer<Vec3f> normals,
+		mesh_buffer<Vec2f> st,
+		const Vec3f &mesh_color,
+		bvh prebuilt_bvh = bvh(),
+		const Matrix44f &mesh_translation = Matrix44f(),
+		const Matrix44f &mesh_rotation = Matrix44f()) :
+		Object(mesh_color),
+		numTris(static_cast<uint32_t>(tris.size() / 3)),
+		vertices(std::move(verts)),
+		trisIndex(std::move(tris)),
+		N(std::move(normals)),
+		texCoordinates(std::move(st)),
+		translation(mesh_translation),
+		rotation(mesh_rotation),
+		accel(std::move(prebuilt_bvh))
+	{
+		assert(trisIndex.size() == numTris * 3);
+		assert(N.size() == trisIndex.size());
+		assert(texCoordinates.size() == trisIndex.size());
+		if (accel.empty())
+			build_bvh();
 	}
 	// Test if the ray interesests this triangle mesh
 	bool intersect(const Vec3f &orig, const Vec3f &dir, float &tNear, uint32_t &triIndex, Vec2f &uv) const
 	{
-		uint32_t j = 0;
 		bool isect = false;
-		for (uint32_t i = 0; i < numTris; ++i) {
-			const Vec3f &v0 = vertices[trisIndex[j]];
-			const Vec3f &v1 = vertices[trisIndex[j + 1]];
-			const Vec3f &v2 = vertices[trisIndex[j + 2]];
+		accel.traverse(orig, dir, tNear, [&](uint32_t i) {
+			const Vec3f &v0 = vertices[trisIndex[i * 3]];
+			const Vec3f &v1 = vertices[trisIndex[i * 3 + 1]];
+			const Vec3f &v2 = vertices[trisIndex[i * 3 + 2]];
 			float t = kInfinity, u, v;
 			if (rayTriangleIntersect(orig, dir, v0, v1, v2, t, u, v) && t < tNear) {
 				tNear = t;
@@ -143,8 +213,7 @@ public:
 				triIndex = i;
 				isect = true;
 			}
-			j += 3;
-		}
+		});
 
 		return isect;
 	}
@@ -178,18 +247,49 @@ public:
 		*/
 	}
 
+	float texture_density(const uint32_t &triIndex) const
+	{
+		return density(vertices[trisIndex[triIndex * 3]], vertices[trisIndex[triIndex * 3 + 1]], vertices[trisIndex[triIndex * 3 + 2]],
+			texCoordinates[triIndex * 3], texCoordinates[triIndex * 3 + 1], texCoordinates[triIndex * 3 + 2]);
+	}
+
+	uint32_t material_of(const uint32_t &triIndex) const
+	{
+		if (triMaterials.empty() || triMaterials[triIndex] == 0xFFFF)
+			return material_id;
+		return triMaterials[triIndex];
+	}
+
+	// One material id per triangle, 0xFFFF for triangles that use the object's material_id. Empty clears them.
+	void set_triangle_materials(std::vector<uint16_t> materials)
+	{
+		assert(materials.empty() || materials.size() == numTris);
+		triMaterials = std::move(materials);
+	}
+	const std::vector<uint16_t> &get_triangle_materials() const { return triMaterials; }
+
+	// Square root of the ratio of texture area to world area of a triangle
+	static float density(const Vec3f &v0, const Vec3f &v1, const Vec3f &v2, const Vec2f &st0, const Vec2f &st1, const Vec2f &st2)
+	{
+		float world_area = (v1 - v0).crossProduct(v2 - v0).length();
+		float st_area = std::abs((st1.x - st0.x) * (st2.y - st0.y) - (st2.x - st0.x) * (st1.y - st0.y));
+		return world_area > 0.0f ? std::sqrt(st_area / world_area) : 0.0f;
+	}
+
 	// Rotate by arbitrary angle along an aritrary axis
 	void rotate(const float angle, const Vec3f &axis)
 	{
 		auto rot_mat = Matrix44f::create_rotation(angle, axis);
 		rotation = rotation * rot_mat;
 		auto inv_transl = translation.inverse();
+		Vec3f *first = vertices.mutable_data(), *last = first + vertices.size();
 
 		// Translate the mesh to origin
-		std::for_each(vertices.begin(), vertices.end(), [&inv_transl](Vec3f &vertex) { inv_transl.multVecMatrix(vertex, vertex); });
-		std::for_each(vertices.begin(), vertices.end(), [&rot_mat](Vec3f &vertex) {	rot_mat.multVecMatrix(vertex, vertex); });
+		std::for_each(first, last, [&inv_transl](Vec3f &vertex) { inv_transl.multVecMatrix(vertex, vertex); });
+		std::for_each(first, last, [&rot_mat](Vec3f &vertex) {	rot_mat.multVecMatrix(vertex, vertex); });
 		// Restore the position of the mesh
-		std::for_each(vertices.begin(), vertices.end(), [this](Vec3f &vertex) { translation.multVecMatrix(vertex, vertex); });
+		std::for_each(first, last, [this](Vec3f &vertex) { translation.multVecMatrix(vertex, vertex); });
+		bvh_dirty = true;
 	}
 
 	// Rotate along a pivot
@@ -199,14 +299,16 @@ public:
 		auto pivot_transl = Matrix44f::create_translation(pivot);
 		auto pivot_transl_inv = pivot_transl.inverse();
 		auto inv_transl = translation.inverse();
+		Vec3f *first = vertices.mutable_data(), *last = first + vertices.size();
 		// Translate the mesh to origin
-		std::for_each(vertices.begin(), vertices.end(), [&inv_transl](Vec3f &vertex) { inv_transl.multVecMatrix(vertex, vertex); });
-		std::for_each(vertices.begin(), vertices.end(), [&pivot_transl_inv](Vec3f &vertex) { pivot_transl_inv.multVecMatrix(vertex, vertex); });	
+		std::for_each(first, last, [&inv_transl](Vec3f &vertex) { inv_transl.multVecMatrix(vertex, vertex); });
+		std::for_each(first, last, [&pivot_transl_inv](Vec3f &vertex) { pivot_transl_inv.multVecMatrix(vertex, vertex); });	
 		auto rot_mat = Matrix44f::create_rotation(angle, axis);
 		//rotation = rotation * rot_mat;
-		std::for_each(vertices.begin(), vertices.end(), [&rot_mat](Vec3f &vertex) {	rot_mat.multVecMatrix(vertex, vertex); });
-		std::for_each(vertices.begin(), vertices.end(), [&pivot_transl](Vec3f &vertex) { pivot_transl.multVecMatrix(vertex, vertex); });
-		std::for_each(vertices.begin(), vertices.end(), [this](Vec3f &vertex) { translation.multVecMatrix(vertex, vertex); });
+		std::for_each(first, last, [&rot_mat](Vec3f &vertex) {	rot_mat.multVecMatrix(vertex, vertex); });
+		std::for_each(first, last, [&pivot_transl](Vec3f &vertex) { pivot_transl.multVecMatrix(vertex, vertex); });
+		std::for_each(first, last, [this](Vec3f &vertex) { translation.multVecMatrix(vertex, vertex); });
+		bvh_dirty = true;
 	}
 
 	// Translate by specified vector
@@ -214,14 +316,115 @@ public:
 	{
 		auto new_translation = Matrix44f::create_translation(transl_vector);
 		translation = translation * new_translation;
-		std::for_each(vertices.begin(), vertices.end(), [&new_translation](Vec3f &vertex) { new_translation.multVecMatrix(vertex, vertex); });
+		Vec3f *first = vertices.mutable_data(), *last = first + vertices.size();
+		std::for_each(first, last, [&new_translation](Vec3f &vertex) { new_translation.multVecMatrix(vertex, vertex); });
+		bvh_dirty = true;
 	}
+
+	// rotate and translate only mark the bvh dirty so any number of them in a frame cost one refit here.
+	// Every few refits the tree quality is compared against the last build and a rebuild is started
+	// in the background once it got too loose, the refitted tree is used until the new one is ready.
+	bool update()
+	{
+		bool moved = bvh_dirty;
+		if (pending_rebuild && pending_rebuild->done) {
+			// Built from the vertices at the time it was started, the refit below catches up with later moves
+			accel = std::move(pending_rebuild->result);
+			built_sah_cost = pending_rebuild->sah_cost;
+			pending_rebuild.reset();
+			refits_since_check = 0;
+			bvh_dirty = true;
+		}
+
+		if (!bvh_dirty)
+			return moved;
+
+		// Adopted trees, e.g. from a scene cache, get their reference cost on first use
+		if (built_sah_cost < 0.0f)
+			built_sah_cost = accel.sah_cost();
+		accel.refit(vertices.data(), trisIndex.data());
+		bvh_dirty = false;
+		if (pending_rebuild || ++refits_since_check < kQualityCheckInterval)
+			return moved;
+
+		refits_since_check = 0;
+		if (accel.sah_cost() <= built_sah_cost * kRebuildThreshold)
+			return moved;
+
+		if (numTris < kMinAsyncRebuildTris) {
+			build_bvh();
+			return moved;
+		}
+
+		auto job = std::make_shared<bvh_rebuild>();
+		job->vertices.assign(vertices.begin(), vertices.end());
+		job->tris_index.assign(trisIndex.begin(), trisIndex.end());
+		pending_rebuild = job;
+		// The job owns everything it reads, the mesh is free to move or go away meanwhile
+		thread_pool::shared().submit([job]() {
+			job->result = build_bvh(job->vertices.data(), job->tris_index.data(), static_cast<uint32_t>(job->tris_index.size() / 3));
+			job->sah_cost = job->result.sah_cost();
+			job->done = true;
+		});
+		return moved;
+	}
+
+	uint32_t get_num_tris() const { return numTris; }
+	const mesh_buffer<Vec3f> &get_vertices() const { return vertices; }
+	const mesh_buffer<uint32_t> &get_tris_index() const { return trisIndex; }
+	const mesh_buffer<Vec3f> &get_normals() const { return N; }
+	const mesh_buffer<Vec2f> &get_tex_coordinates() const { return texCoordinates; }
+	const Matrix44f &get_translation() const { return translation; }
+	const Matrix44f &get_rotation() const { return rotation; }
+	// Call update first if the mesh moved
+	const bvh &get_bvh() const { assert(!bvh_dirty); return accel; }
 private:
+	// Refits between quality checks
+	static constexpr uint32_t kQualityCheckInterval = 8;
+	// Rebuild once the refitted tree costs this much more than a fresh one did
+	static constexpr float kRebuildThreshold = 1.3f;
+	// Smaller meshes build faster than the hand off to another thread
+	static constexpr uint32_t kMinAsyncRebuildTris = 4096;
+	// Meshes this large get the parallel builder, the binned sah builder is serial but builds slightly better trees for small meshes
+	static constexpr uint32_t kMinParallelBuildTris = 1u << 16;
+
+	static bvh build_bvh(const Vec3f *verts, const uint32_t *tris, uint32_t num_tris)
+	{
+		if (num_tris >= kMinParallelBuildTris)
+			return lbvh::build(verts, tris, num_tris);
+		bvh result;
+		result.build(verts, tris, num_tris);
+		return result;
+	}
+
+	// Background bvh build over a snapshot of the mesh
+	struct bvh_rebuild
+	{
+		std::vector<Vec3f> vertices;
+		std::vector<uint32_t> tris_index;
+		bvh result;
+		float sah_cost = 0.0f;
+		std::atomic<bool> done{ false };
+	};
+
+	void build_bvh()
+	{
+		accel = build_bvh(vertices.data(), trisIndex.data(), numTris);
+		built_sah_cost = accel.sah_cost();
+		refits_since_check = 0;
+	}
+
 	// member variables
 	uint32_t numTris;                         // number of triangles
-	std::vector<Vec3f> vertices;              // triangles vertex position
-	std::vector<uint32_t> trisIndex;   // vertex index array
-	std::vector<Vec3f> N;              // triangles vertex normals
-	std::vector<Vec2f> texCoordinates; // triangles texture coordinates
+	mesh_buffer<Vec3f> vertices;              // triangles vertex position
+	mesh_buffer<uint32_t> trisIndex;   // vertex index array
+	mesh_buffer<Vec3f> N;              // triangles vertex normals
+	mesh_buffer<Vec2f> texCoordinates; // triangles texture coordinates
+	std::vector<uint16_t> triMaterials; // material per triangle, empty when they all use material_id
 	Matrix44f translation, rotation, rotation_pivot;
+	bvh accel;
+	bool bvh_dirty = false;
+	uint32_t refits_since_check = 0;
+	float built_sah_cost = -1.0f;
+	std::shared_ptr<bvh_rebuild> pending_rebuild;
 };
\ No newline at end of file
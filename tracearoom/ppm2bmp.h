@@ -5,16 +5,16 @@
 #include<cstring>
 #include<string>
 #include<vector>
-#include<iterator>
-#include<streambuf>
 #include<memory>
 
+#include"image_io.h"
+
 class ppm_to_bmp
 {
 	typedef unsigned char uchar;
 	std::string ppm_path;
-	uint32_t file_size, ppm_width, ppm_height, max_intensity;
-	uchar *image_data;
+	uint32_t file_size, ppm_width, ppm_height;
+	std::vector<uchar> image_data;
 	struct BITMAPINFOHEADER
 	{
 		uint32_t size = 40;
@@ -35,53 +35,37 @@ class ppm_to_bmp
 		info_header.width = ppm_width;
 		info_header.height = ppm_height;
 	}
+	// Rows in a bmp file are padded to a multiple of 4 bytes
+	uint32_t row_stride() const { return (ppm_width * 3 + 3) & ~3u; }
+
 	void read_data()
 	{
-		std::ifstream ifs(ppm_path, std::ios::in);
-		std::basic_string<uchar> file_contents;
-		ifs.seekg(0, std::ios::end);
-		file_contents.reserve(ifs.tellg());
-		ifs.seekg(0, std::ios::beg);
-
-		file_contents.assign((std::istream_iterator<uchar>(ifs)),
-			std::istream_iterator<uchar>());
-
-		if (!ifs.is_open())
+		std::vector<uchar> rgb;
+		if (!image_io::read_ppm(ppm_path, ppm_width, ppm_height, rgb))
 		{
 			//Send error to application
-			//   std::cout << "Unable to open ppm file. Please check the path.\n";
+			//   std::cout << "Unable to read ppm file. Please check the path.\n";
 			exit(1);
 		}
-		//char signature[2];
-		//ifs >> signature[0], ifs >> signature[1];
-		//if (signature[0] != 'P' || signature[1] != '6')
-		//{
-		//	// std::cerr<<"Incorrect header\n";
-		//	exit(1);
-		//}
-		//ifs >> ppm_width, ifs >> ppm_height, ifs >> max_intensity;
-		//ifs.close();
-		//ifs.open(ppm_path, std::ios::in | std::ios::binary);
-		//auto stream_start = std::istreambuf_iterator<char>(ifs);
-		//auto stream_end = std::istreambuf_iterator<char>();
-		//std::vector<uchar> data(stream_start, stream_end);
-		//ifs.close();
-		//file_size = ppm_width * ppm_height * 3 + 54;
-		//image_data = new uchar[file_size - 54];
-		//uchar *des_start = image_data;
-		//for (auto src_start = data.end() - ppm_width * 3; src_start > data.begin() + 15; src_start -= ppm_width * 3)
-		//{
-		//	auto src_end = src_start + ppm_width * 3;
-		//	std::copy(src_start, src_end, des_start);
-		//	des_start += ppm_width * 3;
-		//}
+
+		// ppm is top-down rgb, bmp is bottom-up bgr
+		uint32_t stride = row_stride();
+		file_size = stride * ppm_height + 54;
+		image_data.assign(static_cast<size_t>(stride) * ppm_height, 0);
+		for (uint32_t row = 0; row < ppm_height; ++row)
+		{
+			const uchar *src = &rgb[static_cast<size_t>(row) * ppm_width * 3];
+			uchar *dst = &image_data[static_cast<size_t>(ppm_height - 1 - row) * stride];
+			for (uint32_t i = 0; i < ppm_width; ++i)
+			{
+				dst[i * 3 + 0] = src[i * 3 + 2];
+				dst[i * 3 + 1] = src[i * 3 + 1];
+				dst[i * 3 + 2] = src[i * 3 + 0];
+			}
+		}
 	}
 public:
-	 ppm_to_bmp(std::string p_path) : ppm_path(p_path), file_size(0) { read_data(); }
-	~ppm_to_bmp() 
-	{ 
-		//delete[] image_data; 
-	}
+	ppm_to_bmp(std::string p_path) : ppm_path(p_path), file_size(0), ppm_width(0), ppm_height(0) { read_data(); }
 
 	void convert_to_bmp(std::string bmp_path)
 	{
@@ -95,7 +79,7 @@ public:
 
 		ofs.write((char*)fH, 14);
 		ofs.write((char*)ih_array, 40);
-		ofs.write((char*)image_data, ppm_width * ppm_height * 3);
+		ofs.write((char*)image_data.data(), image_data.size());
 		ofs.close();
 	}
 
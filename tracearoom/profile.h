@@ -0,0 +1,262 @@
+#pragma once
+
+#include<atomic>
+#include<chrono>
+#include<cstdint>
+#include<fstream>
+#include<memory>
+#include<mutex>
+#include<string>
+#include<vector>
+
+#include"thread_pool.h"
+
+// Compile time switchable instrumentation of the renderer's hot paths, define TRACEAROOM_PROFILE=1 to build it in.
+// Without it the macros at the bottom expand to nothing, so a normal build pays nothing for them.
+//
+// Every thread counts into a record of its own, counters are only ever written by their thread so they need no
+// locked read-modify-write. There are two kinds of timers: TRACEAROOM_PROFILE_SCOPE records a trace event and is
+// meant for coarse stages(a frame, a chunk of rows), TRACEAROOM_PROFILE_TIME only adds the elapsed time to a counter
+// and is cheap enough for code that runs once per ray. Results are written as JSON totals or as a Chrome trace
+// (load it in chrome://tracing or ui.perfetto.dev).
+#ifndef TRACEAROOM_PROFILE
+#define TRACEAROOM_PROFILE 0
+#endif
+
+namespace profile
+{
+	enum class counter : uint32_t
+	{
+		rays_cast,
+		triangle_tests,
+		bvh_nodes_visited,
+		lights_evaluated,
+		shade_time_ns,
+		count
+	};
+
+	constexpr uint32_t kNumCounters = static_cast<uint32_t>(counter::count);
+
+	inline const char *counter_name(uint32_t c)
+	{
+		static const char *names[kNumCounters] = { "rays_cast", "triangle_tests", "bvh_nodes_visited", "lights_evaluated", "shade_time_ns" };
+		return names[c];
+	}
+
+	constexpr bool enabled() { return TRACEAROOM_PROFILE != 0; }
+
+	namespace detail
+	{
+		struct event
+		{
+			const char *name;
+			int64_t start_us;
+			int64_t duration_us;
+		};
+
+		struct thread_record
+		{
+			uint32_t id;
+			uint32_t pool_index;	// thread_pool::thread_index() of the thread
+			std::atomic<uint64_t> counters[kNumCounters];
+			std::mutex events_mutex;
+			std::vector<event> events;
+		};
+
+		// Records are never freed, a thread's record stays readable after the thread ends
+		struct registry
+		{
+			std::mutex mutex;
+			std::vector<std::unique_ptr<thread_record>> threads;
+			std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+		};
+
+		inline registry &get_registry()
+		{
+			static registry instance;
+			return instance;
+		}
+
+		inline thread_record &local()
+		{
+			static thread_local thread_record *record = nullptr;
+			if (!record)
+			{
+				registry &r = get_registry();
+				std::lock_guard<std::mutex> lock(r.mutex);
+				r.threads.emplace_back(new thread_record);
+				record = r.threads.back().get();
+				record->id = static_cast<uint32_t>(r.threads.size() - 1);
+				record->pool_index = thread_pool::thread_index();
+				for (auto &c : record->counters)
+					c.store(0, std::memory_order_relaxed);
+			}
+			return *record;
+		}
+
+		inline int64_t now_us()
+		{
+			return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - get_registry().epoch).count();
+		}
+
+		inline void write_counters(std::ostream &os, const uint64_t *values)
+		{
+			os << "{";
+			for (uint32_t c = 0; c < kNumCounters; ++c)
+				os << (c ? ", " : " ") << "\"" << counter_name(c) << "\": " << values[c];
+			os << " }";
+		}
+	}
+
+	inline void add(counter c, uint64_t n = 1)
+	{
+		std::atomic<uint64_t> &value = detail::local().counters[static_cast<uint32_t>(c)];
+		value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	// Records a trace event named name(a string literal) spanning its lifetime
+	class scoped_event
+	{
+		const char *name;
+		int64_t start;
+	public:
+		explicit scoped_event(const char *event_name) : name(event_name), start(detail::now_us()) {}
+		~scoped_event()
+		{
+			detail::thread_record &record = detail::local();
+			std::lock_guard<std::mutex> lock(record.events_mutex);
+			record.events.push_back({ name, start, detail::now_us() - start });
+		}
+
+		scoped_event(const scoped_event &) = delete;
+		scoped_event &operator=(const scoped_event &) = delete;
+	};
+
+	// Adds its lifetime in nanoseconds to a counter
+	class scoped_time
+	{
+		counter target;
+		std::chrono::steady_clock::time_point start;
+	public:
+		explicit scoped_time(counter c) : target(c), start(std::chrono::steady_clock::now()) {}
+		~scoped_time() { add(target, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()); }
+
+		scoped_time(const scoped_time &) = delete;
+		scoped_time &operator=(const scoped_time &) = delete;
+	};
+
+	// The writers and reset expect the threads to be idle, e.g. between frames
+
+	inline void reset()
+	{
+		detail::registry &r = detail::get_registry();
+		std::lock_guard<std::mutex> lock(r.mutex);
+		for (auto &record : r.threads)
+		{
+			for (auto &c : record->counters)
+				c.store(0, std::memory_order_relaxed);
+			std::lock_guard<std::mutex> events_lock(record->events_mutex);
+			record->events.clear();
+		}
+	}
+
+	// Counter totals, per thread counters and the call count and total time of every named stage
+	inline bool write_json(const std::string &path)
+	{
+		std::ofstream ofs(path);
+		if (!ofs.is_open())
+			return false;
+
+		detail::registry &r = detail::get_registry();
+		std::lock_guard<std::mutex> lock(r.mutex);
+
+		uint64_t totals[kNumCounters] = {};
+		std::vector<std::pair<const char*, std::pair<uint64_t, int64_t>>> stages;
+		for (auto &record : r.threads)
+		{
+			for (uint32_t c = 0; c < kNumCounters; ++c)
+				totals[c] += record->counters[c].load(std::memory_order_relaxed);
+
+			std::lock_guard<std::mutex> events_lock(record->events_mutex);
+			for (const detail::event &e : record->events)
+			{
+				// Names are literals, equal strings are compared by content since literals need not be merged
+				auto stage = stages.begin();
+				while (stage != stages.end() && std::string(stage->first) != e.name)
+					++stage;
+				if (stage == stages.end())
+					stage = stages.insert(stages.end(), { e.name, { 0, 0 } });
+				stage->second.first += 1;
+				stage->second.second += e.duration_us;
+			}
+		}
+
+		ofs << "{\n\t\"enabled\": " << (enabled() ? "true" : "false") << ",\n\t\"counters\": ";
+		detail::write_counters(ofs, totals);
+		ofs << ",\n\t\"stages\": {";
+		for (size_t s = 0; s < stages.size(); ++s)
+			ofs << (s ? "," : "") << "\n\t\t\"" << stages[s].first << "\": { \"calls\": " << stages[s].second.first <<
+				", \"total_ms\": " << stages[s].second.second / 1000.0 << " }";
+		ofs << (stages.empty() ? "" : "\n\t") << "},\n\t\"threads\": [";
+		for (size_t t = 0; t < r.threads.size(); ++t)
+		{
+			uint64_t values[kNumCounters];
+			for (uint32_t c = 0; c < kNumCounters; ++c)
+				values[c] = r.threads[t]->counters[c].load(std::memory_order_relaxed);
+			ofs << (t ? "," : "") << "\n\t\t{ \"id\": " << r.threads[t]->id << ", \"pool_index\": " << r.threads[t]->pool_index << ", \"counters\": ";
+			detail::write_counters(ofs, values);
+			ofs << " }";
+		}
+		ofs << (r.threads.empty() ? "" : "\n\t") << "]\n}\n";
+		return static_cast<bool>(ofs);
+	}
+
+	// Chrome trace event format: one complete event per scope, plus a counter event with each thread's totals
+	inline bool write_chrome_trace(const std::string &path)
+	{
+		std::ofstream ofs(path);
+		if (!ofs.is_open())
+			return false;
+
+		detail::registry &r = detail::get_registry();
+		std::lock_guard<std::mutex> lock(r.mutex);
+		int64_t end_us = detail::now_us();
+
+		ofs << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+		bool first = true;
+		auto separator = [&]() -> const char* { const char *s = first ? "\n" : ",\n"; first = false; return s; };
+		for (auto &record : r.threads)
+		{
+			ofs << separator() << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << record->id <<
+				", \"args\": {\"name\": \"" << (record->pool_index ? "worker " : "thread ") << (record->pool_index ? record->pool_index : record->id) << "\"}}";
+
+			std::lock_guard<std::mutex> events_lock(record->events_mutex);
+			for (const detail::event &e : record->events)
+				ofs << separator() << "{\"name\": \"" << e.name << "\", \"cat\": \"tracearoom\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << record->id <<
+					", \"ts\": " << e.start_us << ", \"dur\": " << e.duration_us << "}";
+
+			ofs << separator() << "{\"name\": \"counters\", \"ph\": \"C\", \"pid\": 1, \"tid\": " << record->id << ", \"ts\": " << end_us << ", \"args\": {";
+			for (uint32_t c = 0; c < kNumCounters; ++c)
+				ofs << (c ? ", " : "") << "\"" << counter_name(c) << "\": " << record->counters[c].load(std::memory_order_relaxed);
+			ofs << "}}";
+		}
+		ofs << "\n]}\n";
+		return static_cast<bool>(ofs);
+	}
+}
+
+#define TRACEAROOM_PROFILE_CONCAT_(a, b) a##b
+#define TRACEAROOM_PROFILE_CONCAT(a, b) TRACEAROOM_PROFILE_CONCAT_(a, b)
+
+#if TRACEAROOM_PROFILE
+// TRACEAROOM_COUNT(rays_cast, 1) adds to a counter of the calling thread
+#define TRACEAROOM_COUNT(name, n) ::profile::add(::profile::counter::name, (n))
+// Trace event covering the rest of the enclosing scope, name is a string literal
+#define TRACEAROOM_PROFILE_SCOPE(name) ::profile::scoped_event TRACEAROOM_PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+// Adds the time spent in the rest of the enclosing scope to a counter
+#define TRACEAROOM_PROFILE_TIME(name) ::profile::scoped_time TRACEAROOM_PROFILE_CONCAT(profile_time_, __LINE__)(::profile::counter::name)
+#else
+#define TRACEAROOM_COUNT(name, n) ((void)0)
+#define TRACEAROOM_PROFILE_SCOPE(name) ((void)0)
+#define TRACEAROOM_PROFILE_TIME(name) ((void)0)
+#endif
@@ -0,0 +1,66 @@
+#pragma once
+
+#include<cstdint>
+
+#include"profile.h"
+
+// Work done to trace a ray, recorded per pixel by the heatmap render mode(see heatmap.h).
+// Recording is switched on at runtime: while a ray_cost_scope is alive the calling thread adds its traversal
+// work to it. Traversal code counts in a ray_cost_tally, which costs a couple of register increments and
+// hands its totals over once at the end, so rays that nobody records stay as cheap as before.
+struct ray_cost
+{
+	uint32_t nodes = 0;			// bvh nodes or grid cells visited
+	uint32_t triangles = 0;		// ray/triangle tests
+	uint32_t lights = 0;		// light evaluations
+
+	uint32_t total() const { return nodes + triangles + lights; }
+};
+
+namespace ray_cost_recording
+{
+	// Record of the calling thread, nullptr while nothing is recorded
+	inline ray_cost *&active()
+	{
+		static thread_local ray_cost *cost = nullptr;
+		return cost;
+	}
+
+	inline void add_lights(uint32_t count)
+	{
+		TRACEAROOM_COUNT(lights_evaluated, count);
+		if (ray_cost *cost = active())
+			cost->lights += count;
+	}
+}
+
+// Records the work of the calling thread into cost for the lifetime of the scope
+class ray_cost_scope
+{
+	ray_cost *previous;
+public:
+	explicit ray_cost_scope(ray_cost &cost) : previous(ray_cost_recording::active()) { ray_cost_recording::active() = &cost; }
+	~ray_cost_scope() { ray_cost_recording::active() = previous; }
+
+	ray_cost_scope(const ray_cost_scope &) = delete;
+	ray_cost_scope &operator=(const ray_cost_scope &) = delete;
+};
+
+// Counts the work of one traversal, adds it to the active record and the profile counters when it goes out of scope
+struct ray_cost_tally
+{
+	uint32_t nodes = 0;
+	uint32_t triangles = 0;
+
+	ray_cost_tally() {}
+	~ray_cost_tally()
+	{
+		TRACEAROOM_COUNT(bvh_nodes_visited, nodes);
+		TRACEAROOM_COUNT(triangle_tests, triangles);
+		if (ray_cost *cost = ray_cost_recording::active())
+			cost->nodes += nodes, cost->triangles += triangles;
+	}
+
+	ray_cost_tally(const ray_cost_tally &) = delete;
+	ray_cost_tally &operator=(const ray_cost_tally &) = delete;
+};
@@ -2,19 +2,62 @@
 
 #include<algorithm>
 
+#include"arena.h"
+#include"lod.h"
+#include"material.h"
 #include"raytracer.h"
+#include"texture.h"
 
 raytracer::raytracer(std::vector<std::unique_ptr<Object>> &objects, std::vector<std::unique_ptr<PointLight>> &lights, const Vec3f &bkg_color) 
 	: targets(std::move(objects)), 
 	  point_lights(std::move(lights)),
 	  background(bkg_color)
 {
+	update_targets();
 }
 
 void raytracer::set_targets(std::vector<std::unique_ptr<Object>> &objects)
 {
 	if (objects.size() > 0)
 		targets = std::move(objects);
+	update_targets();
+	if (accel == accelerator::uniform_grid)
+		grid.build(targets);
+	else if (accel == accelerator::cells)
+		rooms.build(targets, building);
+}
+
+void raytracer::update_targets()
+{
+	bool moved = false;
+	batched = false;
+	for (auto &target : targets)
+	{
+		moved |= target->update();
+		batched |= target->prefers_batches();
+	}
+	// Materials are shaded in batches
+	batched |= material::library::shared().size() > 0;
+	if (moved && accel == accelerator::uniform_grid)
+		grid.build(targets);
+	else if (moved && accel == accelerator::cells)
+		rooms.build(targets, building);
+}
+
+void raytracer::set_accelerator(accelerator type)
+{
+	accel = type;
+	if (accel == accelerator::uniform_grid)
+		grid.build(targets);
+	else if (accel == accelerator::cells)
+		rooms.build(targets, building);
+}
+
+void raytracer::set_cells(const cells::layout &layout)
+{
+	building = layout;
+	if (accel == accelerator::cells)
+		rooms.build(targets, building);
 }
 
 void raytracer::set_background_color(const Vec3f &bkg_color)
@@ -22,20 +65,51 @@ void raytracer::set_background_color(const Vec3f &bkg_color)
 	background = bkg_color;
 }
 
-Vec3f raytracer::shoot(const Vec3f &orig, const Vec3f &dir)
+void raytracer::set_irradiance_cache(float cell_size)
+{
+	irradiance.reset(cell_size > 0.0f ? new irradiance_cache(cell_size) : nullptr);
+}
+
+void raytracer::clear_irradiance_cache()
+{
+	if (irradiance)
+		irradiance->clear();
+}
+
+Vec3f raytracer::direct_irradiance(const Vec3f &point, const Vec3f &normal) const
+{
+	Vec3f irradiance = 0;
+	ray_cost_recording::add_lights(static_cast<uint32_t>(point_lights.size()));
+	for (auto &point_light : point_lights)
+	{
+		float distance = 0.0f;
+		Vec3f light_dir, light_intensity;
+		point_light->illuminate(point, light_dir, light_intensity, distance);
+		irradiance = irradiance + light_intensity * std::max(0.f, normal.dotProduct(-light_dir));
+	}
+	return irradiance;
+}
+
+Vec3f raytracer::shoot(const Vec3f &orig, const Vec3f &dir) const
 {
 	ray ray(orig, dir);
 	return shoot(ray);
 }
 
-Vec3f raytracer::shoot(const ray &ray)
+Vec3f raytracer::shoot(const ray &ray) const
+{
+	float hit_distance;
+	return shoot(ray, hit_distance);
+}
+
+const Object *raytracer::find_nearest(const ray &ray, float &tnear, uint32_t &index, Vec2f &uv) const
 {
-	Vec3f hitColor = background;
-	float tnear = kInfinity;
-	Vec2f uv;
-	uint32_t index = 0;
-	Object *hitObject = nullptr;
+	if (accel == accelerator::uniform_grid)
+		return grid.intersect(ray.origin, ray.dir, tnear, index, uv);
+	if (accel == accelerator::cells)
+		return rooms.intersect(ray.origin, ray.dir, tnear, index, uv);
 
+	const Object *hitObject = nullptr;
 	// Find the nearest traiangle that is hit
 	for (uint32_t k = 0; k < targets.size(); ++k)
 	{
@@ -49,22 +123,218 @@ Vec3f raytracer::shoot(const ray &ray)
 			uv = uvTriangle;
 		}
 	}
+	return hitObject;
+}
+
+Vec3f raytracer::shoot(const ray &ray, float &hit_distance) const
+{
+	bool view_dependent;
+	return shoot(ray, hit_distance, view_dependent);
+}
+
+Vec3f raytracer::shoot(const ray &ray, float &hit_distance, bool &view_dependent) const
+{
+	TRACEAROOM_COUNT(rays_cast, 1);
+	ray_hit hit;
+	hit.object = find_nearest(ray, hit.t, hit.index, hit.uv);
+	hit_distance = hit.t;
+	view_dependent = false;
+	if (hit.object)
+	{
+		uint32_t id = hit.object->material_of(hit.index);
+		material::model type = id == material::kNone ? material::model::diffuse : material::library::shared().get(id).type;
+		view_dependent = type == material::model::glossy || type == material::model::mirror || type == material::model::dielectric;
+	}
+	Vec3f color;
+	shade_batch(&ray.origin, &ray.dir, &hit, 1, &color, 0);
+	return color;
+}
+
+void raytracer::shoot_batch(const Vec3f *origins, const Vec3f *dirs, uint32_t count, Vec3f *colors) const
+{
+	trace_batch(origins, dirs, count, colors, 0);
+}
 
-	if (hitObject != nullptr) {
-		Vec3f hitPoint = ray.origin + ray.dir * tnear;
-		Vec3f hitNormal;
+void raytracer::trace_batch(const Vec3f *origins, const Vec3f *dirs, uint32_t count, Vec3f *colors, uint32_t depth) const
+{
+	arena_scope scope(thread_scratch());
+	ray_hit *hits = thread_scratch().allocate_array<ray_hit>(count);
+	std::fill(hits, hits + count, ray_hit());
+	// The grid and the rooms mix every object in each cell, they have nothing to share
+	if (accel != accelerator::object_bvh)
+		for (uint32_t i = 0; i < count; ++i)
+			hits[i].object = find_nearest(ray(origins[i], dirs[i]), hits[i].t, hits[i].index, hits[i].uv);
+	else
+		for (auto &target : targets)
+			target->intersect_batch(origins, dirs, count, hits);
+
+	TRACEAROOM_COUNT(rays_cast, count);
+	shade_batch(origins, dirs, hits, count, colors, depth);
+}
+
+void raytracer::shade_batch(const Vec3f *origins, const Vec3f *dirs, const ray_hit *hits, uint32_t count, Vec3f *colors, uint32_t depth) const
+{
+	TRACEAROOM_PROFILE_TIME(shade_time_ns);
+	arena_scope scope(thread_scratch());
+	surface_hit *surfaces = thread_scratch().allocate_array<surface_hit>(count);
+	uint32_t num_surfaces = 0;
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		const Object *hitObject = hits[i].object;
+		if (hitObject == nullptr)
+		{
+			colors[i] = background;
+			continue;
+		}
+		surface_hit &hit = surfaces[num_surfaces++];
+		hit.point = origins[i] + dirs[i] * hits[i].t;
+		hit.dir = dirs[i];
 		Vec2f hitTexCoordinates;
-		hitObject->getSurfaceProperties(hitPoint, ray.dir, index, uv, hitNormal, hitTexCoordinates);
-		hitColor = { 0 };
-		for (auto &point_light : point_lights)
+		hitObject->getSurfaceProperties(hit.point, hit.dir, hits[i].index, hits[i].uv, hit.normal, hitTexCoordinates);
+		hit.albedo = hitObject->color;
+		if (hitObject->texture_id != texture::kNone)
+		{
+			// The ray's width where it hits, stretched along the surface when it arrives at a grazing angle
+			float cosine = std::max(std::abs(hit.normal.dotProduct(hit.dir)), 0.05f);
+			float footprint = ray_footprint::spread() * hits[i].t / std::sqrt(cosine) * hitObject->texture_density(hits[i].index);
+			hit.albedo = hit.albedo * texture::cache::shared().sample(hitObject->texture_id, hitTexCoordinates, footprint);
+		}
+		hit.material = hitObject->material_of(hits[i].index);
+		hit.ray = i;
+	}
+
+	// Runs of hits with the same material, plain diffuse ones last
+	std::sort(surfaces, surfaces + num_surfaces, [](const surface_hit &a, const surface_hit &b) { return a.material < b.material; });
+	bounce *bounces = thread_scratch().allocate_array<bounce>(num_surfaces * 2);
+	uint32_t num_bounces = 0;
+	for (uint32_t first = 0, last = 0; first < num_surfaces; first = last)
+	{
+		while (last < num_surfaces && surfaces[last].material == surfaces[first].material)
+			++last;
+		const surface_hit *run = surfaces + first;
+		uint32_t run_count = last - first;
+		if (run->material == material::kNone)
+		{
+			shade_diffuse(run, run_count, colors);
+			continue;
+		}
+
+		const material::description &m = material::library::shared().get(run->material);
+		switch (m.type)
+		{
+		case material::model::diffuse:
+			shade_diffuse(run, run_count, colors);
+			break;
+		case material::model::glossy:
+			shade_glossy(run, run_count, m, colors);
+			break;
+		case material::model::mirror:
+			shade_mirror(run, run_count, m, colors, bounces, num_bounces);
+			break;
+		case material::model::dielectric:
+			shade_dielectric(run, run_count, m, colors, bounces, num_bounces);
+			break;
+		case material::model::emissive:
+			shade_diffuse(run, run_count, colors);
+			for (uint32_t i = 0; i < run_count; ++i)
+				colors[run[i].ray] = colors[run[i].ray] + m.emission;
+			break;
+		}
+	}
+
+	// Reflected and refracted rays are traced together, one level deeper. Past the last level they see nothing.
+	if (num_bounces == 0 || depth + 1 >= material::kMaxDepth)
+		return;
+	Vec3f *bounce_origins = thread_scratch().allocate_array<Vec3f>(num_bounces);
+	Vec3f *bounce_dirs = thread_scratch().allocate_array<Vec3f>(num_bounces);
+	Vec3f *bounce_colors = thread_scratch().allocate_array<Vec3f>(num_bounces);
+	for (uint32_t i = 0; i < num_bounces; ++i)
+		bounce_origins[i] = bounces[i].origin, bounce_dirs[i] = bounces[i].dir;
+	trace_batch(bounce_origins, bounce_dirs, num_bounces, bounce_colors, depth + 1);
+	for (uint32_t i = 0; i < num_bounces; ++i)
+		colors[bounces[i].ray] = colors[bounces[i].ray] + bounces[i].weight * bounce_colors[i];
+}
+
+void raytracer::shade_diffuse(const surface_hit *hits, uint32_t count, Vec3f *colors) const
+{
+	if (irradiance)
+	{
+		for (uint32_t i = 0; i < count; ++i)
+			colors[hits[i].ray] = hits[i].albedo * irradiance->lookup(hits[i].point, hits[i].normal, [this](const Vec3f &p, const Vec3f &n) { return direct_irradiance(p, n); });
+		return;
+	}
+
+	for (uint32_t i = 0; i < count; ++i)
+		colors[hits[i].ray] = { 0 };
+	ray_cost_recording::add_lights(static_cast<uint32_t>(point_lights.size() * count));
+	for (auto &point_light : point_lights)
+		for (uint32_t i = 0; i < count; ++i)
 		{
 			float tnear = 0.0f;
 			Vec3f light_dir, light_intensity;
-			point_light->illuminate(hitPoint, light_dir, light_intensity, tnear);
+			point_light->illuminate(hits[i].point, light_dir, light_intensity, tnear);
+			colors[hits[i].ray] = colors[hits[i].ray] + hits[i].albedo * light_intensity * std::max(0.f, hits[i].normal.dotProduct(-light_dir));
+		}
+}
 
-			hitColor = hitColor + hitObject->color * light_intensity * std::max(0.f, hitNormal.dotProduct(-light_dir));
+void raytracer::shade_glossy(const surface_hit *hits, uint32_t count, const material::description &m, Vec3f *colors) const
+{
+	shade_diffuse(hits, count, colors);
+	// The diffuse term leaves out its 1 / pi, the highlight is scaled to match
+	const float alpha = std::max(m.roughness * m.roughness, 1e-3f);
+	for (auto &point_light : point_lights)
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			float distance = 0.0f;
+			Vec3f light_dir, light_intensity;
+			point_light->illuminate(hits[i].point, light_dir, light_intensity, distance);
+			Vec3f view = -hits[i].dir;
+			Vec3f normal = hits[i].normal.dotProduct(view) < 0.0f ? -hits[i].normal : hits[i].normal;
+			Vec3f to_light = -light_dir;
+			float n_dot_l = normal.dotProduct(to_light), n_dot_v = normal.dotProduct(view);
+			if (n_dot_l <= 0.0f || n_dot_v <= 0.0f)
+				continue;
+			Vec3f half = to_light + view;
+			half.normalize();
+			float d = material::ggx_distribution(std::max(0.0f, normal.dotProduct(half)), alpha);
+			float g = material::smith_g1(n_dot_l, alpha) * material::smith_g1(n_dot_v, alpha);
+			Vec3f f = material::fresnel_schlick(m.specular, std::max(0.0f, half.dotProduct(view)));
+			float scale = static_cast<float>(M_PI) * d * g / (4.0f * n_dot_v);
+			colors[hits[i].ray] = colors[hits[i].ray] + f * light_intensity * scale;
 		}
+}
+
+void raytracer::shade_mirror(const surface_hit *hits, uint32_t count, const material::description &m, Vec3f *colors, bounce *bounces, uint32_t &num_bounces) const
+{
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		const surface_hit &hit = hits[i];
+		Vec3f normal = hit.normal.dotProduct(hit.dir) > 0.0f ? -hit.normal : hit.normal;
+		colors[hit.ray] = { 0 };
+		bounces[num_bounces++] = { hit.point + normal * material::kBounceOffset, material::reflect(hit.dir, normal), m.specular * hit.albedo, hit.ray };
 	}
+}
 
-	return hitColor;
-}
\ No newline at end of file
+void raytracer::shade_dielectric(const surface_hit *hits, uint32_t count, const material::description &m, Vec3f *colors, bounce *bounces, uint32_t &num_bounces) const
+{
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		const surface_hit &hit = hits[i];
+		// Rays that meet the back of the surface are leaving the material
+		float cos_i = -hit.normal.dotProduct(hit.dir);
+		bool entering = cos_i >= 0.0f;
+		Vec3f normal = entering ? hit.normal : -hit.normal;
+		float eta = entering ? 1.0f / m.ior : m.ior;
+		cos_i = std::abs(cos_i);
+		float cos_t;
+		float reflectance = material::fresnel_dielectric(cos_i, eta, cos_t);
+		colors[hit.ray] = { 0 };
+		bounces[num_bounces++] = { hit.point + normal * material::kBounceOffset, material::reflect(hit.dir, normal), Vec3f(reflectance), hit.ray };
+		if (reflectance < 1.0f)
+		{
+			Vec3f refracted = hit.dir * eta + normal * (eta * cos_i - cos_t);
+			refracted.normalize();
+			bounces[num_bounces++] = { hit.point - normal * material::kBounceOffset, refracted, hit.albedo * (1.0f - reflectance), hit.ray };
+		}
+	}
+}
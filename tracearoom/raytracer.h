@@ -2,9 +2,15 @@
 
 #include<memory>
 #include<vector>
+#include"cells.h"
 #include"geometry.h"
+#include"irradiance_cache.h"
+#include"material.h"
 #include "lights.h"
 #include"polygon_primitves.h"
+#include"profile.h"
+#include"ray_cost.h"
+#include"uniform_grid.h"
 
 struct ray
 {
@@ -17,15 +23,83 @@ struct ray
 		this->dir = dir;
 	}
 };
+// How rays find the nearest object
+enum class accelerator
+{
+	object_bvh,		// every object in turn, each through its own bvh
+	uniform_grid,	// one hashed grid over the whole scene(see uniform_grid.h)
+	cells			// the rooms and doorways a ray passes through(see cells.h), needs a layout
+};
+
 class raytracer
 {
 	std::vector<std::unique_ptr<Object>> targets; 
 	std::vector<std::unique_ptr<PointLight>> point_lights;
 	Vec3f background;
+	std::unique_ptr<irradiance_cache> irradiance;
+	accelerator accel = accelerator::object_bvh;
+	uniform_grid grid;
+	cells::layout building;
+	cells::portal_graph rooms;
+	bool batched = false;
+
+	// A hit waiting for its material
+	struct surface_hit
+	{
+		Vec3f point, normal, dir, albedo;
+		uint32_t material;
+		uint32_t ray;		// index of the colour it goes to
+	};
+
+	// A reflected or refracted ray, what it sees times weight adds to the colour of ray
+	struct bounce
+	{
+		Vec3f origin, dir, weight;
+		uint32_t ray;
+	};
+
+	// Nearest hit among the targets, nullptr if there is none
+	const Object *find_nearest(const ray &ray, float &tnear, uint32_t &index, Vec2f &uv) const;
+
+	// Colours of count rays of bounce depth
+	void trace_batch(const Vec3f *origins, const Vec3f *dirs, uint32_t count, Vec3f *colors, uint32_t depth) const;
+
+	// Colours of the hits of count rays, background for those that hit nothing. Hits are sorted by material
+	// and each run is shaded by the kernel of its model, reflected and refracted rays are traced as one batch.
+	void shade_batch(const Vec3f *origins, const Vec3f *dirs, const ray_hit *hits, uint32_t count, Vec3f *colors, uint32_t depth) const;
+
+	// Material kernels over count hits of the same material, colours are written at each hit's ray
+	void shade_diffuse(const surface_hit *hits, uint32_t count, Vec3f *colors) const;
+	void shade_glossy(const surface_hit *hits, uint32_t count, const material::description &m, Vec3f *colors) const;
+	void shade_mirror(const surface_hit *hits, uint32_t count, const material::description &m, Vec3f *colors, bounce *bounces, uint32_t &num_bounces) const;
+	void shade_dielectric(const surface_hit *hits, uint32_t count, const material::description &m, Vec3f *colors, bounce *bounces, uint32_t &num_bounces) const;
+
+	// Light arriving at point on a surface facing normal
+	Vec3f direct_irradiance(const Vec3f &point, const Vec3f &normal) const;
 public:
-	raytracer(std::vector<std::unique_ptr<Object>> &objects, std::vector<std::unique_ptr<PointLight>> &lights, const Vec3f &background_color = Vec3f(255));
+	raytracer(std::vector<std::unique_ptr<Object>> &objects, std::vector<std::unique_ptr<PointLight>> &lights, const Vec3f &background_color = Vec3f(1));
 	void set_targets(std::vector<std::unique_ptr<Object>> &objects);
+	// Call after moving targets, before shooting any rays
+	void update_targets();
+	std::vector<std::unique_ptr<Object>> &get_targets() { return targets; }
 	void set_background_color(const Vec3f &bkg_color);
-	Vec3f shoot(const Vec3f &orig, const Vec3f &dir);
-	Vec3f shoot(const ray &ray);
+	void set_accelerator(accelerator type);
+	// Rooms and doorways of accelerator::cells, set before switching to it
+	void set_cells(const cells::layout &layout);
+	const cells::portal_graph &get_cells() const { return rooms; }
+	// Interpolate diffuse lighting from a world space cache with cells of cell_size, 0 turns it off
+	void set_irradiance_cache(float cell_size);
+	// Drop cached lighting after objects or lights moved
+	void clear_irradiance_cache();
+	// Safe to call from several threads at once
+	Vec3f shoot(const Vec3f &orig, const Vec3f &dir) const;
+	Vec3f shoot(const ray &ray) const;
+	// Also returns the distance to the hit, kInfinity when nothing was hit
+	Vec3f shoot(const ray &ray, float &hit_distance) const;
+	// Also tells whether the colour changes with the direction the hit is seen from(glossy, mirror and dielectric materials)
+	Vec3f shoot(const ray &ray, float &hit_distance, bool &view_dependent) const;
+	// True when a target traces much faster through shoot_batch, like a paged mesh
+	bool prefers_batches() const { return batched; }
+	// Shoots count rays together so targets can share work between them, colors receives one colour per ray
+	void shoot_batch(const Vec3f *origins, const Vec3f *dirs, uint32_t count, Vec3f *colors) const;
 };
\ No newline at end of file
@@ -0,0 +1,232 @@
+#pragma once
+
+#include<algorithm>
+#include<atomic>
+#include<condition_variable>
+#include<cstdint>
+#include<deque>
+#include<memory>
+#include<mutex>
+#include<vector>
+
+#include"distributed.h"
+#include"geometry.h"
+#include"thread_pool.h"
+
+// Renders that run in the background on the shared thread pool, for hosts that start renders, watch them and take
+// tiles as they finish without a thread of their own per render.
+//
+// A job is a frame split into tiles. It never has more tiles in flight than the pool has threads, and a finished
+// tile queues the job's next one behind whatever else is waiting, so any number of jobs share the pool in turns
+// instead of one after the other. Cancelling is cooperative: tiles that are being traced finish, no new ones start.
+// On a pool without workers(--threads 1) the tiles are traced by whoever waits for them.
+namespace render_job
+{
+	enum class status
+	{
+		running,
+		finished,
+		cancelled
+	};
+
+	struct progress
+	{
+		uint32_t tiles_done = 0;
+		uint32_t tiles = 0;
+		status state = status::running;
+	};
+
+	// A finished tile, width() * height() pixels row by row
+	struct finished_tile
+	{
+		distributed::tile area;
+		std::vector<Vec3f> pixels;
+	};
+
+	namespace detail
+	{
+		struct job
+		{
+			uint32_t width, height;
+			std::vector<distributed::tile> tiles;
+			distributed::tile_renderer trace;
+			thread_pool *pool;
+			std::unique_ptr<Vec3f[]> frame;
+
+			std::atomic<uint32_t> next_tile{ 0 };
+			std::atomic<bool> cancelled{ false };
+			std::mutex mutex;
+			std::condition_variable changed;
+			// Guarded by mutex
+			std::deque<finished_tile> finished;
+			uint32_t tiles_done = 0, in_flight = 0;
+			bool over = false;
+
+			// Traces the next tile if there is one and it is not cancelled, returns false otherwise
+			bool run_one()
+			{
+				uint32_t t = cancelled ? static_cast<uint32_t>(tiles.size()) : next_tile++;
+				if (t >= tiles.size())
+					return false;
+
+				const distributed::tile &area = tiles[t];
+				finished_tile done;
+				done.area = area;
+				done.pixels.resize(static_cast<size_t>(area.width()) * area.height());
+				trace(area, done.pixels.data());
+				for (uint32_t y = area.y0; y < area.y1; ++y)
+					std::copy(done.pixels.begin() + (y - area.y0) * area.width(), done.pixels.begin() + (y - area.y0 + 1) * area.width(), frame.get() + static_cast<size_t>(y) * width + area.x0);
+
+				std::lock_guard<std::mutex> lock(mutex);
+				finished.push_back(std::move(done));
+				++tiles_done;
+				changed.notify_all();
+				return true;
+			}
+
+			// One of the job's slots on the pool: a tile, then the slot goes to the back of the queue again
+			static void step(std::shared_ptr<job> self)
+			{
+				if (self->run_one())
+				{
+					thread_pool *pool = self->pool;
+					pool->submit([self] { step(self); });
+					return;
+				}
+				std::lock_guard<std::mutex> lock(self->mutex);
+				if (--self->in_flight == 0)
+				{
+					self->over = true;
+					self->changed.notify_all();
+				}
+			}
+		};
+	}
+
+	// Owns a running job, dropping it cancels the job and waits for the tiles being traced
+	class handle
+	{
+		std::shared_ptr<detail::job> state;
+
+		// Without workers nothing else traces, so the caller traces a tile, or ends the job when none are left.
+		// Returns true if it traced one.
+		bool drive_inline() const
+		{
+			if (state->pool->size() > 0)
+				return false;
+			if (state->run_one())
+				return true;
+			std::lock_guard<std::mutex> lock(state->mutex);
+			state->over = true;
+			return false;
+		}
+	public:
+		handle() {}
+		explicit handle(std::shared_ptr<detail::job> job) : state(std::move(job)) {}
+		handle(handle &&) = default;
+		handle &operator=(handle &&other)
+		{
+			if (this != &other)
+			{
+				cancel();
+				wait();
+				state = std::move(other.state);
+			}
+			return *this;
+		}
+		handle(const handle &) = delete;
+		handle &operator=(const handle &) = delete;
+
+		~handle()
+		{
+			cancel();
+			wait();
+		}
+
+		bool valid() const { return static_cast<bool>(state); }
+
+		progress get_progress() const
+		{
+			progress p;
+			if (!state)
+				return p;
+			std::lock_guard<std::mutex> lock(state->mutex);
+			p.tiles_done = state->tiles_done;
+			p.tiles = static_cast<uint32_t>(state->tiles.size());
+			p.state = !state->over ? status::running : (state->tiles_done == p.tiles ? status::finished : status::cancelled);
+			return p;
+		}
+
+		// Takes a finished tile without waiting, returns false when none is ready
+		bool poll(finished_tile &tile)
+		{
+			if (!state)
+				return false;
+			drive_inline();
+			std::lock_guard<std::mutex> lock(state->mutex);
+			if (state->finished.empty())
+				return false;
+			tile = std::move(state->finished.front());
+			state->finished.pop_front();
+			return true;
+		}
+
+		// Waits for the next finished tile, returns false once the job is over and every tile has been taken
+		bool next(finished_tile &tile)
+		{
+			if (!state)
+				return false;
+			drive_inline();
+			std::unique_lock<std::mutex> lock(state->mutex);
+			state->changed.wait(lock, [this] { return !state->finished.empty() || state->over; });
+			if (state->finished.empty())
+				return false;
+			tile = std::move(state->finished.front());
+			state->finished.pop_front();
+			return true;
+		}
+
+		// Tiles that have not started are skipped, the job is over once the ones being traced finish
+		void cancel()
+		{
+			if (state)
+				state->cancelled = true;
+		}
+
+		// Blocks until the job is over, tiles that were not taken stay queued
+		status wait()
+		{
+			if (!state)
+				return status::finished;
+			while (drive_inline()) {}
+			{
+				std::unique_lock<std::mutex> lock(state->mutex);
+				state->changed.wait(lock, [this] { return state->over; });
+			}
+			return get_progress().state;
+		}
+
+		// The whole frame, width * height pixels. Complete once wait() returned finished.
+		const Vec3f *frame() const { return state ? state->frame.get() : nullptr; }
+	};
+
+	// Starts rendering a width x height frame as tiles of tile_size, trace is called from pool threads, several
+	// tiles at once. Whatever trace refers to has to outlive the job.
+	inline handle start(uint32_t width, uint32_t height, uint32_t tile_size, distributed::tile_renderer trace, thread_pool &pool = thread_pool::shared())
+	{
+		std::shared_ptr<detail::job> job(new detail::job);
+		job->width = width, job->height = height;
+		job->tiles = distributed::split(width, height, tile_size);
+		job->trace = std::move(trace);
+		job->pool = &pool;
+		job->frame.reset(new Vec3f[static_cast<size_t>(width) * height]);
+
+		uint32_t slots = std::min(pool.size(), static_cast<uint32_t>(job->tiles.size()));
+		job->in_flight = slots;
+		if (job->tiles.empty())
+			job->over = true;
+		for (uint32_t s = 0; s < slots; ++s)
+			pool.submit([job] { detail::job::step(job); });
+		return handle(std::move(job));
+	}
+}
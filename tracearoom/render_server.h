@@ -0,0 +1,542 @@
+#pragma once
+
+#include<algorithm>
+#include<chrono>
+#include<condition_variable>
+#include<cstdint>
+#include<cstdio>
+#include<deque>
+#include<functional>
+#include<iostream>
+#include<memory>
+#include<mutex>
+#include<sstream>
+#include<string>
+#include<thread>
+#include<vector>
+
+#ifdef _WIN32
+#include<fcntl.h>
+#include<io.h>
+#else
+#include<cerrno>
+#include<csignal>
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<unistd.h>
+#endif
+
+#include"geometry.h"
+
+// Long running render server: the scene and the thread pool stay loaded and every request only pays for tracing.
+//
+// Requests come in as text lines, on stdin or from any number of clients on a Unix socket:
+//   render <id> <width> <height> <fov> <samples per pixel> <16 cameraToWorld values, row by row>
+//   quit		closes the connection
+//   shutdown	stops the server once the requests in flight are done
+// Answers go back to the client that asked:
+//   ready						once, when the server takes requests
+//   rows <id> <first row> <count>\n followed by count * width linear rgb pixels as 32 bit floats, top row first
+//   done <id> <milliseconds spent tracing>
+//   error <id> <reason>
+//
+// Requests are traced a band of rows at a time, taking turns with every other request in flight, so a small
+// request sent behind a big one does not wait for it to finish. Each band is queued for its client as soon as it is
+// traced and written by a thread of that client's own, so a client that reads slowly only holds up itself: once
+// more than kMaxQueuedBytes of its answers wait, its requests are parked until it catches up.
+namespace render_server
+{
+	const uint32_t kMaxImageSize = 16384;
+	const uint32_t kMaxSamples = 4096;
+
+	struct request
+	{
+		std::string id;
+		uint32_t width = 0, height = 0;
+		float fov = 0.0f;
+		uint32_t samples = 1;
+		Matrix44f camera_to_world;
+	};
+
+	// Parses the fields after "render", error receives what was wrong
+	inline bool parse_request(std::istream &is, request &r, std::string &error)
+	{
+		if (!(is >> r.id >> r.width >> r.height >> r.fov >> r.samples))
+		{
+			error = "expected: render <id> <width> <height> <fov> <samples> <16 matrix values>";
+			return false;
+		}
+		for (uint32_t i = 0; i < 16; ++i)
+			is >> r.camera_to_world.x[i / 4][i % 4];
+		if (!is)
+			error = "expected 16 cameraToWorld values";
+		else if (r.width == 0 || r.height == 0 || r.width > kMaxImageSize || r.height > kMaxImageSize)
+			error = "image size out of range";
+		else if (r.samples == 0 || r.samples > kMaxSamples)
+			error = "samples out of range";
+		else if (!(r.fov > 0.0f && r.fov < 180.0f))
+			error = "fov out of range";
+		else
+			return true;
+		return false;
+	}
+
+	// Writes to a client, returns false once the client has gone
+	typedef std::function<bool(const void *data, size_t bytes)> client_writer;
+
+	// Traces rows [first_row, last_row) of a request into rows, width pixels each. Called from the server thread.
+	typedef std::function<void(const request &, uint32_t first_row, uint32_t last_row, Vec3f *rows)> band_tracer;
+
+	// Answers a client may have waiting to be written before its requests are parked
+	const size_t kMaxQueuedBytes = 64 << 20;
+	// How long a stopping server waits for a parked client to read before dropping its requests
+	const std::chrono::seconds kStalledClientTimeout(10);
+
+	class server
+	{
+		// Answers are queued and written by a thread of the client's own, so tracing never waits on a socket.
+		// The writer owns the client: it finishes once the client stopped sending and has no requests left, after
+		// everything queued has been written.
+		struct client
+		{
+			client_writer write;
+			server *owner;
+			std::mutex mutex;
+			std::condition_variable changed;
+			// Guarded by mutex
+			std::deque<std::string> outbox;
+			size_t queued_bytes = 0;
+			uint32_t requests = 0;
+			bool reading = true, gone = false;
+
+			client(client_writer writer, server *s) : write(std::move(writer)), owner(s) {}
+
+			// Queues a text line and optionally a binary payload as one message
+			void send(const std::string &line, const void *payload = nullptr, size_t bytes = 0)
+			{
+				std::string message;
+				message.reserve(line.size() + bytes);
+				message.append(line);
+				message.append(static_cast<const char*>(payload), bytes);
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					if (gone)
+						return;
+					queued_bytes += message.size();
+					outbox.push_back(std::move(message));
+				}
+				changed.notify_one();
+			}
+
+			bool has_gone()
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				return gone;
+			}
+
+			bool backed_up()
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				return queued_bytes > kMaxQueuedBytes;
+			}
+
+			void request_added()
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				++requests;
+			}
+
+			void request_finished()
+			{
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					--requests;
+				}
+				changed.notify_one();
+			}
+
+			void stopped_reading()
+			{
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					reading = false;
+				}
+				changed.notify_one();
+			}
+
+			// Body of the writer thread
+			static void drain(std::shared_ptr<client> self)
+			{
+				std::unique_lock<std::mutex> lock(self->mutex);
+				for (;;)
+				{
+					self->changed.wait(lock, [&] { return !self->outbox.empty() || (!self->reading && self->requests == 0); });
+					if (self->outbox.empty())
+						break;
+					std::string message = std::move(self->outbox.front());
+					self->outbox.pop_front();
+					lock.unlock();
+					bool written = self->write(message.data(), message.size());
+					lock.lock();
+					self->queued_bytes -= message.size();
+					if (!written)
+					{
+						self->gone = true;
+						self->outbox.clear();
+						self->queued_bytes = 0;
+					}
+					// A parked request of this client may go on
+					lock.unlock();
+					self->owner->wake();
+					lock.lock();
+				}
+				lock.unlock();
+				self->owner->writer_finished();
+			}
+		};
+
+		struct job
+		{
+			request req;
+			std::shared_ptr<client> to;
+			uint32_t next_row = 0;
+			std::chrono::steady_clock::duration traced{ 0 };
+
+			~job()
+			{
+				if (to)
+					to->request_finished();
+			}
+		};
+
+		band_tracer trace;
+		uint32_t band_rows;
+		std::deque<std::unique_ptr<job>> jobs;		// served round robin from the front
+		std::mutex mutex;
+		std::condition_variable work;
+		bool stopping = false;
+		uint32_t writers = 0;
+		std::condition_variable writers_done;
+		std::vector<Vec3f> band;
+
+		void wake()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+			}
+			work.notify_all();
+		}
+
+		void writer_finished()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			--writers;
+			writers_done.notify_all();
+		}
+
+		// Takes the first job whose client can take more, null once stopped and done. Jobs of clients that are
+		// backed up stay queued in order, a stopping server drops them if none of those clients reads for
+		// kStalledClientTimeout.
+		std::unique_ptr<job> next_job()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			for (;;)
+			{
+				if (jobs.empty())
+				{
+					if (stopping)
+						return nullptr;
+					work.wait(lock);
+					continue;
+				}
+				auto ready = std::find_if(jobs.begin(), jobs.end(), [](const std::unique_ptr<job> &j) { return j->to->has_gone() || !j->to->backed_up(); });
+				if (ready != jobs.end())
+				{
+					std::unique_ptr<job> j = std::move(*ready);
+					jobs.erase(ready);
+					return j;
+				}
+				if (work.wait_for(lock, kStalledClientTimeout) == std::cv_status::timeout && stopping)
+					jobs.clear();
+			}
+		}
+	public:
+		typedef std::shared_ptr<client> connection;
+
+		explicit server(band_tracer tracer, uint32_t rows_per_band = 16) : trace(std::move(tracer)), band_rows(std::max(1u, rows_per_band)) {}
+
+		// Starts the client's writer, disconnect() has to be called once it sends no more lines
+		connection connect(client_writer writer)
+		{
+			auto c = std::make_shared<client>(std::move(writer), this);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				++writers;
+			}
+			std::thread(client::drain, c).detach();
+			c->send("ready\n");
+			return c;
+		}
+
+		// The client's writer finishes once its requests are answered
+		void disconnect(const connection &from)
+		{
+			from->stopped_reading();
+		}
+
+		// Handles one line from a client. Returns false when the client is done with the connection.
+		bool handle(const std::string &line, const connection &from)
+		{
+			std::istringstream iss(line);
+			std::string keyword;
+			if (!(iss >> keyword))
+				return true;
+			if (keyword == "quit")
+				return false;
+			if (keyword == "shutdown")
+			{
+				stop();
+				return false;
+			}
+			if (keyword != "render")
+			{
+				from->send("error - unknown command " + keyword + "\n");
+				return true;
+			}
+
+			std::unique_ptr<job> j(new job);
+			std::string error;
+			if (!parse_request(iss, j->req, error))
+			{
+				from->send("error " + (j->req.id.empty() ? std::string("-") : j->req.id) + " " + error + "\n");
+				return true;
+			}
+			from->request_added();
+			j->to = from;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				jobs.push_back(std::move(j));
+			}
+			work.notify_one();
+			return true;
+		}
+
+		// Traces requests on the calling thread until stop() is called and everything queued is done
+		void run()
+		{
+			while (std::unique_ptr<job> j = next_job())
+			{
+				// Nobody is listening anymore
+				if (j->to->has_gone())
+					continue;
+
+				const request &r = j->req;
+				uint32_t first_row = j->next_row, last_row = std::min(r.height, first_row + band_rows);
+				band.resize(static_cast<size_t>(last_row - first_row) * r.width);
+				auto start = std::chrono::steady_clock::now();
+				trace(r, first_row, last_row, band.data());
+				j->traced += std::chrono::steady_clock::now() - start;
+				j->next_row = last_row;
+
+				std::ostringstream header;
+				header << "rows " << r.id << " " << first_row << " " << last_row - first_row << "\n";
+				j->to->send(header.str(), band.data(), band.size() * sizeof(Vec3f));
+				if (last_row < r.height)
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					jobs.push_back(std::move(j));
+					continue;
+				}
+
+				std::ostringstream done;
+				done << "done " << r.id << " " << std::chrono::duration_cast<std::chrono::microseconds>(j->traced).count() / 1000.0 << "\n";
+				j->to->send(done.str());
+			}
+		}
+
+		void stop()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			work.notify_all();
+		}
+
+		bool is_stopping()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			return stopping;
+		}
+
+		// Waits up to timeout for every client's writer to finish, returns false if some are still writing. The
+		// server has to outlive the writers.
+		bool wait_for_writers(std::chrono::steady_clock::duration timeout)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			return writers_done.wait_for(lock, timeout, [this] { return writers == 0; });
+		}
+
+		void wait_for_writers()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			writers_done.wait(lock, [this] { return writers == 0; });
+		}
+	};
+
+	// Serves requests from stdin, answering on stdout, until shutdown, quit or the end of input
+	inline void serve_stdio(server &s)
+	{
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		std::cout.flush();
+		auto connection = s.connect([](const void *data, size_t bytes) {
+			bool written = fwrite(data, 1, bytes, stdout) == bytes;
+			return fflush(stdout) == 0 && written;
+		});
+		std::thread reader([&s, connection] {
+			std::string line;
+			while (std::getline(std::cin, line) && s.handle(line, connection))
+				;
+			s.disconnect(connection);
+			s.stop();
+		});
+		s.run();
+		reader.join();
+		s.wait_for_writers();
+	}
+
+#ifndef _WIN32
+	namespace detail
+	{
+		// Closes a client socket once neither its reader nor any of its requests need it
+		struct socket_handle
+		{
+			int fd;
+			explicit socket_handle(int socket_fd) : fd(socket_fd) {}
+			~socket_handle() { close(fd); }
+		};
+
+		inline bool write_all(int fd, const void *data, size_t bytes)
+		{
+			const char *p = static_cast<const char*>(data);
+			while (bytes > 0)
+			{
+				ssize_t n = write(fd, p, bytes);
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n <= 0)
+					return false;
+				p += n, bytes -= static_cast<size_t>(n);
+			}
+			return true;
+		}
+
+		// Feeds the lines a client sends to the server until it quits or disconnects
+		inline void read_client(server &s, int fd, server::connection connection)
+		{
+			std::string pending;
+			char buffer[4096];
+			for (;;)
+			{
+				ssize_t n = read(fd, buffer, sizeof(buffer));
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n <= 0)
+					return;
+				pending.append(buffer, static_cast<size_t>(n));
+				size_t end;
+				while ((end = pending.find('\n')) != std::string::npos)
+				{
+					std::string line = pending.substr(0, end);
+					pending.erase(0, end + 1);
+					if (!s.handle(line, connection))
+						return;
+				}
+			}
+		}
+	}
+
+	// Serves every client that connects to a Unix socket at path until one of them sends shutdown.
+	// Returns false if the socket could not be set up.
+	inline bool serve_socket(server &s, const std::string &path)
+	{
+		sockaddr_un address = {};
+		address.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(address.sun_path))
+			return false;
+		std::copy(path.begin(), path.end(), address.sun_path);
+
+		int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener < 0)
+			return false;
+		unlink(path.c_str());
+		if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 16) != 0)
+		{
+			close(listener);
+			return false;
+		}
+
+		// Clients that hang up mid answer must not take the server with them
+		void(*previous_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+		// Sockets with a reader blocked on them
+		std::mutex readers_mutex;
+		std::condition_variable readers_done;
+		std::vector<int> reading;
+		// Every client socket, to cut off the ones still not reading their answers at the end
+		std::vector<std::weak_ptr<detail::socket_handle>> sockets;
+		std::thread acceptor([&] {
+			for (;;)
+			{
+				int fd = accept(listener, nullptr, nullptr);
+				if (fd < 0)
+				{
+					if (errno == EINTR || errno == ECONNABORTED)
+						continue;
+					return;
+				}
+
+				auto handle = std::make_shared<detail::socket_handle>(fd);
+				std::lock_guard<std::mutex> lock(readers_mutex);
+				if (s.is_stopping())
+					return;
+				reading.push_back(fd);
+				sockets.push_back(handle);
+				auto connection = s.connect([handle](const void *data, size_t bytes) { return detail::write_all(handle->fd, data, bytes); });
+				std::thread([&, fd, connection] {
+					detail::read_client(s, fd, connection);
+					s.disconnect(connection);
+					shutdown(fd, SHUT_RD);
+					std::lock_guard<std::mutex> lock(readers_mutex);
+					reading.erase(std::find(reading.begin(), reading.end(), fd));
+					readers_done.notify_all();
+				}).detach();
+			}
+		});
+
+		s.run();
+
+		// Wake up everything still blocked on a socket
+		shutdown(listener, SHUT_RDWR);
+		acceptor.join();
+		close(listener);
+		{
+			std::unique_lock<std::mutex> lock(readers_mutex);
+			for (int fd : reading)
+				shutdown(fd, SHUT_RD);
+			readers_done.wait(lock, [&] { return reading.empty(); });
+		}
+		if (!s.wait_for_writers(kStalledClientTimeout))
+		{
+			for (auto &socket : sockets)
+				if (auto handle = socket.lock())
+					shutdown(handle->fd, SHUT_RDWR);
+			s.wait_for_writers();
+		}
+		unlink(path.c_str());
+		signal(SIGPIPE, previous_sigpipe);
+		return true;
+	}
+#endif
+}
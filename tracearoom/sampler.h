@@ -0,0 +1,294 @@
+#pragma once
+
+#include<algorithm>
+#include<cmath>
+#include<cstdint>
+#include<string>
+#include<vector>
+
+#include"geometry.h"
+
+// Sample points for anything that takes several samples per pixel.
+//
+// Every sample is a pure function of (pixel, sample index, dimension), there is no generator state, so any thread can
+// ask for any sample without locks or coordination and a pixel gets the same samples however the frame is split up.
+//
+// Two sequences:
+//  - sobol: the Sobol sequence with hash based Owen scrambling(Burley, "Practical Hash-based Owen Scrambling", 2020).
+//    Each pixel scrambles with its own seed, so neighbouring pixels are decorrelated while the samples within a pixel
+//    keep the stratification of the Sobol sequence at every power of two.
+//  - blue_noise: a rank 1 lattice(the R2 sequence) rotated per pixel by a blue noise tile made with void and cluster
+//    (Ulichney 1993). At a few samples per pixel the error of neighbouring pixels differs as much as it can, so what
+//    noise is left is high frequency and looks far smoother than white noise at the same sample count.
+//
+// Dimensions past kSobolDimensions are padded: they reuse the lower dimensions with another scramble.
+namespace sampler
+{
+	const uint32_t kSobolDimensions = 8;
+	const uint32_t kBlueNoiseSize = 64;
+
+	enum class sequence
+	{
+		sobol,
+		blue_noise
+	};
+
+	inline bool parse_sequence(const std::string &name, sequence &s)
+	{
+		if (name == "sobol")
+			s = sequence::sobol;
+		else if (name == "blue-noise")
+			s = sequence::blue_noise;
+		else
+			return false;
+		return true;
+	}
+
+	inline uint32_t reverse_bits(uint32_t bits)
+	{
+		bits = (bits << 16) | (bits >> 16);
+		bits = ((bits & 0x55555555u) << 1) | ((bits & 0xAAAAAAAAu) >> 1);
+		bits = ((bits & 0x33333333u) << 2) | ((bits & 0xCCCCCCCCu) >> 2);
+		bits = ((bits & 0x0F0F0F0Fu) << 4) | ((bits & 0xF0F0F0F0u) >> 4);
+		bits = ((bits & 0x00FF00FFu) << 8) | ((bits & 0xFF00FF00u) >> 8);
+		return bits;
+	}
+
+	// [0, 1) from the top 24 bits, never rounds up to 1
+	inline float to_unit(uint32_t bits) { return (bits >> 8) * (1.0f / 16777216.0f); }
+
+	// Radical inverse in base 2, spreads sample indices over [0, 1)
+	inline float radical_inverse(uint32_t index) { return to_unit(reverse_bits(index)); }
+
+	// Integer hash with good avalanche(Wellons' lowbias32)
+	inline uint32_t hash(uint32_t x)
+	{
+		x ^= x >> 16;
+		x *= 0x7feb352du;
+		x ^= x >> 15;
+		x *= 0x846ca68bu;
+		x ^= x >> 16;
+		return x;
+	}
+
+	inline uint32_t hash_combine(uint32_t seed, uint32_t value)
+	{
+		return hash(seed ^ (value + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+	}
+
+	// Seed of a pixel, frame tells apart frames of a sequence
+	inline uint32_t pixel_seed(uint32_t x, uint32_t y, uint32_t frame = 0)
+	{
+		return hash_combine(hash_combine(hash(x), y), frame);
+	}
+
+	namespace detail
+	{
+		// Primitive polynomials and initial direction numbers of dimensions 2 to 8(Joe and Kuo, new-joe-kuo-6.21201)
+		struct sobol_polynomial
+		{
+			uint32_t degree, coefficients, m[5];
+		};
+
+		const sobol_polynomial kPolynomials[kSobolDimensions - 1] = {
+			{ 1, 0, { 1 } },
+			{ 2, 1, { 1, 3 } },
+			{ 3, 1, { 1, 3, 1 } },
+			{ 3, 2, { 1, 1, 1 } },
+			{ 4, 1, { 1, 1, 3, 3 } },
+			{ 4, 4, { 1, 3, 5, 13 } },
+			{ 5, 2, { 1, 1, 5, 5, 17 } },
+		};
+
+		// 32 direction numbers per dimension, dimension 0 is the van der Corput sequence
+		inline const uint32_t *sobol_directions()
+		{
+			static const std::vector<uint32_t> directions = [] {
+				std::vector<uint32_t> v(kSobolDimensions * 32);
+				for (uint32_t i = 0; i < 32; ++i)
+					v[i] = 1u << (31 - i);
+				for (uint32_t d = 1; d < kSobolDimensions; ++d)
+				{
+					const sobol_polynomial &p = kPolynomials[d - 1];
+					uint32_t *dir = &v[d * 32];
+					for (uint32_t i = 0; i < 32; ++i)
+					{
+						if (i < p.degree)
+						{
+							dir[i] = p.m[i] << (31 - i);
+							continue;
+						}
+						dir[i] = dir[i - p.degree] ^ (dir[i - p.degree] >> p.degree);
+						for (uint32_t k = 1; k < p.degree; ++k)
+							if ((p.coefficients >> (p.degree - 1 - k)) & 1)
+								dir[i] ^= dir[i - k];
+					}
+				}
+				return v;
+			}();
+			return directions.data();
+		}
+
+		// Random permutation of the bits below each bit, applied from the top bit down(Laine and Karras 2011,
+		// constants from Burley 2020). Bit reversal turns it into a nested uniform scramble.
+		inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+		{
+			x += seed;
+			x ^= x * 0x6c50b47cu;
+			x ^= x * 0xb82f1e52u;
+			x ^= x * 0xc7afe638u;
+			x ^= x * 0x8d22f6e6u;
+			return x;
+		}
+
+		inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+		{
+			return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+		}
+
+		// Toroidal void and cluster: ones are added where their neighbourhood is emptiest and taken away where it
+		// is fullest, the order in which cells turn on is the threshold of the blue noise tile
+		inline std::vector<float> void_and_cluster()
+		{
+			const int size = static_cast<int>(kBlueNoiseSize), cells = size * size, radius = 6;
+			const float sigma = 1.5f;
+			std::vector<float> kernel((2 * radius + 1) * (2 * radius + 1));
+			for (int dy = -radius; dy <= radius; ++dy)
+				for (int dx = -radius; dx <= radius; ++dx)
+					kernel[(dy + radius) * (2 * radius + 1) + dx + radius] = std::exp(-(dx * dx + dy * dy) / (2.0f * sigma * sigma));
+
+			std::vector<float> energy(cells, 0.0f);
+			std::vector<char> on(cells, 0);
+			auto toggle = [&](int cell, bool value) {
+				on[cell] = value;
+				float sign = value ? 1.0f : -1.0f;
+				int x = cell % size, y = cell / size;
+				for (int dy = -radius; dy <= radius; ++dy)
+					for (int dx = -radius; dx <= radius; ++dx)
+						energy[((y + dy + size) % size) * size + (x + dx + size) % size] += sign * kernel[(dy + radius) * (2 * radius + 1) + dx + radius];
+			};
+			// Fullest cell that is on, or emptiest cell that is off
+			auto extreme = [&](bool of_on) {
+				int best = -1;
+				for (int c = 0; c < cells; ++c)
+					if (on[c] == of_on && (best < 0 || (of_on ? energy[c] > energy[best] : energy[c] < energy[best])))
+						best = c;
+				return best;
+			};
+
+			// A tenth of the cells at random, then spread evenly
+			int ones = 0;
+			for (int c = 0; c < cells; ++c)
+				if (hash(static_cast<uint32_t>(c)) % 10 == 0)
+					toggle(c, true), ++ones;
+			for (int i = 0; i < cells; ++i)
+			{
+				int cluster = extreme(true);
+				toggle(cluster, false);
+				int gap = extreme(false);
+				toggle(gap, true);
+				if (gap == cluster)
+					break;
+			}
+
+			std::vector<float> rank(cells);
+			std::vector<char> initial_on = on;
+			std::vector<float> initial_energy = energy;
+			for (int r = ones - 1; r >= 0; --r)
+			{
+				int cluster = extreme(true);
+				toggle(cluster, false);
+				rank[cluster] = static_cast<float>(r);
+			}
+			on = initial_on;
+			energy = initial_energy;
+			for (int r = ones; r < cells; ++r)
+			{
+				int gap = extreme(false);
+				toggle(gap, true);
+				rank[gap] = static_cast<float>(r);
+			}
+			for (float &r : rank)
+				r = (r + 0.5f) / cells;
+			return rank;
+		}
+	}
+
+	// Unscrambled Sobol sample, dimension below kSobolDimensions
+	inline uint32_t sobol_bits(uint32_t index, uint32_t dimension)
+	{
+		const uint32_t *dir = detail::sobol_directions() + dimension * 32;
+		uint32_t result = 0;
+		for (uint32_t i = 0; index; index >>= 1, ++i)
+			if (index & 1)
+				result ^= dir[i];
+		return result;
+	}
+
+	// Owen scrambled Sobol sample of a pixel seed
+	inline float owen_sobol(uint32_t seed, uint32_t index, uint32_t dimension)
+	{
+		// Padding dimensions reuse the lower ones with another seed
+		uint32_t pad = dimension / kSobolDimensions;
+		uint32_t dim_seed = hash_combine(seed, pad);
+		uint32_t shuffled = detail::nested_uniform_scramble(index, dim_seed);
+		uint32_t bits = sobol_bits(shuffled, dimension % kSobolDimensions);
+		return to_unit(detail::nested_uniform_scramble(bits, hash_combine(dim_seed, dimension)));
+	}
+
+	// Threshold of a cell of the blue noise tile in (0, 1), the tile repeats
+	inline float blue_noise_threshold(uint32_t x, uint32_t y)
+	{
+		static const std::vector<float> tile = detail::void_and_cluster();
+		return tile[(y % kBlueNoiseSize) * kBlueNoiseSize + x % kBlueNoiseSize];
+	}
+
+	// Blue noise rotated R2 sample of a pixel
+	inline float blue_noise(uint32_t x, uint32_t y, uint32_t index, uint32_t dimension)
+	{
+		// Every dimension reads the tile at another offset so they are not correlated with each other
+		uint32_t shift = hash(dimension + 1);
+		float rotation = blue_noise_threshold(x + (shift & 0xFFFF), y + (shift >> 16));
+		const float alpha = dimension % 2 == 0 ? 0.7548776662f : 0.5698402910f;
+		float value = rotation + alpha * static_cast<float>(index % 16777216u);
+		return value - std::floor(value);
+	}
+
+	// Samples of one pixel, cheap to make wherever they are needed
+	class pixel_sampler
+	{
+		sequence kind;
+		uint32_t x, y, seed;
+	public:
+		pixel_sampler(sequence s, uint32_t px, uint32_t py, uint32_t frame = 0) : kind(s), x(px), y(py), seed(pixel_seed(px, py, frame)) {}
+
+		float get(uint32_t index, uint32_t dimension) const
+		{
+			return kind == sequence::sobol ? owen_sobol(seed, index, dimension) : blue_noise(x, y, index, dimension);
+		}
+
+		Vec2f get_2d(uint32_t index, uint32_t dimension) const { return Vec2f(get(index, dimension), get(index, dimension + 1)); }
+
+		// count samples of one dimension from first_index on. One dimension at a time keeps its direction numbers
+		// and scramble seed in registers for the whole loop.
+		void get_batch(uint32_t first_index, uint32_t count, uint32_t dimension, float *values) const
+		{
+			if (kind == sequence::blue_noise)
+			{
+				for (uint32_t i = 0; i < count; ++i)
+					values[i] = blue_noise(x, y, first_index + i, dimension);
+				return;
+			}
+			const uint32_t *dir = detail::sobol_directions() + (dimension % kSobolDimensions) * 32;
+			uint32_t dim_seed = hash_combine(seed, dimension / kSobolDimensions);
+			uint32_t value_seed = hash_combine(dim_seed, dimension);
+			for (uint32_t i = 0; i < count; ++i)
+			{
+				uint32_t index = detail::nested_uniform_scramble(first_index + i, dim_seed), bits = 0;
+				for (uint32_t b = 0; b < 32; ++b)
+					bits ^= dir[b] & (0u - ((index >> b) & 1));
+				values[i] = to_unit(detail::nested_uniform_scramble(bits, value_seed));
+			}
+		}
+	};
+}
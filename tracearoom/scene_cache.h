@@ -0,0 +1,231 @@
+#pragma once
+
+#include<cstdint>
+#include<cstring>
+#include<fstream>
+#include<memory>
+#include<string>
+#include<vector>
+
+#include"appearance.h"
+#include"bvh.h"
+#include"geometry.h"
+#include"mapped_file.h"
+#include"polygon_primitves.h"
+
+// Binary scene cache: the flattened triangles, colors, textures, materials and bvh of every TriangleMesh in a scene.
+// Every array lives at an aligned offset in the file so the whole file can be memory mapped and used in place.
+// Textures and materials are stored as tables(see appearance.h), scenes with textures made in memory cannot be cached.
+//
+// Layout: file_header | mesh_record * num_meshes | arrays... | tables
+namespace scene_cache
+{
+	const char kMagic[8] = { 'T', 'R', 'A', 'C', 'E', 'S', 'C', 'N' };
+	const uint32_t kVersion = 2;
+	const uint64_t kAlignment = 64;
+
+	struct file_header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t num_meshes;
+		uint64_t tables_offset;
+		uint64_t tables_bytes;
+	};
+
+	struct mesh_record
+	{
+		Vec3f color;
+		uint32_t num_tris;
+		uint32_t num_vertices;
+		uint32_t num_nodes;
+		float translation[16];
+		float rotation[16];
+		uint32_t texture;			// index into the file's tables, appearance::kNone for none
+		uint32_t material;
+		uint64_t vertices_offset;
+		uint64_t tris_offset;
+		uint64_t normals_offset;
+		uint64_t st_offset;
+		uint64_t nodes_offset;
+		uint64_t prim_indices_offset;
+		uint64_t tri_materials_offset;	// one 16 bit material index per triangle when has_tri_materials is set
+		uint32_t has_tri_materials;
+		uint32_t padding;
+	};
+
+	namespace detail
+	{
+		inline uint64_t align(uint64_t offset) { return (offset + kAlignment - 1) & ~(kAlignment - 1); }
+
+		inline void write_padding(std::ofstream &ofs, uint64_t &offset)
+		{
+			static const char zeros[kAlignment] = {};
+			uint64_t aligned = align(offset);
+			ofs.write(zeros, static_cast<std::streamsize>(aligned - offset));
+			offset = aligned;
+		}
+
+		template<typename T>
+		uint64_t write_array(std::ofstream &ofs, uint64_t &offset, const T *data, size_t count)
+		{
+			write_padding(ofs, offset);
+			uint64_t start = offset;
+			ofs.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(count * sizeof(T)));
+			offset += count * sizeof(T);
+			return start;
+		}
+
+		template<typename T>
+		uint64_t write_array(std::ofstream &ofs, uint64_t &offset, const mesh_buffer<T> &data)
+		{
+			return write_array(ofs, offset, data.data(), data.size());
+		}
+
+		// Points data into the mapping, the buffer holds a reference to the mapping
+		template<typename T>
+		bool map_array(const std::shared_ptr<mapped_file> &file, uint64_t offset, uint64_t count, mesh_buffer<T> &data)
+		{
+			if (offset % alignof(T) != 0 || offset > file->size() || count > (file->size() - offset) / sizeof(T))
+				return false;
+			data = mesh_buffer<T>(reinterpret_cast<const T*>(file->data() + offset), static_cast<size_t>(count), file);
+			return true;
+		}
+	}
+
+	// Only TriangleMesh objects are stored, anything else is skipped. Returns false without writing when a mesh
+	// uses a texture made in memory.
+	inline bool save(const std::string &path, const std::vector<std::unique_ptr<Object>> &objects)
+	{
+		std::vector<const TriangleMesh*> meshes;
+		for (auto &object : objects)
+			if (auto mesh = dynamic_cast<const TriangleMesh*>(object.get()))
+				meshes.push_back(mesh);
+
+		std::vector<mesh_record> records(meshes.size());
+		appearance::table_writer tables;
+		for (size_t i = 0; i < meshes.size(); ++i)
+		{
+			if (!tables.texture(meshes[i]->texture_id, records[i].texture))
+				return false;
+			records[i].material = tables.material(meshes[i]->material_id);
+		}
+
+		std::ofstream ofs(path, std::ios::out | std::ios::binary);
+		if (!ofs.is_open())
+			return false;
+
+		file_header header;
+		std::memcpy(header.magic, kMagic, sizeof(kMagic));
+		header.version = kVersion;
+		header.num_meshes = static_cast<uint32_t>(meshes.size());
+		header.tables_offset = header.tables_bytes = 0;
+
+		// The header and record table are written up front with placeholder offsets and patched once the arrays are out
+		ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		ofs.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(mesh_record));
+		uint64_t offset = sizeof(header) + records.size() * sizeof(mesh_record);
+
+		for (size_t i = 0; i < meshes.size(); ++i)
+		{
+			const TriangleMesh &mesh = *meshes[i];
+			mesh_record &record = records[i];
+			record.color = mesh.color;
+			record.num_tris = mesh.get_num_tris();
+			record.num_vertices = static_cast<uint32_t>(mesh.get_vertices().size());
+			record.num_nodes = static_cast<uint32_t>(mesh.get_bvh().get_nodes().size());
+			std::memcpy(record.translation, &mesh.get_translation().x[0][0], sizeof(record.translation));
+			std::memcpy(record.rotation, &mesh.get_rotation().x[0][0], sizeof(record.rotation));
+			record.vertices_offset = detail::write_array(ofs, offset, mesh.get_vertices());
+			record.tris_offset = detail::write_array(ofs, offset, mesh.get_tris_index());
+			record.normals_offset = detail::write_array(ofs, offset, mesh.get_normals());
+			record.st_offset = detail::write_array(ofs, offset, mesh.get_tex_coordinates());
+			record.nodes_offset = detail::write_array(ofs, offset, mesh.get_bvh().get_nodes());
+			record.prim_indices_offset = detail::write_array(ofs, offset, mesh.get_bvh().get_prim_indices());
+			record.has_tri_materials = !mesh.get_triangle_materials().empty();
+			record.tri_materials_offset = 0;
+			if (record.has_tri_materials)
+			{
+				std::vector<uint16_t> indices = tables.triangle_materials(mesh.get_triangle_materials());
+				record.tri_materials_offset = detail::write_array(ofs, offset, indices.data(), indices.size());
+			}
+			record.padding = 0;
+		}
+
+		std::vector<char> table_data = tables.serialize();
+		header.tables_offset = detail::write_array(ofs, offset, table_data.data(), table_data.size());
+		header.tables_bytes = table_data.size();
+
+		ofs.seekp(0);
+		ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		ofs.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(mesh_record));
+		return static_cast<bool>(ofs);
+	}
+
+	// Appends the cached meshes to objects. The meshes use the mapped arrays in place, the mapping stays
+	// open until the last of them is gone. Returns false for missing, truncated or incompatible files, for files
+	// whose indices point out of range and when a texture cannot be read, in which case objects is left untouched.
+	inline bool load(const std::string &path, std::vector<std::unique_ptr<Object>> &objects)
+	{
+		auto file = std::make_shared<mapped_file>();
+		if (!file->open(path) || file->size() < sizeof(file_header))
+			return false;
+
+		const file_header &header = *reinterpret_cast<const file_header*>(file->data());
+		if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion ||
+			header.num_meshes > (file->size() - sizeof(file_header)) / sizeof(mesh_record) ||
+			header.tables_offset > file->size() || header.tables_bytes > file->size() - header.tables_offset)
+			return false;
+
+		appearance::table tables;
+		if (!tables.read(reinterpret_cast<const char*>(file->data() + header.tables_offset), header.tables_bytes))
+			return false;
+
+		const mesh_record *records = reinterpret_cast<const mesh_record*>(file->data() + sizeof(file_header));
+		std::vector<std::unique_ptr<Object>> loaded;
+		for (uint32_t i = 0; i < header.num_meshes; ++i)
+		{
+			const mesh_record &record = records[i];
+			uint64_t corners = static_cast<uint64_t>(record.num_tris) * 3;
+			mesh_buffer<Vec3f> vertices, normals;
+			mesh_buffer<uint32_t> tris, prim_indices;
+			mesh_buffer<Vec2f> st;
+			mesh_buffer<bvh_node> nodes;
+			if (!detail::map_array(file, record.vertices_offset, record.num_vertices, vertices) ||
+				!detail::map_array(file, record.tris_offset, corners, tris) ||
+				!detail::map_array(file, record.normals_offset, corners, normals) ||
+				!detail::map_array(file, record.st_offset, corners, st) ||
+				!detail::map_array(file, record.nodes_offset, record.num_nodes, nodes) ||
+				!detail::map_array(file, record.prim_indices_offset, record.num_tris, prim_indices))
+				return false;
+			// A corrupt or stale file must not send traversal or shading out of bounds
+			if (!bvh::well_formed(nodes.data(), record.num_nodes, prim_indices.data(), record.num_tris, record.num_tris))
+				return false;
+			for (uint64_t c = 0; c < corners; ++c)
+				if (tris[c] >= record.num_vertices)
+					return false;
+
+			uint32_t texture_id, material_id;
+			mesh_buffer<uint16_t> tri_material_indices;
+			std::vector<uint16_t> tri_materials;
+			if (!tables.texture(record.texture, texture_id) || !tables.material(record.material, material_id) ||
+				(record.has_tri_materials && (!detail::map_array(file, record.tri_materials_offset, record.num_tris, tri_material_indices) ||
+					!tables.triangle_materials(tri_material_indices.data(), tri_material_indices.size(), tri_materials))))
+				return false;
+
+			Matrix44f translation, rotation;
+			std::memcpy(&translation.x[0][0], record.translation, sizeof(record.translation));
+			std::memcpy(&rotation.x[0][0], record.rotation, sizeof(record.rotation));
+			loaded.push_back(std::unique_ptr<Object>(new TriangleMesh(std::move(vertices), std::move(tris), std::move(normals), std::move(st),
+				record.color, bvh(std::move(nodes), std::move(prim_indices)), translation, rotation)));
+			loaded.back()->texture_id = texture_id;
+			loaded.back()->material_id = material_id;
+			if (!tri_materials.empty())
+				static_cast<TriangleMesh*>(loaded.back().get())->set_triangle_materials(std::move(tri_materials));
+		}
+
+		for (auto &object : loaded)
+			objects.push_back(std::move(object));
+		return true;
+	}
+}
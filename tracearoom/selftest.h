@@ -0,0 +1,565 @@
+#pragma once
+
+#include<algorithm>
+#include<cmath>
+#include<cstdint>
+#include<fstream>
+#include<iostream>
+#include<memory>
+#include<set>
+#include<string>
+#include<thread>
+#include<vector>
+
+#include"cells.h"
+#include"compact_mesh.h"
+#include"geometry.h"
+#include"image_io.h"
+#include"lod.h"
+#include"polygon_primitves.h"
+#include"raytracer.h"
+#include"render_job.h"
+#include"sampler.h"
+#include"temporal_cache.h"
+#include"uniform_grid.h"
+
+// Checks the optimised parts of the renderer against simple references, run with --selftest.
+//
+// The accelerators are checked differentially: seeded random rays go through every way the renderer can intersect
+// a mesh(its bvh, from either builder, batches, the uniform grid, compact and lod meshes) and the hits have to match
+// those of testing every triangle in turn. Paths that trace the same triangles must agree to the bit, compact meshes
+// within their quantization. Renders are checked against golden images with compare_golden(--golden).
+namespace selftest
+{
+	// Count of checks and what failed, failures are printed as they happen
+	struct report
+	{
+		uint32_t checks = 0, failures = 0;
+
+		bool expect(bool ok, const std::string &what)
+		{
+			++checks;
+			if (!ok)
+			{
+				++failures;
+				std::cout << "FAILED: " << what << "\n";
+			}
+			return ok;
+		}
+	};
+
+	// Seeded random numbers, every run checks the same rays
+	class rng
+	{
+		uint32_t state;
+	public:
+		explicit rng(uint32_t seed) : state(seed) {}
+		float next() { return sampler::to_unit(sampler::hash(state++)); }
+		float next(float lo, float hi) { return lo + (hi - lo) * next(); }
+		Vec3f next(const Vec3f &lo, const Vec3f &hi) { return Vec3f(next(lo.x, hi.x), next(lo.y, hi.y), next(lo.z, hi.z)); }
+	};
+
+	// Sphere of radius around center cut into rings x segments quads, two triangles each
+	inline std::unique_ptr<TriangleMesh> make_sphere(const Vec3f &center, float radius, uint32_t rings, uint32_t segments)
+	{
+		std::vector<Vec3f> verts;
+		for (uint32_t r = 0; r <= rings; ++r)
+			for (uint32_t s = 0; s <= segments; ++s)
+			{
+				float theta = static_cast<float>(M_PI) * r / rings, phi = 2.0f * static_cast<float>(M_PI) * s / segments;
+				verts.push_back(center + Vec3f(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi)) * radius);
+			}
+		std::vector<uint32_t> tris;
+		for (uint32_t r = 0; r < rings; ++r)
+			for (uint32_t s = 0; s < segments; ++s)
+			{
+				uint32_t a = r * (segments + 1) + s, b = a + segments + 1;
+				uint32_t quad[6] = { a, b, a + 1, a + 1, b, b + 1 };
+				tris.insert(tris.end(), quad, quad + 6);
+			}
+		std::vector<Vec3f> normals(tris.size());
+		std::vector<Vec2f> st(tris.size());
+		return std::unique_ptr<TriangleMesh>(new TriangleMesh(std::move(verts), std::move(tris), std::move(normals), std::move(st), Vec3f(0.8f)));
+	}
+
+	// count triangles of up to size scattered over the box [lo, hi]
+	inline std::unique_ptr<TriangleMesh> make_soup(rng &random, uint32_t count, const Vec3f &lo, const Vec3f &hi, float size)
+	{
+		std::vector<Vec3f> verts;
+		std::vector<uint32_t> tris;
+		for (uint32_t t = 0; t < count; ++t)
+		{
+			Vec3f corner = random.next(lo, hi);
+			for (uint32_t k = 0; k < 3; ++k)
+			{
+				tris.push_back(static_cast<uint32_t>(verts.size()));
+				verts.push_back(corner + random.next(Vec3f(-size), Vec3f(size)));
+			}
+		}
+		std::vector<Vec3f> normals(tris.size());
+		std::vector<Vec2f> st(tris.size());
+		return std::unique_ptr<TriangleMesh>(new TriangleMesh(std::move(verts), std::move(tris), std::move(normals), std::move(st), Vec3f(0.8f)));
+	}
+
+	// Nearest hit by testing every triangle, the reference for everything else
+	inline bool brute_force_intersect(const TriangleMesh &mesh, const Vec3f &orig, const Vec3f &dir, float &tNear, uint32_t &tri)
+	{
+		const mesh_buffer<Vec3f> &verts = mesh.get_vertices();
+		const mesh_buffer<uint32_t> &index = mesh.get_tris_index();
+		bool isect = false;
+		for (uint32_t i = 0; i < mesh.get_num_tris(); ++i)
+		{
+			float t = kInfinity, u, v;
+			if (TriangleMesh::rayTriangleIntersect(orig, dir, verts[index[i * 3]], verts[index[i * 3 + 1]], verts[index[i * 3 + 2]], t, u, v) && t > 0.0f && t < tNear)
+				tNear = t, tri = i, isect = true;
+		}
+		return isect;
+	}
+
+	// Rays from around the bounds of mesh aimed at points inside them, so most of them hit
+	inline void make_rays(const TriangleMesh &mesh, rng &random, uint32_t count, std::vector<Vec3f> &origins, std::vector<Vec3f> &dirs)
+	{
+		Vec3f lo(kInfinity), hi(-kInfinity);
+		for (const Vec3f &v : mesh.get_vertices())
+		{
+			lo = Vec3f(std::min(lo.x, v.x), std::min(lo.y, v.y), std::min(lo.z, v.z));
+			hi = Vec3f(std::max(hi.x, v.x), std::max(hi.y, v.y), std::max(hi.z, v.z));
+		}
+		Vec3f margin = (hi - lo) * 0.5f + Vec3f(1e-3f);
+		origins.resize(count);
+		dirs.resize(count);
+		for (uint32_t r = 0; r < count; ++r)
+		{
+			origins[r] = random.next(lo - margin, hi + margin);
+			dirs[r] = random.next(lo, hi) - origins[r];
+			dirs[r].normalize();
+		}
+	}
+
+	// The matrix and inverse that geometry.h was first checked with(exported from Maya), then random rigid transforms
+	inline void check_matrix_inverse(report &result, rng &random)
+	{
+		Matrix44f m(0.707107f, 0, -0.707107f, 0, -0.331295f, 0.883452f, -0.331295f, 0, 0.624695f, 0.468521f, 0.624695f, 0, 4.000574f, 3.00043f, 4.000574f, 1);
+		Matrix44f expected(0.707107f, -0.331295f, 0.624695f, 0, 0, 0.883452f, 0.468521f, 0, -0.707107f, -0.331295f, 0.624695f, 0, 0, 0, -6.404043f, 1);
+		Matrix44f inverse = m.inverse();
+		float error = 0.0f;
+		for (uint32_t i = 0; i < 4; ++i)
+			for (uint32_t j = 0; j < 4; ++j)
+				error = std::max(error, std::abs(inverse[i][j] - expected[i][j]));
+		result.expect(error < 1e-4f, "Matrix44f::inverse of the reference matrix, off by " + std::to_string(error));
+
+		error = 0.0f;
+		for (uint32_t n = 0; n < 256; ++n)
+		{
+			Vec3f axis = random.next(Vec3f(-1), Vec3f(1)) + Vec3f(1e-3f);
+			axis.normalize();
+			Matrix44f transform = Matrix44f::create_rotation(random.next(-180.0f, 180.0f), axis) * Matrix44f::create_translation(random.next(Vec3f(-50), Vec3f(50)));
+			Matrix44f identity = transform * transform.inverse();
+			for (uint32_t i = 0; i < 4; ++i)
+				for (uint32_t j = 0; j < 4; ++j)
+					error = std::max(error, std::abs(identity[i][j] - (i == j ? 1.0f : 0.0f)));
+		}
+		result.expect(error < 1e-4f, "Matrix44f::inverse of random rigid transforms, off by " + std::to_string(error));
+	}
+
+	// Every way of intersecting mesh against testing each triangle
+	inline void check_mesh(report &result, rng &random, std::unique_ptr<TriangleMesh> mesh, const std::string &name, uint32_t num_rays)
+	{
+		mesh->update();
+		std::vector<Vec3f> origins, dirs;
+		make_rays(*mesh, random, num_rays, origins, dirs);
+
+		std::vector<float> reference(num_rays, kInfinity);
+		uint32_t num_hits = 0;
+		for (uint32_t r = 0; r < num_rays; ++r)
+		{
+			uint32_t tri;
+			num_hits += brute_force_intersect(*mesh, origins[r], dirs[r], reference[r], tri);
+		}
+		result.expect(num_hits > num_rays / 4, name + ": too few rays hit to tell anything, " + std::to_string(num_hits));
+
+		// Same triangles, same arithmetic: the nearest distance has to match exactly
+		auto exact = [&](const std::string &path, const std::vector<float> &t) {
+			uint32_t wrong = 0;
+			for (uint32_t r = 0; r < num_rays; ++r)
+				wrong += t[r] != reference[r];
+			result.expect(wrong == 0, name + ", " + path + ": " + std::to_string(wrong) + " of " + std::to_string(num_rays) + " rays differ from testing every triangle");
+		};
+
+		std::vector<float> t(num_rays, kInfinity);
+		for (uint32_t r = 0; r < num_rays; ++r)
+		{
+			uint32_t tri;
+			Vec2f uv;
+			mesh->intersect(origins[r], dirs[r], t[r], tri, uv);
+		}
+		exact(mesh->get_num_tris() >= (1u << 16) ? "lbvh" : "bvh", t);
+
+		std::vector<ray_hit> hits(num_rays);
+		mesh->intersect_batch(origins.data(), dirs.data(), num_rays, hits.data());
+		for (uint32_t r = 0; r < num_rays; ++r)
+			t[r] = hits[r].t;
+		exact("intersect_batch", t);
+
+		// A lod mesh traced without a ray footprint is the original
+		if (mesh->get_num_tris() > lod::kMinTris)
+		{
+			lod::lod_mesh levels(std::unique_ptr<TriangleMesh>(new TriangleMesh(mesh->get_vertices(), mesh->get_tris_index(), mesh->get_normals(), mesh->get_tex_coordinates(), mesh->color)), 1.0f);
+			std::fill(t.begin(), t.end(), kInfinity);
+			for (uint32_t r = 0; r < num_rays; ++r)
+			{
+				uint32_t tri;
+				Vec2f uv;
+				levels.intersect(origins[r], dirs[r], t[r], tri, uv);
+			}
+			exact("lod level 0", t);
+		}
+
+		// The grid over the mesh and a copy of it split in two, hits may come from either
+		{
+			std::vector<std::unique_ptr<Object>> objects;
+			objects.push_back(std::unique_ptr<Object>(new TriangleMesh(mesh->get_vertices(), mesh->get_tris_index(), mesh->get_normals(), mesh->get_tex_coordinates(), mesh->color)));
+			objects.back()->update();
+			uniform_grid grid;
+			grid.build(objects);
+			std::fill(t.begin(), t.end(), kInfinity);
+			for (uint32_t r = 0; r < num_rays; ++r)
+			{
+				uint32_t tri;
+				Vec2f uv;
+				grid.intersect(origins[r], dirs[r], t[r], tri, uv);
+			}
+			exact("uniform grid", t);
+		}
+
+		// Quantized positions move hits by up to the quantization step, a ray near an edge may go either way
+		{
+			compact::CompactTriangleMesh compact_mesh(*mesh);
+			uint32_t disagree = 0, far_off = 0;
+			for (uint32_t r = 0; r < num_rays; ++r)
+			{
+				float tc = kInfinity;
+				uint32_t tri;
+				Vec2f uv;
+				bool hit = compact_mesh.intersect(origins[r], dirs[r], tc, tri, uv);
+				if (hit != (reference[r] < kInfinity))
+					++disagree;
+				else if (hit && std::abs(tc - reference[r]) > 1e-3f * std::max(1.0f, reference[r]))
+					++far_off;
+			}
+			result.expect(disagree <= num_rays / 200 && far_off <= num_rays / 200, name + ", compact: " + std::to_string(disagree) +
+				" rays disagree on hitting and " + std::to_string(far_off) + " hit elsewhere, of " + std::to_string(num_rays));
+		}
+	}
+
+	// A row of rooms along -z with a doorway in every wall between two of them and a window to the outside in the
+	// first, each room holding a random triangle soup. Adds the walls and soups to objects and returns the layout.
+	inline cells::layout make_building(rng &random, uint32_t num_rooms, std::vector<std::unique_ptr<Object>> &objects)
+	{
+		cells::layout building;
+		std::vector<Vec3f> verts;
+		auto quad = [&](const Vec3f &a, const Vec3f &b, const Vec3f &c, const Vec3f &d) {
+			const Vec3f corners[6] = { a, b, c, c, d, a };
+			verts.insert(verts.end(), corners, corners + 6);
+		};
+		// Walls facing along z with a hole [x0, x1] x [y0, y1] in them
+		auto wall = [&](float z, float x0, float x1, float y0, float y1) {
+			quad(Vec3f(-10, -6, z), Vec3f(x0, -6, z), Vec3f(x0, 6, z), Vec3f(-10, 6, z));
+			quad(Vec3f(x1, -6, z), Vec3f(10, -6, z), Vec3f(10, 6, z), Vec3f(x1, 6, z));
+			quad(Vec3f(x0, -6, z), Vec3f(x1, -6, z), Vec3f(x1, y0, z), Vec3f(x0, y0, z));
+			quad(Vec3f(x0, y1, z), Vec3f(x1, y1, z), Vec3f(x1, 6, z), Vec3f(x0, 6, z));
+		};
+
+		wall(0, 0, 0, 0, 0);
+		for (uint32_t r = 0; r < num_rooms; ++r)
+		{
+			float z0 = -20.0f * (r + 1), z1 = -20.0f * r;
+			building.cells.push_back({ "room" + std::to_string(r), bbox(Vec3f(-10, -6, z0), Vec3f(10, 6, z1)) });
+			quad(Vec3f(-10, -6, z0), Vec3f(10, -6, z0), Vec3f(10, -6, z1), Vec3f(-10, -6, z1));
+			quad(Vec3f(-10, 6, z0), Vec3f(10, 6, z0), Vec3f(10, 6, z1), Vec3f(-10, 6, z1));
+			quad(Vec3f(10, -6, z0), Vec3f(10, 6, z0), Vec3f(10, 6, z1), Vec3f(10, -6, z1));
+			if (r == 0)
+			{
+				// Window in the side wall, z in [-14, -6] and y in [-2, 2]
+				quad(Vec3f(-10, -6, z0), Vec3f(-10, 6, z0), Vec3f(-10, 6, -14), Vec3f(-10, -6, -14));
+				quad(Vec3f(-10, -6, -6), Vec3f(-10, 6, -6), Vec3f(-10, 6, z1), Vec3f(-10, -6, z1));
+				quad(Vec3f(-10, -6, -14), Vec3f(-10, -2, -14), Vec3f(-10, -2, -6), Vec3f(-10, -6, -6));
+				quad(Vec3f(-10, 2, -14), Vec3f(-10, 6, -14), Vec3f(-10, 6, -6), Vec3f(-10, 2, -6));
+				building.portals.push_back({ { 0, cells::kOutside }, bbox(Vec3f(-10, -2, -14), Vec3f(-10, 2, -6)) });
+			}
+			else
+				quad(Vec3f(-10, -6, z0), Vec3f(-10, 6, z0), Vec3f(-10, 6, z1), Vec3f(-10, -6, z1));
+
+			float door = r % 2 == 0 ? -4.0f : 4.0f;
+			if (r + 1 == num_rooms)
+				wall(z0, 0, 0, 0, 0);
+			else
+			{
+				wall(z0, door - 2, door + 2, -6, 2);
+				building.portals.push_back({ { r, r + 1 }, bbox(Vec3f(door - 2, -6, z0), Vec3f(door + 2, 2, z0)) });
+			}
+			objects.push_back(make_soup(random, 400, Vec3f(-9, -5, z0 + 1), Vec3f(9, 5, z1 - 1), 0.8f));
+		}
+		// Something to see through the window
+		quad(Vec3f(-30, -20, -40), Vec3f(-30, 20, -40), Vec3f(-30, 20, 20), Vec3f(-30, -20, 20));
+
+		std::vector<uint32_t> tris(verts.size());
+		for (uint32_t i = 0; i < tris.size(); ++i)
+			tris[i] = i;
+		size_t num_verts = verts.size();
+		objects.push_back(std::unique_ptr<Object>(new TriangleMesh(std::move(verts), std::move(tris), std::vector<Vec3f>(num_verts), std::vector<Vec2f>(num_verts), Vec3f(0.8f))));
+		for (auto &object : objects)
+			object->update();
+		return building;
+	}
+
+	// Rays from inside the rooms in every direction, most of them pass doorways, some the window
+	inline void check_cells(report &result, rng &random, uint32_t num_rays)
+	{
+		std::vector<std::unique_ptr<Object>> objects;
+		cells::layout building = make_building(random, 12, objects);
+		cells::portal_graph rooms;
+		rooms.build(objects, building);
+
+		uint32_t wrong = 0;
+		for (uint32_t r = 0; r < num_rays; ++r)
+		{
+			const cells::cell &start = building.cells[static_cast<uint32_t>(random.next() * building.cells.size())];
+			Vec3f orig = random.next(start.bounds.min + Vec3f(0.5f), start.bounds.max - Vec3f(0.5f));
+			// Aimed down the row of rooms a third of the time so plenty of rays pass several doorways
+			Vec3f dir = random.next(Vec3f(-1), Vec3f(1));
+			if (r % 3 == 0)
+				dir.z = -std::abs(dir.z) * 4.0f;
+			dir.normalize();
+
+			float expected = kInfinity;
+			for (auto &object : objects)
+			{
+				float t = kInfinity;
+				uint32_t tri;
+				if (brute_force_intersect(static_cast<const TriangleMesh&>(*object), orig, dir, t, tri) && t < expected)
+					expected = t;
+			}
+			float t = kInfinity;
+			uint32_t tri;
+			Vec2f uv;
+			rooms.intersect(orig, dir, t, tri, uv);
+			wrong += t != expected;
+		}
+		result.expect(wrong == 0, "cells and portals: " + std::to_string(wrong) + " of " + std::to_string(num_rays) + " rays differ from testing every triangle");
+	}
+
+	// Trees stay within the traversal stack: triangles crowded towards one corner at powers of two give the linear
+	// builder long chains of morton code prefixes, and a tree read from a file that is too deep is turned away
+	inline void check_bvh_depth(report &result)
+	{
+		const uint32_t steps = 30, count = 30000;
+		std::vector<Vec3f> verts;
+		std::vector<uint32_t> tris;
+		for (uint32_t t = 0; t < count; ++t)
+		{
+			Vec3f corner(std::ldexp(1.0f, -static_cast<int>(t % steps)), std::ldexp(1.0f, -static_cast<int>(t / steps % steps)), std::ldexp(1.0f, -static_cast<int>(t / steps / steps % steps)));
+			for (const Vec3f &offset : { Vec3f(0), Vec3f(1e-7f, 0, 0), Vec3f(0, 1e-7f, 0) })
+			{
+				tris.push_back(static_cast<uint32_t>(verts.size()));
+				verts.push_back(corner + offset);
+			}
+		}
+		bvh binned;
+		binned.build(verts.data(), tris.data(), count);
+		bvh linear = lbvh::build(verts.data(), tris.data(), count);
+		result.expect(bvh::well_formed_tree(binned.get_nodes().data(), static_cast<uint32_t>(binned.get_nodes().size())), "bvh depth: the binned builder went deeper than bvh::kMaxDepth");
+		result.expect(bvh::well_formed_tree(linear.get_nodes().data(), static_cast<uint32_t>(linear.get_nodes().size())), "bvh depth: the linear builder went deeper than bvh::kMaxDepth");
+
+		// Every interior node's far child is a leaf at the end
+		const uint32_t interior = bvh::kMaxDepth + 1, num_nodes = 2 * interior + 1;
+		std::vector<bvh_node> chain(num_nodes);
+		for (uint32_t n = 0; n < interior; ++n)
+			chain[n].count = 0, chain[n].offset = num_nodes - 1 - n;
+		for (uint32_t n = interior; n < num_nodes; ++n)
+			chain[n].count = 1, chain[n].offset = 0;
+		result.expect(!bvh::well_formed_tree(chain.data(), num_nodes), "bvh depth: a tree deeper than bvh::kMaxDepth was accepted");
+	}
+
+	// A pool without workers has nobody to hand tasks to, so submit and parallel_for run them before returning
+	inline void check_thread_pool(report &result)
+	{
+		thread_pool no_workers(0);
+		bool ran = false;
+		no_workers.submit([&ran] { ran = true; });
+		result.expect(ran, "thread pool without workers: submit did not run the task");
+
+		uint32_t sum = 0;
+		no_workers.parallel_for(0, 100, 7, [&sum](uint32_t first, uint32_t last) {
+			for (uint32_t i = first; i < last; ++i)
+				sum += i;
+		});
+		result.expect(sum == 4950, "thread pool without workers: parallel_for summed to " + std::to_string(sum));
+	}
+
+	// Every tile of a job arrives once and lands in the frame, also on a pool without workers, and cancelling stops
+	// a job before its last tile
+	inline void check_render_jobs(report &result)
+	{
+		auto fill = [](const distributed::tile &t, Vec3f *pixels) { std::fill(pixels, pixels + t.width() * t.height(), Vec3f(static_cast<float>(t.id))); };
+		thread_pool no_workers(0);
+		thread_pool *pools[2] = { &thread_pool::shared(), &no_workers };
+		for (thread_pool *pool : pools)
+		{
+			const uint32_t width = 100, height = 70;
+			render_job::handle job = render_job::start(width, height, 16, fill, *pool);
+			std::vector<uint32_t> seen(job.get_progress().tiles, 0);
+			render_job::finished_tile tile;
+			while (job.next(tile))
+				++seen[tile.area.id];
+			bool every_tile_once = std::count(seen.begin(), seen.end(), 1u) == static_cast<std::ptrdiff_t>(seen.size());
+			uint32_t misplaced = 0;
+			for (uint32_t y = 0; y < height; ++y)
+				for (uint32_t x = 0; x < width; ++x)
+					misplaced += job.frame()[y * width + x].x != static_cast<float>(y / 16 * ((width + 15) / 16) + x / 16);
+			std::string pool_name = pool->size() ? "render jobs" : "render jobs without workers";
+			result.expect(job.wait() == render_job::status::finished && every_tile_once, pool_name + ": tiles missing or repeated");
+			result.expect(misplaced == 0, pool_name + ": " + std::to_string(misplaced) + " pixels of the frame are not from their tile");
+		}
+
+		render_job::handle slow = render_job::start(64, 64, 4, [&](const distributed::tile &t, Vec3f *pixels) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			fill(t, pixels);
+		});
+		render_job::finished_tile tile;
+		slow.next(tile);
+		slow.cancel();
+		render_job::progress p = slow.get_progress();
+		result.expect(slow.wait() == render_job::status::cancelled && slow.get_progress().tiles_done < p.tiles, "render jobs: cancelling did not stop the job");
+	}
+
+	// Stratification the sampler promises: every dimension alone and the first two together at every power of two
+	inline void check_sampler(report &result)
+	{
+		uint32_t bad = 0;
+		const uint32_t seed = sampler::pixel_seed(17, 42);
+		for (uint32_t m = 1; m <= 8; ++m)
+		{
+			uint32_t n = 1u << m;
+			for (uint32_t d = 0; d < sampler::kSobolDimensions; ++d)
+			{
+				std::set<uint32_t> strata;
+				for (uint32_t i = 0; i < n; ++i)
+					strata.insert(static_cast<uint32_t>(sampler::owen_sobol(seed, i, d) * n));
+				bad += strata.size() != n;
+			}
+			for (uint32_t k = 0; k <= m; ++k)
+			{
+				std::set<uint64_t> cells;
+				for (uint32_t i = 0; i < n; ++i)
+					cells.insert(static_cast<uint64_t>(sampler::owen_sobol(seed, i, 0) * (1u << k)) << 32 | static_cast<uint32_t>(sampler::owen_sobol(seed, i, 1) * (1u << (m - k))));
+				bad += cells.size() != n;
+			}
+		}
+		result.expect(bad == 0, "Owen scrambled Sobol samples lost their stratification in " + std::to_string(bad) + " cases");
+	}
+
+	// Pixels that temporal reuse traces average every sample of the pixel, as renders without reuse do
+	inline void check_temporal_samples(report &result)
+	{
+		const uint32_t samples = 4, width = 32, height = 24;
+		std::vector<std::unique_ptr<Object>> objects;
+		std::vector<Vec3f> corners{ { 2, 1.5f, -5 }, { -1, 1.5f, -5 }, { -1, -2, -5 }, { 2, -2, -5 } };
+		objects.emplace_back(new TriangleMesh(std::move(corners), std::vector<uint32_t>{ 0, 1, 2, 2, 3, 0 }, std::vector<Vec3f>(6), std::vector<Vec2f>(6), Vec3f(0.8f)));
+		std::vector<std::unique_ptr<PointLight>> lights;
+		lights.emplace_back(new PointLight(Matrix44f::create_translation(Vec3f(0, 3, 0)), 1, 100));
+		raytracer tracer(objects, lights, Vec3f(0.2f));
+
+		pinhole_camera camera(width, height, 60.0f, Matrix44f());
+		temporal_cache reprojection;
+		reprojection.config.samples = samples;
+		std::vector<Vec3f> frame(width * height);
+		reprojection.render(camera, tracer, frame.data(), 3);
+
+		uint32_t wrong = 0, averaged = 0;
+		ray_footprint_scope footprint(camera.pixel_spread() / std::sqrt(static_cast<float>(samples)));
+		for (uint32_t j = 0; j < height; ++j)
+			for (uint32_t i = 0; i < width; ++i)
+			{
+				sampler::pixel_sampler pixel(sampler::sequence::sobol, i, j, 3);
+				Vec3f sum = 0;
+				for (uint32_t s = 0; s < samples; ++s)
+					sum = sum + tracer.shoot(camera.origin, camera.ray_direction_at(i + pixel.get(s, 0), j + pixel.get(s, 1)));
+				Vec3f expected = sum * (1.0f / samples), got = frame[j * width + i];
+				wrong += got.x != expected.x || got.y != expected.y || got.z != expected.z;
+				Vec3f center = tracer.shoot(camera.origin, camera.ray_direction(i, j));
+				averaged += got.x != center.x || got.y != center.y || got.z != center.z;
+			}
+		result.expect(wrong == 0 && averaged > 0, "temporal reuse: " + std::to_string(wrong) + " of " + std::to_string(width * height) + " traced pixels are not the average of their " + std::to_string(samples) + " samples");
+	}
+
+	// Runs every check on generated geometry and on the meshes of scene, returns true if all passed
+	inline bool run(const std::vector<std::unique_ptr<Object>> &scene)
+	{
+		report result;
+		rng random(1);
+		check_matrix_inverse(result, random);
+		check_sampler(result);
+		check_cells(result, random, 4096);
+		check_bvh_depth(result);
+		check_thread_pool(result);
+		check_render_jobs(result);
+		check_temporal_samples(result);
+		check_mesh(result, random, make_soup(random, 3000, Vec3f(-5), Vec3f(5), 0.6f), "random triangles", 4096);
+		check_mesh(result, random, make_sphere(Vec3f(1, 2, -3), 4.0f, 160, 256), "sphere", 4096);
+		for (size_t i = 0; i < scene.size(); ++i)
+			if (auto mesh = dynamic_cast<const TriangleMesh*>(scene[i].get()))
+			{
+				std::unique_ptr<TriangleMesh> copy(new TriangleMesh(mesh->get_vertices(), mesh->get_tris_index(), mesh->get_normals(), mesh->get_tex_coordinates(), mesh->color));
+				// Testing every triangle is slow on large meshes, fewer rays keep the whole run to seconds
+				uint32_t num_rays = std::max(256u, std::min(2048u, (1u << 28) / std::max(1u, mesh->get_num_tris())));
+				check_mesh(result, random, std::move(copy), "scene mesh " + std::to_string(i), num_rays);
+			}
+
+		std::cout << result.checks - result.failures << " of " << result.checks << " checks passed\n";
+		return result.failures == 0;
+	}
+
+	// Compares a frame with a golden image, written from the frame when there is none yet. Fails when the mean
+	// relative difference of the channels goes over tolerance, or any channel is off by more than 100 times that.
+	inline bool compare_golden(const std::string &path, uint32_t width, uint32_t height, const Vec3f *pixels, float tolerance)
+	{
+		uint32_t golden_width, golden_height;
+		std::vector<Vec3f> golden;
+		if (!image_io::read_pfm(path, golden_width, golden_height, golden))
+		{
+			// A golden image that is there but cannot be read fails, only a missing one is recorded
+			if (std::ifstream(path).is_open())
+			{
+				std::cout << "Unable to read the golden image " << path << "\n";
+				return false;
+			}
+			if (!image_io::write_pfm(path, width, height, pixels))
+			{
+				std::cout << "Unable to write " << path << "\n";
+				return false;
+			}
+			std::cout << "Recorded the golden image " << path << "\n";
+			return true;
+		}
+		if (golden_width != width || golden_height != height)
+		{
+			std::cout << "Golden image " << path << " is " << golden_width << "x" << golden_height << ", the frame " << width << "x" << height << "\n";
+			return false;
+		}
+
+		double sum = 0.0;
+		float worst = 0.0f;
+		for (size_t p = 0; p < golden.size(); ++p)
+			for (uint32_t c = 0; c < 3; ++c)
+			{
+				float difference = std::abs(pixels[p][c] - golden[p][c]) / std::max(std::abs(golden[p][c]), 1e-3f);
+				sum += difference;
+				worst = std::max(worst, difference);
+			}
+		float mean = static_cast<float>(sum / (golden.size() * 3));
+		bool ok = mean <= tolerance && worst <= tolerance * 100.0f;
+		std::cout << (ok ? "Matches" : "Differs from") << " golden image " << path << ": mean relative difference " << mean << ", largest " << worst << "\n";
+		return ok;
+	}
+}
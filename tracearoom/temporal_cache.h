@@ -0,0 +1,261 @@
+#pragma once
+
+#include<algorithm>
+#include<atomic>
+#include<cmath>
+#include<cstdint>
+#include<cstring>
+#include<memory>
+#include<vector>
+
+#include"camera.h"
+#include"geometry.h"
+#include"lod.h"
+#include"profile.h"
+#include"raytracer.h"
+#include"sampler.h"
+#include"thread_pool.h"
+
+// Reuses the previous frame's shading when only the camera moved.
+// Every pixel remembers the world point it hit and the radiance there. The next frame scatters those points through the
+// new camera, the nearest one landing in a pixel wins. Diffuse shading looks the same from every direction so its
+// radiance can be reused, apart from texture filtering picking mip levels by distance. Glossy, mirror and dielectric
+// points still hide what is behind them but are always traced again, as are pixels that got no point, sit on a depth
+// edge or whose point got too old.
+// When too few points survive the whole frame is traced instead.
+// Traced pixels average config.samples rays spread over the pixel like any other render, the hit of the first one is
+// the point that is reprojected.
+//
+// Call invalidate whenever anything but the camera changed.
+class temporal_cache
+{
+public:
+	struct settings
+	{
+		uint8_t max_lifetime = 8;			// frames a traced point is reused at most
+		float depth_tolerance = 0.05f;		// relative depth difference to a neighbor that counts as an edge
+		float max_retrace_fraction = 0.5f;	// trace the full frame when more of the reprojected points than this are rejected
+		uint32_t samples = 1;				// rays per traced pixel
+		sampler::sequence sequence = sampler::sequence::sobol;
+	};
+
+	struct frame_stats
+	{
+		uint32_t reused = 0;
+		uint32_t traced = 0;
+		bool full_trace = false;
+	};
+
+	settings config;
+
+	void invalidate() { valid = false; }
+
+	// Renders the frame seen by camera into framebuffer(width * height pixels), frame seeds the sample patterns
+	frame_stats render(const pinhole_camera &camera, const raytracer &tracer, Vec3f *framebuffer, uint32_t frame = 0, thread_pool &pool = thread_pool::shared())
+	{
+		TRACEAROOM_PROFILE_SCOPE("trace");
+		if (camera.width != width || camera.height != height)
+			resize(camera.width, camera.height);
+
+		frame_stats stats;
+		bool reuse = valid && scatter(camera, pool) && classify(pool);
+		stats.full_trace = !reuse;
+
+		std::atomic<uint32_t> num_reused{ 0 };
+		pool.parallel_for(0, height, 4, [&](uint32_t first_row, uint32_t last_row) {
+			TRACEAROOM_PROFILE_SCOPE("trace rows");
+			const uint32_t samples = std::max(1u, config.samples);
+			// Each sample covers a share of the pixel
+			ray_footprint_scope footprint(camera.pixel_spread() / std::sqrt(static_cast<float>(samples)));
+			std::vector<float> dx(samples), dy(samples);
+			uint32_t reused = 0;
+			for (uint32_t j = first_row; j < last_row; ++j) {
+				for (uint32_t i = 0; i < width; ++i) {
+					uint32_t p = j * width + i;
+					if (reuse && !retrace[p]) {
+						uint32_t source = static_cast<uint32_t>(nearest[p].load(std::memory_order_relaxed));
+						framebuffer[p] = radiance[source];
+						next_positions[p] = positions[source];
+						next_radiance[p] = radiance[source];
+						next_lifetimes[p] = static_cast<uint8_t>(lifetimes[source] - 1);
+						next_view_dependent[p] = 0;
+						++reused;
+						continue;
+					}
+
+					Vec3f dir;
+					float hit_distance;
+					bool view_dependent;
+					Vec3f color = trace_pixel(camera, tracer, i, j, frame, dx.data(), dy.data(), dir, hit_distance, view_dependent);
+					framebuffer[p] = color;
+					next_positions[p] = hit_distance < kInfinity ? camera.origin + dir * hit_distance : Vec3f(kInfinity);
+					next_radiance[p] = color;
+					next_lifetimes[p] = initial_lifetime(i, j);
+					next_view_dependent[p] = view_dependent ? 1 : 0;
+				}
+			}
+			num_reused += reused;
+		});
+
+		std::swap(positions, next_positions);
+		std::swap(radiance, next_radiance);
+		std::swap(lifetimes, next_lifetimes);
+		std::swap(view_dependent, next_view_dependent);
+		valid = true;
+		stats.reused = num_reused;
+		stats.traced = width * height - stats.reused;
+		return stats;
+	}
+
+private:
+	static constexpr uint64_t kNoPoint = ~0ull;
+
+	uint32_t width = 0, height = 0;
+	bool valid = false;
+	// Per pixel state of the last frame, pixels that hit nothing have a position of kInfinity
+	std::vector<Vec3f> positions, radiance;
+	std::vector<uint8_t> lifetimes;
+	// 1 where the radiance depends on the view, those points are never reused
+	std::vector<uint8_t> view_dependent;
+	// State of the frame being rendered, swapped in once it is done
+	std::vector<Vec3f> next_positions, next_radiance;
+	std::vector<uint8_t> next_lifetimes, next_view_dependent;
+	// Nearest point that landed in each pixel, its depth bits in the high half and its source pixel in the low half
+	std::unique_ptr<std::atomic<uint64_t>[]> nearest;
+	std::vector<uint8_t> retrace;
+	uint32_t num_scattered = 0;
+
+	void resize(uint32_t image_width, uint32_t image_height)
+	{
+		width = image_width, height = image_height;
+		size_t num_pixels = static_cast<size_t>(width) * height;
+		positions.assign(num_pixels, Vec3f(kInfinity));
+		radiance.assign(num_pixels, Vec3f(0));
+		lifetimes.assign(num_pixels, 0);
+		view_dependent.assign(num_pixels, 0);
+		next_positions.resize(num_pixels);
+		next_radiance.resize(num_pixels);
+		next_lifetimes.resize(num_pixels);
+		next_view_dependent.resize(num_pixels);
+		nearest.reset(new std::atomic<uint64_t>[num_pixels]);
+		retrace.resize(num_pixels);
+		valid = false;
+	}
+
+	// Colour of pixel (i, j), dir and hit_distance of its first ray. dx and dy hold config.samples values.
+	Vec3f trace_pixel(const pinhole_camera &camera, const raytracer &tracer, uint32_t i, uint32_t j, uint32_t frame, float *dx, float *dy, Vec3f &dir, float &hit_distance, bool &view_dependent) const
+	{
+		if (config.samples <= 1) {
+			dir = camera.ray_direction(i, j);
+			return tracer.shoot(ray(camera.origin, dir), hit_distance, view_dependent);
+		}
+
+		sampler::pixel_sampler pixel(config.sequence, i, j, frame);
+		pixel.get_batch(0, config.samples, 0, dx);
+		pixel.get_batch(0, config.samples, 1, dy);
+		Vec3f sum = 0;
+		view_dependent = false;
+		for (uint32_t s = 0; s < config.samples; ++s) {
+			Vec3f sample_dir = camera.ray_direction_at(i + dx[s], j + dy[s]);
+			float distance;
+			bool sample_view_dependent;
+			sum = sum + tracer.shoot(ray(camera.origin, sample_dir), distance, sample_view_dependent);
+			view_dependent = view_dependent || sample_view_dependent;
+			if (s == 0)
+				dir = sample_dir, hit_distance = distance;
+		}
+		return sum * (1.0f / config.samples);
+	}
+
+	// Spread between half and the full lifetime so the whole image does not expire in the same frame
+	uint8_t initial_lifetime(uint32_t i, uint32_t j) const
+	{
+		uint32_t half = config.max_lifetime / 2u;
+		uint32_t hash = (i * 73856093u) ^ (j * 19349663u);
+		return static_cast<uint8_t>(config.max_lifetime - (half ? (hash >> 8) % (half + 1) : 0));
+	}
+
+	static float depth_of(uint64_t key)
+	{
+		uint32_t bits = static_cast<uint32_t>(key >> 32);
+		float depth;
+		std::memcpy(&depth, &bits, sizeof(depth));
+		return depth;
+	}
+
+	// Forward projects the last frame's points, returns false when none of them is visible
+	bool scatter(const pinhole_camera &camera, thread_pool &pool)
+	{
+		uint32_t num_pixels = width * height;
+		std::atomic<uint32_t> scattered{ 0 };
+		pool.parallel_for(0, num_pixels, 16384, [&](uint32_t first, uint32_t last) {
+			for (uint32_t p = first; p < last; ++p)
+				nearest[p].store(kNoPoint, std::memory_order_relaxed);
+		});
+
+		pool.parallel_for(0, num_pixels, 16384, [&](uint32_t first, uint32_t last) {
+			uint32_t count = 0;
+			for (uint32_t source = first; source < last; ++source) {
+				float px, py, depth;
+				if (positions[source].x == kInfinity || lifetimes[source] == 0 || !camera.project(positions[source], px, py, depth))
+					continue;
+				if (px < 0.0f || py < 0.0f || px >= width || py >= height)
+					continue;
+
+				// Positive floats order like their bits, so the smallest key is the nearest point
+				uint32_t depth_bits;
+				std::memcpy(&depth_bits, &depth, sizeof(depth_bits));
+				uint64_t key = (static_cast<uint64_t>(depth_bits) << 32) | source;
+				auto &slot = nearest[static_cast<uint32_t>(py) * width + static_cast<uint32_t>(px)];
+				uint64_t current = slot.load(std::memory_order_relaxed);
+				while (key < current && !slot.compare_exchange_weak(current, key, std::memory_order_relaxed)) {}
+				++count;
+			}
+			scattered += count;
+		});
+
+		num_scattered = scattered;
+		return num_scattered > 0;
+	}
+
+	// Marks the pixels that have to be traced, returns false when so many points were rejected that a full trace is due
+	bool classify(thread_pool &pool)
+	{
+		std::atomic<uint32_t> accepted{ 0 };
+		pool.parallel_for(0, height, 16, [&](uint32_t first_row, uint32_t last_row) {
+			uint32_t count = 0;
+			for (uint32_t j = first_row; j < last_row; ++j) {
+				for (uint32_t i = 0; i < width; ++i) {
+					uint32_t p = j * width + i;
+					uint64_t key = nearest[p].load(std::memory_order_relaxed);
+					if (key == kNoPoint) {
+						retrace[p] = 1;
+						continue;
+					}
+
+					// Points on a depth edge or next to a hole may cover something that became visible, e.g. past a silhouette
+					float depth = depth_of(key);
+					uint32_t holes = 0;
+					bool edge = false;
+					const int32_t offsets[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+					for (const auto &offset : offsets) {
+						int32_t ni = static_cast<int32_t>(i) + offset[0], nj = static_cast<int32_t>(j) + offset[1];
+						if (ni < 0 || nj < 0 || ni >= static_cast<int32_t>(width) || nj >= static_cast<int32_t>(height))
+							continue;
+						uint64_t neighbor = nearest[nj * width + ni].load(std::memory_order_relaxed);
+						if (neighbor == kNoPoint)
+							++holes;
+						else if (std::fabs(depth_of(neighbor) - depth) > config.depth_tolerance * std::min(depth, depth_of(neighbor)))
+							edge = true;
+					}
+
+					retrace[p] = (edge || holes > 0 || view_dependent[static_cast<uint32_t>(key)]) ? 1 : 0;
+					count += retrace[p] ? 0 : 1;
+				}
+			}
+			accepted += count;
+		});
+
+		return accepted >= (1.0f - config.max_retrace_fraction) * num_scattered;
+	}
+};
@@ -0,0 +1,526 @@
+#pragma once
+
+#include<algorithm>
+#include<cmath>
+#include<condition_variable>
+#include<cstdint>
+#include<cstring>
+#include<fstream>
+#include<list>
+#include<memory>
+#include<mutex>
+#include<string>
+#include<vector>
+
+#include<sys/stat.h>
+#include<sys/types.h>
+
+#include"geometry.h"
+#include"image_io.h"
+
+// Textures for surface colours, sampled with trilinear filtering over precomputed mip chains.
+//
+// Texels are 8 bit sRGB(stored as RGBA8) and filtered in linear space. Every mip level is kept in tiles of 8x8 texels,
+// tiles row by row and the texels of a tile in Morton order, so the texels a bilinear lookup and its neighbours touch
+// share a few cache lines whatever direction rays walk across the texture.
+//
+// All textures live in one shared cache. Without a budget every level stays in memory. With one, the levels of file
+// textures are written to a mip file next to the source(<source>.mip, reused while the source keeps its size and
+// modification time) and read
+// back on demand, least recently used levels are dropped once the resident ones take more than the budget(a level
+// larger than the whole budget is still read, it is just the only one left). Distant
+// surfaces only ever need the small levels, so a room of 8K textures keeps only the levels its view really uses.
+// Generated textures have no file to go back to and stay resident.
+namespace texture
+{
+	const uint32_t kNone = ~0u;
+	const uint32_t kTileSize = 8;
+	const char kMagic[8] = { 'T', 'R', 'A', 'C', 'E', 'M', 'I', 'P' };
+	const uint32_t kVersion = 2;
+
+	namespace detail
+	{
+		inline float srgb_to_linear(uint32_t value)
+		{
+			static const std::vector<float> table = [] {
+				std::vector<float> t(256);
+				for (uint32_t i = 0; i < 256; ++i)
+				{
+					float c = i / 255.0f;
+					t[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+				}
+				return t;
+			}();
+			return table[value & 0xFF];
+		}
+
+		inline uint32_t linear_to_srgb(float c)
+		{
+			c = std::min(1.0f, std::max(0.0f, c));
+			float s = c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+			return static_cast<uint32_t>(s * 255.0f + 0.5f);
+		}
+
+		inline uint32_t pack(const Vec3f &linear)
+		{
+			return linear_to_srgb(linear.x) | linear_to_srgb(linear.y) << 8 | linear_to_srgb(linear.z) << 16 | 0xFFu << 24;
+		}
+
+		inline Vec3f unpack(uint32_t texel)
+		{
+			return Vec3f(srgb_to_linear(texel), srgb_to_linear(texel >> 8), srgb_to_linear(texel >> 16));
+		}
+
+		// What a mip file remembers of its source to tell whether it still matches
+		struct file_stamp
+		{
+			uint64_t bytes;
+			int64_t modified;		// seconds since the epoch
+		};
+
+		inline bool stamp_of(const std::string &path, file_stamp &stamp)
+		{
+#ifdef _WIN32
+			struct _stat64 info;
+			if (_stat64(path.c_str(), &info) != 0)
+				return false;
+#else
+			struct stat info;
+			if (stat(path.c_str(), &info) != 0)
+				return false;
+#endif
+			stamp.bytes = static_cast<uint64_t>(info.st_size);
+			stamp.modified = static_cast<int64_t>(info.st_mtime);
+			return true;
+		}
+
+		// Position of (x, y) within an 8x8 tile
+		inline uint32_t morton(uint32_t x, uint32_t y)
+		{
+			auto spread = [](uint32_t v) { return (v & 1) | (v & 2) << 1 | (v & 4) << 2; };
+			return spread(x) | spread(y) << 1;
+		}
+	}
+
+	// One level of a mip chain
+	struct level
+	{
+		uint32_t width = 0, height = 0;
+		uint32_t tiles_x = 0, tiles_y = 0;
+		std::vector<uint32_t> texels;	// tiled, see above
+
+		level() {}
+		level(uint32_t w, uint32_t h) :
+			width(w),
+			height(h),
+			tiles_x((w + kTileSize - 1) / kTileSize),
+			tiles_y((h + kTileSize - 1) / kTileSize),
+			texels(static_cast<size_t>(tiles_x) * tiles_y * kTileSize * kTileSize, 0)
+		{}
+
+		size_t index(uint32_t x, uint32_t y) const
+		{
+			return (static_cast<size_t>(y / kTileSize) * tiles_x + x / kTileSize) * kTileSize * kTileSize + detail::morton(x % kTileSize, y % kTileSize);
+		}
+
+		uint32_t fetch(uint32_t x, uint32_t y) const { return texels[index(x, y)]; }
+		size_t bytes() const { return texels.size() * sizeof(uint32_t); }
+		// Bytes of a level of w x h texels
+		static uint64_t bytes(uint32_t w, uint32_t h) { return static_cast<uint64_t>((w + kTileSize - 1) / kTileSize) * ((h + kTileSize - 1) / kTileSize) * kTileSize * kTileSize * sizeof(uint32_t); }
+
+		// Half the size, each texel the linear average of up to four
+		level downsample() const
+		{
+			level half(std::max(1u, width / 2), std::max(1u, height / 2));
+			for (uint32_t y = 0; y < half.height; ++y)
+				for (uint32_t x = 0; x < half.width; ++x)
+				{
+					uint32_t x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+					uint32_t y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+					Vec3f sum = detail::unpack(fetch(x0, y0)) + detail::unpack(fetch(x1, y0)) + detail::unpack(fetch(x0, y1)) + detail::unpack(fetch(x1, y1));
+					half.texels[half.index(x, y)] = detail::pack(sum * 0.25f);
+				}
+			return half;
+		}
+
+		// Bilinear lookup with the texture repeating, st in texture units with t = 0 at the bottom row as in obj files
+		Vec3f bilinear(const Vec2f &st) const
+		{
+			float x = st.x * width - 0.5f, y = (1.0f - st.y) * height - 0.5f;
+			float fx = std::floor(x), fy = std::floor(y);
+			float tx = x - fx, ty = y - fy;
+			auto wrap = [](float v, uint32_t size) {
+				int64_t i = static_cast<int64_t>(v) % static_cast<int64_t>(size);
+				return static_cast<uint32_t>(i < 0 ? i + size : i);
+			};
+			uint32_t x0 = wrap(fx, width), x1 = wrap(fx + 1, width), y0 = wrap(fy, height), y1 = wrap(fy + 1, height);
+			Vec3f top = detail::unpack(fetch(x0, y0)) * (1 - tx) + detail::unpack(fetch(x1, y0)) * tx;
+			Vec3f bottom = detail::unpack(fetch(x0, y1)) * (1 - tx) + detail::unpack(fetch(x1, y1)) * tx;
+			return top * (1 - ty) + bottom * ty;
+		}
+	};
+
+	// Texture from rows of linear colours, top row first
+	inline level from_rows(uint32_t width, uint32_t height, const Vec3f *rows)
+	{
+		level base(width, height);
+		for (uint32_t y = 0; y < height; ++y)
+			for (uint32_t x = 0; x < width; ++x)
+				base.texels[base.index(x, y)] = detail::pack(rows[static_cast<size_t>(y) * width + x]);
+		return base;
+	}
+
+	// The old procedural pattern of the renderer: squares x squares checks of 0.3 and 0.7 grey
+	inline level checker(uint32_t size, uint32_t squares)
+	{
+		std::vector<Vec3f> rows(static_cast<size_t>(size) * size);
+		for (uint32_t y = 0; y < size; ++y)
+			for (uint32_t x = 0; x < size; ++x)
+				rows[static_cast<size_t>(y) * size + x] = ((x * squares / size) + (y * squares / size)) % 2 ? 0.7f : 0.3f;
+		return from_rows(size, size, rows.data());
+	}
+
+	class cache
+	{
+	public:
+		struct stats
+		{
+			uint64_t level_loads = 0;
+			uint64_t evictions = 0;
+			size_t resident_bytes = 0;
+			size_t peak_bytes = 0;
+			size_t budget = 0;
+		};
+
+		static cache &shared()
+		{
+			static cache instance;
+			return instance;
+		}
+
+		// 0 keeps everything resident. Applies to textures added afterwards.
+		void set_budget(size_t bytes)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			budget = bytes;
+		}
+
+		// Loads a .ppm, .pfm or .hdr file, kNone if it cannot be read. Adding a file twice returns the same texture.
+		uint32_t add(const std::string &path)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				for (uint32_t id = 0; id < textures.size(); ++id)
+					if (textures[id]->source == path)
+						return id;
+			}
+
+			detail::file_stamp source;
+			if (!detail::stamp_of(path, source))
+				return kNone;
+
+			std::unique_ptr<entry> e(new entry);
+			e->source = path;
+			e->from_file = true;
+			bool paged = get_budget() > 0;
+			e->mip_path = paged ? path + ".mip" : std::string();
+			if (!paged || !read_mip_index(*e, source))
+			{
+				std::vector<level> chain;
+				if (!decode(path, chain))
+					return kNone;
+				if (paged && !write_mip_file(e->mip_path, source, chain, *e))
+					e->mip_path.clear();
+				if (e->mip_path.empty())
+					adopt(*e, chain);
+			}
+			return insert(std::move(e));
+		}
+
+		// A texture from memory, it stays resident
+		uint32_t add(const std::string &name, level base)
+		{
+			std::unique_ptr<entry> e(new entry);
+			e->source = name;
+			std::vector<level> chain;
+			chain.push_back(std::move(base));
+			build_chain(chain);
+			adopt(*e, chain);
+			return insert(std::move(e));
+		}
+
+		// Path of the file a texture was read from, false for textures made in memory
+		bool source_file(uint32_t id, std::string &path)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (id >= textures.size() || !textures[id]->from_file)
+				return false;
+			path = textures[id]->source;
+			return true;
+		}
+
+		// Trilinear lookup. footprint: width of the area to average in texture units, 0 for the finest level.
+		Vec3f sample(uint32_t id, const Vec2f &st, float footprint)
+		{
+			const entry &e = *textures[id];
+			float lod = footprint > 0.0f ? std::log2(footprint * std::max(e.width, e.height)) : 0.0f;
+			lod = std::min(std::max(lod, 0.0f), static_cast<float>(e.levels.size() - 1));
+			uint32_t fine = static_cast<uint32_t>(lod);
+			float t = lod - fine;
+			Vec3f color = find(id, fine)->bilinear(st);
+			if (t > 0.0f && fine + 1 < e.levels.size())
+				color = color * (1 - t) + find(id, fine + 1)->bilinear(st) * t;
+			return color;
+		}
+
+		stats get_stats()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stats result = counters;
+			result.budget = budget;
+			return result;
+		}
+	private:
+		struct slot
+		{
+			std::shared_ptr<const level> resident;
+			uint32_t width = 0, height = 0;
+			uint64_t offset = 0;		// in the mip file
+			bool loading = false;
+			bool pinned = false;
+			std::list<std::pair<uint32_t, uint32_t>>::iterator lru_position;
+		};
+
+		struct entry
+		{
+			std::string source;
+			bool from_file = false;
+			std::string mip_path;		// empty when every level is pinned
+			uint32_t width = 0, height = 0;
+			std::vector<slot> levels;	// finest first
+		};
+
+		struct file_header
+		{
+			char magic[8];
+			uint32_t version;
+			uint32_t num_levels;
+			uint64_t source_bytes;		// size and modification time of the file the levels were made from
+			int64_t source_modified;
+		};
+
+		struct level_record
+		{
+			uint32_t width, height;
+			uint64_t offset;
+		};
+
+		// Entries are never removed, so a pointer to one stays valid while the vector grows
+		std::vector<std::unique_ptr<entry>> textures;
+		std::list<std::pair<uint32_t, uint32_t>> lru;	// (texture, level) of paged levels, most recently used first
+		size_t budget = 0;
+		stats counters;
+		std::mutex mutex;
+		std::condition_variable loaded;
+
+		size_t get_budget()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			return budget;
+		}
+
+		uint32_t insert(std::unique_ptr<entry> e)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			textures.push_back(std::move(e));
+			return static_cast<uint32_t>(textures.size() - 1);
+		}
+
+		static void build_chain(std::vector<level> &chain)
+		{
+			while (chain.back().width > 1 || chain.back().height > 1)
+				chain.push_back(chain.back().downsample());
+		}
+
+		void adopt(entry &e, std::vector<level> &chain)
+		{
+			e.width = chain[0].width, e.height = chain[0].height;
+			e.levels.resize(chain.size());
+			std::lock_guard<std::mutex> lock(mutex);
+			for (size_t i = 0; i < chain.size(); ++i)
+			{
+				slot &s = e.levels[i];
+				s.width = chain[i].width, s.height = chain[i].height;
+				s.pinned = true;
+				counters.resident_bytes += chain[i].bytes();
+				s.resident = std::make_shared<const level>(std::move(chain[i]));
+			}
+			counters.peak_bytes = std::max(counters.peak_bytes, counters.resident_bytes);
+		}
+
+		static bool decode(const std::string &path, std::vector<level> &chain)
+		{
+			uint32_t width = 0, height = 0;
+			std::vector<Vec3f> rows;
+			std::string extension = path.substr(path.find_last_of('.') + 1);
+			if (extension == "ppm")
+			{
+				std::vector<unsigned char> rgb;
+				if (!image_io::read_ppm(path, width, height, rgb))
+					return false;
+				rows.resize(static_cast<size_t>(width) * height);
+				for (size_t i = 0; i < rows.size(); ++i)
+					rows[i] = Vec3f(detail::srgb_to_linear(rgb[i * 3]), detail::srgb_to_linear(rgb[i * 3 + 1]), detail::srgb_to_linear(rgb[i * 3 + 2]));
+			}
+			else if (!((extension == "pfm" && image_io::read_pfm(path, width, height, rows)) ||
+				(extension == "hdr" && image_io::read_hdr(path, width, height, rows))))
+				return false;
+			if (width == 0 || height == 0)
+				return false;
+
+			chain.clear();
+			chain.push_back(from_rows(width, height, rows.data()));
+			build_chain(chain);
+			return true;
+		}
+
+		// Takes the levels of a mip file made from source as it is now. The levels have to form a whole chain and lie
+		// within the file, anything else is written again.
+		bool read_mip_index(entry &e, const detail::file_stamp &source)
+		{
+			std::ifstream ifs(e.mip_path, std::ios::in | std::ios::binary | std::ios::ate);
+			if (!ifs.is_open())
+				return false;
+			uint64_t file_size = static_cast<uint64_t>(ifs.tellg());
+			ifs.seekg(0);
+			file_header header;
+			if (!ifs.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+				header.version != kVersion || header.source_bytes != source.bytes || header.source_modified != source.modified ||
+				header.num_levels == 0 || header.num_levels > 32)
+				return false;
+
+			std::vector<level_record> records(header.num_levels);
+			if (!ifs.read(reinterpret_cast<char*>(records.data()), records.size() * sizeof(level_record)))
+				return false;
+			uint64_t levels_start = sizeof(header) + records.size() * sizeof(level_record);
+			for (size_t i = 0; i < records.size(); ++i)
+			{
+				const level_record &r = records[i];
+				bool chained = i == 0 ? r.width > 0 && r.height > 0 : r.width == std::max(1u, records[i - 1].width / 2) && r.height == std::max(1u, records[i - 1].height / 2);
+				if (!chained || r.offset < levels_start || r.offset > file_size || level::bytes(r.width, r.height) > file_size - r.offset)
+					return false;
+			}
+			if (records.back().width != 1 || records.back().height != 1)
+				return false;
+
+			e.width = records[0].width, e.height = records[0].height;
+			e.levels.resize(records.size());
+			for (size_t i = 0; i < records.size(); ++i)
+				e.levels[i].width = records[i].width, e.levels[i].height = records[i].height, e.levels[i].offset = records[i].offset;
+			return true;
+		}
+
+		static bool write_mip_file(const std::string &path, const detail::file_stamp &source, const std::vector<level> &chain, entry &e)
+		{
+			std::ofstream ofs(path, std::ios::out | std::ios::binary);
+			if (!ofs.is_open())
+				return false;
+
+			file_header header;
+			std::memcpy(header.magic, kMagic, sizeof(kMagic));
+			header.version = kVersion;
+			header.num_levels = static_cast<uint32_t>(chain.size());
+			header.source_bytes = source.bytes;
+			header.source_modified = source.modified;
+			std::vector<level_record> records(chain.size());
+			uint64_t offset = sizeof(header) + records.size() * sizeof(level_record);
+			for (size_t i = 0; i < chain.size(); ++i)
+			{
+				records[i] = { chain[i].width, chain[i].height, offset };
+				offset += chain[i].bytes();
+			}
+			ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			ofs.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(level_record));
+			for (const level &l : chain)
+				ofs.write(reinterpret_cast<const char*>(l.texels.data()), l.bytes());
+			if (!ofs)
+				return false;
+
+			e.width = chain[0].width, e.height = chain[0].height;
+			e.levels.resize(chain.size());
+			for (size_t i = 0; i < chain.size(); ++i)
+				e.levels[i].width = records[i].width, e.levels[i].height = records[i].height, e.levels[i].offset = records[i].offset;
+			return true;
+		}
+
+		std::shared_ptr<const level> read_level(const entry &e, uint32_t index)
+		{
+			const slot &s = e.levels[index];
+			auto result = std::make_shared<level>(s.width, s.height);
+			std::ifstream ifs(e.mip_path, std::ios::in | std::ios::binary);
+			ifs.seekg(static_cast<std::streamoff>(s.offset));
+			// A mip file that went missing reads as black rather than failing mid frame
+			if (!ifs.read(reinterpret_cast<char*>(result->texels.data()), result->bytes()))
+				std::fill(result->texels.begin(), result->texels.end(), 0xFF000000u);
+			return result;
+		}
+
+		// Level of a texture, read from its mip file if it is not resident. Recently used levels are remembered per
+		// thread, they stay valid even if the cache drops them meanwhile.
+		const level *find(uint32_t id, uint32_t index)
+		{
+			struct memo
+			{
+				uint32_t id = kNone, index = 0;
+				std::shared_ptr<const level> resident;
+			};
+			static thread_local memo recent[4];
+			static thread_local uint32_t next = 0;
+			for (const memo &m : recent)
+				if (m.id == id && m.index == index)
+					return m.resident.get();
+
+			memo &m = recent[next++ % 4];
+			m.id = id, m.index = index;
+			m.resident = acquire(id, index);
+			return m.resident.get();
+		}
+
+		std::shared_ptr<const level> acquire(uint32_t id, uint32_t index)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			entry &e = *textures[id];
+			slot &s = e.levels[index];
+			loaded.wait(lock, [&s] { return !s.loading; });
+			if (s.resident)
+			{
+				if (!s.pinned)
+					lru.splice(lru.begin(), lru, s.lru_position);
+				return s.resident;
+			}
+
+			s.loading = true;
+			lock.unlock();
+			std::shared_ptr<const level> result = read_level(e, index);
+			lock.lock();
+
+			s.loading = false;
+			s.resident = result;
+			lru.push_front({ id, index });
+			s.lru_position = lru.begin();
+			counters.level_loads += 1;
+			counters.resident_bytes += result->bytes();
+			while (counters.resident_bytes > budget && lru.size() > 1)
+			{
+				slot &victim = textures[lru.back().first]->levels[lru.back().second];
+				counters.resident_bytes -= victim.resident->bytes();
+				victim.resident.reset();
+				lru.pop_back();
+				counters.evictions += 1;
+			}
+			counters.peak_bytes = std::max(counters.peak_bytes, counters.resident_bytes);
+			loaded.notify_all();
+			return result;
+		}
+	};
+}
@@ -0,0 +1,220 @@
+#pragma once
+
+#include<algorithm>
+#include<atomic>
+#include<condition_variable>
+#include<cstdint>
+#include<functional>
+#include<memory>
+#include<mutex>
+#include<thread>
+#include<type_traits>
+#include<vector>
+
+// Fixed set of worker threads shared by every parallel stage of the renderer.
+// parallel_for lets the calling thread take part in the work, so it can also be used from inside a task.
+class thread_pool
+{
+	// State of one parallel_for call. Helpers that are still queued when the call returns keep it alive through refs,
+	// whoever lets go last hands it back to free_states, so repeated calls do not allocate.
+	struct parallel_state
+	{
+		std::atomic<uint32_t> next_chunk{ 0 };
+		std::atomic<uint32_t> done_chunks{ 0 };
+		std::atomic<uint32_t> refs{ 0 };
+		std::mutex done_mutex;
+		std::condition_variable done_cv;
+		void(*invoke)(void *fn, uint32_t first, uint32_t last) = nullptr;
+		void *fn = nullptr;
+		uint32_t begin = 0, end = 0, grain = 1, num_chunks = 0;
+	};
+
+	std::vector<std::thread> workers;
+	// Ring buffer of pending tasks, it only grows when more tasks are queued than ever before
+	std::vector<std::function<void()>> tasks;
+	size_t tasks_head = 0, tasks_count = 0;
+	std::mutex tasks_mutex;
+	std::condition_variable tasks_cv;
+	bool stopping = false;
+
+	std::vector<std::unique_ptr<parallel_state>> states;
+	std::vector<parallel_state*> free_states;
+	std::mutex states_mutex;
+
+	static uint32_t &current_index()
+	{
+		static thread_local uint32_t index = 0;
+		return index;
+	}
+
+	void worker_loop(uint32_t index)
+	{
+		current_index() = index;
+		for (;;)
+		{
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(tasks_mutex);
+				tasks_cv.wait(lock, [this] { return stopping || tasks_count > 0; });
+				if (stopping && tasks_count == 0)
+					return;
+				task = std::move(tasks[tasks_head]);
+				tasks_head = (tasks_head + 1) % tasks.size();
+				--tasks_count;
+			}
+			task();
+		}
+	}
+
+	// Call with tasks_mutex held
+	void push_task(std::function<void()> task)
+	{
+		if (tasks_count == tasks.size())
+		{
+			std::vector<std::function<void()>> grown(std::max<size_t>(16, tasks.size() * 2));
+			for (size_t i = 0; i < tasks_count; ++i)
+				grown[i] = std::move(tasks[(tasks_head + i) % tasks.size()]);
+			tasks.swap(grown);
+			tasks_head = 0;
+		}
+		tasks[(tasks_head + tasks_count++) % tasks.size()] = std::move(task);
+	}
+
+	parallel_state *acquire_state()
+	{
+		std::lock_guard<std::mutex> lock(states_mutex);
+		if (free_states.empty())
+		{
+			states.emplace_back(new parallel_state);
+			free_states.reserve(states.size());
+			return states.back().get();
+		}
+		parallel_state *state = free_states.back();
+		free_states.pop_back();
+		return state;
+	}
+
+	void release_state(parallel_state *state)
+	{
+		if (state->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+			return;
+		std::lock_guard<std::mutex> lock(states_mutex);
+		free_states.push_back(state);
+	}
+
+	// Helpers only touch fn after claiming a chunk, and the caller outlives every claimed chunk
+	static void run_chunks(parallel_state *state)
+	{
+		for (uint32_t chunk = state->next_chunk++; chunk < state->num_chunks; chunk = state->next_chunk++)
+		{
+			uint32_t chunk_begin = state->begin + chunk * state->grain;
+			state->invoke(state->fn, chunk_begin, std::min(state->end, chunk_begin + state->grain));
+			if (++state->done_chunks == state->num_chunks)
+			{
+				std::lock_guard<std::mutex> lock(state->done_mutex);
+				state->done_cv.notify_all();
+			}
+		}
+	}
+
+	template<typename Fn>
+	static void invoke_chunk(void *fn, uint32_t first, uint32_t last) { (*static_cast<Fn*>(fn))(first, last); }
+public:
+	explicit thread_pool(uint32_t num_threads = std::max(1u, std::thread::hardware_concurrency()))
+	{
+		workers.reserve(num_threads);
+		for (uint32_t i = 0; i < num_threads; ++i)
+			workers.emplace_back(&thread_pool::worker_loop, this, i + 1);
+	}
+
+	~thread_pool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(tasks_mutex);
+			stopping = true;
+		}
+		tasks_cv.notify_all();
+		for (auto &worker : workers)
+			worker.join();
+	}
+
+	thread_pool(const thread_pool &) = delete;
+	thread_pool &operator=(const thread_pool &) = delete;
+
+	uint32_t size() const { return static_cast<uint32_t>(workers.size()); }
+
+	// 0 on threads that do not belong to a pool, 1..size() on workers.
+	// Use it to index per-thread scratch data sized size() + 1.
+	static uint32_t thread_index() { return current_index(); }
+
+	// Runs task on a worker, or right away on the calling thread when the pool has none(--threads 1)
+	void submit(std::function<void()> task)
+	{
+		if (workers.empty())
+		{
+			task();
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(tasks_mutex);
+			push_task(std::move(task));
+		}
+		tasks_cv.notify_one();
+	}
+
+	// Calls fn(chunk_begin, chunk_end) over [begin, end) in chunks of grain items and blocks until all are done
+	template<typename Fn>
+	void parallel_for(uint32_t begin, uint32_t end, uint32_t grain, Fn &&fn)
+	{
+		if (begin >= end)
+			return;
+
+		grain = std::max(1u, grain);
+		uint32_t num_chunks = (end - begin + grain - 1) / grain;
+		if (num_chunks == 1 || workers.empty())
+		{
+			fn(begin, end);
+			return;
+		}
+
+		parallel_state *state = acquire_state();
+		state->next_chunk = 0;
+		state->done_chunks = 0;
+		state->invoke = &invoke_chunk<typename std::remove_reference<Fn>::type>;
+		state->fn = const_cast<void*>(static_cast<const void*>(std::addressof(fn)));
+		state->begin = begin, state->end = end, state->grain = grain, state->num_chunks = num_chunks;
+
+		uint32_t num_helpers = std::min(size(), num_chunks - 1);
+		state->refs = num_helpers + 1;
+		{
+			std::lock_guard<std::mutex> lock(tasks_mutex);
+			// Small enough for std::function to store in place
+			for (uint32_t i = 0; i < num_helpers; ++i)
+				push_task([this, state] { run_chunks(state); release_state(state); });
+		}
+		tasks_cv.notify_all();
+
+		run_chunks(state);
+
+		{
+			std::unique_lock<std::mutex> lock(state->done_mutex);
+			state->done_cv.wait(lock, [state] { return state->done_chunks == state->num_chunks; });
+		}
+		release_state(state);
+	}
+
+	// Threads taking part in the shared pool's work, the calling thread included. 0 picks one per hardware thread.
+	// Only has an effect before the shared pool is first used.
+	static uint32_t &shared_threads()
+	{
+		static uint32_t threads = 0;
+		return threads;
+	}
+
+	// Pool used by the renderer when the caller does not provide one
+	static thread_pool &shared()
+	{
+		static thread_pool pool(shared_threads() > 0 ? shared_threads() - 1 : std::max(1u, std::thread::hardware_concurrency()));
+		return pool;
+	}
+};
@@ -0,0 +1,139 @@
+#pragma once
+
+#include<algorithm>
+#include<array>
+#include<cmath>
+#include<cstdint>
+#include<vector>
+
+#include"arena.h"
+#include"geometry.h"
+#include"profile.h"
+#include"thread_pool.h"
+
+// Converts the linear float framebuffer into 8 bit bmp pixels.
+// The conversion runs over rows in parallel, and each row goes through two flat loops (curve, then encode)
+// so the compiler can vectorise the arithmetic. Output is written straight into bgr, bottom-up, padded rows.
+namespace tonemap
+{
+	typedef unsigned char uchar;
+
+	enum class curve
+	{
+		clamp,		// plain clamp to [0, 1]
+		reinhard,	// x / (1 + x)
+		aces		// Narkowicz's fit of the ACES filmic curve
+	};
+
+	struct settings
+	{
+		float exposure = 0.0f;		// in stops
+		curve op = curve::clamp;
+		bool srgb = false;			// encode with the sRGB transfer function, otherwise store linear values
+		bool dither = false;		// 4x4 ordered dither before quantization
+	};
+
+	namespace detail
+	{
+		constexpr uint32_t kLutSize = 1 << 14;
+
+		// Maps [0, 1] linear values to [0, 255] sRGB encoded values
+		inline const std::vector<float> &srgb_lut()
+		{
+			static const std::vector<float> lut = []
+			{
+				std::vector<float> table(kLutSize + 1);
+				for (uint32_t i = 0; i <= kLutSize; ++i)
+				{
+					float v = i / static_cast<float>(kLutSize);
+					table[i] = 255.0f * (v <= 0.0031308f ? 12.92f * v : 1.055f * std::pow(v, 1.0f / 2.4f) - 0.055f);
+				}
+				return table;
+			}();
+			return lut;
+		}
+
+		// Thresholds of a 4x4 bayer matrix, offset to the middle of each step
+		inline float bayer4(uint32_t x, uint32_t y)
+		{
+			static const uchar matrix[4][4] = { { 0, 8, 2, 10 },{ 12, 4, 14, 6 },{ 3, 11, 1, 9 },{ 15, 7, 13, 5 } };
+			return (matrix[y & 3][x & 3] + 0.5f) / 16.0f;
+		}
+
+		inline void apply_curve(const float *src, float *dst, uint32_t count, float scale, curve op)
+		{
+			switch (op)
+			{
+			case curve::clamp:
+				for (uint32_t i = 0; i < count; ++i)
+					dst[i] = std::min(1.0f, std::max(0.0f, src[i] * scale));
+				break;
+			case curve::reinhard:
+				for (uint32_t i = 0; i < count; ++i)
+				{
+					float x = std::max(0.0f, src[i] * scale);
+					dst[i] = x / (1.0f + x);
+				}
+				break;
+			case curve::aces:
+				for (uint32_t i = 0; i < count; ++i)
+				{
+					float x = std::max(0.0f, src[i] * scale);
+					dst[i] = std::min(1.0f, (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f));
+				}
+				break;
+			}
+		}
+	}
+
+	// Size in bytes of one row of a 24 bit bmp
+	inline uint32_t bgr_row_stride(uint32_t width) { return (width * 3 + 3) & ~3u; }
+
+	// framebuffer: width * height linear rgb pixels, top-down
+	// bgr: bgr_row_stride(width) * height bytes, receives bottom-up bgr rows ready to be written to a bmp
+	inline void to_bgr(const Vec3f *framebuffer, uint32_t width, uint32_t height, uchar *bgr, const settings &config, thread_pool &pool = thread_pool::shared())
+	{
+		TRACEAROOM_PROFILE_SCOPE("tone-map");
+		const float scale = std::exp2(config.exposure);
+		const uint32_t stride = bgr_row_stride(width);
+		const uint32_t row_floats = width * 3;
+		const float *lut = detail::srgb_lut().data();
+
+		pool.parallel_for(0, height, 16, [&](uint32_t row_begin, uint32_t row_end)
+		{
+			// The mapped row lives in the thread's scratch arena for the duration of the chunk
+			arena_scope scope(thread_scratch());
+			float *mapped = thread_scratch().allocate_array<float>(row_floats);
+			for (uint32_t row = row_begin; row < row_end; ++row)
+			{
+				detail::apply_curve(&framebuffer[static_cast<size_t>(row) * width].x, mapped, row_floats, scale, config.op);
+
+				if (config.srgb)
+					for (uint32_t i = 0; i < row_floats; ++i)
+						mapped[i] = lut[static_cast<uint32_t>(mapped[i] * detail::kLutSize + 0.5f)];
+				else
+					for (uint32_t i = 0; i < row_floats; ++i)
+						mapped[i] *= 255.0f;
+
+				// Without dithering values are truncated, the same as the old (uchar)(255 * v) conversion
+				float offsets[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+				if (config.dither)
+					for (uint32_t i = 0; i < 4; ++i)
+						offsets[i] = detail::bayer4(i, row);
+
+				// rgb -> bgr
+				uchar *dst = bgr + static_cast<size_t>(height - 1 - row) * stride;
+				for (uint32_t i = 0; i < width; ++i)
+				{
+					const float *rgb = mapped + i * 3;
+					float offset = offsets[i & 3];
+					dst[i * 3 + 0] = static_cast<uchar>(std::min(255.0f, rgb[2] + offset));
+					dst[i * 3 + 1] = static_cast<uchar>(std::min(255.0f, rgb[1] + offset));
+					dst[i * 3 + 2] = static_cast<uchar>(std::min(255.0f, rgb[0] + offset));
+				}
+
+				std::fill(dst + row_floats, dst + stride, static_cast<uchar>(0));
+			}
+		});
+	}
+}
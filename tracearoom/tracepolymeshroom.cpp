@@ -10,14 +10,42 @@
 #include <cmath>
 #include <sstream>
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <cstring>
+#include <functional>
 
 #include "geometry.h"
 #include "raytracer.h"
 #include "bitmap_utils.h"
+#include "image_io.h"
+#include "tonemap.h"
+#include "obj_loader.h"
+#include "scene_cache.h"
+#include "compact_mesh.h"
+#include "animation.h"
+#include "thread_pool.h"
+#include "camera.h"
+#include "temporal_cache.h"
+#include "profile.h"
+#include "heatmap.h"
+#include "paged_mesh.h"
+#include "arena.h"
+#include "distributed.h"
+#include "render_server.h"
+#include "lod.h"
+#include "texture.h"
+#include "sampler.h"
+#include "frame_hash.h"
+#include "render_job.h"
+#include "selftest.h"
+#include "microbench.h"
 
 using namespace std;
 
-static const Vec3f kDefaultBackgroundColor = Vec3f(255.0f, 255.0f, 255.0f);
+static const Vec3f kDefaultBackgroundColor = Vec3f(1.0f, 1.0f, 1.0f);
 
 inline
 float clamp(const float &lo, const float &hi, const float &v)
@@ -34,96 +62,529 @@ struct Options
     float fov = 90;
     Vec3f backgroundColor = kDefaultBackgroundColor;
     Matrix44f cameraToWorld;
+	string output_path = "D:\\out.bmp";
+	// Unclamped linear framebuffer(.pfm or .hdr), left empty to skip
+	string hdr_output_path = "D:\\out.pfm";
+	tonemap::settings tonemapping;
+	// Batch mode reuses the previous frame's shading on frames where only the camera moved
+	bool temporal_reuse = false;
+	// Cell size of the irradiance cache in world units, 0 shades every hit directly
+	float irradiance_cell_size = 0.0f;
+	accelerator scene_accelerator = accelerator::object_bvh;
+	// Single frame renders also write a false colour map of the per pixel ray cost(.bmp) and its histogram(.csv),
+	// left empty to skip
+	string heatmap_path;
+	heatmap::metric heatmap_metric = heatmap::metric::total;
+	// Single frame renders are split into tiles for this many worker processes, 0 traces in this process
+	uint32_t worker_processes = 0;
+	distributed::settings distribution;
+	// Rays per pixel, spread over the pixel by the sampler and averaged
+	uint32_t samples_per_pixel = 1;
+	sampler::sequence sampling = sampler::sequence::sobol;
+	// Frame of a sequence being traced, every frame gets its own sample patterns
+	uint32_t frame = 0;
+	// Single frame renders are traced twice and their hash checked against the one in this file, which is written
+	// when there is none yet. Left empty to skip.
+	string verify_path;
+	// Single frame renders are compared with this golden image within golden_tolerance(see selftest::compare_golden),
+	// it is written when there is none yet. Left empty to skip.
+	string golden_path;
+	float golden_tolerance = 1e-3f;
 };
 
-void render(
+// Traces the pixels [x0, x1) x [y0, y1) into pixels, rows of row_stride apart, on the calling thread.
+// When costs is given, laid out like pixels, it receives the work done for every pixel.
+// Scenes that prefer batches, like paged meshes, get the whole rectangle shot at once.
+void trace_rect(
+    const pinhole_camera &camera,
+    const raytracer &raytracer,
+    uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1,
+    Vec3f *pixels,
+    uint32_t row_stride,
+    ray_cost *costs = nullptr)
+{
+	ray_footprint_scope footprint(camera.pixel_spread());
+	if (raytracer.prefers_batches() && !costs) {
+		uint32_t width = x1 - x0, count = width * (y1 - y0);
+		arena_scope scope(thread_scratch());
+		Vec3f *origins = thread_scratch().allocate_array<Vec3f>(count);
+		Vec3f *dirs = thread_scratch().allocate_array<Vec3f>(count);
+		Vec3f *colors = row_stride == width ? pixels : thread_scratch().allocate_array<Vec3f>(count);
+		for (uint32_t j = y0, k = 0; j < y1; ++j)
+			for (uint32_t i = x0; i < x1; ++i, ++k) {
+				origins[k] = camera.origin;
+				dirs[k] = camera.ray_direction(i, j);
+			}
+		raytracer.shoot_batch(origins, dirs, count, colors);
+		if (colors != pixels)
+			for (uint32_t j = 0; j < y1 - y0; ++j)
+				std::copy(colors + j * width, colors + (j + 1) * width, pixels + j * row_stride);
+		return;
+	}
+	for (uint32_t j = y0; j < y1; ++j) {
+		Vec3f *pix = pixels + (j - y0) * row_stride;
+		for (uint32_t i = x0; i < x1; ++i, ++pix) {
+			if (!costs) {
+				*pix = raytracer.shoot(camera.origin, camera.ray_direction(i, j));
+				continue;
+			}
+			ray_cost_scope record(costs[pix - pixels]);
+			*pix = raytracer.shoot(camera.origin, camera.ray_direction(i, j));
+		}
+	}
+}
+
+// Traces samples rays through every pixel of [x0, x1) x [y0, y1) of frame and averages them into pixels, rows of
+// row_stride apart. When costs is given, laid out like pixels, it receives the work done for all samples of every
+// pixel. Otherwise a row of samples is shot at once when the scene prefers batches.
+void trace_rect_samples(
+    const pinhole_camera &camera,
+    const raytracer &raytracer,
+    uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1,
+    Vec3f *pixels,
+    uint32_t row_stride,
+    uint32_t samples,
+    sampler::sequence sequence,
+    uint32_t frame,
+    ray_cost *costs = nullptr)
+{
+	// Each sample covers a share of the pixel
+	ray_footprint_scope footprint(camera.pixel_spread() / std::sqrt(static_cast<float>(samples)));
+	const float weight = 1.0f / samples;
+	uint32_t count = (x1 - x0) * samples;
+	arena_scope scope(thread_scratch());
+	float *dx = thread_scratch().allocate_array<float>(samples);
+	float *dy = thread_scratch().allocate_array<float>(samples);
+	Vec3f *origins = thread_scratch().allocate_array<Vec3f>(count);
+	Vec3f *dirs = thread_scratch().allocate_array<Vec3f>(count);
+	Vec3f *colors = thread_scratch().allocate_array<Vec3f>(count);
+	for (uint32_t j = y0; j < y1; ++j) {
+		for (uint32_t i = x0, k = 0; i < x1; ++i) {
+			sampler::pixel_sampler pixel(sequence, i, j, frame);
+			pixel.get_batch(0, samples, 0, dx);
+			pixel.get_batch(0, samples, 1, dy);
+			for (uint32_t s = 0; s < samples; ++s, ++k) {
+				origins[k] = camera.origin;
+				dirs[k] = camera.ray_direction_at(i + dx[s], j + dy[s]);
+			}
+		}
+		if (costs) {
+			for (uint32_t k = 0; k < count; ++k) {
+				ray_cost_scope record(costs[(j - y0) * row_stride + k / samples]);
+				colors[k] = raytracer.shoot(origins[k], dirs[k]);
+			}
+		}
+		else if (raytracer.prefers_batches())
+			raytracer.shoot_batch(origins, dirs, count, colors);
+		else
+			for (uint32_t k = 0; k < count; ++k)
+				colors[k] = raytracer.shoot(origins[k], dirs[k]);
+
+		Vec3f *pix = pixels + (j - y0) * row_stride;
+		for (uint32_t i = 0; i < x1 - x0; ++i) {
+			Vec3f sum = 0;
+			for (uint32_t s = 0; s < samples; ++s)
+				sum = sum + colors[i * samples + s];
+			pix[i] = sum * weight;
+		}
+	}
+}
+
+// Traces one frame into framebuffer, rows are spread over the thread pool.
+// When costs is given it receives the work done for every pixel.
+void trace_frame(
     const Options &options,
-    std::vector<std::unique_ptr<Object>> &objects)
-{
-    std::unique_ptr<Vec3f []> framebuffer(new Vec3f[options.width * options.height]);
-    Vec3f *pix = framebuffer.get();
-    float scale = tan(deg2rad(options.fov * 0.5f));
-    float imageAspectRatio = options.width / (float)options.height;
-    Vec3f orig;
-    options.cameraToWorld.multVecMatrix(Vec3f(0), orig);
-	
-	std::vector<std::unique_ptr<PointLight>> point_lights;
-	Matrix44f l2w = Matrix44f(1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 3.0f, 0.0f, 0.0f, -15.0f, 1.0f);
-	point_lights.push_back(std::make_unique<PointLight>(l2w, 1, 580));
-	raytracer raytracer(objects, point_lights, options.backgroundColor);
-    
-	for (uint32_t j = 0; j < options.height; ++j) {
-        for (uint32_t i = 0; i < options.width; ++i) {
-            // generate primary ray direction
-            float x = (2 * (i + 0.5f) / (float)options.width - 1) * imageAspectRatio * scale;
-            float y = (1 - 2 * (j + 0.5f) / (float)options.height) * scale;
-            Vec3f dir, pixel_coord;
-            options.cameraToWorld.multDirMatrix(Vec3f(x, y, (orig.z -1)), pixel_coord);
-			dir = pixel_coord - orig;
-            dir.normalize();
-            *(pix++) = raytracer.shoot(orig, dir);
-        }
-    }
-	string filepath = "D:\\out.bmp";
-
-	auto imgdata = std::unique_ptr<unsigned char []>(new unsigned char[options.width * options.height * 3]);
-    //ofs << "P6\n" << options.width << " " << options.height << "\n255\n";
-    for (uint32_t i = 0; i < options.height * options.width; ++i) {
-        auto r = (unsigned char)(255 * clamp(0, 1, framebuffer[i].x));
-        auto g = (unsigned char)(255 * clamp(0, 1, framebuffer[i].y));
-        auto b = (unsigned char)(255 * clamp(0, 1, framebuffer[i].z));
-		imgdata[i * 3 + 0] = r;
-		imgdata[i * 3 + 1] = g;
-		imgdata[i * 3 + 2] = b;
-        //ofs << r << g << b;
-    }
+    const raytracer &raytracer,
+    Vec3f *framebuffer,
+    ray_cost *costs = nullptr)
+{
+	TRACEAROOM_PROFILE_SCOPE("trace");
+	pinhole_camera camera(options.width, options.height, options.fov, options.cameraToWorld);
+	// Bigger chunks let a batch share more of its work
+	uint32_t grain = raytracer.prefers_batches() && !costs ? 16 : 4;
+	thread_pool::shared().parallel_for(0, options.height, grain, [&](uint32_t first_row, uint32_t last_row) {
+		TRACEAROOM_PROFILE_SCOPE("trace rows");
+		size_t first = first_row * options.width;
+		if (options.samples_per_pixel > 1)
+			trace_rect_samples(camera, raytracer, 0, first_row, options.width, last_row, framebuffer + first, options.width, options.samples_per_pixel, options.sampling, options.frame, costs ? costs + first : nullptr);
+		else
+			trace_rect(camera, raytracer, 0, first_row, options.width, last_row, framebuffer + first, options.width, costs ? costs + first : nullptr);
+	});
+}
+
+// Traces rows of a server request(see render_server.h). A single sample goes through the pixel center like
+// trace_frame, more are spread over the pixel by the sampler and averaged.
+void trace_request_rows(
+    const raytracer &raytracer,
+    const render_server::request &request,
+    uint32_t first_row,
+    uint32_t last_row,
+    Vec3f *rows,
+    sampler::sequence sequence)
+{
+	TRACEAROOM_PROFILE_SCOPE("trace request");
+	pinhole_camera camera(request.width, request.height, request.fov, request.camera_to_world);
+	thread_pool::shared().parallel_for(first_row, last_row, 1, [&](uint32_t first, uint32_t last) {
+		Vec3f *pix = rows + (first - first_row) * request.width;
+		if (request.samples == 1)
+			trace_rect(camera, raytracer, 0, first, request.width, last, pix, request.width);
+		else
+			trace_rect_samples(camera, raytracer, 0, first, request.width, last, pix, request.width, request.samples, sequence, 0);
+	});
+}
+
+// Traces a tile into pixels, t.width() of them per row
+void trace_tile(
+    const Options &options,
+    const pinhole_camera &camera,
+    const raytracer &raytracer,
+    const distributed::tile &t,
+    Vec3f *pixels)
+{
+	if (options.samples_per_pixel > 1)
+		trace_rect_samples(camera, raytracer, t.x0, t.y0, t.x1, t.y1, pixels, t.width(), options.samples_per_pixel, options.sampling, options.frame);
+	else
+		trace_rect(camera, raytracer, t.x0, t.y0, t.x1, t.y1, pixels, t.width());
+}
+
+// Traces one frame as tiles on worker processes(see distributed.h)
+void trace_frame_distributed(
+    const Options &options,
+    const raytracer &raytracer,
+    Vec3f *framebuffer)
+{
+	TRACEAROOM_PROFILE_SCOPE("trace");
+	pinhole_camera camera(options.width, options.height, options.fov, options.cameraToWorld);
+	distributed::settings settings = options.distribution;
+	settings.workers = options.worker_processes;
+	auto report = distributed::render(options.width, options.height, settings, [&](const distributed::tile &t, Vec3f *pixels) {
+		trace_tile(options, camera, raytracer, t, pixels);
+	}, framebuffer);
+	cout << "Rendered " << report.tiles << " tiles on " << report.workers_started << " workers, " << report.workers_failed << " failed, "
+		<< report.tiles_reissued << " tiles reissued, " << report.tiles_local << " rendered locally\n";
+}
+
+// A framebuffer together with everything needed to write it out. Allocated once and reused by every frame,
+// so rendering a sequence does not go back to the heap for pixels.
+struct frame_buffer
+{
+	std::unique_ptr<Vec3f []> pixels;
+	std::unique_ptr<unsigned char []> bgr;	// tone-mapped bitmap rows
+	string output_path;
+	string hdr_output_path;
+
+	// Set while the frame is written in the background
+	bool writing = false;
+	std::mutex write_mutex;
+	std::condition_variable write_done;
+
+	frame_buffer(const Options &options) :
+		pixels(new Vec3f[options.width * options.height]),
+		bgr(new unsigned char[tonemap::bgr_row_stride(options.width) * options.height])
+	{}
+
+	void wait_for_write()
+	{
+		std::unique_lock<std::mutex> lock(write_mutex);
+		write_done.wait(lock, [this] { return !writing; });
+	}
+};
+
+// Writes the linear framebuffer if hdr_output_path is set, then the tone-mapped bitmap
+void write_frame(
+    const Options &options,
+    frame_buffer &frame)
+{
+	if (!frame.hdr_output_path.empty()) {
+		TRACEAROOM_PROFILE_SCOPE("write");
+		if (!image_io::write_float_image(frame.hdr_output_path, options.width, options.height, frame.pixels.get()))
+			cout << "Unable to write " << frame.hdr_output_path << "\n";
+	}
+
+	tonemap::to_bgr(frame.pixels.get(), options.width, options.height, frame.bgr.get(), options.tonemapping);
+	TRACEAROOM_PROFILE_SCOPE("write");
+	bitmap_utils::bitmap_image bmp_image(options.width, options.height, frame.bgr.get());
+	bmp_image.write_to_file(frame.output_path);
+}
+
+// Writes the heatmap of one measure of costs to heatmap_path and its histogram next to it, bgr is scratch for the bitmap
+void write_heatmap(
+    const Options &options,
+    const vector<ray_cost> &costs,
+    unsigned char *bgr)
+{
+	vector<uint32_t> values(costs.size());
+	for (size_t p = 0; p < costs.size(); ++p)
+		values[p] = heatmap::cost_of(costs[p], options.heatmap_metric);
+
+	auto stats = heatmap::summarize(values);
+	cout << "Ray cost per pixel: min " << stats.min << ", mean " << stats.mean << ", median " << stats.p50 <<
+		", p90 " << stats.p90 << ", p99 " << stats.p99 << ", max " << stats.max << "\n";
+
+	heatmap::to_bgr(values, options.width, options.height, bgr, stats.p99);
+	bitmap_utils::bitmap_image bmp_image(options.width, options.height, bgr);
+	bmp_image.write_to_file(options.heatmap_path);
+
+	size_t dot = options.heatmap_path.find_last_of('.');
+	if (dot == string::npos || dot < options.heatmap_path.find_last_of("/\\") + 1)
+		dot = options.heatmap_path.size();
+	string histogram_path = options.heatmap_path.substr(0, dot) + ".csv";
+	if (!heatmap::write_histogram(histogram_path, values))
+		cout << "Unable to write " << histogram_path << "\n";
+}
+
+// Checks that a frame is reproducible: traces it again, which schedules the work differently, and compares both
+// hashes with each other and with the reference in options.verify_path. Returns false on any mismatch.
+bool verify_frame(
+    const Options &options,
+    const Vec3f *pixels,
+    const std::function<void(Vec3f *)> &trace)
+{
+	size_t num_pixels = static_cast<size_t>(options.width) * options.height;
+	uint64_t hash = frame_hash::hash(pixels, num_pixels);
+	std::unique_ptr<Vec3f[]> again(new Vec3f[num_pixels]);
+	trace(again.get());
+	uint64_t hash_again = frame_hash::hash(again.get(), num_pixels);
+	cout << "Frame hash " << frame_hash::to_hex(hash) << "\n";
+	if (hash_again != hash) {
+		size_t differing = 0;
+		for (size_t p = 0; p < num_pixels; ++p)
+			differing += std::memcmp(&pixels[p], &again[p], sizeof(Vec3f)) != 0;
+		cout << "Verify failed: tracing the frame again gave " << frame_hash::to_hex(hash_again) << ", " << differing << " pixels differ\n";
+		return false;
+	}
+
+	uint64_t reference;
+	if (!frame_hash::read_reference(options.verify_path, reference)) {
+		if (!frame_hash::write_reference(options.verify_path, hash)) {
+			cout << "Unable to write " << options.verify_path << "\n";
+			return false;
+		}
+		cout << "Recorded the reference hash in " << options.verify_path << "\n";
+		return true;
+	}
+	if (reference != hash) {
+		cout << "Verify failed: the reference is " << frame_hash::to_hex(reference) << "\n";
+		return false;
+	}
+	cout << "Verified against " << options.verify_path << "\n";
+	return true;
+}
+
+// Renders a single frame, returns false if it failed verification or differs from the golden image
+bool render(
+    const Options &options,
+    const raytracer &raytracer)
+{
+	frame_buffer frame(options);
+	frame.output_path = options.output_path;
+	frame.hdr_output_path = options.hdr_output_path;
+	vector<ray_cost> costs(options.heatmap_path.empty() ? 0 : options.width * options.height);
+	auto trace = [&](Vec3f *pixels, ray_cost *frame_costs) {
+		if (options.worker_processes > 0 && !frame_costs)
+			trace_frame_distributed(options, raytracer, pixels);
+		else
+			trace_frame(options, raytracer, pixels, frame_costs);
+	};
+	trace(frame.pixels.get(), costs.empty() ? nullptr : costs.data());
 	cout << "\nRaytracing done...\n";
 	cout << "Creating bitmap file...\n";
-	bitmap_utils::bitmap_image bmp_image(options.width, options.height, std::move(imgdata));
-	bmp_image.write_to_file(filepath);
+	write_frame(options, frame);
+	if (!costs.empty())
+		write_heatmap(options, costs, frame.bgr.get());
+	bool ok = true;
+	if (!options.golden_path.empty())
+		ok = selftest::compare_golden(options.golden_path, options.width, options.height, frame.pixels.get(), options.golden_tolerance);
+	// The second trace takes the same path as the first, recording costs included
+	if (!options.verify_path.empty())
+		ok = verify_frame(options, frame.pixels.get(), [&](Vec3f *pixels) {
+			vector<ray_cost> again(costs.size());
+			trace(pixels, again.empty() ? nullptr : again.data());
+		}) && ok;
+	return ok;
+}
+
+// Starts rendering a single frame as tiles on the shared pool and returns at once(see render_job.h).
+// raytracer has to outlive the job.
+render_job::handle render_async(
+    const Options &options,
+    const raytracer &raytracer)
+{
+	pinhole_camera camera(options.width, options.height, options.fov, options.cameraToWorld);
+	return render_job::start(options.width, options.height, options.distribution.tile_size, [options, camera, &raytracer](const distributed::tile &t, Vec3f *pixels) {
+		trace_tile(options, camera, raytracer, t, pixels);
+	});
+}
+
+// Renders num_jobs copies of a single frame as jobs that share the pool, taking their tiles as they finish, and
+// writes the first. Returns false if the copies are not identical.
+bool render_jobs(
+    const Options &options,
+    const raytracer &raytracer,
+    uint32_t num_jobs)
+{
+	std::vector<render_job::handle> jobs;
+	jobs.reserve(num_jobs);
+	for (uint32_t j = 0; j < num_jobs; ++j)
+		jobs.push_back(render_async(options, raytracer));
+
+	uint32_t total = 0, taken = 0, next_report = 0;
+	for (auto &job : jobs)
+		total += job.get_progress().tiles;
+	render_job::finished_tile tile;
+	for (auto &job : jobs) {
+		while (job.next(tile)) {
+			if (++taken < next_report)
+				continue;
+			next_report += std::max(1u, total / 4);
+			cout << "Tiles taken " << taken << "/" << total << ", per job";
+			for (auto &other : jobs)
+				cout << " " << other.get_progress().tiles_done;
+			cout << "\n";
+		}
+	}
+
+	size_t num_pixels = static_cast<size_t>(options.width) * options.height;
+	uint64_t hash = frame_hash::hash(jobs[0].frame(), num_pixels);
+	bool identical = true;
+	for (auto &job : jobs)
+		identical = job.wait() == render_job::status::finished && frame_hash::hash(job.frame(), num_pixels) == hash && identical;
+	cout << "Rendered " << num_jobs << " jobs, " << (identical ? "all frames identical" : "frames differ") << "\n";
+
+	frame_buffer frame(options);
+	frame.output_path = options.output_path;
+	frame.hdr_output_path = options.hdr_output_path;
+	std::copy(jobs[0].frame(), jobs[0].frame() + num_pixels, frame.pixels.get());
+	write_frame(options, frame);
+	return identical;
+}
+
+// "out.bmp" -> "out_0012.bmp", written into numbered so its storage is reused from frame to frame
+void numbered_path(const string &path, uint32_t frame, string &numbered)
+{
+	numbered.clear();
+	if (path.empty())
+		return;
+
+	size_t dot = path.find_last_of('.');
+	if (dot == string::npos || dot < path.find_last_of("/\\") + 1)
+		dot = path.size();
+	char number[16];
+	snprintf(number, sizeof(number), "_%04u", frame);
+	numbered.append(path, 0, dot).append(number).append(path, dot, string::npos);
+}
+
+// Only plain triangle meshes can be moved, returns false and says why when a motion of camera targets anything else,
+// like the meshes --lod, --compact and --paged make, or an object that does not exist
+bool motions_supported(
+    const animation::camera_path &camera,
+    const std::vector<std::unique_ptr<Object>> &objects)
+{
+	bool supported = true;
+	for (const auto &motion : camera.motions) {
+		if (motion.object >= objects.size()) {
+			cout << "Cannot move object " << motion.object << ", the scene has " << objects.size() << " objects\n";
+			supported = false;
+		}
+		else if (!dynamic_cast<const TriangleMesh*>(objects[motion.object].get())) {
+			cout << "Cannot move object " << motion.object << ", only triangle meshes loaded without --lod, --compact or --paged can move\n";
+			supported = false;
+		}
+	}
+	return supported;
 }
 
-unique_ptr<TriangleMesh> generateQuadMesh(vector<Vec3f> &quad_vertices)
+// Renders every frame of camera to numbered files. The scene, its bvhs and the thread pool live on between frames,
+// and each frame is tone-mapped and written in the background while the next one traces.
+// Once the first frames have warmed up the buffers and the pool, a frame makes no heap allocations of its own.
+void render_sequence(
+    Options options,
+    const animation::camera_path &camera,
+    raytracer &raytracer)
 {
-	auto faceIdx = vector<uint32_t>(2);
-	auto vertIdx = vector<uint32_t>(6);
-	auto normals = vector<Vec3f>(6);
-	auto st = vector<Vec2f>(6);
+	auto &objects = raytracer.get_targets();
+	// One framebuffer traces while the other is written out
+	frame_buffer frames[2] = { { options }, { options } };
+	temporal_cache reprojection;
+	reprojection.config.samples = options.samples_per_pixel;
+	reprojection.config.sequence = options.sampling;
+
+	for (uint32_t frame = 0; frame < camera.num_frames; ++frame) {
+		bool scene_moved = false;
+		for (const auto &motion : camera.motions) {
+			if (frame < motion.first_frame || frame > motion.last_frame || motion.object >= objects.size())
+				continue;
+			auto mesh = dynamic_cast<TriangleMesh*>(objects[motion.object].get());
+			if (!mesh)
+				continue;
+			if (motion.type == animation::object_motion::kind::translate)
+				mesh->translate(motion.vector);
+			else
+				mesh->rotate(motion.angle, motion.vector);
+			scene_moved = true;
+		}
+		if (scene_moved) {
+			reprojection.invalidate();
+			raytracer.clear_irradiance_cache();
+		}
+		{
+			TRACEAROOM_PROFILE_SCOPE("scene update");
+			raytracer.update_targets();
+		}
+
+		options.cameraToWorld = camera.camera_at(static_cast<float>(frame));
+		options.frame = frame;
+		frame_buffer &target = frames[frame % 2];
+		target.wait_for_write();
+		if (options.temporal_reuse) {
+			auto stats = reprojection.render(pinhole_camera(options.width, options.height, options.fov, options.cameraToWorld), raytracer, target.pixels.get(), frame);
+			cout << "Traced frame " << frame + 1 << "/" << camera.num_frames << ", reused " << stats.reused << " pixels\n";
+		}
+		else {
+			trace_frame(options, raytracer, target.pixels.get());
+			cout << "Traced frame " << frame + 1 << "/" << camera.num_frames << "\n";
+		}
 
-	faceIdx[0] = 3;
-	faceIdx[1] = 3;
+		numbered_path(options.output_path, frame, target.output_path);
+		numbered_path(options.hdr_output_path, frame, target.hdr_output_path);
+		target.writing = true;
+		// Captures two pointers, small enough for std::function to hold without allocating
+		const Options *frame_options = &options;
+		frame_buffer *written = &target;
+		thread_pool::shared().submit([frame_options, written]() {
+			write_frame(*frame_options, *written);
+			std::lock_guard<std::mutex> lock(written->write_mutex);
+			written->writing = false;
+			written->write_done.notify_all();
+		});
+	}
 
-	vertIdx[0] = 0;
-	vertIdx[1] = 1;
-	vertIdx[2] = 2;
-	vertIdx[3] = 2;
-	vertIdx[4] = 3;
-	vertIdx[5] = 0;
-	
-	return unique_ptr<TriangleMesh>(new TriangleMesh(2, faceIdx, vertIdx, quad_vertices, normals, st, { 0, 1,0 }));
+	for (auto &frame : frames)
+		frame.wait_for_write();
+}
+
+std::vector<std::unique_ptr<PointLight>> create_lights()
+{
+	std::vector<std::unique_ptr<PointLight>> point_lights;
+	Matrix44f l2w = Matrix44f(1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 3.0f, 0.0f, 0.0f, -15.0f, 1.0f);
+	point_lights.push_back(std::make_unique<PointLight>(l2w, 1, 580));
+	return point_lights;
+}
+
+// Two triangles over the four corners of quad_vertices. The quad is already triangulated,
+// so the mesh adopts the arrays built here instead of copying them.
+unique_ptr<TriangleMesh> generateQuadMesh(vector<Vec3f> quad_vertices, const Vec3f &color = { 0, 1, 0 })
+{
+	Matrix44f pivot = Matrix44f::create_translation({ 0.0f, 0.0f, quad_vertices[0].z });
+	vector<Vec2f> st{ { 1, 1 }, { 0, 1 }, { 0, 0 }, { 0, 0 }, { 1, 0 }, { 1, 1 } };
+	return unique_ptr<TriangleMesh>(new TriangleMesh(std::move(quad_vertices), vector<uint32_t>{ 0, 1, 2, 2, 3, 0 }, vector<Vec3f>(6), std::move(st), color, bvh(), pivot));
 }
 
 // create a unit quad in XY plane and (0, 0, z_offset) as pivot
 // z_offset should be smaller than camera position's z-coordinate
 unique_ptr<TriangleMesh> generateQuadMesh(float scalex, float scaley, float z_offset = 0.0f, const Vec3f &color = { 1, 0, 0 })
 {
-	auto faceIdx = vector<uint32_t>(2);
-	auto vertIdx = vector<uint32_t>(6);
-	auto normals = vector<Vec3f>(6);
-	auto st = vector<Vec2f>(6);
-	vector<Vec3f> quad_vertices = { {scalex, scaley, z_offset}, {-scalex, scaley, z_offset }, {-scalex, -scaley, z_offset }, { scalex ,-scaley, z_offset } };
-	
-	faceIdx[0] = 3;
-	faceIdx[1] = 3;
-
-	vertIdx[0] = 0;
-	vertIdx[1] = 1;
-	vertIdx[2] = 2;
-	vertIdx[3] = 2;
-	vertIdx[4] = 3;
-	vertIdx[5] = 0;
-
-	return unique_ptr<TriangleMesh>(new TriangleMesh(2, faceIdx, vertIdx, quad_vertices, normals, st, color));
+	return generateQuadMesh({ {scalex, scaley, z_offset}, {-scalex, scaley, z_offset }, {-scalex, -scaley, z_offset }, { scalex ,-scaley, z_offset } }, color);
 }
 
 // [comment]
@@ -139,17 +600,258 @@ int main(int argc, char **argv)
 	options.cameraToWorld = tmp;
     options.fov = 50.0393f;
     
-	unique_ptr<TriangleMesh> wall1 = generateQuadMesh(6.5f, 5, -23);
-	unique_ptr<TriangleMesh> wall2 = generateQuadMesh(5, 4.5f, -20, {0.1f, 0.8f, 0});
-	wall1->translate({ 2, 0, 0 });
-	wall2->rotate(20, { 0, 1, 0 });
-	wall2->translate({ -5, 0, 0 });
+	// tracearoom [--obj room.obj] [--cache room.scene] [--compact] [--irradiance-cache 0.25] [--grid] [--path camera.path [--reuse]]
+	//            [--profile stats.json] [--trace-events trace.json] [--heatmap heat.bmp [--heatmap-metric total|nodes|triangles|lights]]
+	//            [--paged room.pages [--page-budget 256]] [--workers 4 [--tile-size 32] [--fail-worker 0]]
+	//            [--serve | --serve-socket /tmp/tracearoom.sock] [--lod 1] [--checker 10] [--texture-budget 64]
+	//            [--spp 16 [--sampler sobol|blue-noise]] [--threads 8] [--verify frame.hash] [--golden frame.pfm [--golden-tolerance 0.001]]
+	//            [--selftest] [--bench] [--cells building.cells] [--async 4]
+	// A valid cache is memory mapped instead of building the scene, otherwise the cache is written after the build.
+	// --compact swaps the meshes for their quantized versions to save memory.
+	// --path renders every frame of a camera path(see animation.h) to numbered files.
+	// --irradiance-cache <cell size> interpolates diffuse lighting from a world space cache(see irradiance_cache.h).
+	// --grid traces through one uniform grid over the scene instead of the per object bvhs.
+	// --cells traces only through the rooms a ray passes, crossing from room to room through the doorways of the file(see cells.h).
+	// --reuse lets a camera path reproject the previous frame instead of tracing every pixel(see temporal_cache.h).
+	// --profile and --trace-events write the counters and stage timings of a TRACEAROOM_PROFILE build(see profile.h).
+	// --heatmap writes the per pixel ray cost of a single frame render as a false colour bitmap and a histogram(see heatmap.h).
+	// --workers renders a single frame as tiles on that many worker processes(see distributed.h), with --tile-size pixel tiles.
+	// --fail-worker makes one of them crash to try out how its tiles are reissued.
+	// --serve keeps the scene loaded and renders requests from stdin, --serve-socket takes them from clients of a Unix socket
+	// instead(see render_server.h).
+	// --lod <tolerance> traces far meshes at decimated levels of detail that stray by less than tolerance pixels(see lod.h).
+	// --checker <squares> puts a checker texture on the walls of the default scene.
+	// --texture-budget keeps the mip levels of file textures within that many megabytes(see texture.h).
+	// --spp traces that many rays per pixel, placed by Owen scrambled Sobol or blue noise samples(see sampler.h).
+	// --sampler also picks the samples of server requests.
+	// --threads sets how many threads trace, the calling one included. Images do not depend on it.
+	// --verify traces a single frame twice and checks its hash against the one in the file, recording it the first
+	// time. The exit code is 1 when it does not match.
+	// --golden compares a single frame with a golden image, recording it the first time, --golden-tolerance is the mean
+	// relative difference it may have. The exit code is 1 when it differs.
+	// --selftest checks the accelerators, compact and lod meshes against testing every triangle, on generated meshes and on
+	// the scene's(see selftest.h). --bench times the intersection kernels(see microbench.h). Both exit without rendering,
+	// --selftest with 1 when a check failed.
+	// --async renders that many copies of a single frame as concurrent jobs on the shared pool, taking tiles as they
+	// finish(see render_job.h). The exit code is 1 when the copies differ.
+	// --paged streams the meshes from a paged file within --page-budget megabytes(see paged_mesh.h), the file is written
+	// from the scene when it is not there yet.
+	string obj_path, cache_path, camera_path_file, profile_path, trace_events_path, paged_path, cells_path;
+	bool compact_meshes = false;
+	size_t page_budget_mb = 256;
+	bool serve_stdio = false;
+	float lod_tolerance = 0.0f;
+	uint32_t checker_squares = 0;
+	size_t texture_budget_mb = 0;
+	bool run_selftest = false, run_bench = false;
+	uint32_t async_jobs = 0;
+	string serve_socket_path;
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "--obj" && i + 1 < argc)
+			obj_path = argv[++i];
+		else if (arg == "--cache" && i + 1 < argc)
+			cache_path = argv[++i];
+		else if (arg == "--compact")
+			compact_meshes = true;
+		else if (arg == "--path" && i + 1 < argc)
+			camera_path_file = argv[++i];
+		else if (arg == "--grid")
+			options.scene_accelerator = accelerator::uniform_grid;
+		else if (arg == "--cells" && i + 1 < argc)
+			cells_path = argv[++i];
+		else if (arg == "--reuse")
+			options.temporal_reuse = true;
+		else if (arg == "--irradiance-cache" && i + 1 < argc)
+			options.irradiance_cell_size = static_cast<float>(atof(argv[++i]));
+		else if (arg == "--profile" && i + 1 < argc)
+			profile_path = argv[++i];
+		else if (arg == "--trace-events" && i + 1 < argc)
+			trace_events_path = argv[++i];
+		else if (arg == "--heatmap" && i + 1 < argc)
+			options.heatmap_path = argv[++i];
+		else if (arg == "--heatmap-metric" && i + 1 < argc && !heatmap::parse_metric(argv[++i], options.heatmap_metric))
+			cout << "Unknown heatmap metric " << argv[i] << "\n";
+		else if (arg == "--workers" && i + 1 < argc)
+			options.worker_processes = static_cast<uint32_t>(std::max(0, atoi(argv[++i])));
+		else if (arg == "--tile-size" && i + 1 < argc)
+			options.distribution.tile_size = static_cast<uint32_t>(std::max(1, atoi(argv[++i])));
+		else if (arg == "--fail-worker" && i + 1 < argc)
+			options.distribution.faulty_worker = atoi(argv[++i]);
+		else if (arg == "--lod" && i + 1 < argc)
+			lod_tolerance = static_cast<float>(atof(argv[++i]));
+		else if (arg == "--checker" && i + 1 < argc)
+			checker_squares = static_cast<uint32_t>(std::max(0, atoi(argv[++i])));
+		else if (arg == "--texture-budget" && i + 1 < argc)
+			texture_budget_mb = static_cast<size_t>(std::max(0, atoi(argv[++i])));
+		else if (arg == "--spp" && i + 1 < argc)
+			options.samples_per_pixel = static_cast<uint32_t>(std::max(1, atoi(argv[++i])));
+		else if (arg == "--sampler" && i + 1 < argc && !sampler::parse_sequence(argv[++i], options.sampling))
+			cout << "Unknown sampler " << argv[i] << "\n";
+		else if (arg == "--threads" && i + 1 < argc)
+			thread_pool::shared_threads() = static_cast<uint32_t>(std::max(1, atoi(argv[++i])));
+		else if (arg == "--verify" && i + 1 < argc)
+			options.verify_path = argv[++i];
+		else if (arg == "--golden" && i + 1 < argc)
+			options.golden_path = argv[++i];
+		else if (arg == "--golden-tolerance" && i + 1 < argc)
+			options.golden_tolerance = static_cast<float>(atof(argv[++i]));
+		else if (arg == "--async" && i + 1 < argc)
+			async_jobs = static_cast<uint32_t>(std::max(0, atoi(argv[++i])));
+		else if (arg == "--selftest")
+			run_selftest = true;
+		else if (arg == "--bench")
+			run_bench = true;
+		else if (arg == "--serve")
+			serve_stdio = true;
+		else if (arg == "--serve-socket" && i + 1 < argc)
+			serve_socket_path = argv[++i];
+		else if (arg == "--paged" && i + 1 < argc)
+			paged_path = argv[++i];
+		else if (arg == "--page-budget" && i + 1 < argc)
+			page_budget_mb = static_cast<size_t>(std::max(1, atoi(argv[++i])));
+	}
+	int exit_code = 0;
+	if (!profile::enabled() && (!profile_path.empty() || !trace_events_path.empty()))
+		cout << "Profiling is not built in, define TRACEAROOM_PROFILE=1 to enable it\n";
+
+	texture::cache::shared().set_budget(texture_budget_mb << 20);
 	std::vector<std::unique_ptr<Object>> objects;
-	objects.push_back(std::move(wall1));
-	objects.push_back(std::move(wall2));
+	std::shared_ptr<paged::page_cache> pages;
+	const size_t page_budget = page_budget_mb << 20;
+	{
+		TRACEAROOM_PROFILE_SCOPE("scene build");
+		if (!paged_path.empty())
+			pages = paged::load(paged_path, page_budget, objects);
+		if (!pages && (cache_path.empty() || !scene_cache::load(cache_path, objects))) {
+			if (!obj_path.empty()) {
+				if (!obj_loader::load(obj_path, objects))
+					cout << "Unable to read " << obj_path << "\n";
+			}
+			else {
+				unique_ptr<TriangleMesh> wall1 = generateQuadMesh(6.5f, 5, -23);
+				unique_ptr<TriangleMesh> wall2 = generateQuadMesh(5, 4.5f, -20, {0.1f, 0.8f, 0});
+				wall1->translate({ 2, 0, 0 });
+				wall2->rotate(20, { 0, 1, 0 });
+				wall2->translate({ -5, 0, 0 });
+				if (checker_squares > 0)
+					wall1->texture_id = wall2->texture_id = texture::cache::shared().add("checker", texture::checker(checker_squares * 32, checker_squares));
+				objects.push_back(std::move(wall1));
+				objects.push_back(std::move(wall2));
+			}
+
+			for (auto &object : objects)
+				object->update();
+
+			if (!cache_path.empty() && !scene_cache::save(cache_path, objects))
+				cout << "Unable to write " << cache_path << "\n";
+		}
+
+		// Swap the meshes for their paged versions, anything else stays as it is
+		if (!paged_path.empty() && !pages) {
+			std::vector<std::unique_ptr<Object>> paged_objects;
+			if (paged::write(paged_path, objects))
+				pages = paged::load(paged_path, page_budget, paged_objects);
+			if (pages) {
+				for (auto &object : objects)
+					if (!dynamic_cast<TriangleMesh*>(object.get()))
+						paged_objects.push_back(std::move(object));
+				objects = std::move(paged_objects);
+			}
+			else
+				cout << "Unable to write " << paged_path << "\n";
+		}
+
+		if (lod_tolerance > 0.0f) {
+			size_t lod_tris = lod::make_lods(objects, lod_tolerance);
+			cout << "Added " << lod_tris << " triangles of coarser detail levels\n";
+		}
+
+		if (compact_meshes) {
+			auto bytes = compact::compact_objects(objects);
+			cout << "Compacted geometry from " << bytes.first << " to " << bytes.second << " bytes\n";
+		}
+	}
+
+	if (run_selftest || run_bench) {
+		if (run_bench)
+			microbench::run();
+		if (run_selftest && !selftest::run(objects))
+			exit_code = 1;
+		return exit_code;
+	}
+
+	auto point_lights = create_lights();
+	raytracer raytracer(objects, point_lights, options.backgroundColor);
+	raytracer.set_irradiance_cache(options.irradiance_cell_size);
+	if (!cells_path.empty()) {
+		cells::layout building;
+		if (cells::load(cells_path, building)) {
+			raytracer.set_cells(building);
+			options.scene_accelerator = accelerator::cells;
+		}
+		else
+			cout << "Unable to read " << cells_path << "\n";
+	}
+	auto accel_start = chrono::steady_clock::now();
+	{
+		TRACEAROOM_PROFILE_SCOPE("accelerator build");
+		raytracer.set_accelerator(options.scene_accelerator);
+	}
+	if (options.scene_accelerator == accelerator::uniform_grid)
+		cout << "Built uniform grid in " << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - accel_start).count() << " ms\n";
+	else if (options.scene_accelerator == accelerator::cells)
+		cout << "Built " << raytracer.get_cells().num_cells() << " cells over " << raytracer.get_cells().num_triangles() << " triangles in "
+			<< chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - accel_start).count() << " ms\n";
 
 	// finally, render
-    render(options, objects);
+	if (serve_stdio || !serve_socket_path.empty()) {
+		render_server::server server([&raytracer, &options](const render_server::request &request, uint32_t first_row, uint32_t last_row, Vec3f *rows) {
+			trace_request_rows(raytracer, request, first_row, last_row, rows, options.sampling);
+		});
+		if (serve_stdio)
+			render_server::serve_stdio(server);
+#ifndef _WIN32
+		else if (!render_server::serve_socket(server, serve_socket_path))
+			cout << "Unable to serve on " << serve_socket_path << "\n";
+#else
+		else
+			cout << "Unix sockets are not available here, use --serve\n";
+#endif
+	}
+	else if (!camera_path_file.empty()) {
+		animation::camera_path camera;
+		if (!animation::load(camera_path_file, camera, options.cameraToWorld))
+			cout << "Unable to read " << camera_path_file << "\n";
+		else if (!motions_supported(camera, raytracer.get_targets()))
+			exit_code = 1;
+		else
+			render_sequence(options, camera, raytracer);
+	}
+	else if (async_jobs > 0) {
+		if (!render_jobs(options, raytracer, async_jobs))
+			exit_code = 1;
+	}
+	else if (!render(options, raytracer))
+		exit_code = 1;
+
+	if (pages) {
+		auto stats = pages->get_stats();
+		cout << "Paged geometry: " << stats.loads << " page loads, " << stats.evictions << " evictions, " << stats.queued_rays << " queued rays, "
+			<< "peak " << (stats.peak_bytes >> 20) << " of " << (stats.budget >> 20) << " MB resident\n";
+		if (stats.broken_loads > 0)
+			cout << stats.broken_loads << " pages could not be read or were malformed, their triangles are missing from the image\n";
+	}
+
+	auto texture_stats = texture::cache::shared().get_stats();
+	if (texture_stats.budget > 0)
+		cout << "Textures: " << texture_stats.level_loads << " mip level loads, " << texture_stats.evictions << " evictions, "
+			<< "peak " << (texture_stats.peak_bytes >> 10) << " of " << (texture_stats.budget >> 10) << " KB resident\n";
+
+	if (!profile_path.empty() && profile::enabled() && !profile::write_json(profile_path))
+		cout << "Unable to write " << profile_path << "\n";
+	if (!trace_events_path.empty() && profile::enabled() && !profile::write_chrome_trace(trace_events_path))
+		cout << "Unable to write " << trace_events_path << "\n";
 
-    return 0;
+    return exit_code;
 }
@@ -0,0 +1,233 @@
+#pragma once
+
+#include<algorithm>
+#include<atomic>
+#include<cmath>
+#include<cstdint>
+#include<memory>
+#include<vector>
+
+#include"bvh.h"
+#include"geometry.h"
+#include"polygon_primitves.h"
+#include"ray_cost.h"
+#include"thread_pool.h"
+
+// Scene wide uniform grid over the triangles of every TriangleMesh, an alternative to walking the objects and their bvhs.
+// Suits rooms full of similarly sized objects, where the per object loop and deep trees cost more than a few cells.
+//
+// Only the cells that hold triangles take memory: cells are hashed into a table of buckets and a bucket lists the
+// triangles of every cell that maps to it. Building runs on the thread pool as an atomic counting sort,
+// rays walk the cells front to back with a 3D-DDA. Objects that are not a TriangleMesh are tested on every ray.
+class uniform_grid
+{
+public:
+	struct prim_ref
+	{
+		uint32_t object;
+		uint32_t tri;
+
+		bool operator<(const prim_ref &other) const { return object != other.object ? object < other.object : tri < other.tri; }
+	};
+
+private:
+	// Triangles per cell the resolution aims for
+	static constexpr float kDensity = 2.0f;
+	static constexpr int32_t kMaxResolution = 1024;
+
+	bbox bounds;
+	int32_t resolution[3] = { 0, 0, 0 };
+	Vec3f cell_size, inv_cell_size;
+	uint32_t bucket_mask = 0;
+	std::vector<uint32_t> bucket_offsets;	// bucket b owns refs[bucket_offsets[b], bucket_offsets[b + 1])
+	std::vector<prim_ref> refs;
+	std::vector<const TriangleMesh*> meshes;	// indexed by object
+	std::vector<const Object*> unbounded;
+
+	uint32_t bucket_of(int32_t x, int32_t y, int32_t z) const
+	{
+		uint32_t h = static_cast<uint32_t>(x) * 73856093u ^ static_cast<uint32_t>(y) * 19349663u ^ static_cast<uint32_t>(z) * 83492791u;
+		return h & bucket_mask;
+	}
+
+	int32_t cell_coordinate(float p, uint8_t axis) const
+	{
+		int32_t c = static_cast<int32_t>((p - bounds.min[axis]) * inv_cell_size[axis]);
+		return std::max(0, std::min(resolution[axis] - 1, c));
+	}
+
+	void triangle_vertices(const prim_ref &ref, Vec3f &v0, Vec3f &v1, Vec3f &v2) const
+	{
+		const TriangleMesh &mesh = *meshes[ref.object];
+		const uint32_t *tri = mesh.get_tris_index().data() + ref.tri * 3;
+		v0 = mesh.get_vertices()[tri[0]], v1 = mesh.get_vertices()[tri[1]], v2 = mesh.get_vertices()[tri[2]];
+	}
+
+	// Calls fn(bucket) for every cell the triangle's bounds overlap
+	template<typename Fn>
+	void for_each_cell(const prim_ref &ref, Fn &&fn) const
+	{
+		Vec3f v0, v1, v2;
+		triangle_vertices(ref, v0, v1, v2);
+		bbox tri_bounds;
+		tri_bounds.extend(v0), tri_bounds.extend(v1), tri_bounds.extend(v2);
+		int32_t lo[3], hi[3];
+		for (uint8_t a = 0; a < 3; ++a)
+			lo[a] = cell_coordinate(tri_bounds.min[a], a), hi[a] = cell_coordinate(tri_bounds.max[a], a);
+		for (int32_t z = lo[2]; z <= hi[2]; ++z)
+			for (int32_t y = lo[1]; y <= hi[1]; ++y)
+				for (int32_t x = lo[0]; x <= hi[0]; ++x)
+					fn(bucket_of(x, y, z));
+	}
+
+public:
+	// Rebuilds the grid over objects, which have to stay alive and unchanged until the next build
+	void build(const std::vector<std::unique_ptr<Object>> &objects, thread_pool &pool = thread_pool::shared())
+	{
+		bounds = bbox();
+		meshes.assign(objects.size(), nullptr);
+		unbounded.clear();
+		std::vector<prim_ref> prims;
+		for (uint32_t k = 0; k < objects.size(); ++k)
+		{
+			auto mesh = dynamic_cast<const TriangleMesh*>(objects[k].get());
+			if (!mesh)
+			{
+				unbounded.push_back(objects[k].get());
+				continue;
+			}
+			meshes[k] = mesh;
+			for (const Vec3f &v : mesh->get_vertices())
+				bounds.extend(v);
+			for (uint32_t t = 0; t < mesh->get_num_tris(); ++t)
+				prims.push_back({ k, t });
+		}
+
+		refs.clear();
+		bucket_offsets.assign(2, 0);
+		bucket_mask = 0;
+		if (prims.empty())
+			return;
+
+		// Cubic cells sized so the scene holds about kDensity triangles per cell
+		Vec3f extent = bounds.extent();
+		float longest = std::max(extent.x, std::max(extent.y, extent.z));
+		extent = Vec3f(std::max(extent.x, longest * 1e-3f), std::max(extent.y, longest * 1e-3f), std::max(extent.z, longest * 1e-3f));
+		bounds.max = bounds.min + extent;
+		float cell = std::cbrt(extent.x * extent.y * extent.z * kDensity / prims.size());
+		for (uint8_t a = 0; a < 3; ++a)
+		{
+			resolution[a] = std::max(1, std::min(int32_t(kMaxResolution), static_cast<int32_t>(std::ceil(extent[a] / cell))));
+			cell_size[a] = extent[a] / resolution[a];
+			inv_cell_size[a] = resolution[a] / extent[a];
+		}
+
+		uint32_t num_buckets = 1;
+		while (num_buckets < prims.size())
+			num_buckets <<= 1;
+		bucket_mask = num_buckets - 1;
+
+		// Count the references of every bucket, then give each bucket its range and scatter into it
+		std::unique_ptr<std::atomic<uint32_t>[]> counts(new std::atomic<uint32_t>[num_buckets]);
+		for (uint32_t b = 0; b < num_buckets; ++b)
+			counts[b].store(0, std::memory_order_relaxed);
+		const uint32_t num_prims = static_cast<uint32_t>(prims.size());
+		pool.parallel_for(0, num_prims, 4096, [&](uint32_t first, uint32_t last) {
+			for (uint32_t p = first; p < last; ++p)
+				for_each_cell(prims[p], [&](uint32_t bucket) { counts[bucket].fetch_add(1, std::memory_order_relaxed); });
+		});
+
+		bucket_offsets.resize(num_buckets + 1);
+		bucket_offsets[0] = 0;
+		for (uint32_t b = 0; b < num_buckets; ++b)
+		{
+			bucket_offsets[b + 1] = bucket_offsets[b] + counts[b].load(std::memory_order_relaxed);
+			counts[b].store(bucket_offsets[b], std::memory_order_relaxed);
+		}
+
+		refs.resize(bucket_offsets[num_buckets]);
+		pool.parallel_for(0, num_prims, 4096, [&](uint32_t first, uint32_t last) {
+			for (uint32_t p = first; p < last; ++p)
+				for_each_cell(prims[p], [&](uint32_t bucket) { refs[counts[bucket].fetch_add(1, std::memory_order_relaxed)] = prims[p]; });
+		});
+
+		// The scatter order depends on thread timing, sorting the buckets keeps ties between equally near hits stable
+		pool.parallel_for(0, num_buckets, 1024, [&](uint32_t first, uint32_t last) {
+			for (uint32_t b = first; b < last; ++b)
+				std::sort(refs.begin() + bucket_offsets[b], refs.begin() + bucket_offsets[b + 1]);
+		});
+	}
+
+	size_t memory_usage() const { return refs.size() * sizeof(prim_ref) + bucket_offsets.size() * sizeof(uint32_t); }
+
+	// Nearest hit along the ray, same contract as Object::intersect. Returns the object that was hit or nullptr.
+	const Object *intersect(const Vec3f &orig, const Vec3f &dir, float &tNear, uint32_t &triIndex, Vec2f &uv) const
+	{
+		const Object *hit_object = nullptr;
+		for (const Object *object : unbounded)
+		{
+			float t = kInfinity;
+			uint32_t index;
+			Vec2f object_uv;
+			if (object->intersect(orig, dir, t, index, object_uv) && t < tNear)
+				tNear = t, triIndex = index, uv = object_uv, hit_object = object;
+		}
+
+		if (refs.empty())
+			return hit_object;
+
+		Vec3f inv_dir = safe_inverse(dir);
+		float tentry;
+		if (!intersect_bbox(bounds.min, bounds.max, orig, inv_dir, tNear, tentry))
+			return hit_object;
+
+		ray_cost_tally tally;
+		// Start in the cell the ray enters through, then always step across the nearest cell wall
+		int32_t cell[3], step[3], end[3];
+		float tnext[3], tdelta[3];
+		for (uint8_t a = 0; a < 3; ++a)
+		{
+			cell[a] = cell_coordinate(orig[a] + dir[a] * tentry, a);
+			if (dir[a] == 0.0f)
+			{
+				step[a] = 0, end[a] = -1, tnext[a] = kInfinity, tdelta[a] = kInfinity;
+				continue;
+			}
+			step[a] = dir[a] > 0.0f ? 1 : -1;
+			end[a] = dir[a] > 0.0f ? resolution[a] : -1;
+			float wall = bounds.min[a] + (cell[a] + (dir[a] > 0.0f ? 1 : 0)) * cell_size[a];
+			tnext[a] = (wall - orig[a]) * inv_dir[a];
+			tdelta[a] = cell_size[a] * std::fabs(inv_dir[a]);
+		}
+
+		for (;;)
+		{
+			uint32_t bucket = bucket_of(cell[0], cell[1], cell[2]);
+			++tally.nodes;
+			tally.triangles += bucket_offsets[bucket + 1] - bucket_offsets[bucket];
+			for (uint32_t r = bucket_offsets[bucket]; r < bucket_offsets[bucket + 1]; ++r)
+			{
+				const prim_ref &ref = refs[r];
+				Vec3f v0, v1, v2;
+				triangle_vertices(ref, v0, v1, v2);
+				float t, u, v;
+				if (TriangleMesh::rayTriangleIntersect(orig, dir, v0, v1, v2, t, u, v) && t > 0.0f && t < tNear)
+				{
+					tNear = t, triIndex = ref.tri, uv = Vec2f(u, v);
+					hit_object = meshes[ref.object];
+				}
+			}
+
+			// Triangles also reach into neighboring cells, a hit only ends the walk once it lies within the current one
+			uint8_t axis = tnext[0] < tnext[1] ? (tnext[0] < tnext[2] ? 0 : 2) : (tnext[1] < tnext[2] ? 1 : 2);
+			if (tNear <= tnext[axis])
+				break;
+			cell[axis] += step[axis];
+			if (cell[axis] == end[axis])
+				break;
+			tnext[axis] += tdelta[axis];
+		}
+
+		return hit_object;
+	}
+};